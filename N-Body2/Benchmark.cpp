@@ -0,0 +1,61 @@
+#include "Benchmark.h"
+#include <chrono>
+#include <iomanip>
+#include <numeric>
+#include <thread>
+
+void Benchmark::numaAccess(std::size_t megabytes, std::ostream& out)
+{
+	const int nodes = Numa::nodeCount();
+	const std::size_t count = megabytes * 1024 * 1024 / sizeof(std::size_t);
+	const std::size_t loads = count / 4;
+
+	out << "NUMA access -- " << nodes << " node(s), " << megabytes << " MiB per buffer\n";
+	out << std::setw(10) << "cpu node" << std::setw(14) << "memory node" << std::setw(16) << "latency [ns]" << std::setw(18) << "bandwidth [GB/s]" << "\n";
+
+	for (int memory = 0; memory < nodes; ++memory) {
+		std::vector<std::size_t> chain;
+
+		// Allocated and first touched by a thread on `memory`, so the pages land there.
+		// Sattolo's shuffle makes one cycle through every entry, defeating the prefetcher.
+		std::thread([&]() {
+			Numa::pinThreadToNode(memory);
+			chain.resize(count);
+			std::iota(chain.begin(), chain.end(), std::size_t(0));
+
+			std::mt19937_64 rng(7);
+			for (std::size_t i = count - 1; i > 0; --i) {
+				std::uniform_int_distribution<std::size_t> pick(0, i - 1);
+				std::swap(chain[i], chain[pick(rng)]);
+			}
+		}).join();
+
+		for (int cpu = 0; cpu < nodes; ++cpu) {
+			double latency = 0.0, bandwidth = 0.0;
+
+			std::thread([&]() {
+				Numa::pinThreadToNode(cpu);
+				volatile std::size_t sink = 0;
+
+				auto start = std::chrono::high_resolution_clock::now();
+				std::size_t next = 0;
+				for (std::size_t i = 0; i < loads; ++i)
+					next = chain[next];
+				auto middle = std::chrono::high_resolution_clock::now();
+
+				std::size_t sum = 0;
+				for (std::size_t value : chain)
+					sum += value;
+				auto end = std::chrono::high_resolution_clock::now();
+
+				sink = next + sum;
+				(void)sink;
+				latency = 1e9 * std::chrono::duration<double>(middle - start).count() / loads;
+				bandwidth = count * sizeof(std::size_t) / std::chrono::duration<double>(end - middle).count() / 1e9;
+			}).join();
+
+			out << std::setw(10) << cpu << std::setw(14) << memory << std::fixed << std::setprecision(1)
+				<< std::setw(16) << latency << std::setw(18) << bandwidth << std::defaultfloat << "\n";
+		}
+	}
+}
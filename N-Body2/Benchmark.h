@@ -0,0 +1,79 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+#pragma once
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Ensemble.h"
+#include "OutOfCore.h"
+#include "TreeWrapper.h"
+#include "Numa.h"
+#include "Utils.h"
+
+// Standalone performance runs selected with --benchmark. Each one builds its own
+// bodies, prints a table to `out` and leaves the simulation untouched.
+class Benchmark
+{
+public:
+	// Force evaluation time and accuracy of Barnes-Hut, the FMM and TreePM on
+	// uniform random cubes, doubling N up to maxBodies. Errors are RMS relative
+	// to direct summation over a sample of bodies.
+	template <typename VecType>
+	static void engineScaling(std::size_t maxBodies, double theta, int fmmOrder, std::ostream& out);
+
+	// Latency (dependent loads) and bandwidth (sequential read) from every NUMA
+	// node to memory first touched on every node: the local / remote access cost
+	static void numaAccess(std::size_t megabytes, std::ostream& out);
+
+	// Time per update() of the threaded Barnes-Hut walk without NUMA placement,
+	// with it, and with the top tree levels replicated on every node
+	template <typename VecType>
+	static void numaScaling(std::size_t bodies, double theta, int steps, std::ostream& out);
+
+	// Time per update() and energy drift of Barnes-Hut with the far field reused
+	// for k steps, against the every-step baseline (k = 1)
+	template <typename VecType>
+	static void farFieldDrift(std::size_t bodies, double theta, int steps, std::ostream& out);
+
+	// Barnes-Hut force evaluation with open and periodic boundaries on the same
+	// uniform cubes, doubling N up to maxBodies: the cost of the minimum-image walk
+	// with the Ewald correction. Errors are RMS relative to the direct periodic sum.
+	template <typename VecType>
+	static void periodicCost(std::size_t maxBodies, double theta, std::ostream& out);
+
+	// Time per update() of Barnes-Hut and the FMM in the fast and the deterministic
+	// mode at 1, half and all hardware threads, measuring conservation every step.
+	// A run is reproducible if its bodies and energy match the single-threaded run
+	// of the same mode to the bit.
+	template <typename VecType>
+	static void deterministicCost(std::size_t bodies, double theta, int fmmOrder, int steps, std::ostream& out);
+
+	// Time per step, throughput and I/O per step of the out-of-core path for two
+	// chunk sizes against update() in memory, on the same uniform cube. The force
+	// error is RMS relative to direct summation, the drift the median distance
+	// from the in-memory positions after `steps` steps, relative to the cube's
+	// half length. The files go to `path`.
+	template <typename VecType>
+	static void outOfCore(std::size_t bodies, double theta, int steps, const std::string& path, std::ostream& out);
+
+	// Force evaluation of the per-body Barnes-Hut walk against the FMM's one-sided
+	// and mutual traversals on uniform random cubes, doubling N up to maxBodies:
+	// time, interactions per body and RMS error relative to direct summation.
+	// The walk counts body-body and body-cell evaluations, the FMM P2P and M2L pairs.
+	template <typename VecType>
+	static void dualTree(std::size_t maxBodies, double theta, int fmmOrder, std::ostream& out);
+
+	// Fills `wrapper` with `count` bodies spread uniformly in a cube of half
+	// length `halfLength`, using the ranges of Data/pythonScripts/random_bodies.py
+	template <typename VecType>
+	static void randomBodies(TreeWrapper<VecType>& wrapper, std::size_t count, double halfLength, unsigned int seed);
+
+	// RMS force error of `forces` against direct summation on `samples` bodies
+	template <typename VecType>
+	static double forceError(const std::vector<Node<VecType>>& bodies, const std::vector<VecType>& forces, std::size_t samples);
+};
+
+#include "Benchmark.tpp"
+#endif
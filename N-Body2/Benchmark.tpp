@@ -0,0 +1,475 @@
+#ifndef BENCHMARK_TPP
+#define BENCHMARK_TPP
+#include "Benchmark.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+
+template <typename VecType>
+void Benchmark::randomBodies(TreeWrapper<VecType>& wrapper, std::size_t count, double halfLength, unsigned int seed)
+{
+	std::mt19937_64 rng(seed);
+	std::uniform_real_distribution<double> mass(1e20, 1e30);
+	std::uniform_real_distribution<double> radius(1e3, 1e6);
+	std::uniform_real_distribution<double> position(-halfLength, halfLength);
+	std::uniform_real_distribution<double> velocity(-1e4, 1e4);
+
+	wrapper.nodeList.clear();
+	wrapper.nodeList.reserve(count);
+
+	for (std::size_t i = 0; i < count; ++i) {
+		VecType pos, vel;
+		for (int d = 0; d < VecType::length(); ++d) {
+			pos[d] = position(rng);
+			vel[d] = velocity(rng);
+		}
+
+		Node<VecType> body(static_cast<int>(i), "Body_" + std::to_string(i), pos, vel, mass(rng), radius(rng));
+		wrapper.insertBody(body);
+	}
+}
+
+template <typename VecType>
+double Benchmark::forceError(const std::vector<Node<VecType>>& bodies, const std::vector<VecType>& forces, std::size_t samples)
+{
+	std::size_t stride = bodies.size() / samples > 0 ? bodies.size() / samples : 1;
+	double error = 0.0, norm = 0.0;
+
+	for (std::size_t i = 0; i < bodies.size(); i += stride) {
+		VecType exact(0);
+		for (std::size_t j = 0; j < bodies.size(); ++j) {
+			if (i == j)
+				continue;
+
+			VecType distance = bodies[i].position - bodies[j].position;
+			double r = glm::length(distance);
+			exact += -G * bodies[i].mass * bodies[j].mass * distance / (r * r * r);
+		}
+
+		VecType difference = forces[i] - exact;
+		error += glm::dot(difference, difference);
+		norm += glm::dot(exact, exact);
+	}
+
+	return norm > 0.0 ? std::sqrt(error / norm) : 0.0;
+}
+
+template <typename VecType>
+void Benchmark::engineScaling(std::size_t maxBodies, double theta, int fmmOrder, std::ostream& out)
+{
+	const std::size_t samples = 200;
+	const double half_length = 1e9;
+
+	const ForceEngine engines[] = { ENGINE_BARNES_HUT, ENGINE_FMM, ENGINE_TREEPM };
+	const char* names[] = { "BH", "FMM", "TreePM" };
+
+	out << "Engine scaling -- " << VecType::length() << "D, theta " << theta << ", FMM order " << fmmOrder << "\n";
+	out << std::setw(10) << "N";
+	for (const char* name : names) {
+		out << std::setw(14) << std::string(name) + " [s]" << std::setw(14) << std::string(name) + " [us/N]" << std::setw(12) << "err";
+	}
+	out << "\n";
+
+	for (std::size_t n = 1000; n <= maxBodies; n *= 2) {
+		Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+		TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+		wrapper.getTree().setTheta(theta);
+		randomBodies(wrapper, n, half_length, 42);
+
+		// Every engine on a single thread so the per-body cost is comparable
+		wrapper.getFmm().setOrder(fmmOrder);
+		wrapper.setThreads(1);
+		wrapper.getFmm().setThreads(1);
+		wrapper.getMesh().setThreads(1);
+
+		std::vector<VecType> forces;
+		out << std::setw(10) << n << std::scientific << std::setprecision(3);
+
+		for (ForceEngine engine : engines) {
+			wrapper.setEngine(engine);
+			auto time = Utils::measureInvokeCall(&TreeWrapper<VecType>::computeForces, wrapper, forces);
+			double error = forceError(wrapper.nodeList, forces, samples);
+
+			out << std::setw(14) << time.count() << std::setw(14) << 1e6 * time.count() / n << std::setw(12) << error;
+		}
+		out << std::defaultfloat << "\n";
+	}
+}
+
+template <typename VecType>
+void Benchmark::numaScaling(std::size_t bodies, double theta, int steps, std::ostream& out)
+{
+	const double half_length = 1e9;
+	const double dt = 1.0;
+
+	struct Mode {
+		const char* name;
+		bool numa;
+		int replicaLevels;
+	};
+	const Mode modes[] = { { "threads", false, 0 }, { "numa", true, 0 }, { "numa + replicas", true, 3 } };
+
+	out << "NUMA force walk -- " << VecType::length() << "D, " << bodies << " bodies, "
+		<< std::thread::hardware_concurrency() << " threads, " << Numa::nodeCount() << " node(s), " << steps << " steps\n";
+	out << std::setw(18) << "mode" << std::setw(16) << "[s / step]" << std::setw(12) << "speedup" << "\n";
+
+	double baseline = 0.0;
+	for (const Mode& mode : modes) {
+		Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+		TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+		wrapper.getTree().setTheta(theta);
+		randomBodies(wrapper, bodies, half_length, 42);
+		wrapper.setNuma(mode.numa, mode.replicaLevels);
+
+		auto total = std::chrono::duration<double>::zero();
+		for (int step = 0; step < steps; ++step) {
+			total += Utils::measureInvokeCall(&TreeWrapper<VecType>::update, wrapper, dt);
+		}
+
+		double per_step = total.count() / steps;
+		if (baseline == 0.0)
+			baseline = per_step;
+
+		out << std::setw(18) << mode.name << std::scientific << std::setprecision(3) << std::setw(16) << per_step
+			<< std::defaultfloat << std::setw(12) << baseline / per_step << "\n";
+	}
+}
+
+template <typename VecType>
+void Benchmark::periodicCost(std::size_t maxBodies, double theta, std::ostream& out)
+{
+	const std::size_t samples = 100;
+	const double half_length = 1e9;
+
+	out << "Periodic boundaries -- " << VecType::length() << "D, theta " << theta << ", Ewald table of "
+		<< Ewald<VecType>::cells + 1 << " points per axis\n";
+	out << std::setw(10) << "N" << std::setw(14) << "open [s]" << std::setw(14) << "setup [s]" << std::setw(14) << "periodic [s]"
+		<< std::setw(10) << "ratio" << std::setw(12) << "err" << "\n";
+
+	for (std::size_t n = 1000; n <= maxBodies; n *= 2) {
+		Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+		TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+		wrapper.getTree().setTheta(theta);
+		randomBodies(wrapper, n, half_length, 42);
+
+		std::vector<VecType> forces;
+		auto open = Utils::measureInvokeCall(&TreeWrapper<VecType>::computeForces, wrapper, forces);
+
+		// Tabulating the correction, wrapping the bodies and rebuilding the tree
+		auto setup = Utils::measureInvokeCall(&TreeWrapper<VecType>::setPeriodic, wrapper, 2 * half_length);
+		auto periodic = Utils::measureInvokeCall(&TreeWrapper<VecType>::computeForces, wrapper, forces);
+
+		// Direct sum over the nearest images plus the same correction table
+		const std::vector<Node<VecType>>& bodies = wrapper.nodeList;
+		const Box<VecType> cell(VecType(0.0), half_length, half_length, half_length);
+		std::size_t stride = bodies.size() / samples > 0 ? bodies.size() / samples : 1;
+		double error = 0.0, norm = 0.0;
+
+		for (std::size_t i = 0; i < bodies.size(); i += stride) {
+			VecType exact(0);
+			for (std::size_t j = 0; j < bodies.size(); ++j) {
+				if (i == j)
+					continue;
+
+				VecType distance = cell.nearestImage(bodies[i].position - bodies[j].position);
+				double r = glm::length(distance);
+				exact += G * bodies[i].mass * bodies[j].mass * (wrapper.getEwald().correction(distance) - distance / (r * r * r));
+			}
+
+			VecType difference = forces[i] - exact;
+			error += glm::dot(difference, difference);
+			norm += glm::dot(exact, exact);
+		}
+
+		out << std::setw(10) << n << std::scientific << std::setprecision(3) << std::setw(14) << open.count()
+			<< std::setw(14) << setup.count() << std::setw(14) << periodic.count()
+			<< std::defaultfloat << std::setw(10) << periodic.count() / open.count()
+			<< std::scientific << std::setw(12) << (norm > 0.0 ? std::sqrt(error / norm) : 0.0) << std::defaultfloat << "\n";
+	}
+}
+
+template <typename VecType>
+void Benchmark::farFieldDrift(std::size_t bodies, double theta, int steps, std::ostream& out)
+{
+	const double half_length = 1e9;
+
+	struct Mode {
+		int interval;
+		bool extrapolate;
+	};
+	const Mode modes[] = { { 1, false }, { 2, false }, { 4, false }, { 8, false }, { 4, true }, { 8, true } };
+
+	// A fixed fraction of the crossing time, so the drift does not depend on N
+	double total_mass = 0.0;
+	{
+		Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+		TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+		randomBodies(wrapper, bodies, half_length, 42);
+		for (const Node<VecType>& body : wrapper.nodeList)
+			total_mass += body.mass;
+	}
+	const double dt = 1e-4 * std::sqrt(half_length * half_length * half_length / (G * total_mass));
+
+	out << "Far-field reuse -- " << VecType::length() << "D, " << bodies << " bodies, theta " << theta
+		<< ", " << steps << " steps of " << dt << " s\n";
+	out << std::setw(18) << "mode" << std::setw(16) << "[s / step]" << std::setw(12) << "speedup"
+		<< std::setw(16) << "|dE / E|" << std::setw(16) << "|E - E(k = 1)|" << "\n";
+
+	// Unsoftened close pairs make |dE / E| large for every k; the difference to the
+	// k = 1 run's final energy isolates the error of reusing the far field
+	double baseline_time = 0.0, baseline_energy = 0.0;
+	for (const Mode& mode : modes) {
+		Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+		TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+		wrapper.getTree().setTheta(theta);
+		randomBodies(wrapper, bodies, half_length, 42);
+		wrapper.setFarField(mode.interval, 0.0, mode.extrapolate);
+
+		double initial = Ensemble<VecType>::totalEnergy(wrapper.nodeList, wrapper.getTree().getEpsilon());
+
+		auto total = std::chrono::duration<double>::zero();
+		for (int step = 0; step < steps; ++step) {
+			total += Utils::measureInvokeCall(&TreeWrapper<VecType>::update, wrapper, dt);
+		}
+
+		double energy = Ensemble<VecType>::totalEnergy(wrapper.nodeList, wrapper.getTree().getEpsilon());
+		double per_step = total.count() / steps;
+		if (baseline_time == 0.0) {
+			baseline_time = per_step;
+			baseline_energy = energy;
+		}
+
+		std::string name = "k = " + std::to_string(mode.interval) + (mode.extrapolate ? " + taylor" : "");
+		out << std::setw(18) << name << std::scientific << std::setprecision(3) << std::setw(16) << per_step
+			<< std::defaultfloat << std::setw(12) << baseline_time / per_step
+			<< std::scientific << std::setw(16) << std::abs((energy - initial) / initial)
+			<< std::setw(16) << std::abs((energy - baseline_energy) / initial) << std::defaultfloat << "\n";
+	}
+}
+
+template <typename VecType>
+void Benchmark::deterministicCost(std::size_t bodies, double theta, int fmmOrder, int steps, std::ostream& out)
+{
+	const double half_length = 1e9;
+
+	const ForceEngine engines[] = { ENGINE_BARNES_HUT, ENGINE_FMM };
+	const char* names[] = { "BH", "FMM" };
+
+	unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> thread_counts = { 1 };
+	if (cores / 2 > 1)
+		thread_counts.push_back(cores / 2);
+	if (cores > 1)
+		thread_counts.push_back(cores);
+
+	// Long enough for close pairs to amplify any difference in the last bit
+	double total_mass = 0.0;
+	{
+		Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+		TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+		randomBodies(wrapper, bodies, half_length, 42);
+		for (const Node<VecType>& body : wrapper.nodeList)
+			total_mass += body.mass;
+	}
+	const double dt = 1e-3 * std::sqrt(half_length * half_length * half_length / (G * total_mass));
+
+	out << "Deterministic mode -- " << VecType::length() << "D, " << bodies << " bodies, theta " << theta
+		<< ", FMM order " << fmmOrder << ", " << steps << " steps\n";
+	out << std::setw(8) << "engine" << std::setw(15) << "mode" << std::setw(9) << "threads" << std::setw(14) << "[s / step]"
+		<< std::setw(10) << "speedup" << std::setw(8) << "cost" << std::setw(14) << "reproducible" << "\n";
+
+	auto same_bits = [](const std::vector<Node<VecType>>& a, const std::vector<Node<VecType>>& b) {
+		if (a.size() != b.size())
+			return false;
+		for (std::size_t i = 0; i < a.size(); ++i) {
+			if (std::memcmp(&a[i].position, &b[i].position, sizeof(VecType)) != 0
+				|| std::memcmp(&a[i].velocity, &b[i].velocity, sizeof(VecType)) != 0)
+				return false;
+		}
+		return true;
+	};
+
+	for (std::size_t e = 0; e < 2; ++e) {
+		std::vector<double> fast_times;
+
+		for (bool deterministic : { false, true }) {
+			std::vector<Node<VecType>> reference;
+			double reference_energy = 0.0;
+			double serial = 0.0;
+
+			for (std::size_t t = 0; t < thread_counts.size(); ++t) {
+				Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+				TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+				wrapper.getTree().setTheta(theta);
+				randomBodies(wrapper, bodies, half_length, 42);
+				wrapper.setEngine(engines[e]);
+				wrapper.getFmm().setOrder(fmmOrder);
+				wrapper.setThreads(thread_counts[t]);
+				wrapper.getFmm().setThreads(thread_counts[t]);
+				wrapper.setDeterministic(deterministic);
+
+				auto total = std::chrono::duration<double>::zero();
+				for (int step = 0; step < steps; ++step) {
+					wrapper.measureConservation();
+					total += Utils::measureInvokeCall(&TreeWrapper<VecType>::update, wrapper, dt);
+				}
+
+				double per_step = total.count() / steps;
+				double energy = wrapper.getConservation().energy();
+				if (t == 0) {
+					serial = per_step;
+					reference = wrapper.nodeList;
+					reference_energy = energy;
+				}
+				if (!deterministic)
+					fast_times.push_back(per_step);
+
+				bool reproducible = same_bits(wrapper.nodeList, reference) && std::memcmp(&energy, &reference_energy, sizeof(double)) == 0;
+
+				out << std::setw(8) << names[e] << std::setw(15) << (deterministic ? "deterministic" : "fast")
+					<< std::setw(9) << thread_counts[t] << std::scientific << std::setprecision(3) << std::setw(14) << per_step
+					<< std::defaultfloat << std::setprecision(3) << std::setw(10) << serial / per_step
+					<< std::setw(8) << per_step / fast_times[t]
+					<< std::setw(14) << (t == 0 ? "-" : reproducible ? "yes" : "no") << std::setprecision(6) << "\n";
+			}
+		}
+	}
+}
+
+template <typename VecType>
+void Benchmark::outOfCore(std::size_t bodies, double theta, int steps, const std::string& path, std::ostream& out)
+{
+	const std::size_t samples = 200;
+	const double half_length = 1e9;
+	const double megabyte = 1024.0 * 1024.0;
+
+	Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+	TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+	wrapper.getTree().setTheta(theta);
+	randomBodies(wrapper, bodies, half_length, 42);
+	const std::vector<Node<VecType>> initial = wrapper.nodeList;
+
+	double total_mass = 0.0;
+	for (const Node<VecType>& body : initial)
+		total_mass += body.mass;
+	const double dt = 1e-3 * std::sqrt(half_length * half_length * half_length / (G * total_mass));
+
+	out << "Out of core -- " << VecType::length() << "D, " << bodies << " bodies, theta " << theta << ", " << steps << " steps, files at " << path << "\n";
+	out << std::setw(22) << "path" << std::setw(12) << "[s / step]" << std::setw(12) << "bodies / s" << std::setw(10) << "speed"
+		<< std::setw(12) << "read [MB]" << std::setw(12) << "write [MB]" << std::setw(16) << "device [MB]"
+		<< std::setw(12) << "force err" << std::setw(12) << "drift" << "\n";
+
+	std::vector<VecType> forces;
+	wrapper.computeForces(forces);
+	double memory_error = forceError(wrapper.nodeList, forces, samples);
+
+	// A step of length 0 leaves the bodies in place and stores the forces on them,
+	// so both paths start their timed steps from their own forces
+	wrapper.update(0.0);
+
+	auto total = std::chrono::duration<double>::zero();
+	for (int step = 0; step < steps; ++step)
+		total += Utils::measureInvokeCall(&TreeWrapper<VecType>::update, wrapper, dt);
+	const double memory_step = total.count() / steps;
+
+	out << std::setw(22) << "in memory" << std::scientific << std::setprecision(3) << std::setw(12) << memory_step
+		<< std::setw(12) << bodies / memory_step << std::defaultfloat << std::setw(10) << 1.0
+		<< std::setw(12) << "-" << std::setw(12) << "-" << std::setw(16) << "-"
+		<< std::scientific << std::setw(12) << memory_error << std::setw(12) << "-" << std::defaultfloat << "\n";
+
+	for (std::size_t chunk_bodies : { std::max<std::size_t>(bodies / 16, 1024), std::max<std::size_t>(bodies / 4, 1024) }) {
+		OutOfCore<VecType> store(path, chunk_bodies);
+		store.getWrapper().getTree().setTheta(theta);
+		store.import(initial);
+
+		std::vector<Node<VecType>> stepped;
+		store.step(0.0);
+		store.readBodies(stepped);
+		for (std::size_t i = 0; i < stepped.size(); ++i)
+			forces[i] = stepped[i].force;
+		double error = forceError(stepped, forces, samples);
+
+		typename OutOfCore<VecType>::IoStatistics io;
+		double seconds = 0.0;
+		for (int step = 0; step < steps; ++step) {
+			store.step(dt);
+			const auto& last = store.getLastStep();
+			seconds += last.forceSeconds + last.sortSeconds;
+			io.logicalRead += last.logicalRead;
+			io.logicalWritten += last.logicalWritten;
+			io.deviceRead += last.deviceRead;
+			io.deviceWritten += last.deviceWritten;
+		}
+		const double per_step = seconds / steps;
+
+		// The paths only part by their force errors; the median leaves out the few
+		// close pairs that any difference sends apart
+		store.readBodies(stepped);
+		std::vector<double> distances(stepped.size());
+		for (std::size_t i = 0; i < stepped.size(); ++i)
+			distances[i] = glm::length(stepped[i].position - wrapper.nodeList[i].position);
+		std::nth_element(distances.begin(), distances.begin() + distances.size() / 2, distances.end());
+		double drift = distances.empty() ? 0.0 : distances[distances.size() / 2] / half_length;
+
+		std::string name = "chunks of " + std::to_string(chunk_bodies);
+		std::ostringstream device;
+		device << std::setprecision(3) << io.deviceRead / steps / megabyte << " / " << io.deviceWritten / steps / megabyte;
+
+		out << std::setw(22) << name << std::scientific << std::setprecision(3) << std::setw(12) << per_step
+			<< std::setw(12) << bodies / per_step << std::defaultfloat << std::setw(10) << memory_step / per_step
+			<< std::setw(12) << io.logicalRead / steps / megabyte << std::setw(12) << io.logicalWritten / steps / megabyte
+			<< std::setw(16) << device.str() << std::scientific << std::setw(12) << error << std::setw(12) << drift
+			<< std::defaultfloat << std::setprecision(6) << "\n";
+	}
+}
+
+template <typename VecType>
+void Benchmark::dualTree(std::size_t maxBodies, double theta, int fmmOrder, std::ostream& out)
+{
+	const std::size_t samples = 200;
+	const double half_length = 1e9;
+
+	struct Method {
+		const char* name;
+		ForceEngine engine;
+		bool mutual;
+	};
+	const Method methods[] = { { "BH", ENGINE_BARNES_HUT, false }, { "one-sided", ENGINE_FMM, false }, { "mutual", ENGINE_FMM, true } };
+
+	out << "Dual-tree traversal -- " << VecType::length() << "D, theta " << theta << ", FMM order " << fmmOrder << "\n";
+	out << std::setw(10) << "N";
+	for (const Method& method : methods) {
+		out << std::setw(16) << std::string(method.name) + " [s]" << std::setw(10) << "inter/N" << std::setw(12) << "err";
+	}
+	out << "\n";
+
+	for (std::size_t n = 1000; n <= maxBodies; n *= 2) {
+		Box<VecType> box(VecType(0.0), 2 * half_length, 2 * half_length, 2 * half_length);
+		TreeWrapper<VecType> wrapper(std::make_shared<Tree<VecType>>(box));
+		wrapper.getTree().setTheta(theta);
+		randomBodies(wrapper, n, half_length, 42);
+
+		wrapper.getFmm().setOrder(fmmOrder);
+		wrapper.setThreads(1);
+		wrapper.getFmm().setThreads(1);
+
+		std::vector<VecType> forces;
+		out << std::setw(10) << n;
+
+		for (const Method& method : methods) {
+			wrapper.setEngine(method.engine);
+			wrapper.getFmm().setMutual(method.mutual);
+			auto time = Utils::measureInvokeCall(&TreeWrapper<VecType>::computeForces, wrapper, forces);
+			double error = forceError(wrapper.nodeList, forces, samples);
+
+			out << std::scientific << std::setprecision(3) << std::setw(16) << time.count()
+				<< std::defaultfloat << std::setprecision(4) << std::setw(10) << static_cast<double>(wrapper.getForceInteractions()) / n
+				<< std::scientific << std::setprecision(3) << std::setw(12) << error;
+		}
+		out << std::defaultfloat << "\n";
+	}
+}
+
+#endif
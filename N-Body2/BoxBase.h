@@ -2,6 +2,7 @@
 #include <glm/glm.hpp>
 #include <type_traits>
 #include <sstream>
+#include <cmath>
 
 	/*
 				   +--------------+ topRight
@@ -129,6 +130,64 @@ public:
         return contains_impl(point, std::is_same<VecType, glm::dvec3>());
     }
 
+    // Returns the squared distance from a point to the closest point of the box
+    // (0 if the point is inside)
+    double distanceSquared(const VecType& point) const {
+        double dx = std::abs(point.x - center.x) - m_halfWidth;
+        double dy = std::abs(point.y - center.y) - m_halfLength;
+        double sum = 0.0;
+
+        if (dx > 0.0) sum += dx * dx;
+        if (dy > 0.0) sum += dy * dy;
+
+        if constexpr (std::is_same_v<VecType, glm::dvec3>) {
+            double dz = std::abs(point.z - center.z) - m_halfHeight;
+            if (dz > 0.0) sum += dz * dz;
+        }
+        return sum;
+    }
+
+    // Checks if a sphere (circle in 2D) overlaps the box
+    bool intersects(const VecType& point, double radius) const {
+        return distanceSquared(point) <= radius * radius;
+    }
+
+    // Checks if two boxes overlap
+    bool intersects(const Box<VecType>& other) const {
+        bool overlap = std::abs(center.x - other.center.x) <= m_halfWidth + other.m_halfWidth &&
+            std::abs(center.y - other.center.y) <= m_halfLength + other.m_halfLength;
+
+        if constexpr (std::is_same_v<VecType, glm::dvec3>) {
+            overlap = overlap && std::abs(center.z - other.center.z) <= m_halfHeight + other.m_halfHeight;
+        }
+        return overlap;
+    }
+
+    // --- Periodic boundaries ---
+    // The box taken as the unit cell of a periodic lattice
+
+    // Image of `point` inside the box: [center - half, center + half) per axis
+    VecType wrap(const VecType& point) const {
+        VecType wrapped = point - center;
+        double half[3] = { m_halfWidth, m_halfLength, m_halfHeight };
+        for (int d = 0; d < VecType::length(); ++d) {
+            double period = 2.0 * half[d];
+            wrapped[d] -= period * std::floor((wrapped[d] + half[d]) / period);
+        }
+        return center + wrapped;
+    }
+
+    // Shortest of the separations between the images of two points
+    VecType nearestImage(const VecType& separation) const {
+        VecType nearest = separation;
+        double half[3] = { m_halfWidth, m_halfLength, m_halfHeight };
+        for (int d = 0; d < VecType::length(); ++d) {
+            double period = 2.0 * half[d];
+            nearest[d] -= period * std::round(nearest[d] / period);
+        }
+        return nearest;
+    }
+
 private:
     // Implementation for 2D
     bool contains_impl(const glm::dvec2& point, std::false_type) const {
@@ -0,0 +1,117 @@
+#ifndef DOMAIN_H
+#define DOMAIN_H
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "constants.h"
+#include "BoxBase.h"
+#include "Node.h"
+#include "TreeWrapper.h"
+#include "Transport.h"
+
+/*
+	Splits one simulation across several processes (ranks) on the same machine.
+
+	Space is cut by orthogonal recursive bisection (ORB): the bodies are halved
+	along the widest axis of their distribution, recursively, until there is one
+	region per rank. The cuts are placed at the weighted median of a sample of
+	bodies from every rank, each sample weighted by its rank's measured step time,
+	so a rebalance moves work away from the slow ranks.
+
+	Every rank runs the usual TreeWrapper on the bodies it owns. Before each step
+	the ranks send each other their locally essential trees (see
+	Tree::collectEssential), which are inserted as ghost bodies so the local tree
+	walk sees the whole system. After the step bodies that left their region
+	migrate to the new owner.
+
+	Only Barnes-Hut is exchanged this way; collisions are resolved within a rank.
+*/
+template <typename VecType>
+class DomainDecomposition
+{
+private:
+	static constexpr int dimensions = static_cast<int>(VecDimensions<VecType>::value);
+
+	// One cut of the bisection; leaves name the rank owning the region
+	struct Split {
+		int axis;
+		double value;
+		int low;	// index of the child below `value`, -1 for leaves
+		int high;
+		int rank;
+	};
+
+	struct Sample {
+		VecType position;
+		double weight;
+	};
+
+	TreeWrapper<VecType>& m_wrapper;
+	Transport m_transport;
+
+	int m_rebalanceInterval;
+	std::size_t m_samplesPerRank;
+	int m_steps;
+
+	std::vector<Split> m_splits;
+
+	// Statistics
+	double m_intervalTime;			// update() time on this rank since the last rebalance
+	double m_totalStepTime;
+	double m_communicationTime;
+	std::size_t m_ghosts;			// ghosts received before the last step
+	std::size_t m_migrated;			// bodies sent to other ranks so far
+
+public:
+	DomainDecomposition(TreeWrapper<VecType>& wrapper, int rebalanceInterval = 10, std::size_t samplesPerRank = 4096);
+
+	// Getters
+	int getRank();
+	int getRanks();
+	std::size_t getGhosts();
+	std::size_t getMigrated();
+	double getTotalStepTime();
+	double getCommunicationTime();
+	Transport& getTransport();
+
+	// Connects to the other ranks. Every rank must have loaded the same bodies;
+	// each keeps an equal share and the first decomposition is cut by body count.
+	bool start(int rank, int size, int basePort);
+
+	// Ghost exchange, update(dt) on the local bodies, migration and, every
+	// m_rebalanceInterval steps, a new decomposition
+	void step(const double& dt);
+
+	// Recomputes the regions from the measured step times and migrates
+	void rebalance();
+
+	/** Collective operations: every rank has to call them **/
+
+	// Rank 0 receives every body sorted by id; other ranks get an empty list
+	void gatherBodies(std::vector<Node<VecType>>& bodies);
+
+	int getTotalBodies();
+
+	// Slowest rank's total step time over the mean (1 = perfectly balanced)
+	double getImbalance();
+
+	// Sum over the ranks of the wrappers' last conservation measurements
+	Conservation<VecType> getConservation();
+
+private:
+	void exchangeEssential();
+	void migrate();
+
+	int buildSplits(std::vector<Sample>& samples, std::size_t begin, std::size_t end, int firstRank, int ranks);
+	int findOwner(const VecType& position);
+
+	static void writeBody(MessageBuffer& buffer, const Node<VecType>& body);
+	static Node<VecType> readBody(MessageBuffer& buffer);
+};
+
+using DomainDecomposition2D = DomainDecomposition<glm::dvec2>;
+using DomainDecomposition3D = DomainDecomposition<glm::dvec3>;
+
+#include "Domain.tpp"
+#endif
@@ -0,0 +1,467 @@
+#ifndef DOMAIN_TPP
+#define DOMAIN_TPP
+#include "Domain.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+template <typename VecType>
+DomainDecomposition<VecType>::DomainDecomposition(TreeWrapper<VecType>& wrapper, int rebalanceInterval, std::size_t samplesPerRank) :
+	m_wrapper(wrapper),
+	m_transport(),
+	m_rebalanceInterval(rebalanceInterval),
+	m_samplesPerRank(samplesPerRank),
+	m_steps(0),
+	m_intervalTime(0.0),
+	m_totalStepTime(0.0),
+	m_communicationTime(0.0),
+	m_ghosts(0),
+	m_migrated(0)
+{}
+
+template <typename VecType>
+int DomainDecomposition<VecType>::getRank() {
+	return m_transport.getRank();
+}
+
+template <typename VecType>
+int DomainDecomposition<VecType>::getRanks() {
+	return m_transport.getSize();
+}
+
+template <typename VecType>
+std::size_t DomainDecomposition<VecType>::getGhosts() {
+	return m_ghosts;
+}
+
+template <typename VecType>
+std::size_t DomainDecomposition<VecType>::getMigrated() {
+	return m_migrated;
+}
+
+template <typename VecType>
+double DomainDecomposition<VecType>::getTotalStepTime() {
+	return m_totalStepTime;
+}
+
+template <typename VecType>
+double DomainDecomposition<VecType>::getCommunicationTime() {
+	return m_communicationTime;
+}
+
+template <typename VecType>
+Transport& DomainDecomposition<VecType>::getTransport() {
+	return m_transport;
+}
+
+template <typename VecType>
+bool DomainDecomposition<VecType>::start(int rank, int size, int basePort)
+{
+	if (!m_transport.open(rank, size, basePort))
+		return false;
+
+	if (size <= 1)
+		return true;
+
+	std::vector<Node<VecType>> share;
+	for (std::size_t i = rank; i < m_wrapper.nodeList.size(); i += size)
+		share.push_back(m_wrapper.nodeList[i]);
+
+	m_wrapper.nodeList = std::move(share);
+	m_wrapper.setGhosts({});
+
+	rebalance();
+	return true;
+}
+
+template <typename VecType>
+void DomainDecomposition<VecType>::step(const double& dt)
+{
+	if (getRanks() <= 1) {
+		m_wrapper.update(dt);
+		return;
+	}
+
+	auto communication_start = std::chrono::high_resolution_clock::now();
+	exchangeEssential();
+	auto step_start = std::chrono::high_resolution_clock::now();
+
+	m_wrapper.update(dt);
+
+	auto step_end = std::chrono::high_resolution_clock::now();
+	double step_time = std::chrono::duration<double>(step_end - step_start).count();
+	m_intervalTime += step_time;
+	m_totalStepTime += step_time;
+	++m_steps;
+
+	if (m_rebalanceInterval > 0 && m_steps % m_rebalanceInterval == 0)
+		rebalance();
+	else
+		migrate();
+
+	m_communicationTime += std::chrono::duration<double>(step_start - communication_start).count()
+		+ std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - step_end).count();
+}
+
+template <typename VecType>
+void DomainDecomposition<VecType>::exchangeEssential()
+{
+	int ranks = getRanks();
+	int rank = getRank();
+	const std::vector<Node<VecType>>& bodies = m_wrapper.nodeList;
+
+	// Everyone needs the bounds of every other rank's bodies
+	MessageBuffer bounds;
+	bounds.write<std::uint8_t>(bodies.empty() ? 0 : 1);
+
+	if (!bodies.empty()) {
+		VecType low = bodies.front().position;
+		VecType high = low;
+
+		for (const Node<VecType>& body : bodies) {
+			low = glm::min(low, body.position);
+			high = glm::max(high, body.position);
+		}
+
+		for (int d = 0; d < dimensions; ++d) {
+			bounds.write(low[d]);
+			bounds.write(high[d]);
+		}
+	}
+
+	std::vector<std::vector<char>> all_bounds = m_transport.exchange(std::vector<std::vector<char>>(ranks, bounds.data));
+
+	// Send each rank what its bodies need from ours
+	std::vector<std::vector<char>> outgoing(ranks);
+	std::vector<Node<VecType>> essential;
+
+	for (int other = 0; other < ranks; ++other) {
+		MessageBuffer region_data(all_bounds[other]);
+		if (other == rank || region_data.read<std::uint8_t>() == 0)
+			continue;
+
+		VecType low(0), high(0);
+		for (int d = 0; d < dimensions; ++d) {
+			low[d] = region_data.read<double>();
+			high[d] = region_data.read<double>();
+		}
+
+		VecType half = 0.5 * (high - low);
+		Box<VecType> region(0.5 * (low + high), half[1], half[0], half[dimensions - 1]);
+
+		essential.clear();
+		m_wrapper.getTree().collectEssential(region, essential);
+
+		MessageBuffer message;
+		for (const Node<VecType>& node : essential) {
+			for (int d = 0; d < dimensions; ++d)
+				message.write(node.position[d]);
+			message.write(node.mass);
+		}
+		outgoing[other] = std::move(message.data);
+	}
+
+	std::vector<std::vector<char>> incoming = m_transport.exchange(outgoing);
+
+	// Ghost ids count down from -2; -1 marks an empty tree cell
+	std::vector<Node<VecType>> ghosts;
+	for (int other = 0; other < ranks; ++other) {
+		if (other == rank)
+			continue;
+
+		MessageBuffer message(std::move(incoming[other]));
+		while (!message.finished()) {
+			VecType position(0);
+			for (int d = 0; d < dimensions; ++d)
+				position[d] = message.read<double>();
+			double mass = message.read<double>();
+
+			int id = -2 - static_cast<int>(ghosts.size());
+			ghosts.push_back(Node<VecType>(id, "", position, VecType(0), mass, 0.0));
+		}
+	}
+
+	m_ghosts = ghosts.size();
+	m_wrapper.setGhosts(std::move(ghosts));
+}
+
+template <typename VecType>
+void DomainDecomposition<VecType>::migrate()
+{
+	int ranks = getRanks();
+	int rank = getRank();
+
+	std::vector<MessageBuffer> messages(ranks);
+	std::vector<Node<VecType>> kept;
+	std::size_t sent = 0;
+
+	for (const Node<VecType>& body : m_wrapper.nodeList) {
+		int owner = findOwner(body.position);
+
+		if (owner == rank) {
+			kept.push_back(body);
+			continue;
+		}
+
+		writeBody(messages[owner], body);
+		++sent;
+	}
+
+	std::vector<std::vector<char>> outgoing(ranks);
+	for (int other = 0; other < ranks; ++other)
+		outgoing[other] = std::move(messages[other].data);
+
+	std::vector<std::vector<char>> incoming = m_transport.exchange(outgoing);
+	std::size_t received = 0;
+
+	for (int other = 0; other < ranks; ++other) {
+		if (other == rank)
+			continue;
+
+		MessageBuffer message(std::move(incoming[other]));
+		while (!message.finished()) {
+			kept.push_back(readBody(message));
+			++received;
+		}
+	}
+
+	m_migrated += sent;
+
+	if (sent || received) {
+		m_wrapper.nodeList = std::move(kept);
+		m_wrapper.setGhosts({});
+	}
+}
+
+template <typename VecType>
+void DomainDecomposition<VecType>::rebalance()
+{
+	const std::vector<Node<VecType>>& bodies = m_wrapper.nodeList;
+	std::size_t count = std::min(bodies.size(), m_samplesPerRank);
+
+	// Before the first step the cost of a rank is its body count
+	double cost = m_steps > 0 ? m_intervalTime : static_cast<double>(bodies.size());
+	m_intervalTime = 0.0;
+
+	MessageBuffer message;
+	for (std::size_t s = 0; s < count; ++s) {
+		const Node<VecType>& body = bodies[s * bodies.size() / count];
+
+		for (int d = 0; d < dimensions; ++d)
+			message.write(body.position[d]);
+		message.write(cost / count);
+	}
+
+	std::vector<std::vector<char>> incoming = m_transport.exchange(std::vector<std::vector<char>>(getRanks(), message.data));
+
+	// Every rank sees the same samples in the same order and cuts the same regions
+	std::vector<Sample> samples;
+	for (std::vector<char>& data : incoming) {
+		MessageBuffer samples_data(std::move(data));
+
+		while (!samples_data.finished()) {
+			Sample sample;
+			sample.position = VecType(0);
+			for (int d = 0; d < dimensions; ++d)
+				sample.position[d] = samples_data.read<double>();
+			sample.weight = samples_data.read<double>();
+			samples.push_back(sample);
+		}
+	}
+
+	m_splits.clear();
+	buildSplits(samples, 0, samples.size(), 0, getRanks());
+
+	migrate();
+}
+
+template <typename VecType>
+int DomainDecomposition<VecType>::buildSplits(std::vector<Sample>& samples, std::size_t begin, std::size_t end, int firstRank, int ranks)
+{
+	int index = static_cast<int>(m_splits.size());
+	m_splits.push_back(Split{ 0, 0.0, -1, -1, firstRank });
+
+	if (ranks == 1)
+		return index;
+
+	// Cut across the widest extent of the samples
+	int axis = 0;
+	if (begin < end) {
+		VecType low = samples[begin].position;
+		VecType high = low;
+
+		for (std::size_t s = begin; s < end; ++s) {
+			low = glm::min(low, samples[s].position);
+			high = glm::max(high, samples[s].position);
+		}
+
+		for (int d = 1; d < dimensions; ++d) {
+			if (high[d] - low[d] > high[axis] - low[axis])
+				axis = d;
+		}
+	}
+
+	std::sort(samples.begin() + begin, samples.begin() + end, [axis](const Sample& a, const Sample& b) {
+		return a.position[axis] < b.position[axis];
+	});
+
+	// Weighted cut giving each half a share of the weight matching its share of the ranks
+	int low_ranks = ranks / 2;
+	double total = 0.0;
+	for (std::size_t s = begin; s < end; ++s)
+		total += samples[s].weight;
+
+	double target = total * low_ranks / ranks;
+	double accumulated = 0.0;
+	std::size_t cut = begin;
+
+	while (cut < end && accumulated + 0.5 * samples[cut].weight < target) {
+		accumulated += samples[cut].weight;
+		++cut;
+	}
+
+	double value;
+	if (begin == end)
+		value = 0.0;
+	else if (cut == begin)
+		value = samples[begin].position[axis];
+	else if (cut == end)
+		value = std::nextafter(samples[end - 1].position[axis], std::numeric_limits<double>::max());
+	else
+		value = 0.5 * (samples[cut - 1].position[axis] + samples[cut].position[axis]);
+
+	int low = buildSplits(samples, begin, cut, firstRank, low_ranks);
+	int high = buildSplits(samples, cut, end, firstRank + low_ranks, ranks - low_ranks);
+
+	m_splits[index] = Split{ axis, value, low, high, -1 };
+	return index;
+}
+
+template <typename VecType>
+int DomainDecomposition<VecType>::findOwner(const VecType& position)
+{
+	if (m_splits.empty())
+		return m_transport.getRank();
+
+	int index = 0;
+	while (m_splits[index].rank < 0) {
+		const Split& split = m_splits[index];
+		index = position[split.axis] < split.value ? split.low : split.high;
+	}
+	return m_splits[index].rank;
+}
+
+template <typename VecType>
+void DomainDecomposition<VecType>::gatherBodies(std::vector<Node<VecType>>& bodies)
+{
+	bodies.clear();
+
+	if (getRanks() <= 1) {
+		bodies = m_wrapper.nodeList;
+		return;
+	}
+
+	MessageBuffer message;
+	for (const Node<VecType>& body : m_wrapper.nodeList)
+		writeBody(message, body);
+
+	std::vector<std::vector<char>> outgoing(getRanks());
+	outgoing[0] = std::move(message.data);
+
+	std::vector<std::vector<char>> incoming = m_transport.exchange(outgoing);
+	if (getRank() != 0)
+		return;
+
+	for (std::vector<char>& data : incoming) {
+		MessageBuffer bodies_data(std::move(data));
+		while (!bodies_data.finished())
+			bodies.push_back(readBody(bodies_data));
+	}
+
+	std::sort(bodies.begin(), bodies.end(), [](const Node<VecType>& a, const Node<VecType>& b) {
+		return a.getId() < b.getId();
+	});
+}
+
+template <typename VecType>
+int DomainDecomposition<VecType>::getTotalBodies()
+{
+	int total = 0;
+	for (double count : m_transport.allGather(static_cast<double>(m_wrapper.nodeList.size())))
+		total += static_cast<int>(count);
+	return total;
+}
+
+template <typename VecType>
+double DomainDecomposition<VecType>::getImbalance()
+{
+	std::vector<double> times = m_transport.allGather(m_totalStepTime);
+
+	double slowest = 0.0;
+	double mean = 0.0;
+	for (double time : times) {
+		slowest = std::max(slowest, time);
+		mean += time / times.size();
+	}
+	return mean > 0.0 ? slowest / mean : 1.0;
+}
+
+template <typename VecType>
+Conservation<VecType> DomainDecomposition<VecType>::getConservation()
+{
+	const Conservation<VecType>& local = m_wrapper.getConservation();
+	Conservation<VecType> total;
+
+	for (double value : m_transport.allGather(local.kinetic))
+		total.kinetic += value;
+	for (double value : m_transport.allGather(local.potential))
+		total.potential += value;
+
+	for (int d = 0; d < dimensions; ++d) {
+		for (double value : m_transport.allGather(local.momentum[d]))
+			total.momentum[d] += value;
+	}
+	for (int d = 0; d < 3; ++d) {
+		for (double value : m_transport.allGather(local.angularMomentum[d]))
+			total.angularMomentum[d] += value;
+	}
+	return total;
+}
+
+template <typename VecType>
+void DomainDecomposition<VecType>::writeBody(MessageBuffer& buffer, const Node<VecType>& body)
+{
+	buffer.write<std::int32_t>(body.getId());
+	buffer.writeString(body.name);
+
+	for (int d = 0; d < dimensions; ++d) {
+		buffer.write(body.position[d]);
+		buffer.write(body.velocity[d]);
+		buffer.write(body.force[d]);
+	}
+	buffer.write(body.mass);
+	buffer.write(body.radius);
+}
+
+template <typename VecType>
+Node<VecType> DomainDecomposition<VecType>::readBody(MessageBuffer& buffer)
+{
+	int id = buffer.read<std::int32_t>();
+	std::string name = buffer.readString();
+
+	VecType position(0), velocity(0), force(0);
+	for (int d = 0; d < dimensions; ++d) {
+		position[d] = buffer.read<double>();
+		velocity[d] = buffer.read<double>();
+		force[d] = buffer.read<double>();
+	}
+	double mass = buffer.read<double>();
+	double radius = buffer.read<double>();
+
+	Node<VecType> body(id, name, position, velocity, mass, radius);
+	body.force = force;
+	return body;
+}
+
+#endif
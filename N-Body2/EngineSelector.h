@@ -0,0 +1,67 @@
+#ifndef ENGINESELECTOR_H
+#define ENGINESELECTOR_H
+#pragma once
+#include <iostream>
+#include <vector>
+
+#include "TreeWrapper.h"
+
+/*
+	Picks the force engine of a run (--engine auto). A calibration evaluates the
+	forces on the current bodies with every engine, compares them with a direct
+	sum over a sample of the bodies and switches the wrapper to the fastest engine
+	whose relative RMS error is within the tolerance. Direct summation is the
+	reference itself; its cost is extrapolated from the sample.
+
+	Which engine wins depends on N and on how clustered the bodies are, so the
+	choice is re-checked every `interval` steps and whenever the body count has
+	changed by more than a tenth since the last calibration (e.g. after mergers).
+	Calibrations only evaluate forces, the bodies do not move.
+*/
+template <typename VecType>
+class EngineSelector
+{
+public:
+	struct Candidate {
+		ForceEngine engine;
+		double seconds;		// one force evaluation of every body
+		double error;		// relative RMS against the direct sum
+	};
+
+private:
+	static constexpr std::size_t samples = 256;
+	static constexpr int repeats = 2;	// evaluations per engine, the fastest counts
+
+	double m_tolerance;
+	int m_interval;			// 0 = only when the body count changes
+
+	int m_calibrations;
+	int m_switches;
+	int m_lastStep;
+	std::size_t m_lastBodies;
+	double m_calibrationTime;
+	ForceEngine m_engine;
+	std::vector<Candidate> m_candidates;	// of the last calibration
+
+public:
+	EngineSelector(double tolerance, int interval);
+
+	// Getters
+	ForceEngine getEngine();
+	int getCalibrations();
+	std::vector<Candidate>& getCandidates();
+
+	// Whether the engine has to be (re-)calibrated before `step`
+	bool due(int step, TreeWrapper<VecType>& wrapper);
+
+	// Times every engine on the bodies of `wrapper` and leaves it on the chosen one
+	ForceEngine calibrate(int step, TreeWrapper<VecType>& wrapper);
+
+	// Summary and the candidates of the last calibration for the run report
+	void report(std::ostream& out);
+
+	static const char* engineName(ForceEngine engine);
+};
+
+#include "EngineSelector.tpp"
+#endif
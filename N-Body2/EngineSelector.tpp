@@ -0,0 +1,146 @@
+#ifndef ENGINESELECTOR_TPP
+#define ENGINESELECTOR_TPP
+#include "EngineSelector.h"
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <limits>
+
+template <typename VecType>
+EngineSelector<VecType>::EngineSelector(double tolerance, int interval) :
+	m_tolerance(tolerance),
+	m_interval(interval > 0 ? interval : 0),
+	m_calibrations(0),
+	m_switches(0),
+	m_lastStep(0),
+	m_lastBodies(0),
+	m_calibrationTime(0.0),
+	m_engine(ENGINE_BARNES_HUT),
+	m_candidates()
+{}
+
+template <typename VecType>
+ForceEngine EngineSelector<VecType>::getEngine() {
+	return m_engine;
+}
+
+template <typename VecType>
+int EngineSelector<VecType>::getCalibrations() {
+	return m_calibrations;
+}
+
+template <typename VecType>
+std::vector<typename EngineSelector<VecType>::Candidate>& EngineSelector<VecType>::getCandidates() {
+	return m_candidates;
+}
+
+template <typename VecType>
+const char* EngineSelector<VecType>::engineName(ForceEngine engine)
+{
+	switch (engine) {
+	case ENGINE_FMM: return "FMM";
+	case ENGINE_TREEPM: return "TreePM";
+	case ENGINE_DIRECT: return "direct";
+	default: return "BH";
+	}
+}
+
+template <typename VecType>
+bool EngineSelector<VecType>::due(int step, TreeWrapper<VecType>& wrapper)
+{
+	if (m_calibrations == 0)
+		return true;
+	if (m_interval > 0 && step - m_lastStep >= m_interval)
+		return true;
+
+	std::size_t bodies = wrapper.nodeList.size();
+	std::size_t change = bodies > m_lastBodies ? bodies - m_lastBodies : m_lastBodies - bodies;
+	return 10 * change > m_lastBodies;
+}
+
+template <typename VecType>
+ForceEngine EngineSelector<VecType>::calibrate(int step, TreeWrapper<VecType>& wrapper)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	const std::vector<Node<VecType>>& bodies = wrapper.nodeList;
+	const std::size_t n = bodies.size();
+	const std::size_t stride = n / samples > 0 ? n / samples : 1;
+	const std::size_t sampled = (n + stride - 1) / stride;
+
+	// Reference forces of the sample, split across threads like a real step
+	std::vector<VecType> exact(sampled, VecType(0));
+	wrapper.setEngine(ENGINE_DIRECT);
+	auto direct_start = std::chrono::high_resolution_clock::now();
+	Utils::parallelFor(sampled, wrapper.getThreads(), [&](std::size_t begin, std::size_t end) {
+		for (std::size_t k = begin; k < end; ++k) {
+			Node<VecType> probe = bodies[k * stride];
+			probe.force = VecType(0);
+			wrapper.directForce(probe);
+			exact[k] = probe.force;
+		}
+	});
+	std::chrono::duration<double> direct = std::chrono::high_resolution_clock::now() - direct_start;
+
+	m_candidates.clear();
+	m_candidates.push_back({ ENGINE_DIRECT, sampled > 0 ? direct.count() * n / sampled : 0.0, 0.0 });
+
+	const ForceEngine engines[] = { ENGINE_BARNES_HUT, ENGINE_FMM, ENGINE_TREEPM };
+	std::vector<VecType> forces;
+	for (ForceEngine engine : engines) {
+		wrapper.setEngine(engine);
+
+		double seconds = std::numeric_limits<double>::max();
+		for (int r = 0; r < repeats; ++r)
+			seconds = std::min(seconds, Utils::measureInvokeCall(&TreeWrapper<VecType>::computeForces, wrapper, forces).count());
+
+		double error = 0.0, norm = 0.0;
+		for (std::size_t k = 0; k < sampled; ++k) {
+			VecType difference = forces[k * stride] - exact[k];
+			error += glm::dot(difference, difference);
+			norm += glm::dot(exact[k], exact[k]);
+		}
+
+		m_candidates.push_back({ engine, seconds, norm > 0.0 ? std::sqrt(error / norm) : 0.0 });
+	}
+
+	// The direct sum always qualifies, so there is a winner
+	const Candidate* best = nullptr;
+	for (const Candidate& candidate : m_candidates) {
+		if (candidate.error <= m_tolerance && (!best || candidate.seconds < best->seconds))
+			best = &candidate;
+	}
+
+	if (m_calibrations > 0 && best->engine != m_engine)
+		++m_switches;
+
+	m_engine = best->engine;
+	wrapper.setEngine(m_engine);
+
+	++m_calibrations;
+	m_lastStep = step;
+	m_lastBodies = n;
+	m_calibrationTime += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	return m_engine;
+}
+
+template <typename VecType>
+void EngineSelector<VecType>::report(std::ostream& out)
+{
+	if (m_calibrations == 0)
+		return;
+
+	out << "Engine -- auto: " << m_calibrations << " calibrations in " << m_calibrationTime << " s, " << m_switches
+		<< " switches, tolerance " << m_tolerance << ", using " << engineName(m_engine) << std::endl;
+
+	out << "Engine -- step " << m_lastStep << ", " << m_lastBodies << " bodies\n";
+	out << std::setw(10) << "engine" << std::setw(14) << "[s / eval]" << std::setw(12) << "err" << "\n";
+	for (const Candidate& candidate : m_candidates) {
+		out << std::setw(10) << engineName(candidate.engine) << std::scientific << std::setprecision(3)
+			<< std::setw(14) << candidate.seconds << std::setw(12) << candidate.error << std::defaultfloat
+			<< (candidate.engine == m_engine ? "  <" : "") << "\n";
+	}
+	out << std::flush;
+}
+
+#endif
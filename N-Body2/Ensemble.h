@@ -0,0 +1,104 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "Node.h"
+#include "Utils.h"
+
+/*
+	Direct-summation engine for many small, independent systems (parameter
+	studies of Earth-Moon.json, Earth_Moon_Sun.json, ...), where a tree per
+	system would be pure overhead.
+
+	Systems with the same number of bodies are packed `lanes` at a time into
+	structure-of-arrays blocks indexed [body * lanes + lane]: the innermost loop
+	of the force calculation runs over the systems of a pack, so every
+	statement of it is one SIMD operation across `lanes` different systems.
+	Packs are independent and are stepped on separate threads for the whole run.
+
+	Bodies are advanced with kick-drift-kick leapfrog.
+*/
+template <typename VecType>
+class Ensemble
+{
+public:
+	// Systems per pack; 8 doubles fill an AVX-512 register, or two AVX2 registers
+	static constexpr std::size_t lanes = 8;
+
+	struct System {
+		std::string source;		// file the system was loaded from
+		int variant;			// 0 as loaded, > 0 perturbed copies
+		std::vector<Node<VecType>> bodies;
+		double initialEnergy;
+		double energy;
+	};
+
+private:
+	static constexpr int dimensions = static_cast<int>(VecDimensions<VecType>::value);
+
+	struct Pack {
+		std::size_t bodies;
+		std::size_t used;					// lanes holding distinct systems, the rest repeat the last one
+		std::size_t systems[lanes];			// index into m_systems per lane
+		std::vector<double> mass;
+		std::vector<double> position[dimensions];
+		std::vector<double> velocity[dimensions];
+		std::vector<double> acceleration[dimensions];
+	};
+
+	std::vector<System> m_systems;
+	std::vector<Pack> m_packs;
+
+	unsigned int m_threads;
+
+	// Pairs closer than this are skipped, as in TreeWrapper
+	double m_epsilon;
+
+	long long m_steps;
+
+public:
+	Ensemble();
+
+	// Getters
+	std::size_t getSystemCount();
+	long long getSteps();
+	std::vector<System>& getSystems();
+
+	// Setters
+	void setThreads(unsigned int threads);
+
+	// Adds the system stored in a bodies JSON file (the format of TreeWrapper::loadBodies)
+	bool loadSystem(const std::string& filePath);
+
+	// Adds `copies` variants of every loaded system, scaling each body's mass and
+	// velocity by independent factors 1 + U(-spread, spread)
+	void addVariants(int copies, double spread, unsigned int seed);
+
+	// Lays the systems out in packs. Call after loading, before step().
+	void pack();
+
+	void step(const double& dt, int steps = 1);
+
+	// Copies the packed state back into getSystems() and updates the energies
+	void collect();
+
+	// One CSV row per body with its system's relative energy error
+	void writeResults(const std::string& filePath);
+
+	// Kinetic plus potential energy; pairs closer than `epsilon` are left out, as
+	// they are from the forces
+	static double totalEnergy(const std::vector<Node<VecType>>& bodies, double epsilon);
+
+private:
+	void computeAccelerations(Pack& pack);
+};
+
+using Ensemble2D = Ensemble<glm::dvec2>;
+using Ensemble3D = Ensemble<glm::dvec3>;
+
+#include "Ensemble.tpp"
+#endif
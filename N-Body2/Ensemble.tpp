@@ -0,0 +1,288 @@
+#ifndef ENSEMBLE_TPP
+#define ENSEMBLE_TPP
+#include "Ensemble.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <random>
+#include <nlohmann/json.hpp>
+
+template <typename VecType>
+Ensemble<VecType>::Ensemble() :
+	m_systems(),
+	m_packs(),
+	m_threads(0),
+	m_epsilon(1e-3),
+	m_steps(0)
+{}
+
+template <typename VecType>
+std::size_t Ensemble<VecType>::getSystemCount() {
+	return m_systems.size();
+}
+
+template <typename VecType>
+long long Ensemble<VecType>::getSteps() {
+	return m_steps;
+}
+
+template <typename VecType>
+std::vector<typename Ensemble<VecType>::System>& Ensemble<VecType>::getSystems() {
+	return m_systems;
+}
+
+template <typename VecType>
+void Ensemble<VecType>::setThreads(unsigned int threads) {
+	m_threads = threads;
+}
+
+template <typename VecType>
+bool Ensemble<VecType>::loadSystem(const std::string& filePath)
+{
+	std::ifstream file(filePath);
+
+	if (!file.is_open()) {
+		std::cerr << "Error: Could not open file " << filePath << std::endl;
+		return false;
+	}
+
+	nlohmann::json body_data = nlohmann::json::parse(file);
+
+	System system;
+	system.source = filePath;
+	system.variant = 0;
+
+	for (const auto& body_json : body_data["bodies"]) {
+		VecType pos(0), vel(0);
+		for (int d = 0; d < dimensions; ++d) {
+			pos[d] = body_json["position"][d].get<double>();
+			vel[d] = body_json["velocity"][d].get<double>();
+		}
+
+		system.bodies.push_back(Node<VecType>(body_json["id"].get<int>(), body_json["name"].get<std::string>(), pos, vel,
+			body_json["mass"].get<double>(), body_json["radius"].get<double>()));
+	}
+
+	system.initialEnergy = totalEnergy(system.bodies, m_epsilon);
+	system.energy = system.initialEnergy;
+
+	m_systems.push_back(system);
+	return true;
+}
+
+template <typename VecType>
+void Ensemble<VecType>::addVariants(int copies, double spread, unsigned int seed)
+{
+	std::mt19937_64 rng(seed);
+	std::uniform_real_distribution<double> factor(1.0 - spread, 1.0 + spread);
+
+	std::size_t originals = m_systems.size();
+	for (std::size_t s = 0; s < originals; ++s) {
+		for (int copy = 1; copy <= copies; ++copy) {
+			System variant = m_systems[s];
+			variant.variant = copy;
+
+			for (Node<VecType>& body : variant.bodies) {
+				body.mass *= factor(rng);
+				body.velocity *= factor(rng);
+			}
+
+			variant.initialEnergy = totalEnergy(variant.bodies, m_epsilon);
+			variant.energy = variant.initialEnergy;
+			m_systems.push_back(variant);
+		}
+	}
+}
+
+template <typename VecType>
+void Ensemble<VecType>::pack()
+{
+	m_packs.clear();
+
+	// Only systems with the same body count can share a pack
+	std::map<std::size_t, std::vector<std::size_t>> by_size;
+	for (std::size_t s = 0; s < m_systems.size(); ++s)
+		by_size[m_systems[s].bodies.size()].push_back(s);
+
+	for (auto& group : by_size) {
+		std::size_t n = group.first;
+		const std::vector<std::size_t>& members = group.second;
+
+		for (std::size_t first = 0; first < members.size(); first += lanes) {
+			Pack pack;
+			pack.bodies = n;
+			pack.used = std::min(lanes, members.size() - first);
+
+			for (std::size_t lane = 0; lane < lanes; ++lane)
+				pack.systems[lane] = members[first + std::min(lane, pack.used - 1)];
+
+			pack.mass.resize(n * lanes);
+			for (int d = 0; d < dimensions; ++d) {
+				pack.position[d].resize(n * lanes);
+				pack.velocity[d].resize(n * lanes);
+				pack.acceleration[d].resize(n * lanes);
+			}
+
+			for (std::size_t lane = 0; lane < lanes; ++lane) {
+				const System& system = m_systems[pack.systems[lane]];
+
+				for (std::size_t i = 0; i < n; ++i) {
+					pack.mass[i * lanes + lane] = system.bodies[i].mass;
+					for (int d = 0; d < dimensions; ++d) {
+						pack.position[d][i * lanes + lane] = system.bodies[i].position[d];
+						pack.velocity[d][i * lanes + lane] = system.bodies[i].velocity[d];
+					}
+				}
+			}
+
+			computeAccelerations(pack);
+			m_packs.push_back(std::move(pack));
+		}
+	}
+}
+
+template <typename VecType>
+void Ensemble<VecType>::computeAccelerations(Pack& pack)
+{
+	const std::size_t n = pack.bodies;
+	const double epsilon_squared = m_epsilon * m_epsilon;
+
+	for (int d = 0; d < dimensions; ++d)
+		std::fill(pack.acceleration[d].begin(), pack.acceleration[d].end(), 0.0);
+
+	// Each pair once; the lane loop is the vectorized one
+	for (std::size_t i = 0; i < n; ++i) {
+		for (std::size_t j = i + 1; j < n; ++j) {
+			const std::size_t a = i * lanes;
+			const std::size_t b = j * lanes;
+
+			for (std::size_t lane = 0; lane < lanes; ++lane) {
+				double distance[dimensions];
+				double r2 = 0.0;
+
+				for (int d = 0; d < dimensions; ++d) {
+					distance[d] = pack.position[d][b + lane] - pack.position[d][a + lane];
+					r2 += distance[d] * distance[d];
+				}
+
+				double inverse = r2 > epsilon_squared ? 1.0 / (r2 * std::sqrt(r2)) : 0.0;
+				double toward_j = G * pack.mass[b + lane] * inverse;
+				double toward_i = G * pack.mass[a + lane] * inverse;
+
+				for (int d = 0; d < dimensions; ++d) {
+					pack.acceleration[d][a + lane] += toward_j * distance[d];
+					pack.acceleration[d][b + lane] -= toward_i * distance[d];
+				}
+			}
+		}
+	}
+}
+
+template <typename VecType>
+void Ensemble<VecType>::step(const double& dt, int steps)
+{
+	// Packs never interact, so each worker runs its packs through every step
+	Utils::parallelFor(m_packs.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t p = begin; p < end; ++p) {
+			Pack& pack = m_packs[p];
+			const std::size_t values = pack.bodies * lanes;
+
+			for (int s = 0; s < steps; ++s) {
+				for (int d = 0; d < dimensions; ++d) {
+					double* position = pack.position[d].data();
+					double* velocity = pack.velocity[d].data();
+					const double* acceleration = pack.acceleration[d].data();
+
+					for (std::size_t k = 0; k < values; ++k) {
+						velocity[k] += 0.5 * dt * acceleration[k];
+						position[k] += dt * velocity[k];
+					}
+				}
+
+				computeAccelerations(pack);
+
+				for (int d = 0; d < dimensions; ++d) {
+					double* velocity = pack.velocity[d].data();
+					const double* acceleration = pack.acceleration[d].data();
+
+					for (std::size_t k = 0; k < values; ++k)
+						velocity[k] += 0.5 * dt * acceleration[k];
+				}
+			}
+		}
+	});
+
+	m_steps += steps;
+}
+
+template <typename VecType>
+void Ensemble<VecType>::collect()
+{
+	for (Pack& pack : m_packs) {
+		for (std::size_t lane = 0; lane < pack.used; ++lane) {
+			System& system = m_systems[pack.systems[lane]];
+
+			for (std::size_t i = 0; i < pack.bodies; ++i) {
+				Node<VecType>& body = system.bodies[i];
+				for (int d = 0; d < dimensions; ++d) {
+					body.position[d] = pack.position[d][i * lanes + lane];
+					body.velocity[d] = pack.velocity[d][i * lanes + lane];
+					body.force[d] = body.mass * pack.acceleration[d][i * lanes + lane];
+				}
+			}
+
+			system.energy = totalEnergy(system.bodies, m_epsilon);
+		}
+	}
+}
+
+template <typename VecType>
+double Ensemble<VecType>::totalEnergy(const std::vector<Node<VecType>>& bodies, double epsilon)
+{
+	double energy = 0.0;
+
+	for (std::size_t i = 0; i < bodies.size(); ++i) {
+		energy += 0.5 * bodies[i].mass * glm::dot(bodies[i].velocity, bodies[i].velocity);
+
+		for (std::size_t j = i + 1; j < bodies.size(); ++j) {
+			VecType distance = bodies[i].position - bodies[j].position;
+			double r2 = glm::dot(distance, distance);
+			if (r2 > epsilon * epsilon)
+				energy -= G * bodies[i].mass * bodies[j].mass / std::sqrt(r2);
+		}
+	}
+	return energy;
+}
+
+template <typename VecType>
+void Ensemble<VecType>::writeResults(const std::string& filePath)
+{
+	std::ofstream file(filePath, std::ios::out | std::ios::trunc);
+	const char* axes[] = { "x", "y", "z" };
+
+	file << "system,source,variant,body,name,mass";
+	for (int d = 0; d < dimensions; ++d)
+		file << "," << axes[d];
+	for (int d = 0; d < dimensions; ++d)
+		file << ",v" << axes[d];
+	file << ",relative_energy_error\n";
+
+	file << std::setprecision(17);
+	for (std::size_t s = 0; s < m_systems.size(); ++s) {
+		const System& system = m_systems[s];
+		double error = system.initialEnergy != 0.0 ? (system.energy - system.initialEnergy) / std::abs(system.initialEnergy) : 0.0;
+
+		for (const Node<VecType>& body : system.bodies) {
+			file << s << "," << system.source << "," << system.variant << "," << body.getId() << "," << body.name << "," << body.mass;
+			for (int d = 0; d < dimensions; ++d)
+				file << "," << body.position[d];
+			for (int d = 0; d < dimensions; ++d)
+				file << "," << body.velocity[d];
+			file << "," << error << "\n";
+		}
+	}
+}
+
+#endif
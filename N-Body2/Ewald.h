@@ -0,0 +1,88 @@
+#ifndef EWALD_H
+#define EWALD_H
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "constants.h"
+#include "Node.h"
+#include "Utils.h"
+
+/*
+	Ewald correction for periodic boundaries.
+
+	In a periodic cube of side L a body feels every image of every other body,
+	plus the uniform background that keeps the infinite sum finite. The tree
+	walk only sees the nearest image, so each interaction adds
+
+		correction(x) = a_ewald(x) + x / |x|^3		(G = m = 1)
+
+	where x is the minimum-image separation. The correction is smooth and is
+	tabulated once on [0, L / 2] per axis, the remaining octants following
+	from its symmetry (odd along its own axis, even along the others). The
+	kernel then interpolates the table trilinearly (bilinearly in 2D).
+
+	The potential gets the same treatment, phi_ewald(x) - 1 / |x| next to the
+	walk's -1 / |x|, so the energy the conservation monitor sums is that of
+	the periodic system the forces belong to. It is even along every axis.
+
+	3D uses the usual Ewald sum (Hernquist, Bouchet & Suto 1991). 2D runs keep
+	the 3D 1 / r^2 force inside a periodic square, which needs the sum for a
+	lattice periodic in two dimensions only (Parry 1975).
+*/
+template <typename VecType>
+class Ewald
+{
+public:
+	// Table intervals per axis over half the period
+	static constexpr int cells = 32;
+
+private:
+	static constexpr int dimensions = static_cast<int>(VecDimensions<VecType>::value);
+
+	// Ewald splitting parameter and the images / wave vectors summed, in a unit box.
+	// Terms beyond the cutoffs are below 1e-10 of the result.
+	static constexpr double alpha = 2.0;
+	static constexpr int images = 3;
+	static constexpr double realCutoff = 3.0;		// |x - n|
+	static constexpr double waveCutoff = 10.0;		// |h|^2
+
+	double m_period;
+	double m_scale;		// table intervals per unit of separation
+	double m_norm;		// 1 / period^2, from the unit box to the period
+
+	// Correction of a unit box at (i, j, k) * 0.5 / cells, x fastest, (cells + 1)^dimensions entries
+	std::vector<VecType> m_table;
+	std::vector<double> m_potentials;	// potential correction at the same points
+
+public:
+	Ewald();
+
+	// Getters
+	double getPeriod();
+	bool isReady();
+
+	// Tabulates the correction for a period of `period`
+	void build(double period, unsigned int threads = 0);
+
+	// Acceleration to add for a unit mass (G = 1) at minimum-image separation
+	// `separation`, on top of the Newtonian -separation / |separation|^3
+	VecType correction(const VecType& separation) const;
+
+	// Potential to add for a unit mass (G = 1) at minimum-image separation
+	// `separation`, on top of the Newtonian -1 / |separation|
+	double potential(const VecType& separation) const;
+
+	// Direct evaluation in a unit box, used to fill the tables
+	static VecType exactCorrection(const VecType& x);
+	static double exactPotential(const VecType& x);
+
+private:
+	// Folds `separation` into the tabulated octant and interpolates `table` there;
+	// `sign` receives the sign of every axis folded away
+	template <typename Value>
+	Value interpolate(const std::vector<Value>& table, const VecType& separation, VecType& sign) const;
+};
+
+#include "Ewald.tpp"
+#endif
@@ -0,0 +1,242 @@
+#ifndef EWALD_TPP
+#define EWALD_TPP
+#include "Ewald.h"
+#include <algorithm>
+#include <cmath>
+
+template <typename VecType>
+Ewald<VecType>::Ewald() :
+	m_period(0.0),
+	m_scale(0.0),
+	m_norm(0.0),
+	m_table(),
+	m_potentials()
+{}
+
+template <typename VecType>
+double Ewald<VecType>::getPeriod() {
+	return m_period;
+}
+
+template <typename VecType>
+bool Ewald<VecType>::isReady() {
+	return m_period > 0.0 && !m_table.empty();
+}
+
+template <typename VecType>
+VecType Ewald<VecType>::exactCorrection(const VecType& x)
+{
+	double r2 = glm::dot(x, x);
+	if (r2 == 0.0)
+		return VecType(0);
+
+	VecType force(0);
+
+	// Real space: screened images, the nearest one without the Newtonian part the walk adds
+	int n[3] = { 0, 0, 0 };
+	const int span = 2 * images + 1;
+	const int real_terms = dimensions == 3 ? span * span * span : span * span;
+
+	for (int term = 0; term < real_terms; ++term) {
+		int rest = term;
+		for (int d = 0; d < dimensions; ++d) {
+			n[d] = rest % span - images;
+			rest /= span;
+		}
+
+		VecType dx = x;
+		for (int d = 0; d < dimensions; ++d)
+			dx[d] -= n[d];
+
+		double r = glm::length(dx);
+		if (r > realCutoff)
+			continue;
+
+		double screened = std::erfc(alpha * r) + 2.0 * alpha * r / std::sqrt(M_PI) * std::exp(-alpha * alpha * r * r);
+
+		bool nearest = n[0] == 0 && n[1] == 0 && n[2] == 0;
+		force += (nearest ? 1.0 - screened : -screened) * dx / (r * r * r);
+	}
+
+	// Reciprocal space
+	for (int term = 0; term < real_terms; ++term) {
+		int rest = term;
+		for (int d = 0; d < dimensions; ++d) {
+			n[d] = rest % span - images;
+			rest /= span;
+		}
+		if (n[0] == 0 && n[1] == 0 && n[2] == 0)
+			continue;
+
+		VecType h(0);
+		for (int d = 0; d < dimensions; ++d)
+			h[d] = n[d];
+
+		double h2 = glm::dot(h, h);
+		if (h2 > waveCutoff)
+			continue;
+
+		double phase = std::sin(2.0 * M_PI * glm::dot(h, x));
+
+		if constexpr (dimensions == 3)
+			force -= 2.0 / h2 * std::exp(-M_PI * M_PI * h2 / (alpha * alpha)) * phase * h;
+		else
+			force -= 2.0 * M_PI / std::sqrt(h2) * std::erfc(M_PI * std::sqrt(h2) / alpha) * phase * h;
+	}
+
+	return force;
+}
+
+template <typename VecType>
+double Ewald<VecType>::exactPotential(const VecType& x)
+{
+	double potential = 0.0;
+
+	// Real space as for the force; the nearest image's erfc(a r) / r - 1 / r tends to -2 a / sqrt(pi)
+	int n[3] = { 0, 0, 0 };
+	const int span = 2 * images + 1;
+	const int real_terms = dimensions == 3 ? span * span * span : span * span;
+
+	for (int term = 0; term < real_terms; ++term) {
+		int rest = term;
+		for (int d = 0; d < dimensions; ++d) {
+			n[d] = rest % span - images;
+			rest /= span;
+		}
+
+		VecType dx = x;
+		for (int d = 0; d < dimensions; ++d)
+			dx[d] -= n[d];
+
+		double r = glm::length(dx);
+		if (r > realCutoff)
+			continue;
+
+		bool nearest = n[0] == 0 && n[1] == 0 && n[2] == 0;
+		if (nearest && r == 0.0)
+			potential -= 2.0 * alpha / std::sqrt(M_PI);
+		else if (nearest)
+			potential -= std::erf(alpha * r) / r;
+		else
+			potential += std::erfc(alpha * r) / r;
+	}
+
+	// Reciprocal space, plus the h = 0 term of the uniform background
+	for (int term = 0; term < real_terms; ++term) {
+		int rest = term;
+		for (int d = 0; d < dimensions; ++d) {
+			n[d] = rest % span - images;
+			rest /= span;
+		}
+		if (n[0] == 0 && n[1] == 0 && n[2] == 0)
+			continue;
+
+		VecType h(0);
+		for (int d = 0; d < dimensions; ++d)
+			h[d] = n[d];
+
+		double h2 = glm::dot(h, h);
+		if (h2 > waveCutoff)
+			continue;
+
+		double phase = std::cos(2.0 * M_PI * glm::dot(h, x));
+
+		if constexpr (dimensions == 3)
+			potential += 1.0 / (M_PI * h2) * std::exp(-M_PI * M_PI * h2 / (alpha * alpha)) * phase;
+		else
+			potential += 1.0 / std::sqrt(h2) * std::erfc(M_PI * std::sqrt(h2) / alpha) * phase;
+	}
+
+	if constexpr (dimensions == 3)
+		potential -= M_PI / (alpha * alpha);
+	else
+		potential -= 2.0 * std::sqrt(M_PI) / alpha;
+
+	return potential;
+}
+
+template <typename VecType>
+void Ewald<VecType>::build(double period, unsigned int threads)
+{
+	m_period = period;
+	m_scale = 2.0 * cells / period;
+	m_norm = 1.0 / (period * period);
+
+	std::size_t entries = 1;
+	for (int d = 0; d < dimensions; ++d)
+		entries *= cells + 1;
+	m_table.assign(entries, VecType(0));
+	m_potentials.assign(entries, 0.0);
+
+	Utils::parallelFor(entries, threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i) {
+			VecType x(0);
+			std::size_t rest = i;
+			for (int d = 0; d < dimensions; ++d) {
+				x[d] = 0.5 * static_cast<double>(rest % (cells + 1)) / cells;
+				rest /= cells + 1;
+			}
+			m_table[i] = exactCorrection(x);
+			m_potentials[i] = exactPotential(x);
+		}
+	});
+}
+
+template <typename VecType>
+VecType Ewald<VecType>::correction(const VecType& separation) const
+{
+	VecType sign(1.0);
+	VecType value = interpolate(m_table, separation, sign);
+	return value * sign * m_norm;
+}
+
+template <typename VecType>
+double Ewald<VecType>::potential(const VecType& separation) const
+{
+	VecType sign(1.0);
+	return interpolate(m_potentials, separation, sign) / m_period;
+}
+
+template <typename VecType>
+template <typename Value>
+Value Ewald<VecType>::interpolate(const std::vector<Value>& table, const VecType& separation, VecType& sign) const
+{
+	// Fold into the tabulated octant, remembering the signs
+	double fraction[3] = { 0.0, 0.0, 0.0 };
+	std::size_t stride[3] = { 1, 0, 0 };
+	std::size_t base = 0;
+
+	for (int d = 0; d < dimensions; ++d) {
+		double u = separation[d] * m_scale;
+		if (u < 0.0) {
+			u = -u;
+			sign[d] = -1.0;
+		}
+
+		int cell = u < cells ? static_cast<int>(u) : cells - 1;
+		fraction[d] = u - cell;
+		base += cell * stride[d];
+		if (d + 1 < 3)
+			stride[d + 1] = stride[d] * (cells + 1);
+	}
+
+	// Linear along x, then y (and z) between the corners of the cell
+	const Value* corner = table.data() + base;
+	const std::size_t y = stride[1];
+
+	Value low = corner[0] + fraction[0] * (corner[1] - corner[0]);
+	Value high = corner[y] + fraction[0] * (corner[y + 1] - corner[y]);
+	Value value = low + fraction[1] * (high - low);
+
+	if constexpr (dimensions == 3) {
+		const Value* top = corner + stride[2];
+		Value top_low = top[0] + fraction[0] * (top[1] - top[0]);
+		Value top_high = top[y] + fraction[0] * (top[y + 1] - top[y]);
+		Value upper = top_low + fraction[1] * (top_high - top_low);
+		value += fraction[2] * (upper - value);
+	}
+
+	return value;
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef FMM_H
+#define FMM_H
+#pragma once
+#include <glm/glm.hpp>
+#include <array>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "constants.h"
+#include "Tree.h"
+#include "TreePolicy.h"
+#include "Utils.h"
+
+/*
+	Fast Multipole Method force engine.
+
+	Reuses the spatial decomposition of Tree<VecType>: the tree is flattened into
+	cells holding at most m_leafSize bodies, and every cell carries a Cartesian
+	Taylor expansion of 1/r up to m_order about its center of mass.
+
+		P2M / M2M	- multipoles are built at the leaves and shifted to parents
+		M2L			- well-separated cell pairs, (r_A + r_B) < theta * |c_A - c_B|,
+					  convert the source multipole into a local expansion of the target
+		L2L / L2P	- local expansions are shifted to the children and evaluated at bodies
+		P2P			- remaining near leaf pairs are summed directly, with the kernel
+					  of the tree walk (TreePolicy): epsilon and softening of the tree
+
+	theta is the tree's own Barnes-Hut theta, so --theta sets the accuracy of
+	both engines; it is capped below 1 here, otherwise a cell could be accepted
+	against a cell containing it.
+
+	By default the traversal is mutual (Dehnen 2002): every unordered cell pair
+	is met once and interacts both ways. One derivative tensor serves the M2L
+	in both directions, with the sign (-1)^|n| for the reversed separation, and
+	P2P applies every body pair's force to both bodies, so the traversal does
+	about half the work of the one-sided one, where every task walks the whole
+	tree as a target.
+
+	Mutual interactions write into both cells, so the parallel part runs on
+	pairs of task subtrees in rounds where no task appears twice. The cells
+	above the tasks interact first on the calling thread. The rounds depend
+	only on the tasks, so the sums are done in the same order for any thread
+	count with the same tasks.
+
+	Expansions are always 3D; 2D bodies simply have z = 0.
+*/
+template <typename VecType>
+class Fmm
+{
+private:
+	struct Cell {
+		Tree<VecType>* tree;
+		glm::dvec3 center;
+		double radius;
+		std::vector<int> children;
+
+		// Range of this cell's bodies in the flattened body arrays
+		std::size_t bodyBegin;
+		std::size_t bodyEnd;
+
+		// Cells handed to a worker thread as one task
+		bool task;
+	};
+
+	// Per-thread scratch space and interaction counters
+	struct Workspace {
+		std::vector<double> terms;
+		std::size_t m2l = 0;
+		std::size_t p2p = 0;
+	};
+
+	// One term of a multi-index sum: out[target] += coefficient * f[power] * in[source]
+	struct Term {
+		int target;
+		int source;
+		int power;
+		double coefficient;
+	};
+
+	int m_order;
+	double m_theta;		// of the tree of the current computeForces call
+	static constexpr double maxTheta = 0.95;
+	std::size_t m_leafSize;
+	unsigned int m_threads;
+
+	// The task cells decide which cell pairs the traversal meets, so with the
+	// default of four tasks per thread the forces change with the thread count.
+	// Deterministic mode cuts a fixed number of tasks instead.
+	bool m_deterministic;
+	static constexpr std::size_t deterministicTasks = 256;
+
+	// Mutual traversal; false walks the tree once per target task
+	bool m_mutual;
+
+	// Kernel of the direct P2P sums, the one of TreeWrapper's walk
+	Softening m_softening;
+
+	// Multi-indices (i, j, k) with i + j + k <= m_order, sorted by degree
+	std::vector<std::array<int, 3>> m_indices;
+	std::vector<int> m_indexLookup;
+	std::vector<double> m_parity;	// (-1)^(i + j + k)
+
+	// For every multi-index n: n - e_axis (0-2) and n - 2e_axis (3-5), or -1
+	std::vector<std::array<int, 6>> m_lowerIndices;
+	std::vector<Term> m_shiftTerms;
+	std::vector<Term> m_m2lTerms;
+
+	// Flattened tree
+	std::vector<Cell> m_cells;
+	std::vector<int> m_tasks;
+	std::vector<double> m_multipoles;
+	std::vector<double> m_locals;
+
+	// Flattened bodies, in tree order
+	std::vector<std::size_t> m_bodyIndex;
+	std::vector<glm::dvec3> m_positions;
+	std::vector<double> m_masses;
+	std::vector<glm::dvec3> m_fields;
+	const std::vector<Node<VecType>>* m_bodies;	// of the current computeForces call, for warnings
+
+	// Interaction counts of the last computeForces call: cell pairs and body pairs,
+	// once per pair with the mutual traversal and once per direction without
+	std::size_t m_m2lCount;
+	std::size_t m_p2pCount;
+
+public:
+	Fmm(int order = 4, std::size_t leafSize = 16);
+
+	// Getters
+	int getOrder();
+	std::size_t getLeafSize();
+	std::size_t getM2LCount();
+	std::size_t getP2PCount();
+	bool getDeterministic();
+	bool getMutual();
+	Softening getSoftening();
+
+	// Setters
+	void setOrder(int order);
+	void setLeafSize(std::size_t leafSize);
+	void setThreads(unsigned int threads);
+	void setDeterministic(bool deterministic);
+	void setMutual(bool mutual);
+	void setSoftening(Softening softening);
+
+	// Computes the gravitational force on every body in `bodies` from the bodies
+	// stored in `tree`. forces[i] belongs to bodies[i].
+	void computeForces(Tree<VecType>& tree, const std::vector<Node<VecType>>& bodies, std::vector<VecType>& forces);
+
+private:
+	void buildTables();
+	int termCount();
+	int lookup(int i, int j, int k);
+	static glm::dvec3 toVec3(const VecType& v);
+
+	// Fills out[t] = d^indices[t] for every multi-index
+	void powers(const glm::dvec3& d, std::vector<double>& out);
+
+	// Fills out[t] = (1 / n!) * D^n (1 / |r|) for every multi-index n
+	void derivatives(const glm::dvec3& r, std::vector<double>& out);
+
+	int flatten(Tree<VecType>* tree, const std::unordered_map<int, std::size_t>& indexOf);
+	void gatherBodies(Tree<VecType>* tree, const std::unordered_map<int, std::size_t>& indexOf);
+	void markTasks();
+
+	// Passes over the flattened tree. With stopAtTasks set, only the cells
+	// above the task cells are visited; the tasks themselves run in parallel.
+	void upward(int cell, bool stopAtTasks, Workspace& work);
+	void downward(int cell, bool stopAtTasks, Workspace& work);
+	void interact(int target, int source, Workspace& work);
+
+	// Mutual traversal of a cell with itself and of two disjoint cells. With
+	// `deferred` set, pairs of task cells are appended to it instead of entered.
+	void interactSelf(int cell, Workspace& work, std::vector<std::pair<int, int>>* deferred);
+	void interactMutual(int a, int b, Workspace& work, std::vector<std::pair<int, int>>* deferred);
+
+	// Splits the task pairs into rounds in which every task appears at most once
+	std::vector<std::vector<std::pair<int, int>>> scheduleRounds(const std::vector<std::pair<int, int>>& pairs);
+
+	void particleToMultipole(int cell, Workspace& work);
+	void multipoleToMultipole(int parent, int child, Workspace& work);
+	void multipoleToLocal(int target, int source, Workspace& work);
+	void multipoleToLocalMutual(int a, int b, Workspace& work);
+	void localToLocal(int parent, int child, Workspace& work);
+	void localToParticle(int cell, Workspace& work);
+	template <Softening Kernel>
+	void particleToParticle(int target, int source, Workspace& work);
+	template <Softening Kernel>
+	void particleToParticleMutual(int a, int b, Workspace& work);
+
+	// Pairs closer than epsilon without softening are skipped with the walk's warning
+	void warnClosePair(std::size_t slot);
+};
+
+using Fmm2D = Fmm<glm::dvec2>;
+using Fmm3D = Fmm<glm::dvec3>;
+
+#include "Fmm.tpp"
+#endif
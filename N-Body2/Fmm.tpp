@@ -0,0 +1,779 @@
+#ifndef FMM_TPP
+#define FMM_TPP
+#include "Fmm.h"
+
+template <typename VecType>
+Fmm<VecType>::Fmm(int order, std::size_t leafSize) :
+	m_order(order < 0 ? 0 : order > 16 ? 16 : order),
+	m_theta(0.5),
+	m_leafSize(leafSize > 0 ? leafSize : 1),
+	m_threads(0),
+	m_deterministic(false),
+	m_mutual(true),
+	m_softening(SOFTENING_NONE),
+	m_bodies(nullptr),
+	m_m2lCount(0),
+	m_p2pCount(0)
+{
+	buildTables();
+}
+
+template <typename VecType>
+int Fmm<VecType>::getOrder() {
+	return m_order;
+}
+
+template <typename VecType>
+std::size_t Fmm<VecType>::getLeafSize() {
+	return m_leafSize;
+}
+
+template <typename VecType>
+std::size_t Fmm<VecType>::getM2LCount() {
+	return m_m2lCount;
+}
+
+template <typename VecType>
+std::size_t Fmm<VecType>::getP2PCount() {
+	return m_p2pCount;
+}
+
+template <typename VecType>
+bool Fmm<VecType>::getDeterministic() {
+	return m_deterministic;
+}
+
+template <typename VecType>
+bool Fmm<VecType>::getMutual() {
+	return m_mutual;
+}
+
+template <typename VecType>
+Softening Fmm<VecType>::getSoftening() {
+	return m_softening;
+}
+
+template <typename VecType>
+void Fmm<VecType>::setOrder(int order) {
+	m_order = order < 0 ? 0 : order > 16 ? 16 : order;
+	buildTables();
+}
+
+template <typename VecType>
+void Fmm<VecType>::setLeafSize(std::size_t leafSize) {
+	m_leafSize = leafSize > 0 ? leafSize : 1;
+}
+
+template <typename VecType>
+void Fmm<VecType>::setThreads(unsigned int threads) {
+	m_threads = threads;
+}
+
+template <typename VecType>
+void Fmm<VecType>::setDeterministic(bool deterministic) {
+	m_deterministic = deterministic;
+}
+
+template <typename VecType>
+void Fmm<VecType>::setMutual(bool mutual) {
+	m_mutual = mutual;
+}
+
+template <typename VecType>
+void Fmm<VecType>::setSoftening(Softening softening) {
+	m_softening = softening;
+}
+
+template <typename VecType>
+int Fmm<VecType>::termCount() {
+	return static_cast<int>(m_indices.size());
+}
+
+template <typename VecType>
+int Fmm<VecType>::lookup(int i, int j, int k) {
+	return m_indexLookup[(i * (m_order + 1) + j) * (m_order + 1) + k];
+}
+
+template <typename VecType>
+glm::dvec3 Fmm<VecType>::toVec3(const VecType& v) {
+	if constexpr (VecDimensions<VecType>::value == 3) {
+		return v;
+	}
+	else {
+		return glm::dvec3(v.x, v.y, 0.0);
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::buildTables()
+{
+	int p = m_order;
+
+	m_indices.clear();
+	m_indexLookup.assign((p + 1) * (p + 1) * (p + 1), -1);
+
+	for (int degree = 0; degree <= p; ++degree) {
+		for (int i = degree; i >= 0; --i) {
+			for (int j = degree - i; j >= 0; --j) {
+				int k = degree - i - j;
+				m_indexLookup[(i * (p + 1) + j) * (p + 1) + k] = static_cast<int>(m_indices.size());
+				m_indices.push_back({ i, j, k });
+			}
+		}
+	}
+
+	// D_n(-r) = (-1)^|n| D_n(r), for the reversed direction of a mutual M2L
+	m_parity.resize(m_indices.size());
+	for (std::size_t t = 0; t < m_indices.size(); ++t) {
+		int degree = m_indices[t][0] + m_indices[t][1] + m_indices[t][2];
+		m_parity[t] = degree % 2 == 0 ? 1.0 : -1.0;
+	}
+
+	m_lowerIndices.assign(m_indices.size(), { -1, -1, -1, -1, -1, -1 });
+	for (std::size_t t = 0; t < m_indices.size(); ++t) {
+		for (int axis = 0; axis < 3; ++axis) {
+			std::array<int, 3> lower = m_indices[t];
+			if (lower[axis] >= 1) {
+				--lower[axis];
+				m_lowerIndices[t][axis] = lookup(lower[0], lower[1], lower[2]);
+			}
+			if (lower[axis] >= 1) {
+				--lower[axis];
+				m_lowerIndices[t][axis + 3] = lookup(lower[0], lower[1], lower[2]);
+			}
+		}
+	}
+
+	// Pascal's triangle for the multi-index binomials
+	std::vector<std::vector<double>> binomial(2 * p + 1, std::vector<double>(2 * p + 1, 0.0));
+	for (int n = 0; n <= 2 * p; ++n) {
+		binomial[n][0] = 1.0;
+		for (int k = 1; k <= n; ++k) {
+			binomial[n][k] = binomial[n - 1][k - 1] + (k <= n - 1 ? binomial[n - 1][k] : 0.0);
+		}
+	}
+
+	// Shifts (M2M, L2L): n -> k for every k <= n componentwise
+	m_shiftTerms.clear();
+	for (auto& n : m_indices) {
+		for (auto& k : m_indices) {
+			if (k[0] > n[0] || k[1] > n[1] || k[2] > n[2])
+				continue;
+
+			Term term;
+			term.target = lookup(n[0], n[1], n[2]);
+			term.source = lookup(k[0], k[1], k[2]);
+			term.power = lookup(n[0] - k[0], n[1] - k[1], n[2] - k[2]);
+			term.coefficient = binomial[n[0]][k[0]] * binomial[n[1]][k[1]] * binomial[n[2]][k[2]];
+			m_shiftTerms.push_back(term);
+		}
+	}
+
+	// M2L: local m from multipole n, truncated at |m| + |n| <= order
+	m_m2lTerms.clear();
+	for (auto& m : m_indices) {
+		for (auto& n : m_indices) {
+			int i = m[0] + n[0], j = m[1] + n[1], k = m[2] + n[2];
+			if (i + j + k > p)
+				continue;
+
+			Term term;
+			term.target = lookup(m[0], m[1], m[2]);
+			term.source = lookup(n[0], n[1], n[2]);
+			term.power = lookup(i, j, k);
+			term.coefficient = binomial[i][n[0]] * binomial[j][n[1]] * binomial[k][n[2]];
+			m_m2lTerms.push_back(term);
+		}
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::powers(const glm::dvec3& d, std::vector<double>& out)
+{
+	out.resize(m_indices.size());
+
+	double px[32], py[32], pz[32];
+	px[0] = py[0] = pz[0] = 1.0;
+	for (int i = 1; i <= m_order; ++i) {
+		px[i] = px[i - 1] * d.x;
+		py[i] = py[i - 1] * d.y;
+		pz[i] = pz[i - 1] * d.z;
+	}
+
+	for (std::size_t t = 0; t < m_indices.size(); ++t) {
+		out[t] = px[m_indices[t][0]] * py[m_indices[t][1]] * pz[m_indices[t][2]];
+	}
+}
+
+// Taylor coefficients of the Green's function follow the recurrence
+//   |n| r^2 a_n + (2|n| - 1) sum_i r_i a_(n - e_i) + (|n| - 1) sum_i a_(n - 2e_i) = 0
+template <typename VecType>
+void Fmm<VecType>::derivatives(const glm::dvec3& r, std::vector<double>& out)
+{
+	out.resize(m_indices.size());
+
+	double r2 = glm::dot(r, r);
+	out[0] = 1.0 / std::sqrt(r2);
+
+	for (std::size_t t = 1; t < m_indices.size(); ++t) {
+		const std::array<int, 3>& n = m_indices[t];
+		const std::array<int, 6>& lower = m_lowerIndices[t];
+		int degree = n[0] + n[1] + n[2];
+		double first = 0.0, second = 0.0;
+
+		for (int axis = 0; axis < 3; ++axis) {
+			if (lower[axis] >= 0)
+				first += r[axis] * out[lower[axis]];
+			if (lower[axis + 3] >= 0)
+				second += out[lower[axis + 3]];
+		}
+
+		out[t] = -((2 * degree - 1) * first + (degree - 1) * second) / (degree * r2);
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::computeForces(Tree<VecType>& tree, const std::vector<Node<VecType>>& bodies, std::vector<VecType>& forces)
+{
+	forces.assign(bodies.size(), VecType(0));
+
+	m_cells.clear();
+	m_tasks.clear();
+	m_bodyIndex.clear();
+	m_positions.clear();
+	m_masses.clear();
+
+	if (tree.m_totalDescendants == 0)
+		return;
+
+	m_theta = tree.m_theta < maxTheta ? tree.m_theta : maxTheta;
+	m_bodies = &bodies;
+
+	// The tree stores copies of the bodies, so map their ids back to `bodies`
+	std::unordered_map<int, std::size_t> index_of;
+	index_of.reserve(bodies.size());
+	for (std::size_t i = 0; i < bodies.size(); ++i) {
+		index_of[bodies[i].getId()] = i;
+	}
+
+	flatten(&tree, index_of);
+	markTasks();
+
+	std::size_t terms = m_indices.size();
+	m_multipoles.assign(m_cells.size() * terms, 0.0);
+	m_locals.assign(m_cells.size() * terms, 0.0);
+	m_fields.assign(m_positions.size(), glm::dvec3(0.0));
+
+	std::vector<Workspace> workspaces(m_tasks.size());
+	Workspace top;
+
+	// Upward pass: every task subtree on its own, then the cells above them
+	Utils::parallelFor(m_tasks.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i) {
+			upward(m_tasks[i], false, workspaces[i]);
+		}
+	});
+	upward(0, true, top);
+
+	if (m_mutual) {
+		std::vector<int> task_of(m_cells.size(), -1);
+		for (std::size_t i = 0; i < m_tasks.size(); ++i) {
+			task_of[m_tasks[i]] = static_cast<int>(i);
+		}
+
+		// The cells above the tasks, collecting the task pairs that are left
+		std::vector<std::pair<int, int>> pairs;
+		interactSelf(0, top, &pairs);
+
+		// Both tasks of a pair are written, so a round never holds a task twice.
+		// The pair's first task owns its workspace for the round.
+		for (auto& round : scheduleRounds(pairs)) {
+			Utils::parallelFor(round.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+				for (std::size_t i = begin; i < end; ++i) {
+					Workspace& work = workspaces[task_of[round[i].first]];
+					if (round[i].first == round[i].second)
+						interactSelf(round[i].first, work, nullptr);
+					else
+						interactMutual(round[i].first, round[i].second, work, nullptr);
+				}
+			});
+		}
+	}
+	else {
+		// Interactions only write into the target subtree, so targets can run in parallel
+		Utils::parallelFor(m_tasks.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+			for (std::size_t i = begin; i < end; ++i) {
+				interact(m_tasks[i], 0, workspaces[i]);
+			}
+		});
+	}
+
+	// Downward pass: the cells above the tasks first, then every task subtree
+	downward(0, true, top);
+	Utils::parallelFor(m_tasks.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i) {
+			downward(m_tasks[i], false, workspaces[i]);
+		}
+	});
+
+	m_m2lCount = top.m2l;
+	m_p2pCount = top.p2p;
+	for (auto& work : workspaces) {
+		m_m2lCount += work.m2l;
+		m_p2pCount += work.p2p;
+	}
+
+	for (std::size_t slot = 0; slot < m_positions.size(); ++slot) {
+		glm::dvec3 force = G * m_masses[slot] * m_fields[slot];
+
+		if constexpr (VecDimensions<VecType>::value == 3) {
+			forces[m_bodyIndex[slot]] = force;
+		}
+		else {
+			forces[m_bodyIndex[slot]] = VecType(force.x, force.y);
+		}
+	}
+	m_bodies = nullptr;
+}
+
+template <typename VecType>
+int Fmm<VecType>::flatten(Tree<VecType>* tree, const std::unordered_map<int, std::size_t>& indexOf)
+{
+	int index = static_cast<int>(m_cells.size());
+
+	Cell cell;
+	cell.tree = tree;
+	cell.center = toVec3(tree->m_centerOfMass);
+	cell.radius = 0.0;
+	cell.bodyBegin = m_positions.size();
+	cell.bodyEnd = m_positions.size();
+	cell.task = false;
+	m_cells.push_back(cell);
+
+	if (tree->isLeaf() || static_cast<std::size_t>(tree->m_totalDescendants) <= m_leafSize) {
+		gatherBodies(tree, indexOf);
+	}
+	else {
+		for (auto& child : tree->m_children) {
+			if (child && child->m_totalDescendants > 0) {
+				int child_index = flatten(child.get(), indexOf);
+				m_cells[index].children.push_back(child_index);
+			}
+		}
+	}
+
+	m_cells[index].bodyEnd = m_positions.size();
+	return index;
+}
+
+template <typename VecType>
+void Fmm<VecType>::gatherBodies(Tree<VecType>* tree, const std::unordered_map<int, std::size_t>& indexOf)
+{
+	if (tree->isLeaf()) {
+		auto found = indexOf.find(tree->m_body.getId());
+		if (tree->m_body.getId() != -1 && found != indexOf.end()) {
+			m_bodyIndex.push_back(found->second);
+			m_positions.push_back(toVec3(tree->m_body.position));
+			m_masses.push_back(tree->m_body.mass);
+		}
+		return;
+	}
+
+	for (auto& child : tree->m_children) {
+		if (child && child->m_totalDescendants > 0)
+			gatherBodies(child.get(), indexOf);
+	}
+}
+
+// Splits the top of the tree into enough independent subtrees to keep every thread busy
+template <typename VecType>
+void Fmm<VecType>::markTasks()
+{
+	unsigned int threads = m_threads ? m_threads : std::thread::hardware_concurrency();
+	std::size_t wanted = m_deterministic ? deterministicTasks : 4 * static_cast<std::size_t>(threads > 0 ? threads : 1);
+
+	std::vector<int> frontier = { 0 };
+	while (frontier.size() < wanted) {
+		std::vector<int> next;
+		bool split = false;
+
+		for (int cell : frontier) {
+			if (m_cells[cell].children.empty()) {
+				next.push_back(cell);
+			}
+			else {
+				next.insert(next.end(), m_cells[cell].children.begin(), m_cells[cell].children.end());
+				split = true;
+			}
+		}
+
+		if (!split)
+			break;
+		frontier.swap(next);
+	}
+
+	m_tasks = frontier;
+	for (int cell : m_tasks) {
+		m_cells[cell].task = true;
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::upward(int cell, bool stopAtTasks, Workspace& work)
+{
+	if (stopAtTasks && m_cells[cell].task)
+		return;
+
+	if (m_cells[cell].children.empty()) {
+		particleToMultipole(cell, work);
+		return;
+	}
+
+	for (int child : m_cells[cell].children) {
+		upward(child, stopAtTasks, work);
+	}
+
+	double radius = 0.0;
+	for (int child : m_cells[cell].children) {
+		multipoleToMultipole(cell, child, work);
+
+		double reach = glm::length(m_cells[child].center - m_cells[cell].center) + m_cells[child].radius;
+		if (reach > radius)
+			radius = reach;
+	}
+	m_cells[cell].radius = radius;
+}
+
+template <typename VecType>
+void Fmm<VecType>::downward(int cell, bool stopAtTasks, Workspace& work)
+{
+	if (stopAtTasks && m_cells[cell].task)
+		return;
+
+	if (m_cells[cell].children.empty()) {
+		localToParticle(cell, work);
+		return;
+	}
+
+	for (int child : m_cells[cell].children) {
+		// Task cells receive their parent's expansion before the parallel pass starts
+		localToLocal(cell, child, work);
+		downward(child, stopAtTasks, work);
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::interact(int target, int source, Workspace& work)
+{
+	const Cell& a = m_cells[target];
+	const Cell& b = m_cells[source];
+
+	if (target != source) {
+		double distance = glm::length(a.center - b.center);
+		if (a.radius + b.radius < m_theta * distance) {
+			multipoleToLocal(target, source, work);
+			return;
+		}
+	}
+
+	bool a_leaf = a.children.empty();
+	bool b_leaf = b.children.empty();
+
+	if (a_leaf && b_leaf) {
+		if (m_softening == SOFTENING_PLUMMER)
+			particleToParticle<SOFTENING_PLUMMER>(target, source, work);
+		else
+			particleToParticle<SOFTENING_NONE>(target, source, work);
+		return;
+	}
+
+	if (target == source) {
+		for (int child_a : a.children) {
+			for (int child_b : a.children) {
+				interact(child_a, child_b, work);
+			}
+		}
+	}
+	// Split the larger cell
+	else if (b_leaf || (!a_leaf && a.radius >= b.radius)) {
+		for (int child : a.children) {
+			interact(child, source, work);
+		}
+	}
+	else {
+		for (int child : b.children) {
+			interact(target, child, work);
+		}
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::interactSelf(int cell, Workspace& work, std::vector<std::pair<int, int>>* deferred)
+{
+	const Cell& c = m_cells[cell];
+
+	if (deferred && c.task) {
+		deferred->emplace_back(cell, cell);
+		return;
+	}
+
+	if (c.children.empty()) {
+		if (m_softening == SOFTENING_PLUMMER)
+			particleToParticleMutual<SOFTENING_PLUMMER>(cell, cell, work);
+		else
+			particleToParticleMutual<SOFTENING_NONE>(cell, cell, work);
+		return;
+	}
+
+	// Every unordered pair of children once
+	for (std::size_t i = 0; i < c.children.size(); ++i) {
+		interactSelf(c.children[i], work, deferred);
+		for (std::size_t j = i + 1; j < c.children.size(); ++j) {
+			interactMutual(c.children[i], c.children[j], work, deferred);
+		}
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::interactMutual(int a, int b, Workspace& work, std::vector<std::pair<int, int>>* deferred)
+{
+	const Cell& cell_a = m_cells[a];
+	const Cell& cell_b = m_cells[b];
+
+	if (deferred && cell_a.task && cell_b.task) {
+		deferred->emplace_back(a, b);
+		return;
+	}
+
+	double distance = glm::length(cell_a.center - cell_b.center);
+	if (cell_a.radius + cell_b.radius < m_theta * distance) {
+		multipoleToLocalMutual(a, b, work);
+		return;
+	}
+
+	bool a_leaf = cell_a.children.empty();
+	bool b_leaf = cell_b.children.empty();
+
+	if (a_leaf && b_leaf) {
+		if (m_softening == SOFTENING_PLUMMER)
+			particleToParticleMutual<SOFTENING_PLUMMER>(a, b, work);
+		else
+			particleToParticleMutual<SOFTENING_NONE>(a, b, work);
+		return;
+	}
+
+	// Above the tasks a cell is split until both sides are tasks, otherwise the larger one is
+	bool split_a = deferred ? !cell_a.task : b_leaf || (!a_leaf && cell_a.radius >= cell_b.radius);
+	if (split_a) {
+		for (int child : cell_a.children) {
+			interactMutual(child, b, work, deferred);
+		}
+	}
+	else {
+		for (int child : cell_b.children) {
+			interactMutual(a, child, work, deferred);
+		}
+	}
+}
+
+// Greedy edge colouring of the task graph: every pair goes into the first round
+// in which neither of its tasks is busy yet
+template <typename VecType>
+std::vector<std::vector<std::pair<int, int>>> Fmm<VecType>::scheduleRounds(const std::vector<std::pair<int, int>>& pairs)
+{
+	std::vector<std::vector<std::pair<int, int>>> rounds;
+	std::vector<std::vector<bool>> busy;	// busy[round][cell]
+
+	for (const auto& pair : pairs) {
+		std::size_t round = 0;
+		while (round < rounds.size() && (busy[round][pair.first] || busy[round][pair.second]))
+			++round;
+
+		if (round == rounds.size()) {
+			rounds.emplace_back();
+			busy.emplace_back(m_cells.size(), false);
+		}
+
+		rounds[round].push_back(pair);
+		busy[round][pair.first] = true;
+		busy[round][pair.second] = true;
+	}
+
+	return rounds;
+}
+
+template <typename VecType>
+void Fmm<VecType>::particleToMultipole(int cell, Workspace& work)
+{
+	Cell& c = m_cells[cell];
+	double* multipole = &m_multipoles[cell * m_indices.size()];
+	double radius = 0.0;
+
+	for (std::size_t slot = c.bodyBegin; slot < c.bodyEnd; ++slot) {
+		glm::dvec3 d = c.center - m_positions[slot];
+		powers(d, work.terms);
+
+		for (std::size_t t = 0; t < m_indices.size(); ++t) {
+			multipole[t] += m_masses[slot] * work.terms[t];
+		}
+
+		double reach = glm::length(d);
+		if (reach > radius)
+			radius = reach;
+	}
+	c.radius = radius;
+}
+
+template <typename VecType>
+void Fmm<VecType>::multipoleToMultipole(int parent, int child, Workspace& work)
+{
+	double* out = &m_multipoles[parent * m_indices.size()];
+	const double* in = &m_multipoles[child * m_indices.size()];
+
+	powers(m_cells[parent].center - m_cells[child].center, work.terms);
+
+	for (const Term& term : m_shiftTerms) {
+		out[term.target] += term.coefficient * work.terms[term.power] * in[term.source];
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::multipoleToLocal(int target, int source, Workspace& work)
+{
+	double* out = &m_locals[target * m_indices.size()];
+	const double* in = &m_multipoles[source * m_indices.size()];
+
+	derivatives(m_cells[target].center - m_cells[source].center, work.terms);
+
+	for (const Term& term : m_m2lTerms) {
+		out[term.target] += term.coefficient * work.terms[term.power] * in[term.source];
+	}
+	++work.m2l;
+}
+
+// One derivative tensor for both directions: L_b uses D(c_b - c_a) = (-1)^|n| D(c_a - c_b)
+template <typename VecType>
+void Fmm<VecType>::multipoleToLocalMutual(int a, int b, Workspace& work)
+{
+	double* out_a = &m_locals[a * m_indices.size()];
+	double* out_b = &m_locals[b * m_indices.size()];
+	const double* in_a = &m_multipoles[a * m_indices.size()];
+	const double* in_b = &m_multipoles[b * m_indices.size()];
+
+	derivatives(m_cells[a].center - m_cells[b].center, work.terms);
+
+	for (const Term& term : m_m2lTerms) {
+		double factor = term.coefficient * work.terms[term.power];
+		out_a[term.target] += factor * in_b[term.source];
+		out_b[term.target] += m_parity[term.power] * factor * in_a[term.source];
+	}
+	++work.m2l;
+}
+
+// Same terms as M2M with the roles reversed: L_child[k] += C(n, k) d^(n - k) L_parent[n]
+template <typename VecType>
+void Fmm<VecType>::localToLocal(int parent, int child, Workspace& work)
+{
+	double* out = &m_locals[child * m_indices.size()];
+	const double* in = &m_locals[parent * m_indices.size()];
+
+	powers(m_cells[child].center - m_cells[parent].center, work.terms);
+
+	for (const Term& term : m_shiftTerms) {
+		out[term.source] += term.coefficient * work.terms[term.power] * in[term.target];
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::localToParticle(int cell, Workspace& work)
+{
+	const Cell& c = m_cells[cell];
+	const double* local = &m_locals[cell * m_indices.size()];
+
+	for (std::size_t slot = c.bodyBegin; slot < c.bodyEnd; ++slot) {
+		powers(m_positions[slot] - c.center, work.terms);
+
+		// Gradient of sum_m L_m y^m
+		glm::dvec3 field(0.0);
+		for (std::size_t t = 1; t < m_indices.size(); ++t) {
+			const std::array<int, 3>& m = m_indices[t];
+			const std::array<int, 6>& lower = m_lowerIndices[t];
+			if (m[0] > 0) field.x += m[0] * local[t] * work.terms[lower[0]];
+			if (m[1] > 0) field.y += m[1] * local[t] * work.terms[lower[1]];
+			if (m[2] > 0) field.z += m[2] * local[t] * work.terms[lower[2]];
+		}
+		m_fields[slot] += field;
+	}
+}
+
+template <typename VecType>
+void Fmm<VecType>::warnClosePair(std::size_t slot)
+{
+	std::cerr << "WARNING: Distance between bodies is too small\n" << "------ " << (*m_bodies)[m_bodyIndex[slot]].name << std::endl;
+}
+
+template <typename VecType>
+template <Softening Kernel>
+void Fmm<VecType>::particleToParticle(int target, int source, Workspace& work)
+{
+	using Policy = TreePolicy<glm::dvec3, Kernel>;
+	const Cell& a = m_cells[target];
+	const Cell& b = m_cells[source];
+	double epsilon = a.tree->m_epsilon;
+	double epsilon_squared = epsilon * epsilon;
+
+	for (std::size_t i = a.bodyBegin; i < a.bodyEnd; ++i) {
+		glm::dvec3 field(0.0);
+
+		for (std::size_t j = b.bodyBegin; j < b.bodyEnd; ++j) {
+			glm::dvec3 distance = m_positions[i] - m_positions[j];
+			double norm_squared = glm::dot(distance, distance);
+
+			if (Policy::interacts(norm_squared, epsilon_squared))
+				field -= (m_masses[j] * Policy::inverseCube(norm_squared, epsilon_squared)) * distance;
+			else if (i != j)
+				warnClosePair(i);
+		}
+		m_fields[i] += field;
+	}
+	work.p2p += (a.bodyEnd - a.bodyBegin) * (b.bodyEnd - b.bodyBegin);
+}
+
+// Every body pair once, applied to both bodies; a == b gives the pairs within one leaf
+template <typename VecType>
+template <Softening Kernel>
+void Fmm<VecType>::particleToParticleMutual(int a, int b, Workspace& work)
+{
+	using Policy = TreePolicy<glm::dvec3, Kernel>;
+	const Cell& cell_a = m_cells[a];
+	const Cell& cell_b = m_cells[b];
+	double epsilon = cell_a.tree->m_epsilon;
+	double epsilon_squared = epsilon * epsilon;
+
+	for (std::size_t i = cell_a.bodyBegin; i < cell_a.bodyEnd; ++i) {
+		glm::dvec3 field(0.0);
+
+		for (std::size_t j = a == b ? i + 1 : cell_b.bodyBegin; j < cell_b.bodyEnd; ++j) {
+			glm::dvec3 distance = m_positions[i] - m_positions[j];
+			double norm_squared = glm::dot(distance, distance);
+
+			if (Policy::interacts(norm_squared, epsilon_squared)) {
+				glm::dvec3 pull = Policy::inverseCube(norm_squared, epsilon_squared) * distance;
+				field -= m_masses[j] * pull;
+				m_fields[j] += m_masses[i] * pull;
+			}
+			else {
+				// Both walks of the tree warn, one from each side
+				warnClosePair(i);
+				warnClosePair(j);
+			}
+		}
+		m_fields[i] += field;
+	}
+
+	std::size_t count_a = cell_a.bodyEnd - cell_a.bodyBegin;
+	std::size_t count_b = cell_b.bodyEnd - cell_b.bodyBegin;
+	work.p2p += a == b ? count_a * (count_a - 1) / 2 : count_a * count_b;
+}
+
+#endif
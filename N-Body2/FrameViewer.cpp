@@ -0,0 +1,162 @@
+#include "FrameViewer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+int FrameViewer::watch(const std::string& name, const std::string& mode, const std::string& out, int waitSeconds) {
+	if (mode != "stats" && mode != "ascii" && mode != "ppm") {
+		std::cout << "Unknown watch mode '" << mode << "'\n";
+		return EXIT_FAILURE;
+	}
+
+	SharedFrames frames;
+	auto start = std::chrono::steady_clock::now();
+	while (!frames.attach(name)) {
+		if (std::chrono::steady_clock::now() - start > std::chrono::seconds(waitSeconds)) {
+			std::cerr << "Error: no simulation is publishing to " << name << std::endl;
+			return EXIT_FAILURE;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	Frame frame;
+	std::uint64_t seen = 0;
+	double half_extent = 0.0;
+	int shown = 0;
+
+	while (true) {
+		// Read the finished flag first so the last frame is never missed
+		bool finished = frames.isFinished();
+
+		if (frames.readLatest(frame, seen)) {
+			seen = frame.number + 1;
+
+			// The scale of the first frame is kept, so motion stays visible
+			if (half_extent == 0.0)
+				half_extent = 1.1 * extentOf(frame);
+
+			if (mode == "stats")
+				printStats(frame, std::cout);
+			else if (mode == "ascii")
+				renderAscii(frame, 80, 40, half_extent, std::cout);
+			else
+				writePpm(frame, out + "_" + std::to_string(frame.number) + ".ppm", 512, half_extent);
+			++shown;
+		}
+		else if (finished) {
+			break;
+		}
+		else if (!frames.isProducerAlive()) {
+			std::cerr << "Error: the simulation publishing to " << name << " stopped without finishing" << std::endl;
+			std::cout << "Watch -- " << shown << " of " << frames.getPublished() << " frames shown" << std::endl;
+			return EXIT_FAILURE;
+		}
+		else {
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	}
+
+	std::cout << "Watch -- " << shown << " of " << frames.getPublished() << " frames shown" << std::endl;
+	return EXIT_SUCCESS;
+}
+
+void FrameViewer::printStats(const Frame& frame, std::ostream& out) {
+	const std::size_t stride = frame.stride();
+	double center[3] = { 0.0, 0.0, 0.0 };
+	double total_mass = 0.0;
+
+	for (std::size_t i = 0; i < frame.count; ++i) {
+		double mass = frame.values[i * stride + frame.dimensions];
+		for (int d = 0; d < frame.dimensions; ++d)
+			center[d] += mass * frame.values[i * stride + d];
+		total_mass += mass;
+	}
+	for (int d = 0; d < frame.dimensions && total_mass > 0.0; ++d)
+		center[d] /= total_mass;
+
+	double radius = 0.0;
+	for (std::size_t i = 0; i < frame.count; ++i) {
+		double mass = frame.values[i * stride + frame.dimensions];
+		for (int d = 0; d < frame.dimensions; ++d) {
+			double offset = frame.values[i * stride + d] - center[d];
+			radius += mass * offset * offset;
+		}
+	}
+	radius = total_mass > 0.0 ? std::sqrt(radius / total_mass) : 0.0;
+
+	out << "frame " << frame.number << "  t = " << frame.time << "  bodies " << frame.count << "  com (";
+	for (int d = 0; d < frame.dimensions; ++d)
+		out << (d ? ", " : "") << center[d];
+	out << ")  rms radius " << radius << "  extent " << extentOf(frame) << "\n";
+}
+
+void FrameViewer::renderAscii(const Frame& frame, int columns, int rows, double halfExtent, std::ostream& out) {
+	static const char shades[] = " .:-=+*#%@";
+	const int levels = static_cast<int>(sizeof(shades)) - 2;
+	const std::size_t stride = frame.stride();
+
+	std::vector<int> counts(static_cast<std::size_t>(columns) * rows, 0);
+	int most = 0;
+	for (std::size_t i = 0; i < frame.count && halfExtent > 0.0; ++i) {
+		int column = static_cast<int>((frame.values[i * stride] / halfExtent + 1.0) * 0.5 * columns);
+		int row = static_cast<int>((1.0 - frame.values[i * stride + 1] / halfExtent) * 0.5 * rows);
+		if (column < 0 || column >= columns || row < 0 || row >= rows)
+			continue;
+
+		most = std::max(most, ++counts[static_cast<std::size_t>(row) * columns + column]);
+	}
+
+	// Home the cursor and clear, so consecutive frames animate in place
+	out << "\x1b[H\x1b[2J";
+	for (int row = 0; row < rows; ++row) {
+		for (int column = 0; column < columns; ++column) {
+			int count = counts[static_cast<std::size_t>(row) * columns + column];
+			int level = count == 0 ? 0 : 1 + static_cast<int>((levels - 1) * std::log(static_cast<double>(count)) / std::log(most + 1.0));
+			out << shades[std::min(level, levels)];
+		}
+		out << "\n";
+	}
+	out << "frame " << frame.number << "  t = " << frame.time << "  bodies " << frame.count << std::endl;
+}
+
+bool FrameViewer::writePpm(const Frame& frame, const std::string& path, int size, double halfExtent) {
+	std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		std::cerr << "Error: Could not open file " << path << std::endl;
+		return false;
+	}
+
+	const std::size_t stride = frame.stride();
+	std::vector<unsigned char> pixels(static_cast<std::size_t>(size) * size * 3, 0);
+
+	// Every body brightens its pixel, so dense regions saturate to white
+	for (std::size_t i = 0; i < frame.count && halfExtent > 0.0; ++i) {
+		int x = static_cast<int>((frame.values[i * stride] / halfExtent + 1.0) * 0.5 * size);
+		int y = static_cast<int>((1.0 - frame.values[i * stride + 1] / halfExtent) * 0.5 * size);
+		if (x < 0 || x >= size || y < 0 || y >= size)
+			continue;
+
+		unsigned char* pixel = &pixels[(static_cast<std::size_t>(y) * size + x) * 3];
+		pixel[0] = static_cast<unsigned char>(std::min(255, pixel[0] + 96));
+		pixel[1] = static_cast<unsigned char>(std::min(255, pixel[1] + 128));
+		pixel[2] = static_cast<unsigned char>(std::min(255, pixel[2] + 160));
+	}
+
+	file << "P6\n" << size << " " << size << "\n255\n";
+	file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+	return true;
+}
+
+double FrameViewer::extentOf(const Frame& frame) {
+	const std::size_t stride = frame.stride();
+	double extent = 0.0;
+
+	for (std::size_t i = 0; i < frame.count; ++i) {
+		extent = std::max(extent, std::abs(frame.values[i * stride]));
+		extent = std::max(extent, std::abs(frame.values[i * stride + 1]));
+	}
+	return extent;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <iostream>
+#include <string>
+
+#include "SharedFrames.h"
+
+// Reference consumer of SharedFrames, selected with --watch: follows a running
+// simulation and prints statistics, draws it in the terminal or writes images
+class FrameViewer
+{
+public:
+	// Attaches to `name` (waiting up to `waitSeconds` for the producer) and
+	// shows every new frame with `mode` (stats, ascii or ppm) until the producer
+	// finishes. Fails if the producer's process exits without finishing the ring.
+	// ppm frames are written to `out`_<frame>.ppm.
+	static int watch(const std::string& name, const std::string& mode, const std::string& out, int waitSeconds = 10);
+
+	// Body count, center of mass, RMS radius about it and extent
+	static void printStats(const Frame& frame, std::ostream& out);
+
+	// x-y projection as a density map of characters, +/- halfExtent on both axes
+	static void renderAscii(const Frame& frame, int columns, int rows, double halfExtent, std::ostream& out);
+
+	// x-y projection as a size x size binary PPM image
+	static bool writePpm(const Frame& frame, const std::string& path, int size, double halfExtent);
+
+	// Largest |x| or |y| of the frame's bodies
+	static double extentOf(const Frame& frame);
+};
@@ -0,0 +1,95 @@
+#ifndef INITIALCONDITIONS_H
+#define INITIALCONDITIONS_H
+#pragma once
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "Node.h"
+#include "Utils.h"
+
+// Mass distributions InitialConditions can sample
+enum Distribution {
+	DISTRIBUTION_UNIFORM = 0,	// uniform cube, roughly virialised Gaussian velocities
+	DISTRIBUTION_PLUMMER = 1,	// Plummer sphere in equilibrium (Aarseth, Henon & Wielen)
+	DISTRIBUTION_HERNQUIST = 2,	// Hernquist halo, isotropic Jeans velocities
+	DISTRIBUTION_DISK = 3		// thin disk on circular orbits around a central mass
+};
+
+// Parameters of InitialConditions::generate
+struct GeneratorSettings {
+	Distribution distribution = DISTRIBUTION_PLUMMER;
+	std::size_t count = 100000;
+	double scale = 1e9;				// cube half length, Plummer / Hernquist scale radius, disk radius [m]
+	double mass = 1e30;				// total mass of the sampled bodies [kg]
+	double centralMass = 2e30;		// disk only: body 0 at the origin [kg]
+	std::uint64_t seed = 1;
+	unsigned int threads = 0;		// 0 = all cores
+};
+
+/*
+	Built-in initial-condition generator, replacing random_bodies.py and its
+	JSON files for large inputs.
+
+	Bodies are produced in fixed blocks of `blockSize`, each with its own RNG
+	stream seeded from (seed, block), and the blocks are spread over threads.
+	The result depends only on the settings, never on the number of threads.
+
+	The spherical models are sampled in 3D; 2D runs use their face-on projection,
+	which is not in equilibrium under the 2D forces. The disk is in both.
+	Every system except the disk is shifted to rest at the origin.
+
+	Snapshots are a small binary header followed by id, mass, radius, position
+	and velocity of every body, so loading them is a single read.
+*/
+template <typename VecType>
+class InitialConditions
+{
+public:
+	static constexpr std::size_t blockSize = 16384;
+
+private:
+	static constexpr int dimensions = static_cast<int>(VecDimensions<VecType>::value);
+	static constexpr std::uint32_t snapshotMagic = 0x4e42534e;	// "NBSN"
+	static constexpr std::uint32_t snapshotVersion = 1;
+
+public:
+	// Replaces `bodies` with settings.count generated bodies
+	static void generate(const GeneratorSettings& settings, std::vector<Node<VecType>>& bodies);
+
+	// Writes the bodies of block `block` (at most blockSize) to `bodies`, exactly as
+	// generate() does but without removing the drift of the whole system
+	static void generateBlock(const GeneratorSettings& settings, std::size_t block, Node<VecType>* bodies);
+
+	// uniform, plummer, hernquist or disk
+	static bool parseDistribution(const std::string& name, Distribution& distribution);
+
+	static bool writeSnapshot(const std::string& filePath, const std::vector<Node<VecType>>& bodies);
+
+	// Writes `count` bodies a block at a time, for bodies that are not in a vector:
+	// body(i, id, mass, radius, position, velocity) gives body i
+	template <typename BodySource>
+	static bool writeSnapshot(const std::string& filePath, std::size_t count, BodySource body);
+
+	static bool readSnapshot(const std::string& filePath, std::vector<Node<VecType>>& bodies);
+
+private:
+	// Independent stream of block `block`
+	static std::uint64_t streamSeed(std::uint64_t seed, std::uint64_t block);
+
+	// Sample of body `index`: 3D position and velocity
+	static void sample(const GeneratorSettings& settings, std::size_t index, std::mt19937_64& rng, glm::dvec3& position, glm::dvec3& velocity);
+
+	static glm::dvec3 isotropic(double length, std::mt19937_64& rng);
+
+	// Shifts the bodies so their center of mass is at rest at the origin
+	static void removeDrift(std::vector<Node<VecType>>& bodies, unsigned int threads);
+};
+
+using InitialConditions2D = InitialConditions<glm::dvec2>;
+using InitialConditions3D = InitialConditions<glm::dvec3>;
+
+#include "InitialConditions.tpp"
+#endif
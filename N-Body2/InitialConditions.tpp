@@ -0,0 +1,329 @@
+#ifndef INITIALCONDITIONS_TPP
+#define INITIALCONDITIONS_TPP
+#include "InitialConditions.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+template <typename VecType>
+bool InitialConditions<VecType>::parseDistribution(const std::string& name, Distribution& distribution)
+{
+	if (name == "uniform")
+		distribution = DISTRIBUTION_UNIFORM;
+	else if (name == "plummer")
+		distribution = DISTRIBUTION_PLUMMER;
+	else if (name == "hernquist")
+		distribution = DISTRIBUTION_HERNQUIST;
+	else if (name == "disk")
+		distribution = DISTRIBUTION_DISK;
+	else
+		return false;
+	return true;
+}
+
+template <typename VecType>
+std::uint64_t InitialConditions<VecType>::streamSeed(std::uint64_t seed, std::uint64_t block)
+{
+	// SplitMix64 of the pair, so neighbouring blocks get unrelated streams
+	std::uint64_t z = seed * 0x9e3779b97f4a7c15ull + block + 1;
+	for (int round = 0; round < 2; ++round) {
+		z += 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		z ^= z >> 31;
+	}
+	return z;
+}
+
+template <typename VecType>
+glm::dvec3 InitialConditions<VecType>::isotropic(double length, std::mt19937_64& rng)
+{
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	double z = 2.0 * unit(rng) - 1.0;
+	double phi = 2.0 * M_PI * unit(rng);
+	double ring = std::sqrt(1.0 - z * z);
+	return length * glm::dvec3(ring * std::cos(phi), ring * std::sin(phi), z);
+}
+
+template <typename VecType>
+void InitialConditions<VecType>::sample(const GeneratorSettings& settings, std::size_t index, std::mt19937_64& rng, glm::dvec3& position, glm::dvec3& velocity)
+{
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	const double a = settings.scale;
+	const double M = settings.mass;
+
+	switch (settings.distribution) {
+	case DISTRIBUTION_UNIFORM: {
+		// Dispersion of a virialised uniform sphere of the same radius
+		std::normal_distribution<double> speed(0.0, std::sqrt(G * M / (5.0 * a)));
+		for (int d = 0; d < 3; ++d) {
+			position[d] = a * (2.0 * unit(rng) - 1.0);
+			velocity[d] = speed(rng);
+		}
+		break;
+	}
+	case DISTRIBUTION_PLUMMER: {
+		// Radius from the inverted cumulative mass, the outer 0.1 % cut off
+		double fraction = 0.999 * unit(rng);
+		double r = a / std::sqrt(std::pow(std::max(fraction, 1e-12), -2.0 / 3.0) - 1.0);
+		position = isotropic(r, rng);
+
+		// Speed as a fraction q of the local escape speed, g(q) = q^2 (1 - q^2)^3.5 by rejection
+		double q = 0.0;
+		while (true) {
+			q = unit(rng);
+			if (0.1 * unit(rng) < q * q * std::pow(1.0 - q * q, 3.5))
+				break;
+		}
+		double escape = std::sqrt(2.0 * G * M / a) * std::pow(1.0 + r * r / (a * a), -0.25);
+		velocity = isotropic(q * escape, rng);
+		break;
+	}
+	case DISTRIBUTION_HERNQUIST: {
+		// M(r) = M r^2 / (r + a)^2, the outer 1 % cut off
+		double s = std::sqrt(0.99 * unit(rng));
+		double r = a * s / (1.0 - s);
+		position = isotropic(r, rng);
+
+		// Isotropic radial dispersion (Hernquist 1990, eq. 10)
+		double x = std::max(r / a, 1e-6);
+		double dispersion = G * M / (12.0 * a) * (12.0 * x * std::pow(1.0 + x, 3) * std::log((1.0 + x) / x)
+			- x / (1.0 + x) * (25.0 + 52.0 * x + 42.0 * x * x + 12.0 * x * x * x));
+		std::normal_distribution<double> speed(0.0, std::sqrt(std::max(dispersion, 0.0)));
+
+		// Bodies above 95 % of the escape speed are drawn again
+		double escape = std::sqrt(2.0 * G * M / (r + a));
+		do {
+			velocity = glm::dvec3(speed(rng), speed(rng), speed(rng));
+		} while (glm::length(velocity) > 0.95 * escape);
+		break;
+	}
+	case DISTRIBUTION_DISK: {
+		if (index == 0) {
+			position = glm::dvec3(0.0);
+			velocity = glm::dvec3(0.0);
+			break;
+		}
+
+		// Surface density ~ 1 / r between inner and a: uniform in radius
+		const double inner = 0.05 * a;
+		double r = inner + (a - inner) * unit(rng);
+		double phi = 2.0 * M_PI * unit(rng);
+		double enclosed = settings.centralMass + M * (r - inner) / (a - inner);
+		double circular = std::sqrt(G * enclosed / r);
+
+		// 1 % thickness and dispersion keep the 3D disk from being exactly flat
+		std::normal_distribution<double> jitter(0.0, 0.01);
+		position = glm::dvec3(r * std::cos(phi), r * std::sin(phi), r * jitter(rng));
+		velocity = glm::dvec3(-circular * std::sin(phi), circular * std::cos(phi), circular * jitter(rng));
+		break;
+	}
+	}
+}
+
+template <typename VecType>
+void InitialConditions<VecType>::generateBlock(const GeneratorSettings& settings, std::size_t block, Node<VecType>* bodies)
+{
+	const std::size_t count = settings.count;
+	const bool disk = settings.distribution == DISTRIBUTION_DISK;
+
+	// The disk's central body carries centralMass, the others share settings.mass
+	const std::size_t sampled = disk && count > 0 ? count - 1 : count;
+	const double body_mass = sampled > 0 ? settings.mass / sampled : 0.0;
+	const double body_radius = 1e-3 * settings.scale / std::cbrt(static_cast<double>(std::max<std::size_t>(count, 1)));
+
+	std::mt19937_64 rng(streamSeed(settings.seed, block));
+	std::size_t first = block * blockSize;
+	std::size_t end = std::min(count, first + blockSize);
+
+	for (std::size_t i = first; i < end; ++i) {
+		glm::dvec3 position, velocity;
+		sample(settings, i, rng, position, velocity);
+
+		VecType pos, vel;
+		for (int d = 0; d < dimensions; ++d) {
+			pos[d] = position[d];
+			vel[d] = velocity[d];
+		}
+
+		bool central = disk && i == 0;
+		bodies[i - first] = Node<VecType>(static_cast<int>(i), central ? "Central" : "Body_" + std::to_string(i), pos, vel,
+			central ? settings.centralMass : body_mass, central ? 1e-3 * settings.scale : body_radius);
+	}
+}
+
+template <typename VecType>
+void InitialConditions<VecType>::generate(const GeneratorSettings& settings, std::vector<Node<VecType>>& bodies)
+{
+	const std::size_t count = settings.count;
+	const std::size_t blocks = (count + blockSize - 1) / blockSize;
+
+	bodies.clear();
+	bodies.resize(count);
+
+	Utils::parallelFor(blocks, settings.threads, [&](std::size_t first, std::size_t last) {
+		for (std::size_t block = first; block < last; ++block)
+			generateBlock(settings, block, bodies.data() + block * blockSize);
+	});
+
+	if (settings.distribution != DISTRIBUTION_DISK)
+		removeDrift(bodies, settings.threads);
+}
+
+template <typename VecType>
+void InitialConditions<VecType>::removeDrift(std::vector<Node<VecType>>& bodies, unsigned int threads)
+{
+	// Partial sums per block, added up in block order so the result does not depend on the threads
+	const std::size_t blocks = (bodies.size() + blockSize - 1) / blockSize;
+	std::vector<VecType> block_position(blocks, VecType(0)), block_momentum(blocks, VecType(0));
+	std::vector<double> block_mass(blocks, 0.0);
+
+	Utils::parallelFor(blocks, threads, [&](std::size_t first, std::size_t last) {
+		for (std::size_t block = first; block < last; ++block) {
+			std::size_t end = std::min(bodies.size(), (block + 1) * blockSize);
+			for (std::size_t i = block * blockSize; i < end; ++i) {
+				block_position[block] += bodies[i].mass * bodies[i].position;
+				block_momentum[block] += bodies[i].mass * bodies[i].velocity;
+				block_mass[block] += bodies[i].mass;
+			}
+		}
+	});
+
+	VecType position(0), momentum(0);
+	double mass = 0.0;
+	for (std::size_t block = 0; block < blocks; ++block) {
+		position += block_position[block];
+		momentum += block_momentum[block];
+		mass += block_mass[block];
+	}
+
+	if (mass <= 0.0)
+		return;
+
+	position /= mass;
+	momentum /= mass;
+	Utils::parallelFor(bodies.size(), threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i) {
+			bodies[i].position -= position;
+			bodies[i].velocity -= momentum;
+		}
+	});
+}
+
+template <typename VecType>
+bool InitialConditions<VecType>::writeSnapshot(const std::string& filePath, const std::vector<Node<VecType>>& bodies)
+{
+	return writeSnapshot(filePath, bodies.size(), [&](std::size_t i, std::int32_t& id, double& mass, double& radius, VecType& position, VecType& velocity) {
+		const Node<VecType>& source = bodies[i];
+		id = source.getId();
+		mass = source.mass;
+		radius = source.radius;
+		position = source.position;
+		velocity = source.velocity;
+	});
+}
+
+template <typename VecType>
+template <typename BodySource>
+bool InitialConditions<VecType>::writeSnapshot(const std::string& filePath, std::size_t count, BodySource body)
+{
+	std::ofstream file(filePath, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		std::cerr << "Error: Could not open file " << filePath << std::endl;
+		return false;
+	}
+
+	const std::uint32_t header[] = { snapshotMagic, snapshotVersion, static_cast<std::uint32_t>(dimensions) };
+	const std::uint64_t total = count;
+	file.write(reinterpret_cast<const char*>(header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(&total), sizeof(total));
+
+	// id, mass, radius, position, velocity; written a block at a time
+	const std::size_t record = sizeof(std::int32_t) + (2 + 2 * dimensions) * sizeof(double);
+	std::vector<char> buffer;
+	buffer.reserve(blockSize * record);
+
+	for (std::size_t first = 0; first < count; first += blockSize) {
+		buffer.clear();
+		std::size_t end = std::min(count, first + blockSize);
+
+		for (std::size_t i = first; i < end; ++i) {
+			std::int32_t id = 0;
+			double mass = 0.0;
+			double radius = 0.0;
+			VecType position(0.0);
+			VecType velocity(0.0);
+			body(i, id, mass, radius, position, velocity);
+
+			double values[2 + 2 * dimensions];
+			values[0] = mass;
+			values[1] = radius;
+			for (int d = 0; d < dimensions; ++d) {
+				values[2 + d] = position[d];
+				values[2 + dimensions + d] = velocity[d];
+			}
+
+			buffer.insert(buffer.end(), reinterpret_cast<const char*>(&id), reinterpret_cast<const char*>(&id) + sizeof(id));
+			buffer.insert(buffer.end(), reinterpret_cast<const char*>(values), reinterpret_cast<const char*>(values) + sizeof(values));
+		}
+		file.write(buffer.data(), buffer.size());
+	}
+	return static_cast<bool>(file);
+}
+
+template <typename VecType>
+bool InitialConditions<VecType>::readSnapshot(const std::string& filePath, std::vector<Node<VecType>>& bodies)
+{
+	std::ifstream file(filePath, std::ios::in | std::ios::binary);
+	if (!file.is_open()) {
+		std::cerr << "Error: Could not open file " << filePath << std::endl;
+		return false;
+	}
+
+	std::uint32_t header[3] = { 0, 0, 0 };
+	std::uint64_t count = 0;
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	file.read(reinterpret_cast<char*>(&count), sizeof(count));
+
+	if (!file || header[0] != snapshotMagic || header[1] != snapshotVersion) {
+		std::cerr << "Error: " << filePath << " is not a snapshot" << std::endl;
+		return false;
+	}
+	if (header[2] != static_cast<std::uint32_t>(dimensions)) {
+		std::cerr << "Error: " << filePath << " holds a " << header[2] << "D system, expected " << dimensions << "D" << std::endl;
+		return false;
+	}
+
+	const std::size_t record = sizeof(std::int32_t) + (2 + 2 * dimensions) * sizeof(double);
+	std::vector<char> buffer(static_cast<std::size_t>(count) * record);
+	file.read(buffer.data(), buffer.size());
+	if (!file) {
+		std::cerr << "Error: " << filePath << " is truncated" << std::endl;
+		return false;
+	}
+
+	bodies.clear();
+	bodies.resize(static_cast<std::size_t>(count));
+
+	Utils::parallelFor(bodies.size(), 0, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i) {
+			const char* bytes = buffer.data() + i * record;
+			std::int32_t id;
+			double values[2 + 2 * dimensions];
+			std::memcpy(&id, bytes, sizeof(id));
+			std::memcpy(values, bytes + sizeof(id), sizeof(values));
+
+			VecType pos, vel;
+			for (int d = 0; d < dimensions; ++d) {
+				pos[d] = values[2 + d];
+				vel[d] = values[2 + dimensions + d];
+			}
+			bodies[i] = Node<VecType>(id, "Body_" + std::to_string(id), pos, vel, values[0], values[1]);
+		}
+	});
+	return true;
+}
+
+#endif
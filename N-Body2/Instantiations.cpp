@@ -0,0 +1,10 @@
+#include "TreeWrapper.h"
+
+// The configurations main() and NBodyLib run, compiled once here instead of in
+// every translation unit. Each TreeWrapper brings the walks of both softening
+// kernels with it through withPolicy.
+template class Tree<glm::dvec2>;
+template class Tree<glm::dvec3>;
+
+template class TreeWrapper<glm::dvec2>;
+template class TreeWrapper<glm::dvec3>;
@@ -0,0 +1,221 @@
+#include "MappedFile.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#elif defined(__linux__) || defined(__unix__)
+#define MAPPED_FILE_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() :
+	m_path(),
+	m_data(nullptr),
+	m_bytes(0),
+#ifdef _WIN32
+	m_file(nullptr),
+	m_mapping(nullptr)
+#else
+	m_descriptor(-1)
+#endif
+{}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+bool MappedFile::isOpen() const {
+	return m_data != nullptr;
+}
+
+char* MappedFile::data() {
+	return m_data;
+}
+
+const char* MappedFile::data() const {
+	return m_data;
+}
+
+std::size_t MappedFile::size() const {
+	return m_bytes;
+}
+
+const std::string& MappedFile::getPath() const {
+	return m_path;
+}
+
+bool MappedFile::create(const std::string& path, std::size_t bytes) {
+	close();
+	m_path = path;
+
+	// Empty mappings are not allowed, an empty store still maps one page
+	std::size_t mapped = bytes > 0 ? bytes : pageSize();
+
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		std::cerr << "Error: Could not create file " << path << std::endl;
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(static_cast<std::uint64_t>(mapped) >> 32), static_cast<DWORD>(mapped & 0xffffffffull), nullptr);
+	void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mapped) : nullptr;
+	if (view == nullptr) {
+		std::cerr << "Error: Could not map " << mapped << " bytes of " << path << std::endl;
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	m_file = file;
+	m_mapping = mapping;
+	m_data = static_cast<char*>(view);
+	m_bytes = bytes;
+	return true;
+#elif defined(MAPPED_FILE_POSIX)
+	int descriptor = ::open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (descriptor < 0 || ftruncate(descriptor, static_cast<off_t>(mapped)) != 0) {
+		std::cerr << "Error: Could not create file " << path << std::endl;
+		if (descriptor >= 0)
+			::close(descriptor);
+		return false;
+	}
+
+	void* memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	if (memory == MAP_FAILED) {
+		std::cerr << "Error: Could not map " << mapped << " bytes of " << path << std::endl;
+		::close(descriptor);
+		return false;
+	}
+
+	m_descriptor = descriptor;
+	m_data = static_cast<char*>(memory);
+	m_bytes = bytes;
+	return true;
+#else
+	std::cerr << "Error: memory-mapped files are not supported on this system" << std::endl;
+	return false;
+#endif
+}
+
+void MappedFile::close(bool remove) {
+	std::size_t mapped = m_bytes > 0 ? m_bytes : pageSize();
+
+#if defined(_WIN32)
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file)
+		CloseHandle(m_file);
+	m_mapping = nullptr;
+	m_file = nullptr;
+#elif defined(MAPPED_FILE_POSIX)
+	if (m_data)
+		munmap(m_data, mapped);
+	if (m_descriptor >= 0)
+		::close(m_descriptor);
+	m_descriptor = -1;
+#endif
+
+	bool opened = m_data != nullptr;
+	m_data = nullptr;
+	m_bytes = 0;
+
+	if (opened && remove)
+		std::remove(m_path.c_str());
+}
+
+void MappedFile::prefetch(std::size_t offset, std::size_t bytes) const {
+	if (!m_data || offset >= m_bytes)
+		return;
+	if (bytes > m_bytes - offset)
+		bytes = m_bytes - offset;
+
+	const std::size_t page = pageSize();
+	std::size_t begin = offset / page * page;
+
+#ifdef MAPPED_FILE_POSIX
+	madvise(m_data + begin, offset + bytes - begin, MADV_WILLNEED);
+#endif
+
+	// Touch one byte per page so the faults are taken here
+	volatile const char* memory = m_data;
+	char sink = 0;
+	for (std::size_t at = offset; at < offset + bytes; at = (at / page + 1) * page)
+		sink ^= memory[at];
+	(void)sink;
+}
+
+void MappedFile::release(std::size_t offset, std::size_t bytes) const {
+	if (!m_data || offset >= m_bytes)
+		return;
+	if (bytes > m_bytes - offset)
+		bytes = m_bytes - offset;
+
+#ifdef MAPPED_FILE_POSIX
+	// Whole pages inside the range only, so neighbouring data stays resident
+	const std::size_t page = pageSize();
+	std::size_t begin = (offset + page - 1) / page * page;
+	std::size_t end = (offset + bytes) / page * page;
+	if (end <= begin)
+		return;
+
+	// Start the write-back of dirty pages, then unmap them; a shared mapping keeps their contents
+	msync(m_data + begin, end - begin, MS_ASYNC);
+	madvise(m_data + begin, end - begin, MADV_DONTNEED);
+#elif defined(_WIN32)
+	// Pages are written back and trimmed by the working set manager
+	FlushViewOfFile(m_data + offset, bytes);
+#endif
+}
+
+std::size_t MappedFile::pageSize() {
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return static_cast<std::size_t>(info.dwPageSize);
+#elif defined(MAPPED_FILE_POSIX)
+	return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#else
+	return 4096;
+#endif
+}
+
+bool MappedFile::ioCounters(std::uint64_t& read, std::uint64_t& written) {
+	read = 0;
+	written = 0;
+
+#if defined(__linux__)
+	// read_bytes / write_bytes: what actually reached the block layer
+	std::ifstream file("/proc/self/io");
+	if (!file)
+		return false;
+
+	std::string key;
+	std::uint64_t value = 0;
+	bool found_read = false, found_written = false;
+	while (file >> key >> value) {
+		if (key == "read_bytes:") {
+			read = value;
+			found_read = true;
+		}
+		else if (key == "write_bytes:") {
+			written = value;
+			found_written = true;
+		}
+	}
+	return found_read && found_written;
+#else
+	// Windows' GetProcessIoCounters only sees the process's own read / write calls,
+	// not the paging of mapped files that makes up nearly all of it
+	return false;
+#endif
+}
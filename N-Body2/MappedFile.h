@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+	A file mapped read / write into the address space, the backing store of
+	OutOfCore. The kernel pages it in on first touch and writes dirty pages back
+	on its own, so it can be far larger than physical memory.
+
+	prefetch() starts reading a range ahead of its use and touches every page
+	of it, so a thread calling it in the background takes the page faults
+	instead of the one that needs the data. release() drops a range from the
+	resident set once it has been used; its contents stay in the file.
+
+	Uses mmap on Linux / POSIX systems and file mappings on Windows.
+*/
+class MappedFile
+{
+private:
+	std::string m_path;
+	char* m_data;
+	std::size_t m_bytes;
+#ifdef _WIN32
+	void* m_file;
+	void* m_mapping;
+#else
+	int m_descriptor;
+#endif
+
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Getters
+	bool isOpen() const;
+	char* data();
+	const char* data() const;
+	std::size_t size() const;
+	const std::string& getPath() const;
+
+	// Creates or truncates `path` to `bytes` and maps all of it
+	bool create(const std::string& path, std::size_t bytes);
+
+	// Unmaps the file; with `remove` it is deleted as well
+	void close(bool remove = false);
+
+	// Reads [offset, offset + bytes) into memory ahead of its use
+	void prefetch(std::size_t offset, std::size_t bytes) const;
+
+	// Drops [offset, offset + bytes) from memory, writing it back first if dirty
+	void release(std::size_t offset, std::size_t bytes) const;
+
+	static std::size_t pageSize();
+
+	// Bytes this process has read from / written to storage so far, including
+	// page cache write-back. Linux only; returns false elsewhere, Windows included, whose
+	// counters leave out the paging of mapped files.
+	static bool ioCounters(std::uint64_t& read, std::uint64_t& written);
+};
@@ -0,0 +1,106 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+#pragma once
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "TreeWrapper.h"
+
+/*
+	Run-time check of the conserved quantities. Every `interval` steps the
+	simulation measures kinetic and potential energy, momentum and angular
+	momentum (see TreeWrapper::measureConservation); each sample is compared
+	with the first one, written to a CSV log and folded into the run report.
+
+	A relative energy error above the tolerance prints a warning once or, when
+	aborting is enabled, tells the caller to stop the run.
+*/
+template <typename VecType>
+class ConservationMonitor
+{
+private:
+	int m_interval;			// 0 = off
+	double m_tolerance;		// relative energy error, 0 = never warn
+	bool m_abort;
+
+	std::ofstream m_log;
+
+	int m_samples;
+	Conservation<VecType> m_initial;
+	Conservation<VecType> m_last;
+	double m_maxEnergyError;
+	bool m_exceeded;
+
+public:
+	ConservationMonitor(int interval, double tolerance, bool abort);
+
+	// Getters
+	int getInterval();
+	int getSamples();
+	double getMaxEnergyError();
+
+	// Starts the CSV log; only the rank writing the report needs one
+	bool open(const std::string& filePath);
+
+	// Whether `step` has to be measured
+	bool due(int step);
+
+	// Records the measurement taken at the start of `step`. Returns false when
+	// the tolerance is exceeded and the run has to stop.
+	bool record(int step, double time, const Conservation<VecType>& sample);
+
+	// Summary line for the run report
+	void report(std::ostream& out);
+
+private:
+	// |E - E0| / |E0| of `sample` against the first one
+	double energyError(const Conservation<VecType>& sample);
+};
+
+/*
+	Periodic look at the shape of the Barnes-Hut tree. Near-coincident bodies
+	make it very deep and bodies outside the root are dropped by insertBody;
+	both only show up as slow or wrong steps otherwise. Every `interval` steps
+	the tree is walked (see Tree::collectStatistics); the run report gets the
+	extremes over all samples and the per-level table of the last one.
+*/
+template <typename VecType>
+class TreeMonitor
+{
+private:
+	// Cells this deep are 2^-48 of the root, close to the resolution of a double
+	static constexpr int deepTree = 48;
+
+	int m_interval;			// 0 = off
+
+	int m_samples;
+	int m_lastStep;
+	TreeStatistics m_last;
+	int m_maxDepth;
+	std::size_t m_maxCells;
+	std::size_t m_maxBytes;
+	double m_maxEmptyFraction;
+	bool m_warnedDepth;
+	bool m_warnedDropped;
+
+public:
+	TreeMonitor(int interval);
+
+	// Getters
+	int getInterval();
+	int getSamples();
+	TreeStatistics& getLast();
+
+	// Whether the tree has to be inspected after `step`
+	bool due(int step);
+
+	// Inspects the tree `wrapper` built during `step`, warning once about deep trees and dropped bodies
+	void record(int step, TreeWrapper<VecType>& wrapper);
+
+	// Summary and per-level table for the run report
+	void report(std::ostream& out);
+};
+
+#include "Monitor.tpp"
+#endif
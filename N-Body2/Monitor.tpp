@@ -0,0 +1,185 @@
+#ifndef MONITOR_TPP
+#define MONITOR_TPP
+#include "Monitor.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+template <typename VecType>
+ConservationMonitor<VecType>::ConservationMonitor(int interval, double tolerance, bool abort) :
+	m_interval(interval > 0 ? interval : 0),
+	m_tolerance(tolerance),
+	m_abort(abort),
+	m_log(),
+	m_samples(0),
+	m_initial(),
+	m_last(),
+	m_maxEnergyError(0.0),
+	m_exceeded(false)
+{}
+
+template <typename VecType>
+int ConservationMonitor<VecType>::getInterval() {
+	return m_interval;
+}
+
+template <typename VecType>
+int ConservationMonitor<VecType>::getSamples() {
+	return m_samples;
+}
+
+template <typename VecType>
+double ConservationMonitor<VecType>::getMaxEnergyError() {
+	return m_maxEnergyError;
+}
+
+template <typename VecType>
+bool ConservationMonitor<VecType>::open(const std::string& filePath)
+{
+	m_log.open(filePath, std::ios::out | std::ios::trunc);
+	if (!m_log.is_open()) {
+		std::cerr << "Error: Could not open file " << filePath << std::endl;
+		return false;
+	}
+
+	m_log << "step,time,kinetic,potential,energy,relative_energy_error";
+	for (int d = 0; d < VecType::length(); ++d)
+		m_log << ",p" << "xyz"[d];
+	m_log << ",lx,ly,lz\n";
+	m_log << std::setprecision(17);
+	return true;
+}
+
+template <typename VecType>
+bool ConservationMonitor<VecType>::due(int step)
+{
+	return m_interval > 0 && step % m_interval == 0;
+}
+
+template <typename VecType>
+double ConservationMonitor<VecType>::energyError(const Conservation<VecType>& sample)
+{
+	double initial = m_initial.energy();
+	return initial != 0.0 ? std::abs((sample.energy() - initial) / initial) : 0.0;
+}
+
+template <typename VecType>
+bool ConservationMonitor<VecType>::record(int step, double time, const Conservation<VecType>& sample)
+{
+	if (m_samples == 0)
+		m_initial = sample;
+	m_last = sample;
+	++m_samples;
+
+	double error = energyError(sample);
+	if (error > m_maxEnergyError)
+		m_maxEnergyError = error;
+
+	if (m_log.is_open()) {
+		m_log << step << "," << time << "," << sample.kinetic << "," << sample.potential << "," << sample.energy() << "," << error;
+		for (int d = 0; d < VecType::length(); ++d)
+			m_log << "," << sample.momentum[d];
+		m_log << "," << sample.angularMomentum.x << "," << sample.angularMomentum.y << "," << sample.angularMomentum.z << "\n";
+	}
+
+	if (m_tolerance <= 0.0 || error <= m_tolerance)
+		return true;
+
+	if (!m_exceeded) {
+		m_exceeded = true;
+		std::cout << "\nWARNING: relative energy error " << error << " exceeds " << m_tolerance << " at step " << step
+			<< (m_abort ? ", stopping.\n" : ".\n");
+	}
+	return !m_abort;
+}
+
+template <typename VecType>
+void ConservationMonitor<VecType>::report(std::ostream& out)
+{
+	if (m_samples == 0)
+		return;
+
+	out << "Conservation -- " << m_samples << " samples every " << m_interval << " steps, max |dE / E|: " << m_maxEnergyError
+		<< ", final |dE / E|: " << energyError(m_last)
+		<< ", |dP|: " << glm::length(m_last.momentum - m_initial.momentum)
+		<< ", |dL|: " << glm::length(m_last.angularMomentum - m_initial.angularMomentum) << std::endl;
+}
+
+template <typename VecType>
+TreeMonitor<VecType>::TreeMonitor(int interval) :
+	m_interval(interval > 0 ? interval : 0),
+	m_samples(0),
+	m_lastStep(0),
+	m_last(),
+	m_maxDepth(0),
+	m_maxCells(0),
+	m_maxBytes(0),
+	m_maxEmptyFraction(0.0),
+	m_warnedDepth(false),
+	m_warnedDropped(false)
+{}
+
+template <typename VecType>
+int TreeMonitor<VecType>::getInterval() {
+	return m_interval;
+}
+
+template <typename VecType>
+int TreeMonitor<VecType>::getSamples() {
+	return m_samples;
+}
+
+template <typename VecType>
+TreeStatistics& TreeMonitor<VecType>::getLast() {
+	return m_last;
+}
+
+template <typename VecType>
+bool TreeMonitor<VecType>::due(int step)
+{
+	return m_interval > 0 && step % m_interval == 0;
+}
+
+template <typename VecType>
+void TreeMonitor<VecType>::record(int step, TreeWrapper<VecType>& wrapper)
+{
+	m_last = wrapper.getTreeStatistics();
+	m_lastStep = step;
+	++m_samples;
+
+	m_maxDepth = std::max(m_maxDepth, m_last.depth());
+	m_maxCells = std::max(m_maxCells, m_last.totalCells());
+	m_maxBytes = std::max(m_maxBytes, m_last.bytes);
+	m_maxEmptyFraction = std::max(m_maxEmptyFraction, m_last.emptyFraction());
+
+	if (!m_warnedDepth && m_last.depth() > deepTree) {
+		m_warnedDepth = true;
+		std::cout << "\nWARNING: tree depth " << m_last.depth() << " at step " << step << ", bodies are (nearly) coincident.\n";
+	}
+	if (!m_warnedDropped && m_last.totalDropped > 0) {
+		m_warnedDropped = true;
+		std::cout << "\nWARNING: " << m_last.totalDropped << " bodies outside the tree were dropped by step " << step << ".\n";
+	}
+}
+
+template <typename VecType>
+void TreeMonitor<VecType>::report(std::ostream& out)
+{
+	if (m_samples == 0)
+		return;
+
+	out << "Tree -- " << m_samples << " samples every " << m_interval << " steps, max depth: " << m_maxDepth
+		<< ", max cells: " << m_maxCells << ", max memory: " << m_maxBytes / (1024.0 * 1024.0) << " MiB"
+		<< ", max empty fraction: " << m_maxEmptyFraction << ", dropped bodies: " << m_last.totalDropped << std::endl;
+
+	out << "Tree -- step " << m_lastStep << ": " << m_last.totalCells() << " cells, " << m_last.bytes / (1024.0 * 1024.0) << " MiB\n";
+	out << std::setw(8) << "level" << std::setw(12) << "cells" << std::setw(12) << "bodies" << std::setw(12) << "empty" << std::setw(12) << "occupied" << "\n";
+	for (int level = 0; level <= m_last.depth(); ++level) {
+		std::size_t cells = m_last.cells[level];
+		out << std::setw(8) << level << std::setw(12) << cells << std::setw(12) << m_last.bodies[level] << std::setw(12) << m_last.empty[level]
+			<< std::setw(12) << static_cast<double>(cells - m_last.empty[level]) / cells << "\n";
+	}
+	out << std::flush;
+}
+
+#endif
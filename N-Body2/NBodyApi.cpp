@@ -0,0 +1,265 @@
+#include "NBodyApi.h"
+#include <exception>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+
+#include "TreeWrapper.h"
+
+struct nbody_simulation {
+	int dimensions;
+	std::unique_ptr<TreeWrapper2D> wrapper2d;
+	std::unique_ptr<TreeWrapper3D> wrapper3d;
+	double time;
+	bool changed;			// bodies added or positions / masses handed out since the last rebuild
+	std::unordered_set<int> ids;	// of every body, while idsValid
+	bool idsValid;			// cleared whenever a load or a step may have changed the bodies
+	std::string error;
+};
+
+namespace {
+	// Runs func on the simulation's wrapper, turning exceptions into NBODY_ERROR
+	template <typename Func>
+	int withWrapper(nbody_simulation* simulation, Func&& func) {
+		if (!simulation)
+			return NBODY_ERROR;
+
+		try {
+			simulation->error.clear();
+			if (simulation->dimensions == 2)
+				return func(*simulation->wrapper2d);
+			return func(*simulation->wrapper3d);
+		}
+		catch (const std::exception& exception) {
+			simulation->error = exception.what();
+		}
+		catch (...) {
+			simulation->error = "unknown error";
+		}
+		return NBODY_ERROR;
+	}
+
+	template <typename VecType>
+	std::size_t stride(const std::vector<Node<VecType>>& bodies) {
+		return bodies.size() > 1 ? static_cast<std::size_t>(reinterpret_cast<const char*>(&bodies[1]) - reinterpret_cast<const char*>(&bodies[0]))
+			: sizeof(Node<VecType>);
+	}
+
+	// View of `member` of every body in nodeList
+	template <typename VecType, typename Member>
+	nbody_array view(std::vector<Node<VecType>>& bodies, Member Node<VecType>::* member, int components) {
+		nbody_array array = { nullptr, bodies.size(), stride(bodies), components };
+		if (!bodies.empty())
+			array.data = reinterpret_cast<double*>(&(bodies[0].*member));
+		return array;
+	}
+}
+
+extern "C" {
+
+int nbody_api_version(void) {
+	return NBODY_API_VERSION;
+}
+
+nbody_simulation* nbody_create(int dimensions, double half_length, double theta) {
+	if ((dimensions != 2 && dimensions != 3) || half_length <= 0.0)
+		return nullptr;
+
+	try {
+		std::unique_ptr<nbody_simulation> simulation(new nbody_simulation());
+		simulation->dimensions = dimensions;
+		simulation->time = 0.0;
+		simulation->changed = false;
+		simulation->idsValid = false;
+
+		if (dimensions == 2) {
+			Box2D box(glm::dvec2(0.0), half_length, half_length, half_length);
+			simulation->wrapper2d.reset(new TreeWrapper2D(std::make_shared<Tree2D>(box)));
+			simulation->wrapper2d->getTree().setTheta(theta);
+		}
+		else {
+			Box3D box(glm::dvec3(0.0), half_length, half_length, half_length);
+			simulation->wrapper3d.reset(new TreeWrapper3D(std::make_shared<Tree3D>(box)));
+			simulation->wrapper3d->getTree().setTheta(theta);
+		}
+		return simulation.release();
+	}
+	catch (...) {
+		return nullptr;
+	}
+}
+
+void nbody_destroy(nbody_simulation* simulation) {
+	delete simulation;
+}
+
+int nbody_load(nbody_simulation* simulation, const char* path) {
+	return withWrapper(simulation, [&](auto& wrapper) {
+		wrapper.nodeList.clear();
+		wrapper.loadBodies(path ? path : "");
+		if (wrapper.nodeList.empty()) {
+			simulation->error = std::string("no bodies loaded from ") + (path ? path : "(null)");
+			return NBODY_ERROR;
+		}
+
+		simulation->changed = false;
+		simulation->idsValid = false;
+		return NBODY_OK;
+	});
+}
+
+int nbody_add_body(nbody_simulation* simulation, int id, const char* name,
+	const double* position, const double* velocity, double mass, double radius) {
+	return withWrapper(simulation, [&](auto& wrapper) {
+		using VecType = std::decay_t<decltype(wrapper.nodeList[0].position)>;
+		if (!position || !velocity || id < 0) {
+			simulation->error = "invalid body";
+			return NBODY_ERROR;
+		}
+
+		// Bodies are told apart by id: the FMM, the walk's self-exclusion and collisions
+		if (!simulation->idsValid) {
+			simulation->ids.clear();
+			for (const auto& body : wrapper.nodeList)
+				simulation->ids.insert(body.getId());
+			simulation->idsValid = true;
+		}
+		if (simulation->ids.count(id)) {
+			simulation->error = "body id " + std::to_string(id) + " already exists";
+			return NBODY_ERROR;
+		}
+
+		VecType pos, vel;
+		for (int d = 0; d < VecType::length(); ++d) {
+			pos[d] = position[d];
+			vel[d] = velocity[d];
+		}
+
+		// The tree is grown and rebuilt once before the next step
+		wrapper.nodeList.push_back(Node<VecType>(id, name ? name : "", pos, vel, mass, radius));
+		simulation->ids.insert(id);
+		simulation->changed = true;
+		return NBODY_OK;
+	});
+}
+
+int nbody_set_theta(nbody_simulation* simulation, double theta) {
+	return withWrapper(simulation, [&](auto& wrapper) {
+		wrapper.getTree().setTheta(theta);
+		return NBODY_OK;
+	});
+}
+
+int nbody_set_engine(nbody_simulation* simulation, int engine) {
+	return withWrapper(simulation, [&](auto& wrapper) {
+		if (engine < NBODY_ENGINE_BARNES_HUT || engine > NBODY_ENGINE_DIRECT) {
+			simulation->error = "unknown engine";
+			return NBODY_ERROR;
+		}
+		wrapper.setEngine(static_cast<ForceEngine>(engine));
+		return NBODY_OK;
+	});
+}
+
+int nbody_set_collisions(nbody_simulation* simulation, int mode) {
+	return withWrapper(simulation, [&](auto& wrapper) {
+		if (mode < NBODY_COLLISION_NONE || mode > NBODY_COLLISION_BOUNCE) {
+			simulation->error = "unknown collision mode";
+			return NBODY_ERROR;
+		}
+		wrapper.setCollisionMode(static_cast<CollisionMode>(mode));
+		return NBODY_OK;
+	});
+}
+
+int nbody_set_threads(nbody_simulation* simulation, unsigned int threads) {
+	return withWrapper(simulation, [&](auto& wrapper) {
+		wrapper.setThreads(threads);
+		wrapper.getFmm().setThreads(threads);
+		wrapper.getMesh().setThreads(threads);
+		return NBODY_OK;
+	});
+}
+
+int nbody_step(nbody_simulation* simulation, double dt, int steps) {
+	return withWrapper(simulation, [&](auto& wrapper) {
+		if (simulation->changed) {
+			wrapper.setGhosts({});
+			simulation->changed = false;
+		}
+
+		// Merging collisions remove bodies
+		simulation->idsValid = false;
+
+		for (int step = 0; step < steps; ++step) {
+			wrapper.update(dt);
+			simulation->time += dt;
+		}
+		return NBODY_OK;
+	});
+}
+
+int nbody_dimensions(const nbody_simulation* simulation) {
+	return simulation ? simulation->dimensions : 0;
+}
+
+size_t nbody_count(const nbody_simulation* simulation) {
+	if (!simulation)
+		return 0;
+	return simulation->dimensions == 2 ? simulation->wrapper2d->nodeList.size() : simulation->wrapper3d->nodeList.size();
+}
+
+double nbody_time(const nbody_simulation* simulation) {
+	return simulation ? simulation->time : 0.0;
+}
+
+nbody_array nbody_positions(nbody_simulation* simulation) {
+	if (!simulation)
+		return nbody_array{ nullptr, 0, 0, 0 };
+
+	// The caller may move bodies through the array, so the tree is rebuilt before the next step
+	simulation->changed = true;
+	if (simulation->dimensions == 2)
+		return view(simulation->wrapper2d->nodeList, &Node<glm::dvec2>::position, 2);
+	return view(simulation->wrapper3d->nodeList, &Node<glm::dvec3>::position, 3);
+}
+
+nbody_array nbody_velocities(nbody_simulation* simulation) {
+	if (!simulation)
+		return nbody_array{ nullptr, 0, 0, 0 };
+	if (simulation->dimensions == 2)
+		return view(simulation->wrapper2d->nodeList, &Node<glm::dvec2>::velocity, 2);
+	return view(simulation->wrapper3d->nodeList, &Node<glm::dvec3>::velocity, 3);
+}
+
+nbody_array nbody_forces(nbody_simulation* simulation) {
+	if (!simulation)
+		return nbody_array{ nullptr, 0, 0, 0 };
+	if (simulation->dimensions == 2)
+		return view(simulation->wrapper2d->nodeList, &Node<glm::dvec2>::force, 2);
+	return view(simulation->wrapper3d->nodeList, &Node<glm::dvec3>::force, 3);
+}
+
+nbody_array nbody_masses(nbody_simulation* simulation) {
+	if (!simulation)
+		return nbody_array{ nullptr, 0, 0, 0 };
+
+	// As for positions: the tree's cells hold the masses too
+	simulation->changed = true;
+	if (simulation->dimensions == 2)
+		return view(simulation->wrapper2d->nodeList, &Node<glm::dvec2>::mass, 1);
+	return view(simulation->wrapper3d->nodeList, &Node<glm::dvec3>::mass, 1);
+}
+
+int nbody_id(const nbody_simulation* simulation, size_t index) {
+	if (!simulation || index >= nbody_count(simulation))
+		return -1;
+	return simulation->dimensions == 2 ? simulation->wrapper2d->nodeList[index].getId() : simulation->wrapper3d->nodeList[index].getId();
+}
+
+const char* nbody_last_error(const nbody_simulation* simulation) {
+	return simulation ? simulation->error.c_str() : "no simulation";
+}
+
+}
@@ -0,0 +1,112 @@
+#ifndef NBODY_API_H
+#define NBODY_API_H
+#pragma once
+#include <stddef.h>
+
+/*
+	C interface of the simulation core, built as the NBodyLib library.
+
+	A simulation is an opaque handle owning one TreeWrapper (2D or 3D).
+	nbody_positions() / nbody_velocities() / nbody_masses() / nbody_forces()
+	point straight into its bodies: element i of an array starts at
+	data + i * stride bytes and holds `components` doubles. Nothing is copied,
+	and writes through them change the simulation. Once positions or masses
+	have been fetched the tree is rebuilt before the next nbody_step(), so
+	bodies moved or reweighted through them are walked where they now are.
+	Bodies are double buffered, so a step leaves them in the other buffer:
+	fetch the arrays again after every nbody_step(). Arrays taken before a
+	step keep showing the state they were taken in until the following step
+	overwrites it.
+
+	Functions returning int give NBODY_OK or NBODY_ERROR; nbody_last_error()
+	describes the last failure. No C++ exception crosses the interface.
+
+	Define NBODY_STATIC when linking the static library.
+*/
+
+#if defined(NBODY_STATIC)
+#define NBODY_API
+#elif defined(_WIN32)
+#ifdef NBODY_EXPORTS
+#define NBODY_API __declspec(dllexport)
+#else
+#define NBODY_API __declspec(dllimport)
+#endif
+#else
+#define NBODY_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped whenever a function or a layout below changes incompatibly
+#define NBODY_API_VERSION 1
+
+#define NBODY_OK 0
+#define NBODY_ERROR -1
+
+// Values of nbody_set_engine, as in ForceEngine
+#define NBODY_ENGINE_BARNES_HUT 0
+#define NBODY_ENGINE_FMM 1
+#define NBODY_ENGINE_TREEPM 2
+#define NBODY_ENGINE_DIRECT 3
+
+// Values of nbody_set_collisions, as in CollisionMode
+#define NBODY_COLLISION_NONE 0
+#define NBODY_COLLISION_MERGE 1
+#define NBODY_COLLISION_BOUNCE 2
+
+typedef struct nbody_simulation nbody_simulation;
+
+// Strided view of one quantity of every body
+typedef struct nbody_array {
+	double* data;
+	size_t count;			// bodies
+	size_t stride;			// bytes from one body to the next
+	int components;			// doubles per body: the dimensions, or 1 for masses
+} nbody_array;
+
+NBODY_API int nbody_api_version(void);
+
+// New empty simulation of `dimensions` (2 or 3) in a root cell of the given
+// half length around the origin. Returns NULL on invalid arguments.
+NBODY_API nbody_simulation* nbody_create(int dimensions, double half_length, double theta);
+NBODY_API void nbody_destroy(nbody_simulation* simulation);
+
+// Replaces the bodies with those of a bodies JSON file
+NBODY_API int nbody_load(nbody_simulation* simulation, const char* path);
+
+// Adds one body; position and velocity hold `dimensions` doubles. The id must
+// not be negative or taken by another body.
+NBODY_API int nbody_add_body(nbody_simulation* simulation, int id, const char* name,
+	const double* position, const double* velocity, double mass, double radius);
+
+NBODY_API int nbody_set_theta(nbody_simulation* simulation, double theta);
+NBODY_API int nbody_set_engine(nbody_simulation* simulation, int engine);
+NBODY_API int nbody_set_collisions(nbody_simulation* simulation, int mode);
+NBODY_API int nbody_set_threads(nbody_simulation* simulation, unsigned int threads);
+
+// Advances the simulation `steps` times by dt
+NBODY_API int nbody_step(nbody_simulation* simulation, double dt, int steps);
+
+NBODY_API int nbody_dimensions(const nbody_simulation* simulation);
+NBODY_API size_t nbody_count(const nbody_simulation* simulation);
+NBODY_API double nbody_time(const nbody_simulation* simulation);
+
+NBODY_API nbody_array nbody_positions(nbody_simulation* simulation);
+NBODY_API nbody_array nbody_velocities(nbody_simulation* simulation);
+NBODY_API nbody_array nbody_forces(nbody_simulation* simulation);
+NBODY_API nbody_array nbody_masses(nbody_simulation* simulation);
+
+// Id of body i, or -1 when out of range
+NBODY_API int nbody_id(const nbody_simulation* simulation, size_t index);
+
+// Message of the last failed call on `simulation` ("" if none)
+NBODY_API const char* nbody_last_error(const nbody_simulation* simulation);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
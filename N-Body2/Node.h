@@ -67,6 +67,7 @@ public:
 	VecType position;
 	VecType velocity;
 	VecType force;
+	double potential;	// potential energy, accumulated by the force walk when measured
 	double mass;
 	double radius;
 
@@ -84,7 +85,7 @@ public:
 	void setId(int id);
 
 	// Various methods
-	void OutputPositionToStream(std::ofstream& file);
+	void OutputPositionToStream(std::ofstream& file) const;
 };
 
 // Helper to determine vector dimensions
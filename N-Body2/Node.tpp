@@ -12,6 +12,7 @@ Node<VecType>::Node() :
 	position(),
 	velocity(),
 	force(),
+	potential(0.0),
 	mass(0.0),
 	radius(0.0)
 {}
@@ -19,10 +20,11 @@ Node<VecType>::Node() :
 template <typename VecType>
 Node<VecType>::Node(int id, std::string name, VecType position, VecType velocity, double const mass, double const radius) :
 	m_id(id),
+	name(name),
 	position(position),
 	velocity(velocity),
 	force(VecType(0)),
-	name(name),
+	potential(0.0),
 	mass(mass),
 	radius(radius)
 {}
@@ -38,7 +40,7 @@ void Node<VecType>::setId(int id) {
 }
 
 template <typename VecType>
-void Node<VecType>::OutputPositionToStream(std::ofstream& file) {
+void Node<VecType>::OutputPositionToStream(std::ofstream& file) const {
 	int vec_length = VecType::length();
 	for (int i = 0; i < vec_length; ++i) {
 		file << "," << position[i]; // Ensure no leading comma
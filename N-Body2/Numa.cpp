@@ -0,0 +1,146 @@
+#include "Numa.h"
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#if defined(__linux__)
+#define NUMA_LINUX
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <Windows.h>
+#endif
+
+namespace {
+	// Logical CPUs of every node, read once
+	std::vector<std::vector<int>> readTopology()
+	{
+		std::vector<std::vector<int>> nodes;
+
+#ifdef NUMA_LINUX
+		// cpulist holds ranges such as "0-7,16-23"
+		for (int node = 0;; ++node) {
+			std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			if (!file)
+				break;
+
+			std::string list;
+			std::getline(file, list);
+
+			std::vector<int> cpus;
+			std::stringstream ranges(list);
+			std::string range;
+
+			while (std::getline(ranges, range, ',')) {
+				if (range.empty())
+					continue;
+
+				std::size_t dash = range.find('-');
+				int first = std::stoi(range.substr(0, dash));
+				int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+				for (int cpu = first; cpu <= last; ++cpu)
+					cpus.push_back(cpu);
+			}
+
+			// Memory-only nodes have no CPUs to run workers on
+			if (!cpus.empty())
+				nodes.push_back(cpus);
+		}
+#endif
+
+		if (nodes.empty()) {
+			std::vector<int> cpus;
+			unsigned int count = std::thread::hardware_concurrency();
+			for (unsigned int cpu = 0; cpu < (count ? count : 1); ++cpu)
+				cpus.push_back(static_cast<int>(cpu));
+			nodes.push_back(cpus);
+		}
+		return nodes;
+	}
+
+	const std::vector<std::vector<int>>& topology()
+	{
+		static const std::vector<std::vector<int>> nodes = readTopology();
+		return nodes;
+	}
+}
+
+int Numa::nodeCount() {
+	return static_cast<int>(topology().size());
+}
+
+const std::vector<int>& Numa::cpusOfNode(int node) {
+	return topology()[node % nodeCount()];
+}
+
+int Numa::currentNode() {
+#ifdef NUMA_LINUX
+	int cpu = sched_getcpu();
+
+	for (int node = 0; node < nodeCount(); ++node) {
+		for (int candidate : cpusOfNode(node)) {
+			if (candidate == cpu)
+				return node;
+		}
+	}
+#endif
+	return 0;
+}
+
+bool Numa::pinThreadToNode(int node) {
+	const std::vector<int>& cpus = cpusOfNode(node);
+
+#ifdef NUMA_LINUX
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+		CPU_SET(cpu, &set);
+
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for (int cpu : cpus) {
+		if (cpu < static_cast<int>(sizeof(DWORD_PTR) * 8))
+			mask |= DWORD_PTR(1) << cpu;
+	}
+
+	return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	return false;
+#endif
+}
+
+bool Numa::placeMemory(const void* data, std::size_t bytes, int node) {
+	if (nodeCount() <= 1 || bytes == 0)
+		return true;
+
+#if defined(NUMA_LINUX) && defined(SYS_move_pages)
+	const std::uintptr_t page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+	std::uintptr_t first = reinterpret_cast<std::uintptr_t>(data) & ~(page - 1);
+	std::uintptr_t last = reinterpret_cast<std::uintptr_t>(data) + bytes;
+
+	std::vector<void*> pages;
+	for (std::uintptr_t address = first; address < last; address += page)
+		pages.push_back(reinterpret_cast<void*>(address));
+
+	std::vector<int> nodes(pages.size(), node);
+	std::vector<int> status(pages.size(), 0);
+
+	// MPOL_MF_MOVE: only pages mapped by this process alone
+	const int move_flag = 1 << 1;
+	long moved = syscall(SYS_move_pages, 0, pages.size(), pages.data(), nodes.data(), status.data(), move_flag);
+
+	return moved >= 0;
+#else
+	return false;
+#endif
+}
+
+int Numa::nodeOfWorker(unsigned int worker, unsigned int workers) {
+	if (workers == 0)
+		return 0;
+	return static_cast<int>(static_cast<unsigned long long>(worker) * nodeCount() / workers);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+/*
+	NUMA topology and placement helpers.
+
+	On Linux the topology is read from /sys/devices/system/node, threads are
+	pinned with sched_setaffinity and pages are moved with the move_pages system
+	call, so no libnuma is needed. Elsewhere the machine is treated as a single
+	node and only thread pinning is available.
+*/
+class Numa
+{
+public:
+	// Number of memory nodes (1 when no NUMA information is available)
+	static int nodeCount();
+
+	// Logical CPUs belonging to `node`
+	static const std::vector<int>& cpusOfNode(int node);
+
+	// Node of the CPU the calling thread is running on
+	static int currentNode();
+
+	// Restricts the calling thread to the CPUs of `node`. Returns false on failure.
+	static bool pinThreadToNode(int node);
+
+	// Moves the pages overlapping [data, data + bytes) to `node`. Returns false
+	// when pages cannot be moved; the memory stays usable either way.
+	static bool placeMemory(const void* data, std::size_t bytes, int node);
+
+	// Node worker `worker` of `workers` is pinned to: consecutive workers share
+	// a node, so neighbouring chunks of work stay on the same socket
+	static int nodeOfWorker(unsigned int worker, unsigned int workers);
+
+	// Utils::parallelFor with every worker pinned to nodeOfWorker(). func is
+	// called as func(begin, end, node). A thread count of 0 uses every hardware thread.
+	template <typename Func>
+	static void parallelFor(std::size_t count, unsigned int threads, Func&& func) {
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads > count)
+			threads = static_cast<unsigned int>(count);
+		if (threads == 0)
+			return;
+
+		std::size_t chunk = (count + threads - 1) / threads;
+		std::vector<std::thread> workers;
+		workers.reserve(threads);
+
+		unsigned int worker = 0;
+		for (std::size_t begin = 0; begin < count; begin += chunk, ++worker) {
+			std::size_t end = begin + chunk < count ? begin + chunk : count;
+			int node = nodeOfWorker(worker, threads);
+
+			workers.emplace_back([&func, begin, end, node]() {
+				pinThreadToNode(node);
+				func(begin, end, node);
+			});
+		}
+
+		for (auto& thread : workers) {
+			thread.join();
+		}
+	}
+};
@@ -0,0 +1,216 @@
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+#pragma once
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "InitialConditions.h"
+#include "MappedFile.h"
+#include "Node.h"
+#include "TreeWrapper.h"
+
+/*
+	Out-of-core simulation (--out-of-core): the bodies live in a memory-mapped
+	file instead of nodeList, so N is bounded by the disk rather than by RAM.
+
+	The file holds one Record per body, sorted by the Morton key of its
+	position in a cube around the origin. Only a tree of cells over that order
+	stays resident: every cell knows its mass, center of mass and the range of
+	records it holds. Cells are split down to about leafBodies bodies, so the
+	tree adapts to clustered systems as the in-memory tree does, at a few
+	bytes per body. It is cut into chunks, the largest cells holding at most
+	m_chunkBodies bodies.
+
+	A step goes through the chunks in file order. For each one the resident
+	tree is walked against the chunk's box: cells passing the opening test
+	become monopole pseudo-bodies, the leaves that fail it are near cells
+	whose bodies are paged in. The chunk's bodies, the near bodies and the
+	monopoles are handed to a TreeWrapper of their own, its Barnes-Hut walk
+	gives the forces on the chunk and the chunk is integrated exactly as
+	TreeWrapper::update does, into a second file. While a chunk is computed a
+	thread pages in the next one.
+
+	At the end of the step the bodies are sorted back into the first file: a
+	counting sort into the buckets of a fixed level, whose sizes were counted
+	while integrating, then every bucket sorted in memory, which also builds
+	its part of the tree. A bucket has to fit into memory, which holds for
+	any distribution short of most of the bodies in one 1 / 2^21 of the box.
+
+	A step reads every body three times and writes it three times, plus the
+	near bodies around every chunk; both the volume asked for and what reached
+	the storage device are counted.
+
+	The two files are working space and are removed with the object. The
+	state of a run is kept by writeSnapshot(), which --out-of-core calls after
+	the last step (--out-of-core-out).
+*/
+template <typename VecType>
+class OutOfCore
+{
+public:
+	// One body in the files; plain data so it can be used in place in the mapping
+	struct Record {
+		VecType position;
+		VecType velocity;
+		VecType force;	// of the last step, 0 before the first
+		double mass;
+		double radius;
+		std::int32_t id;
+	};
+
+	// I/O and time of one step, or summed over every step
+	struct IoStatistics {
+		std::uint64_t logicalRead = 0;		// bytes of records the step read
+		std::uint64_t logicalWritten = 0;
+		std::uint64_t deviceRead = 0;		// bytes that reached the storage device (Linux)
+		std::uint64_t deviceWritten = 0;
+		double forceSeconds = 0.0;		// walking and integrating the chunks
+		double sortSeconds = 0.0;		// sorting the bodies back and rebuilding the tree
+		double waitSeconds = 0.0;		// chunks waiting for their prefetch to finish
+	};
+
+private:
+	static constexpr int dimensions = static_cast<int>(VecDimensions<VecType>::value);
+	static constexpr std::size_t children = std::size_t(1) << dimensions;
+	static constexpr int keyLevels = dimensions == 3 ? 21 : 31;			// levels a Morton key resolves
+	static constexpr int maxBucketLevel = dimensions == 3 ? 7 : 10;		// 2^21 / 2^20 buckets at most
+	static constexpr std::size_t bucketBodies = 256;	// the bucket level is sized for about this many
+	static constexpr std::size_t leafBodies = 64;
+
+	// A cell of the resident tree; its children are contiguous in m_cells
+	struct Cell {
+		VecType center;			// center of mass
+		double mass;
+		std::size_t begin;		// records [begin, end) of the file
+		std::size_t end;
+		std::size_t firstChild;	// 0 = leaf, the root is never a child
+		std::uint64_t prefix;	// Morton key on its level
+		std::uint32_t childCount;
+		std::int32_t level;
+	};
+
+	// What a chunk needs besides its own bodies
+	struct Plan {
+		std::vector<std::pair<std::size_t, std::size_t>> near;	// record ranges
+		std::vector<Node<VecType>> far;							// monopoles of accepted cells
+		std::size_t nearBodies = 0;
+	};
+
+	std::string m_path;
+	MappedFile m_state;		// sorted bodies at the start of a step
+	MappedFile m_back;		// bodies integrated by the step, in the order of m_state
+	std::size_t m_count;
+	std::size_t m_chunkBodies;
+	unsigned int m_threads;
+
+	// A cube of half length m_halfLength around the origin
+	double m_halfLength;
+	int m_bucketLevel;
+	std::vector<std::size_t> m_bucketCount;	// bodies of m_back per bucket
+	std::vector<std::size_t> m_bucketStart;	// first record of every bucket in m_state, m_count at the end
+	std::vector<Cell> m_cells;				// m_cells[0] is the root
+	std::vector<std::size_t> m_chunks;		// cells integrated together, in file order
+
+	// Computes the forces on one chunk at a time
+	TreeWrapper<VecType> m_local;
+	std::size_t m_peakScratch;	// most bodies, near bodies and monopoles held at once
+
+	int m_steps;
+	bool m_deviceCounters;
+	IoStatistics m_lastStep;
+	IoStatistics m_total;
+
+public:
+	// The bodies are kept in `path` and `path`.back
+	OutOfCore(const std::string& path, std::size_t chunkBodies = 65536);
+	~OutOfCore();
+
+	OutOfCore(const OutOfCore&) = delete;
+	OutOfCore& operator=(const OutOfCore&) = delete;
+
+	// Getters
+	std::size_t getCount();
+	std::size_t getChunkCount();
+	std::size_t getCellCount();
+	IoStatistics& getLastStep();
+	IoStatistics& getTotal();
+
+	// Theta, softening and the engine settings of the force walk
+	TreeWrapper<VecType>& getWrapper();
+
+	// Setters
+	void setThreads(unsigned int threads);
+	void setChunkBodies(std::size_t bodies);
+
+	// Writes settings.count generated bodies straight into the file, a block at a
+	// time, so they never have to fit into memory at once
+	bool generate(const GeneratorSettings& settings);
+
+	// Writes `bodies` into the file
+	bool import(const std::vector<Node<VecType>>& bodies);
+
+	// Copies every body back into memory, in id order
+	void readBodies(std::vector<Node<VecType>>& bodies);
+
+	// Streams every body into a snapshot (.nbs) in file order, without holding
+	// them in memory
+	bool writeSnapshot(const std::string& path);
+
+	void step(double dt);
+
+	// Bytes held in memory by the tree, the chunk table and the walk
+	std::size_t residentBytes();
+
+	void report(std::ostream& out);
+
+private:
+	bool createFiles(std::size_t count);
+
+	Record* records(MappedFile& file);
+
+	// Morton key of `position` to keyLevels levels
+	std::uint64_t mortonKey(const VecType& position) const;
+	static std::uint64_t spreadBits(std::uint64_t coordinate);
+	std::size_t bucketOf(const VecType& position) const;
+
+	// Lower corner and side of cell `cell`
+	void cellBox(const Cell& cell, VecType& corner, double& side) const;
+
+	// Sets the cube and the bucket level and counts the bodies of m_back per bucket
+	void countBuckets(double halfLength, IoStatistics& stats);
+
+	// Largest distance of a body in m_back from the origin
+	double backExtent();
+
+	// Sorts m_back into m_state and rebuilds the tree and the chunks
+	void sortBodies(IoStatistics& stats);
+
+	// Sorts the records of one bucket in place and builds its subtree in `cells`,
+	// the bucket's own cell first and child indices relative to `cells`
+	void sortBucket(std::size_t bucket, std::size_t begin, std::size_t end, std::vector<Record>& buffer, std::vector<Cell>& cells);
+	void splitCell(std::vector<Cell>& cells, std::size_t index, const std::vector<std::uint64_t>& keys, const Record* bodies);
+
+	// Links the buckets' subtrees under the levels above them
+	void assembleCell(std::size_t index, std::vector<std::vector<Cell>>& buckets);
+
+	void splitChunks(std::size_t cell);
+
+	void planChunk(std::size_t chunk, Plan& plan);
+	void planCell(const Cell& chunk, const VecType& corner, double side, double theta, std::size_t cell, Plan& plan) const;
+
+	// Touches the pages of the chunk and its near bodies
+	void prefetchChunk(std::size_t chunk, const Plan& plan) const;
+
+	// Forces on and integration of one chunk into m_back, counting the new
+	// buckets; returns the largest distance from the origin
+	double stepChunk(std::size_t chunk, const Plan& plan, double dt, IoStatistics& stats);
+};
+
+using OutOfCore2D = OutOfCore<glm::dvec2>;
+using OutOfCore3D = OutOfCore<glm::dvec3>;
+
+#include "OutOfCore.tpp"
+#endif
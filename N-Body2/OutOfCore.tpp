@@ -0,0 +1,755 @@
+#ifndef OUTOFCORE_TPP
+#define OUTOFCORE_TPP
+#include "OutOfCore.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+template <typename VecType>
+OutOfCore<VecType>::OutOfCore(const std::string& path, std::size_t chunkBodies) :
+	m_path(path),
+	m_state(),
+	m_back(),
+	m_count(0),
+	m_chunkBodies(std::max<std::size_t>(chunkBodies, 1)),
+	m_threads(0),
+	m_halfLength(1.0),
+	m_bucketLevel(0),
+	m_bucketCount(),
+	m_bucketStart(),
+	m_cells(),
+	m_chunks(),
+	m_local(std::make_shared<Tree<VecType>>(Box<VecType>(VecType(0.0), 1.0, 1.0, 1.0))),
+	m_peakScratch(0),
+	m_steps(0),
+	m_deviceCounters(false),
+	m_lastStep(),
+	m_total()
+{
+	static_assert(std::is_trivially_copyable_v<Record>, "records are copied straight into the mapped files");
+}
+
+template <typename VecType>
+OutOfCore<VecType>::~OutOfCore()
+{
+	m_state.close(true);
+	m_back.close(true);
+}
+
+template <typename VecType>
+std::size_t OutOfCore<VecType>::getCount()
+{
+	return m_count;
+}
+
+template <typename VecType>
+std::size_t OutOfCore<VecType>::getChunkCount()
+{
+	return m_chunks.size();
+}
+
+template <typename VecType>
+std::size_t OutOfCore<VecType>::getCellCount()
+{
+	return m_cells.size();
+}
+
+template <typename VecType>
+typename OutOfCore<VecType>::IoStatistics& OutOfCore<VecType>::getLastStep()
+{
+	return m_lastStep;
+}
+
+template <typename VecType>
+typename OutOfCore<VecType>::IoStatistics& OutOfCore<VecType>::getTotal()
+{
+	return m_total;
+}
+
+template <typename VecType>
+TreeWrapper<VecType>& OutOfCore<VecType>::getWrapper()
+{
+	return m_local;
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::setThreads(unsigned int threads)
+{
+	m_threads = threads;
+	m_local.setThreads(threads);
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::setChunkBodies(std::size_t bodies)
+{
+	m_chunkBodies = std::max<std::size_t>(bodies, 1);
+	m_chunks.clear();
+	if (!m_cells.empty())
+		splitChunks(0);
+}
+
+template <typename VecType>
+bool OutOfCore<VecType>::createFiles(std::size_t count)
+{
+	m_count = count;
+	m_cells.clear();
+	m_chunks.clear();
+	m_steps = 0;
+	m_lastStep = IoStatistics();
+	m_total = IoStatistics();
+
+	return m_state.create(m_path, count * sizeof(Record)) && m_back.create(m_path + ".back", count * sizeof(Record));
+}
+
+template <typename VecType>
+typename OutOfCore<VecType>::Record* OutOfCore<VecType>::records(MappedFile& file)
+{
+	return reinterpret_cast<Record*>(file.data());
+}
+
+template <typename VecType>
+bool OutOfCore<VecType>::generate(const GeneratorSettings& settings)
+{
+	if (!createFiles(settings.count))
+		return false;
+
+	using Generator = InitialConditions<VecType>;
+	const std::size_t block_size = Generator::blockSize;
+	const std::size_t blocks = (m_count + block_size - 1) / block_size;
+	Record* back = records(m_back);
+
+	// Partial sums per block for the drift, added up in block order as InitialConditions does
+	std::vector<VecType> block_position(blocks, VecType(0)), block_momentum(blocks, VecType(0));
+	std::vector<double> block_mass(blocks, 0.0);
+
+	Utils::parallelFor(blocks, m_threads, [&](std::size_t first, std::size_t last) {
+		std::vector<Node<VecType>> bodies(block_size);
+
+		for (std::size_t block = first; block < last; ++block) {
+			Generator::generateBlock(settings, block, bodies.data());
+
+			std::size_t begin = block * block_size;
+			std::size_t end = std::min(m_count, begin + block_size);
+			for (std::size_t i = begin; i < end; ++i) {
+				const Node<VecType>& body = bodies[i - begin];
+				back[i] = Record{ body.position, body.velocity, VecType(0), body.mass, body.radius, body.getId() };
+
+				block_position[block] += body.mass * body.position;
+				block_momentum[block] += body.mass * body.velocity;
+				block_mass[block] += body.mass;
+			}
+		}
+	});
+
+	VecType position(0), momentum(0);
+	double mass = 0.0;
+	for (std::size_t block = 0; block < blocks; ++block) {
+		position += block_position[block];
+		momentum += block_momentum[block];
+		mass += block_mass[block];
+	}
+
+	// Every system except the disk starts at rest at the origin
+	if (settings.distribution != DISTRIBUTION_DISK && mass > 0.0) {
+		position /= mass;
+		momentum /= mass;
+		Utils::parallelFor(m_count, m_threads, [&](std::size_t begin, std::size_t end) {
+			for (std::size_t i = begin; i < end; ++i) {
+				back[i].position -= position;
+				back[i].velocity -= momentum;
+			}
+		});
+	}
+
+	IoStatistics stats;
+	countBuckets(backExtent(), stats);
+	sortBodies(stats);
+	return true;
+}
+
+template <typename VecType>
+bool OutOfCore<VecType>::import(const std::vector<Node<VecType>>& bodies)
+{
+	if (!createFiles(bodies.size()))
+		return false;
+
+	Record* back = records(m_back);
+	Utils::parallelFor(m_count, m_threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i) {
+			const Node<VecType>& body = bodies[i];
+			back[i] = Record{ body.position, body.velocity, body.force, body.mass, body.radius, body.getId() };
+		}
+	});
+
+	IoStatistics stats;
+	countBuckets(backExtent(), stats);
+	sortBodies(stats);
+	return true;
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::readBodies(std::vector<Node<VecType>>& bodies)
+{
+	const Record* state = records(m_state);
+	bodies.clear();
+	bodies.reserve(m_count);
+
+	for (std::size_t i = 0; i < m_count; ++i) {
+		const Record& record = state[i];
+		bodies.emplace_back(record.id, "Body_" + std::to_string(record.id), record.position, record.velocity, record.mass, record.radius);
+		bodies.back().force = record.force;
+	}
+
+	std::sort(bodies.begin(), bodies.end(), [](const Node<VecType>& a, const Node<VecType>& b) {
+		return a.getId() < b.getId();
+	});
+}
+
+template <typename VecType>
+bool OutOfCore<VecType>::writeSnapshot(const std::string& path)
+{
+	const Record* state = records(m_state);
+	const std::size_t release_records = std::max<std::size_t>(MappedFile::pageSize() * 256 / sizeof(Record), 1);
+
+	return InitialConditions<VecType>::writeSnapshot(path, m_count, [&](std::size_t i, std::int32_t& id, double& mass, double& radius, VecType& position, VecType& velocity) {
+		const Record& record = state[i];
+		id = record.id;
+		mass = record.mass;
+		radius = record.radius;
+		position = record.position;
+		velocity = record.velocity;
+
+		if ((i + 1) % release_records == 0)
+			m_state.release((i + 1 - release_records) * sizeof(Record), release_records * sizeof(Record));
+	});
+}
+
+template <typename VecType>
+std::uint64_t OutOfCore<VecType>::spreadBits(std::uint64_t coordinate)
+{
+	// Moves bit i of the coordinate to bit dimensions * i
+	if constexpr (dimensions == 3) {
+		coordinate &= 0x1fffff;
+		coordinate = (coordinate | coordinate << 32) & 0x1f00000000ffffull;
+		coordinate = (coordinate | coordinate << 16) & 0x1f0000ff0000ffull;
+		coordinate = (coordinate | coordinate << 8) & 0x100f00f00f00f00full;
+		coordinate = (coordinate | coordinate << 4) & 0x10c30c30c30c30c3ull;
+		coordinate = (coordinate | coordinate << 2) & 0x1249249249249249ull;
+	}
+	else {
+		coordinate &= 0x7fffffff;
+		coordinate = (coordinate | coordinate << 16) & 0x0000ffff0000ffffull;
+		coordinate = (coordinate | coordinate << 8) & 0x00ff00ff00ff00ffull;
+		coordinate = (coordinate | coordinate << 4) & 0x0f0f0f0f0f0f0f0full;
+		coordinate = (coordinate | coordinate << 2) & 0x3333333333333333ull;
+		coordinate = (coordinate | coordinate << 1) & 0x5555555555555555ull;
+	}
+	return coordinate;
+}
+
+template <typename VecType>
+std::uint64_t OutOfCore<VecType>::mortonKey(const VecType& position) const
+{
+	const std::uint64_t side = std::uint64_t(1) << keyLevels;
+	std::uint64_t key = 0;
+
+	for (int d = 0; d < dimensions; ++d) {
+		double scaled = (position[d] + m_halfLength) / (2.0 * m_halfLength) * static_cast<double>(side);
+		std::uint64_t coordinate = scaled <= 0.0 ? 0 : std::min(static_cast<std::uint64_t>(scaled), side - 1);
+		key |= spreadBits(coordinate) << d;
+	}
+	return key;
+}
+
+template <typename VecType>
+std::size_t OutOfCore<VecType>::bucketOf(const VecType& position) const
+{
+	return static_cast<std::size_t>(mortonKey(position) >> ((keyLevels - m_bucketLevel) * dimensions));
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::cellBox(const Cell& cell, VecType& corner, double& side) const
+{
+	side = 2.0 * m_halfLength / static_cast<double>(std::uint64_t(1) << cell.level);
+
+	for (int d = 0; d < dimensions; ++d) {
+		std::uint64_t coordinate = 0;
+		for (int bit = 0; bit < cell.level; ++bit)
+			coordinate |= ((cell.prefix >> (bit * dimensions + d)) & 1) << bit;
+		corner[d] = -m_halfLength + side * static_cast<double>(coordinate);
+	}
+}
+
+template <typename VecType>
+double OutOfCore<VecType>::backExtent()
+{
+	const Record* back = records(m_back);
+	double extent = 0.0;
+	std::mutex extent_mutex;
+
+	Utils::parallelFor(m_count, m_threads, [&](std::size_t begin, std::size_t end) {
+		double local = 0.0;
+		for (std::size_t i = begin; i < end; ++i)
+			local = std::max(local, glm::length(back[i].position));
+
+		std::lock_guard<std::mutex> lock(extent_mutex);
+		extent = std::max(extent, local);
+	});
+	return extent;
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::countBuckets(double halfLength, IoStatistics& stats)
+{
+	m_halfLength = halfLength > 0.0 ? halfLength : 1.0;
+
+	// Enough buckets for about bucketBodies bodies in each
+	m_bucketLevel = 0;
+	while (m_bucketLevel < maxBucketLevel && (std::size_t(1) << (m_bucketLevel * dimensions)) * bucketBodies < m_count)
+		++m_bucketLevel;
+
+	const Record* back = records(m_back);
+	m_bucketCount.assign(std::size_t(1) << (m_bucketLevel * dimensions), 0);
+	std::mutex count_mutex;
+
+	Utils::parallelFor(m_count, m_threads, [&](std::size_t begin, std::size_t end) {
+		std::vector<std::size_t> buckets(end - begin);
+		for (std::size_t i = begin; i < end; ++i)
+			buckets[i - begin] = bucketOf(back[i].position);
+
+		std::lock_guard<std::mutex> lock(count_mutex);
+		for (std::size_t bucket : buckets)
+			++m_bucketCount[bucket];
+	});
+
+	stats.logicalRead += m_count * sizeof(Record);
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::sortBodies(IoStatistics& stats)
+{
+	const std::size_t buckets = m_bucketCount.size();
+	const Record* back = records(m_back);
+	Record* state = records(m_state);
+
+	m_bucketStart.assign(buckets + 1, 0);
+	for (std::size_t bucket = 0; bucket < buckets; ++bucket)
+		m_bucketStart[bucket + 1] = m_bucketStart[bucket] + m_bucketCount[bucket];
+
+	// Counting sort into the buckets. Bodies move little in a step, so m_back is
+	// read in order and m_state written almost in order too.
+	std::vector<std::size_t> cursor(m_bucketStart.begin(), m_bucketStart.end() - 1);
+	const std::size_t release_records = std::max<std::size_t>(MappedFile::pageSize() * 256 / sizeof(Record), 1);
+
+	for (std::size_t i = 0; i < m_count; ++i) {
+		state[cursor[bucketOf(back[i].position)]++] = back[i];
+
+		if ((i + 1) % release_records == 0)
+			m_back.release((i + 1 - release_records) * sizeof(Record), release_records * sizeof(Record));
+	}
+
+	// Then every bucket on its own, building its subtree on the way
+	std::vector<std::vector<Cell>> subtrees(buckets);
+	Utils::parallelFor(buckets, m_threads, [&](std::size_t first, std::size_t last) {
+		std::vector<Record> buffer;
+		for (std::size_t bucket = first; bucket < last; ++bucket) {
+			if (m_bucketStart[bucket] < m_bucketStart[bucket + 1])
+				sortBucket(bucket, m_bucketStart[bucket], m_bucketStart[bucket + 1], buffer, subtrees[bucket]);
+		}
+	});
+
+	m_cells.clear();
+	m_cells.push_back(Cell{ VecType(0), 0.0, 0, m_count, 0, 0, 0, 0 });
+	assembleCell(0, subtrees);
+
+	m_chunks.clear();
+	splitChunks(0);
+
+	stats.logicalRead += 2 * m_count * sizeof(Record);
+	stats.logicalWritten += 2 * m_count * sizeof(Record);
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::sortBucket(std::size_t bucket, std::size_t begin, std::size_t end, std::vector<Record>& buffer, std::vector<Cell>& cells)
+{
+	Record* state = records(m_state);
+	const std::size_t count = end - begin;
+
+	// Ties keep their order, so the result never depends on the threads
+	std::vector<std::pair<std::uint64_t, std::size_t>> order(count);
+	for (std::size_t i = 0; i < count; ++i)
+		order[i] = { mortonKey(state[begin + i].position), i };
+	std::sort(order.begin(), order.end());
+
+	buffer.assign(state + begin, state + end);
+	std::vector<std::uint64_t> keys(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		state[begin + i] = buffer[order[i].second];
+		keys[i] = order[i].first;
+	}
+
+	cells.clear();
+	cells.push_back(Cell{ VecType(0), 0.0, begin, end, 0, bucket, 0, m_bucketLevel });
+	splitCell(cells, 0, keys, state + begin);
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::splitCell(std::vector<Cell>& cells, std::size_t index, const std::vector<std::uint64_t>& keys, const Record* bodies)
+{
+	// keys and bodies start at the bucket's first record, which is cells[0].begin
+	const std::size_t base = cells[0].begin;
+	const std::size_t begin = cells[index].begin;
+	const std::size_t end = cells[index].end;
+	const int level = cells[index].level;
+
+	if (end - begin <= leafBodies || level == keyLevels) {
+		double mass = 0.0;
+		VecType weighted(0);
+		for (std::size_t i = begin; i < end; ++i) {
+			mass += bodies[i - base].mass;
+			weighted += bodies[i - base].mass * bodies[i - base].position;
+		}
+		cells[index].mass = mass;
+		cells[index].center = mass > 0.0 ? weighted / mass : bodies[begin - base].position;
+		return;
+	}
+
+	// Children are the runs of equal keys on the next level
+	const int shift = (keyLevels - level - 1) * dimensions;
+	const std::size_t first = cells.size();
+	for (std::size_t i = begin; i < end;) {
+		std::uint64_t prefix = keys[i - base] >> shift;
+		std::size_t j = i;
+		while (j < end && (keys[j - base] >> shift) == prefix)
+			++j;
+
+		cells.push_back(Cell{ VecType(0), 0.0, i, j, 0, prefix, 0, level + 1 });
+		i = j;
+	}
+
+	const std::size_t count = cells.size() - first;
+	cells[index].firstChild = first;
+	cells[index].childCount = static_cast<std::uint32_t>(count);
+
+	double mass = 0.0;
+	VecType weighted(0);
+	for (std::size_t child = first; child < first + count; ++child) {
+		splitCell(cells, child, keys, bodies);
+		mass += cells[child].mass;
+		weighted += cells[child].mass * cells[child].center;
+	}
+	cells[index].mass = mass;
+	cells[index].center = mass > 0.0 ? weighted / mass : cells[first].center;
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::assembleCell(std::size_t index, std::vector<std::vector<Cell>>& buckets)
+{
+	const Cell cell = m_cells[index];
+
+	// A bucket's subtree moves in whole, its own cell taking the place of `index`
+	if (cell.level == m_bucketLevel) {
+		std::vector<Cell>& subtree = buckets[static_cast<std::size_t>(cell.prefix)];
+		if (subtree.empty())
+			return;
+
+		const std::size_t base = m_cells.size() - 1;
+		for (std::size_t j = 1; j < subtree.size(); ++j) {
+			m_cells.push_back(subtree[j]);
+			if (m_cells.back().firstChild != 0)
+				m_cells.back().firstChild += base;
+		}
+		m_cells[index] = subtree[0];
+		if (m_cells[index].firstChild != 0)
+			m_cells[index].firstChild += base;
+
+		std::vector<Cell>().swap(subtree);
+		return;
+	}
+
+	// The levels above the buckets only hold cells with bodies
+	const int shift = (m_bucketLevel - cell.level - 1) * dimensions;
+	const std::size_t first = m_cells.size();
+	for (std::size_t child = 0; child < children; ++child) {
+		std::uint64_t prefix = (cell.prefix << dimensions) | child;
+		std::size_t begin = m_bucketStart[static_cast<std::size_t>(prefix << shift)];
+		std::size_t end = m_bucketStart[static_cast<std::size_t>((prefix + 1) << shift)];
+		if (begin < end)
+			m_cells.push_back(Cell{ VecType(0), 0.0, begin, end, 0, prefix, 0, cell.level + 1 });
+	}
+
+	const std::size_t count = m_cells.size() - first;
+	if (count == 0)
+		return;
+	m_cells[index].firstChild = first;
+	m_cells[index].childCount = static_cast<std::uint32_t>(count);
+
+	double mass = 0.0;
+	VecType weighted(0);
+	for (std::size_t child = first; child < first + count; ++child) {
+		assembleCell(child, buckets);
+		mass += m_cells[child].mass;
+		weighted += m_cells[child].mass * m_cells[child].center;
+	}
+	m_cells[index].mass = mass;
+	m_cells[index].center = mass > 0.0 ? weighted / mass : m_cells[first].center;
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::splitChunks(std::size_t cell)
+{
+	const Cell& current = m_cells[cell];
+	if (current.begin == current.end)
+		return;
+
+	if (current.end - current.begin <= m_chunkBodies || current.firstChild == 0) {
+		m_chunks.push_back(cell);
+		return;
+	}
+
+	for (std::size_t child = current.firstChild; child < current.firstChild + current.childCount; ++child)
+		splitChunks(child);
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::planChunk(std::size_t chunk, Plan& plan)
+{
+	plan.near.clear();
+	plan.far.clear();
+	plan.nearBodies = 0;
+
+	VecType corner;
+	double side;
+	cellBox(m_cells[chunk], corner, side);
+	planCell(m_cells[chunk], corner, side, m_local.getTree().getTheta(), 0, plan);
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::planCell(const Cell& chunk, const VecType& corner, double side, double theta, std::size_t index, Plan& plan) const
+{
+	const Cell& cell = m_cells[index];
+	if (cell.begin == cell.end || &cell == &chunk)
+		return;
+
+	// The chunk's ancestors are opened, the chunk itself is the bodies being integrated
+	bool ancestor = cell.level < chunk.level && cell.begin <= chunk.begin && chunk.end <= cell.end;
+
+	if (!ancestor) {
+		// Same opening test as the walk, against the nearest point of the chunk's box
+		double cell_side = 2.0 * m_halfLength / static_cast<double>(std::uint64_t(1) << cell.level);
+		double distance_squared = 0.0;
+		for (int d = 0; d < dimensions; ++d) {
+			double gap = std::max({ corner[d] - cell.center[d], cell.center[d] - (corner[d] + side), 0.0 });
+			distance_squared += gap * gap;
+		}
+
+		if (cell_side * cell_side < theta * theta * distance_squared) {
+			plan.far.emplace_back(0, "", cell.center, VecType(0), cell.mass, 0.0);
+			return;
+		}
+
+		// Leaves are visited in file order, so neighbouring ones are merged
+		if (cell.firstChild == 0) {
+			if (!plan.near.empty() && plan.near.back().second == cell.begin)
+				plan.near.back().second = cell.end;
+			else
+				plan.near.emplace_back(cell.begin, cell.end);
+			plan.nearBodies += cell.end - cell.begin;
+			return;
+		}
+	}
+
+	for (std::size_t child = cell.firstChild; child < cell.firstChild + cell.childCount; ++child)
+		planCell(chunk, corner, side, theta, child, plan);
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::prefetchChunk(std::size_t chunk, const Plan& plan) const
+{
+	const Cell& cell = m_cells[chunk];
+	m_state.prefetch(cell.begin * sizeof(Record), (cell.end - cell.begin) * sizeof(Record));
+	for (const auto& range : plan.near)
+		m_state.prefetch(range.first * sizeof(Record), (range.second - range.first) * sizeof(Record));
+}
+
+template <typename VecType>
+double OutOfCore<VecType>::stepChunk(std::size_t chunk, const Plan& plan, double dt, IoStatistics& stats)
+{
+	const Record* state = records(m_state);
+	Record* back = records(m_back);
+	const std::size_t first = m_cells[chunk].begin;
+	const std::size_t count = m_cells[chunk].end - first;
+
+	std::vector<Node<VecType>>& targets = m_local.nodeList;
+	targets.resize(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		const Record& record = state[first + i];
+		targets[i] = Node<VecType>(record.id, "", record.position, record.velocity, record.mass, record.radius);
+	}
+
+	// Near bodies and monopoles only attract; as ghosts they need ids below -1
+	std::vector<Node<VecType>> ghosts;
+	ghosts.reserve(plan.nearBodies + plan.far.size());
+	for (const auto& range : plan.near) {
+		for (std::size_t j = range.first; j < range.second; ++j) {
+			const Record& record = state[j];
+			ghosts.emplace_back(-2 - static_cast<int>(ghosts.size()), "", record.position, record.velocity, record.mass, record.radius);
+		}
+	}
+	for (const Node<VecType>& monopole : plan.far) {
+		ghosts.push_back(monopole);
+		ghosts.back().setId(-2 - static_cast<int>(ghosts.size() - 1));
+	}
+	m_peakScratch = std::max(m_peakScratch, count + ghosts.size());
+
+	std::vector<VecType> forces;
+	m_local.setGhosts(std::move(ghosts));
+	m_local.computeForces(forces);
+
+	// Velocity Verlet as in TreeWrapper::update: the new force is taken at the old position
+	double extent = 0.0;
+	std::mutex step_mutex;
+	Utils::parallelFor(count, m_threads, [&](std::size_t begin, std::size_t end) {
+		double local = 0.0;
+		std::vector<std::size_t> buckets(end - begin);
+
+		for (std::size_t i = begin; i < end; ++i) {
+			const Record& body = state[first + i];
+			Record& next = back[first + i];
+
+			VecType acc = body.force / body.mass;
+			VecType new_accel = forces[i] / body.mass;
+
+			next = body;
+			next.position = body.position + body.velocity * dt + acc * (dt * dt * 0.5);
+			next.velocity = body.velocity + (acc + new_accel) * (dt * 0.5);
+			next.force = forces[i];
+
+			local = std::max(local, glm::length(next.position));
+			buckets[i - begin] = bucketOf(next.position);
+		}
+
+		// The bucket sizes of the sort at the end of the step
+		std::lock_guard<std::mutex> lock(step_mutex);
+		extent = std::max(extent, local);
+		for (std::size_t bucket : buckets)
+			++m_bucketCount[bucket];
+	});
+
+	m_back.release(first * sizeof(Record), count * sizeof(Record));
+
+	stats.logicalRead += (count + plan.nearBodies) * sizeof(Record);
+	stats.logicalWritten += count * sizeof(Record);
+	return extent;
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::step(double dt)
+{
+	if (m_count == 0)
+		return;
+
+	IoStatistics stats;
+	std::uint64_t device_read = 0, device_written = 0;
+	m_deviceCounters = MappedFile::ioCounters(device_read, device_written);
+	auto start = std::chrono::high_resolution_clock::now();
+
+	std::fill(m_bucketCount.begin(), m_bucketCount.end(), 0);
+
+	// The plan of the next chunk is made up front and its pages are touched on
+	// another thread while the current chunk is computed
+	Plan plans[2];
+	planChunk(m_chunks[0], plans[0]);
+	prefetchChunk(m_chunks[0], plans[0]);
+
+	double extent = 0.0;
+	for (std::size_t c = 0; c < m_chunks.size(); ++c) {
+		std::thread prefetcher;
+		if (c + 1 < m_chunks.size()) {
+			Plan& next = plans[(c + 1) % 2];
+			planChunk(m_chunks[c + 1], next);
+			prefetcher = std::thread([this, c, &next]() { prefetchChunk(m_chunks[c + 1], next); });
+		}
+
+		extent = std::max(extent, stepChunk(m_chunks[c], plans[c % 2], dt, stats));
+
+		if (prefetcher.joinable()) {
+			auto wait = std::chrono::high_resolution_clock::now();
+			prefetcher.join();
+			stats.waitSeconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - wait).count();
+		}
+	}
+
+	auto forces_done = std::chrono::high_resolution_clock::now();
+	stats.forceSeconds = std::chrono::duration<double>(forces_done - start).count();
+
+	// The cube only grows, like the tree's root; the buckets were counted in the old one
+	if (extent > m_halfLength)
+		countBuckets(2.0 * extent, stats);
+	sortBodies(stats);
+	stats.sortSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - forces_done).count();
+
+	std::uint64_t read = 0, written = 0;
+	if (m_deviceCounters && MappedFile::ioCounters(read, written)) {
+		stats.deviceRead = read - device_read;
+		stats.deviceWritten = written - device_written;
+	}
+	else {
+		m_deviceCounters = false;
+	}
+
+	m_lastStep = stats;
+	m_total.logicalRead += stats.logicalRead;
+	m_total.logicalWritten += stats.logicalWritten;
+	m_total.deviceRead += stats.deviceRead;
+	m_total.deviceWritten += stats.deviceWritten;
+	m_total.forceSeconds += stats.forceSeconds;
+	m_total.sortSeconds += stats.sortSeconds;
+	m_total.waitSeconds += stats.waitSeconds;
+	++m_steps;
+}
+
+template <typename VecType>
+std::size_t OutOfCore<VecType>::residentBytes()
+{
+	std::size_t bytes = m_cells.size() * sizeof(Cell) + m_chunks.size() * sizeof(std::size_t)
+		+ (m_bucketCount.size() + m_bucketStart.size()) * sizeof(std::size_t);
+
+	// The chunk's bodies and ghosts twice: in nodeList / the ghost list and in the tree's leaves
+	return bytes + 2 * m_peakScratch * sizeof(Node<VecType>);
+}
+
+template <typename VecType>
+void OutOfCore<VecType>::report(std::ostream& out)
+{
+	const double megabyte = 1024.0 * 1024.0;
+	out << "Out of core -- " << m_count << " bodies in " << m_path << " and " << m_path << ".back ("
+		<< 2 * m_count * sizeof(Record) / megabyte << " MB), " << m_chunks.size() << " chunks of up to "
+		<< m_chunkBodies << " bodies, " << m_cells.size() << " resident cells\n";
+	out << "Out of core -- " << residentBytes() / megabyte << " MB resident, at most " << m_peakScratch
+		<< " bodies, near bodies and monopoles walked at once\n";
+
+	if (m_steps == 0) {
+		out << std::flush;
+		return;
+	}
+
+	double steps = static_cast<double>(m_steps);
+	double seconds = (m_total.forceSeconds + m_total.sortSeconds) / steps;
+	out << "Out of core -- per step " << seconds << " s (" << m_count / seconds << " bodies / s): chunks "
+		<< m_total.forceSeconds / steps << " s, waiting for prefetch " << m_total.waitSeconds / steps
+		<< " s, sort " << m_total.sortSeconds / steps << " s\n";
+	out << "Out of core -- per step read " << m_total.logicalRead / steps / megabyte << " MB, written "
+		<< m_total.logicalWritten / steps / megabyte << " MB";
+	if (m_deviceCounters)
+		out << "; from / to the device " << m_total.deviceRead / steps / megabyte << " / " << m_total.deviceWritten / steps / megabyte << " MB";
+	else
+		out << "; device traffic not available";
+	out << std::endl;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef PARTICLEMESH_H
+#define PARTICLEMESH_H
+#pragma once
+#include <glm/glm.hpp>
+#include <complex>
+#include <vector>
+
+#include "constants.h"
+#include "BoxBase.h"
+#include "Node.h"
+#include "Utils.h"
+
+// Mass assignment / interpolation kernel of the mesh
+enum AssignmentScheme {
+	ASSIGN_CIC = 0,	// cloud-in-cell, 2 cells per axis
+	ASSIGN_TSC = 1	// triangular-shaped cloud, 3 cells per axis
+};
+
+/*
+	Long-range half of the TreePM split.
+
+	The 1/r potential is split at scale r_s into
+		long  range: erf(r / 2r_s) / r		- solved on the mesh
+		short range: erfc(r / 2r_s) / r		- summed by the tree walk inside m_cutoff
+
+	Mass is assigned to a mesh covering the tree's bounding box, convolved with
+	the long-range kernel through a zero-padded FFT (open boundaries, no
+	periodic images), differentiated with a 4-point stencil and interpolated back
+	to the bodies with the same assignment kernel.
+
+	2D runs use a 2D mesh with the same 3D kernel, as the tree walk does.
+*/
+template <typename VecType>
+class ParticleMesh
+{
+private:
+	static constexpr int dimensions = static_cast<int>(VecDimensions<VecType>::value);
+
+	// Cells left empty around the bounding box so the stencils never wrap
+	static constexpr int margin = 3;
+
+	std::size_t m_gridSize;
+	double m_splitCells;
+	AssignmentScheme m_scheme;
+	unsigned int m_threads;
+
+	// Geometry of the last solve
+	VecType m_origin;
+	double m_cellSize;
+	double m_splitScale;
+	double m_cutoff;
+
+	// Padded (2 * m_gridSize per axis) work grids
+	std::vector<std::complex<double>> m_density;
+	std::vector<std::complex<double>> m_kernel;
+	double m_kernelCellSize;
+
+	// Mesh acceleration per axis over the unpadded grid, in units of G
+	std::vector<double> m_field[dimensions];
+
+	// Short-range force factor sampled on [0, m_cutoff]
+	std::vector<double> m_shortRange;
+
+public:
+	ParticleMesh(std::size_t gridSize = 64, double splitCells = 1.25, AssignmentScheme scheme = ASSIGN_CIC);
+
+	// Getters
+	std::size_t getGridSize();
+	double getCutoff();
+	double getSplitScale();
+
+	// Setters
+	void setGridSize(std::size_t gridSize);
+	void setScheme(AssignmentScheme scheme);
+	void setThreads(unsigned int threads);
+
+	// Computes the long-range force on every body. The mesh covers `region`,
+	// which must contain all bodies. forces[i] belongs to bodies[i].
+	void computeForces(const Box<VecType>& region, const std::vector<Node<VecType>>& bodies, std::vector<VecType>& forces);
+
+	// Fraction of the Newtonian force between two bodies that the tree walk
+	// still has to provide at distance r: 0 beyond the cutoff.
+	double shortRangeFactor(double r) const;
+
+	// In-place radix-2 FFT of `count` complex values `stride` apart
+	static void fft(std::complex<double>* data, std::size_t count, std::size_t stride, bool inverse);
+
+private:
+	void setGeometry(const Box<VecType>& region);
+	void buildKernel();
+
+	// FFT along every axis of a padded grid
+	void transform(std::vector<std::complex<double>>& grid, bool inverse);
+
+	// Assignment weights along one axis. Returns the first cell and fills
+	// `weights` with 2 (CIC) or 3 (TSC) entries.
+	int weights(double position, double* weights) const;
+
+	std::size_t paddedSize() const;
+	std::size_t paddedIndex(const int* cell) const;
+	std::size_t meshIndex(const int* cell) const;
+};
+
+using ParticleMesh2D = ParticleMesh<glm::dvec2>;
+using ParticleMesh3D = ParticleMesh<glm::dvec3>;
+
+#include "ParticleMesh.tpp"
+#endif
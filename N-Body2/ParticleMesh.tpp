@@ -0,0 +1,362 @@
+#ifndef PARTICLEMESH_TPP
+#define PARTICLEMESH_TPP
+#include "ParticleMesh.h"
+#include <cmath>
+
+template <typename VecType>
+ParticleMesh<VecType>::ParticleMesh(std::size_t gridSize, double splitCells, AssignmentScheme scheme) :
+	m_gridSize(0),
+	m_splitCells(splitCells),
+	m_scheme(scheme),
+	m_threads(0),
+	m_origin(VecType(0)),
+	m_cellSize(0.0),
+	m_splitScale(0.0),
+	m_cutoff(0.0),
+	m_kernelCellSize(0.0)
+{
+	setGridSize(gridSize);
+}
+
+template <typename VecType>
+std::size_t ParticleMesh<VecType>::getGridSize() {
+	return m_gridSize;
+}
+
+template <typename VecType>
+double ParticleMesh<VecType>::getCutoff() {
+	return m_cutoff;
+}
+
+template <typename VecType>
+double ParticleMesh<VecType>::getSplitScale() {
+	return m_splitScale;
+}
+
+// The FFT is radix-2, so the grid is rounded up to a power of two
+template <typename VecType>
+void ParticleMesh<VecType>::setGridSize(std::size_t gridSize) {
+	std::size_t size = 16;
+	while (size < gridSize)
+		size <<= 1;
+
+	m_gridSize = size;
+	m_kernelCellSize = 0.0;
+}
+
+template <typename VecType>
+void ParticleMesh<VecType>::setScheme(AssignmentScheme scheme) {
+	m_scheme = scheme;
+}
+
+template <typename VecType>
+void ParticleMesh<VecType>::setThreads(unsigned int threads) {
+	m_threads = threads;
+}
+
+template <typename VecType>
+std::size_t ParticleMesh<VecType>::paddedSize() const {
+	std::size_t size = 1;
+	for (int d = 0; d < dimensions; ++d)
+		size *= 2 * m_gridSize;
+	return size;
+}
+
+template <typename VecType>
+std::size_t ParticleMesh<VecType>::paddedIndex(const int* cell) const {
+	std::size_t index = 0;
+	for (int d = 0; d < dimensions; ++d)
+		index = index * 2 * m_gridSize + cell[d];
+	return index;
+}
+
+template <typename VecType>
+std::size_t ParticleMesh<VecType>::meshIndex(const int* cell) const {
+	std::size_t index = 0;
+	for (int d = 0; d < dimensions; ++d)
+		index = index * m_gridSize + cell[d];
+	return index;
+}
+
+template <typename VecType>
+double ParticleMesh<VecType>::shortRangeFactor(double r) const
+{
+	if (r >= m_cutoff || m_shortRange.empty())
+		return 0.0;
+
+	double position = r / m_cutoff * (m_shortRange.size() - 1);
+	std::size_t i = static_cast<std::size_t>(position);
+	double fraction = position - i;
+
+	return m_shortRange[i] + fraction * (m_shortRange[i + 1] - m_shortRange[i]);
+}
+
+template <typename VecType>
+void ParticleMesh<VecType>::fft(std::complex<double>* data, std::size_t count, std::size_t stride, bool inverse)
+{
+	// Bit-reversal permutation
+	for (std::size_t i = 1, j = 0; i < count; ++i) {
+		std::size_t bit = count >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+
+		if (i < j)
+			std::swap(data[i * stride], data[j * stride]);
+	}
+
+	for (std::size_t length = 2; length <= count; length <<= 1) {
+		double angle = 2.0 * M_PI / length * (inverse ? 1.0 : -1.0);
+		std::complex<double> step(std::cos(angle), std::sin(angle));
+
+		for (std::size_t i = 0; i < count; i += length) {
+			std::complex<double> twiddle(1.0, 0.0);
+
+			for (std::size_t j = 0; j < length / 2; ++j) {
+				std::complex<double> even = data[(i + j) * stride];
+				std::complex<double> odd = data[(i + j + length / 2) * stride] * twiddle;
+
+				data[(i + j) * stride] = even + odd;
+				data[(i + j + length / 2) * stride] = even - odd;
+				twiddle *= step;
+			}
+		}
+	}
+}
+
+template <typename VecType>
+void ParticleMesh<VecType>::transform(std::vector<std::complex<double>>& grid, bool inverse)
+{
+	std::size_t padded = 2 * m_gridSize;
+	std::size_t lines = grid.size() / padded;
+
+	for (int axis = 0; axis < dimensions; ++axis) {
+		std::size_t stride = 1;
+		for (int d = axis + 1; d < dimensions; ++d)
+			stride *= padded;
+
+		// Lines are independent; each is copied out so the FFT runs on contiguous memory
+		Utils::parallelFor(lines, m_threads, [&](std::size_t begin, std::size_t end) {
+			std::vector<std::complex<double>> line(padded);
+
+			for (std::size_t l = begin; l < end; ++l) {
+				std::size_t base = (l / stride) * stride * padded + (l % stride);
+
+				for (std::size_t k = 0; k < padded; ++k)
+					line[k] = grid[base + k * stride];
+
+				fft(line.data(), padded, 1, inverse);
+
+				for (std::size_t k = 0; k < padded; ++k)
+					grid[base + k * stride] = line[k];
+			}
+		});
+	}
+}
+
+template <typename VecType>
+void ParticleMesh<VecType>::setGeometry(const Box<VecType>& region)
+{
+	double length = region.getLength();
+
+	m_cellSize = length / (m_gridSize - 2 * margin);
+	m_origin = region.center - VecType(0.5 * length + margin * m_cellSize);
+	m_splitScale = m_splitCells * m_cellSize;
+	m_cutoff = 4.5 * m_splitScale;
+
+	// The kernel only depends on the cell size, which changes whenever the tree grows
+	if (m_cellSize != m_kernelCellSize)
+		buildKernel();
+}
+
+template <typename VecType>
+void ParticleMesh<VecType>::buildKernel()
+{
+	int padded = static_cast<int>(2 * m_gridSize);
+	double rs = m_splitScale;
+
+	m_kernel.assign(paddedSize(), std::complex<double>(0.0, 0.0));
+
+	// Long-range Green's function erf(r / 2rs) / r at every (wrapped) cell offset
+	Utils::parallelFor(m_kernel.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t index = begin; index < end; ++index) {
+			std::size_t rest = index;
+			double r2 = 0.0;
+
+			for (int d = dimensions - 1; d >= 0; --d) {
+				int cell = static_cast<int>(rest % padded);
+				rest /= padded;
+
+				int offset = cell < padded / 2 ? cell : cell - padded;
+				r2 += (offset * m_cellSize) * (offset * m_cellSize);
+			}
+
+			double r = std::sqrt(r2);
+			m_kernel[index] = r > 0.0 ? std::erf(r / (2.0 * rs)) / r : 1.0 / (rs * std::sqrt(M_PI));
+		}
+	});
+
+	transform(m_kernel, false);
+
+	// Short-range force factor erfc(u) + 2u / sqrt(pi) * exp(-u^2), u = r / 2rs
+	m_shortRange.resize(1025);
+	for (std::size_t i = 0; i < m_shortRange.size(); ++i) {
+		double u = (m_cutoff * i / (m_shortRange.size() - 1)) / (2.0 * rs);
+		m_shortRange[i] = std::erfc(u) + 2.0 * u / std::sqrt(M_PI) * std::exp(-u * u);
+	}
+	m_shortRange.back() = 0.0;
+
+	m_kernelCellSize = m_cellSize;
+}
+
+template <typename VecType>
+int ParticleMesh<VecType>::weights(double position, double* weights) const
+{
+	// Cell centers sit at k + 0.5
+	if (m_scheme == ASSIGN_TSC) {
+		int cell = static_cast<int>(std::floor(position));
+		double d = position - (cell + 0.5);
+
+		weights[0] = 0.5 * (0.5 - d) * (0.5 - d);
+		weights[1] = 0.75 - d * d;
+		weights[2] = 0.5 * (0.5 + d) * (0.5 + d);
+		return cell - 1;
+	}
+
+	double shifted = position - 0.5;
+	int cell = static_cast<int>(std::floor(shifted));
+	double fraction = shifted - cell;
+
+	weights[0] = 1.0 - fraction;
+	weights[1] = fraction;
+	return cell;
+}
+
+template <typename VecType>
+void ParticleMesh<VecType>::computeForces(const Box<VecType>& region, const std::vector<Node<VecType>>& bodies, std::vector<VecType>& forces)
+{
+	forces.assign(bodies.size(), VecType(0));
+	if (bodies.empty())
+		return;
+
+	setGeometry(region);
+
+	int n = static_cast<int>(m_gridSize);
+	int stencil = m_scheme == ASSIGN_TSC ? 3 : 2;
+	int stencil_points = 1;
+	for (int d = 0; d < dimensions; ++d)
+		stencil_points *= stencil;
+
+	// Bodies are kept inside the margin so every stencil stays on the mesh
+	auto to_mesh = [&](const VecType& position, int* first, double (*w)[3]) {
+		for (int d = 0; d < dimensions; ++d) {
+			double s = (position[d] - m_origin[d]) / m_cellSize;
+			s = s < margin ? margin : s > n - margin ? n - margin : s;
+			first[d] = weights(s, w[d]);
+		}
+	};
+
+	/** Mass assignment **/
+	m_density.assign(paddedSize(), std::complex<double>(0.0, 0.0));
+
+	for (const Node<VecType>& body : bodies) {
+		int first[dimensions];
+		double w[dimensions][3];
+		to_mesh(body.position, first, w);
+
+		for (int point = 0; point < stencil_points; ++point) {
+			int cell[dimensions];
+			double weight = body.mass;
+			int rest = point;
+
+			for (int d = dimensions - 1; d >= 0; --d) {
+				cell[d] = first[d] + rest % stencil;
+				weight *= w[d][rest % stencil];
+				rest /= stencil;
+			}
+			m_density[paddedIndex(cell)] += weight;
+		}
+	}
+
+	/** Potential: density convolved with the long-range kernel **/
+	transform(m_density, false);
+
+	Utils::parallelFor(m_density.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i)
+			m_density[i] *= m_kernel[i];
+	});
+
+	transform(m_density, true);
+	double normalization = 1.0 / m_density.size();
+
+	/** Mesh acceleration with a 4-point central difference **/
+	std::size_t cells = 1;
+	for (int d = 0; d < dimensions; ++d)
+		cells *= m_gridSize;
+
+	for (int d = 0; d < dimensions; ++d)
+		m_field[d].assign(cells, 0.0);
+
+	Utils::parallelFor(cells, m_threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t index = begin; index < end; ++index) {
+			int cell[dimensions];
+			std::size_t rest = index;
+			bool interior = true;
+
+			for (int d = dimensions - 1; d >= 0; --d) {
+				cell[d] = static_cast<int>(rest % m_gridSize);
+				rest /= m_gridSize;
+				interior = interior && cell[d] >= 2 && cell[d] < n - 2;
+			}
+
+			if (!interior)
+				continue;
+
+			for (int d = 0; d < dimensions; ++d) {
+				int neighbour[dimensions];
+				double phi[4];
+				const int offsets[4] = { -2, -1, 1, 2 };
+
+				for (int k = 0; k < 4; ++k) {
+					for (int e = 0; e < dimensions; ++e)
+						neighbour[e] = cell[e];
+					neighbour[d] += offsets[k];
+					phi[k] = m_density[paddedIndex(neighbour)].real() * normalization;
+				}
+
+				// a = G * grad(sum m erf(r / 2rs) / r)
+				m_field[d][index] = G * (8.0 * (phi[2] - phi[1]) - (phi[3] - phi[0])) / (12.0 * m_cellSize);
+			}
+		}
+	});
+
+	/** Interpolation back to the bodies **/
+	Utils::parallelFor(bodies.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i) {
+			int first[dimensions];
+			double w[dimensions][3];
+			to_mesh(bodies[i].position, first, w);
+
+			VecType acceleration(0);
+			for (int point = 0; point < stencil_points; ++point) {
+				int cell[dimensions];
+				double weight = 1.0;
+				int rest = point;
+
+				for (int d = dimensions - 1; d >= 0; --d) {
+					cell[d] = first[d] + rest % stencil;
+					weight *= w[d][rest % stencil];
+					rest /= stencil;
+				}
+
+				std::size_t index = meshIndex(cell);
+				for (int d = 0; d < dimensions; ++d)
+					acceleration[d] += weight * m_field[d][index];
+			}
+
+			forces[i] = bodies[i].mass * acceleration;
+		}
+	});
+}
+
+#endif
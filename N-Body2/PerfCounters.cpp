@@ -0,0 +1,204 @@
+#include "PerfCounters.h"
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+#if defined(__linux__)
+#define PERF_LINUX
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+#ifdef PERF_LINUX
+	const std::uint64_t eventConfigs[PERF_EVENTS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+
+	int openEvent(std::uint64_t config)
+	{
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;	// allowed up to perf_event_paranoid 2
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+#endif
+}
+
+PerfCounters::PerfCounters() :
+	m_fds{ -1, -1, -1, -1 },
+	m_error()
+{}
+
+PerfCounters::~PerfCounters()
+{
+	close();
+}
+
+bool PerfCounters::isOpen() const
+{
+	for (int fd : m_fds) {
+		if (fd >= 0)
+			return true;
+	}
+	return false;
+}
+
+bool PerfCounters::hasEvent(PerfEvent event) const
+{
+	return m_fds[event] >= 0;
+}
+
+const std::string& PerfCounters::getError() const
+{
+	return m_error;
+}
+
+bool PerfCounters::open()
+{
+	close();
+
+#ifdef PERF_LINUX
+	std::string refused;
+	bool denied = false;
+	for (int event = 0; event < PERF_EVENTS; ++event) {
+		m_fds[event] = openEvent(eventConfigs[event]);
+		if (m_fds[event] < 0) {
+			int error = errno;
+			denied = denied || error == EACCES || error == EPERM;
+			refused += std::string(refused.empty() ? "" : ", ") + eventName(static_cast<PerfEvent>(event)) + ": " + std::strerror(error);
+		}
+	}
+
+	if (isOpen()) {
+		m_error = refused.empty() ? "" : "unavailable events (" + refused + ")";
+		return true;
+	}
+
+	// ENOENT / EOPNOTSUPP: no PMU exposed, typical of virtual machines
+	m_error = "perf_event_open failed (" + refused + ")"
+		+ (denied ? ", see /proc/sys/kernel/perf_event_paranoid" : ", no hardware counters exposed");
+	return false;
+#else
+	m_error = "hardware counters are only available on Linux";
+	return false;
+#endif
+}
+
+void PerfCounters::close()
+{
+	for (int& fd : m_fds) {
+#ifdef PERF_LINUX
+		if (fd >= 0)
+			::close(fd);
+#endif
+		fd = -1;
+	}
+}
+
+PerfReading PerfCounters::read() const
+{
+	PerfReading reading;
+
+#ifdef PERF_LINUX
+	for (int event = 0; event < PERF_EVENTS; ++event) {
+		std::uint64_t values[3];
+		if (m_fds[event] >= 0 && ::read(m_fds[event], values, sizeof(values)) == static_cast<ssize_t>(sizeof(values))) {
+			reading.value[event] = values[0];
+			reading.enabled[event] = values[1];
+			reading.running[event] = values[2];
+		}
+	}
+#endif
+
+	reading.time = std::chrono::high_resolution_clock::now();
+	return reading;
+}
+
+void PerfCounters::accumulate(const PerfReading& start, const PerfReading& end, PerfSample& sample) const
+{
+	for (int event = 0; event < PERF_EVENTS; ++event) {
+		double value = static_cast<double>(end.value[event] - start.value[event]);
+		std::uint64_t enabled = end.enabled[event] - start.enabled[event];
+		std::uint64_t running = end.running[event] - start.running[event];
+
+		// Multiplexed: the event only counted for `running` of the `enabled` time
+		if (running > 0 && running < enabled)
+			value *= static_cast<double>(enabled) / running;
+		sample.events[event] += value;
+	}
+
+	sample.seconds += std::chrono::duration<double>(end.time - start.time).count();
+	++sample.calls;
+}
+
+const char* PerfCounters::eventName(PerfEvent event)
+{
+	switch (event) {
+	case PERF_CYCLES: return "cycles";
+	case PERF_INSTRUCTIONS: return "instructions";
+	case PERF_CACHE_MISSES: return "cache-misses";
+	case PERF_BRANCH_MISSES: return "branch-misses";
+	default: return "?";
+	}
+}
+
+void PerfCounters::report(std::ostream& out, const char* const names[], const PerfSample samples[], std::size_t count) const
+{
+	auto cell = [&](bool available, double value) {
+		std::ostringstream text;
+		if (available)
+			text << std::setprecision(3) << value;
+		else
+			text << "-";
+		return text.str();
+	};
+
+	PerfSample total;
+	for (std::size_t p = 0; p < count; ++p) {
+		for (int event = 0; event < PERF_EVENTS; ++event)
+			total.events[event] += samples[p].events[event];
+		total.seconds += samples[p].seconds;
+		total.interactions += samples[p].interactions;
+	}
+
+	out << "Counters -- user space, all threads" << (m_error.empty() ? "" : ", " + m_error) << "\n";
+	out << std::setw(12) << "phase" << std::setw(8) << "calls" << std::setw(12) << "[s]" << std::setw(12) << "Gcycles"
+		<< std::setw(8) << "IPC" << std::setw(12) << "cache-miss" << std::setw(12) << "branch-miss"
+		<< std::setw(14) << "interactions" << std::setw(12) << "cm / int" << std::setw(12) << "bm / int" << "\n";
+
+	for (std::size_t p = 0; p <= count; ++p) {
+		const PerfSample& sample = p < count ? samples[p] : total;
+		if (p < count && sample.calls == 0)
+			continue;
+
+		const double* events = sample.events;
+		bool cycles = hasEvent(PERF_CYCLES), instructions = hasEvent(PERF_INSTRUCTIONS);
+		bool cache = hasEvent(PERF_CACHE_MISSES), branch = hasEvent(PERF_BRANCH_MISSES);
+		bool interactions = sample.interactions > 0;
+		double per_interaction = interactions ? 1.0 / sample.interactions : 0.0;
+
+		out << std::setw(12) << (p < count ? names[p] : "total") << std::setw(8) << (p < count ? std::to_string(sample.calls) : "")
+			<< std::setw(12) << cell(true, sample.seconds)
+			<< std::setw(12) << cell(cycles, events[PERF_CYCLES] * 1e-9)
+			<< std::setw(8) << cell(cycles && instructions && events[PERF_CYCLES] > 0, events[PERF_INSTRUCTIONS] / events[PERF_CYCLES])
+			<< std::setw(12) << cell(cache, events[PERF_CACHE_MISSES])
+			<< std::setw(12) << cell(branch, events[PERF_BRANCH_MISSES])
+			<< std::setw(14) << cell(interactions, static_cast<double>(sample.interactions))
+			<< std::setw(12) << cell(cache && interactions, events[PERF_CACHE_MISSES] * per_interaction)
+			<< std::setw(12) << cell(branch && interactions, events[PERF_BRANCH_MISSES] * per_interaction) << "\n";
+	}
+	out << std::flush;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Hardware events counted by PerfCounters
+enum PerfEvent {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS = 1,
+	PERF_CACHE_MISSES = 2,	// last-level cache
+	PERF_BRANCH_MISSES = 3,
+	PERF_EVENTS = 4
+};
+
+// Raw counter state at one point in time
+struct PerfReading {
+	std::uint64_t value[PERF_EVENTS] = {};
+	std::uint64_t enabled[PERF_EVENTS] = {};	// ns the event was enabled / actually counting,
+	std::uint64_t running[PERF_EVENTS] = {};	// they differ when the PMU multiplexes events
+	std::chrono::high_resolution_clock::time_point time;
+};
+
+// Counts accumulated over every run of one phase
+struct PerfSample {
+	double events[PERF_EVENTS] = {};
+	double seconds = 0.0;
+	std::uint64_t calls = 0;
+	std::uint64_t interactions = 0;	// pairwise force evaluations, 0 = not counted
+};
+
+/*
+	Hardware performance counters of the calling thread, read around the phases
+	of TreeWrapper::update (--perf-counters).
+
+	On Linux every event is opened with perf_event_open for the calling thread,
+	user space only, with inheritance: threads it starts afterwards (the workers
+	of Utils::parallelFor and Numa::parallelFor) count into the same counters,
+	and their counts are added when they exit. A phase that joins its workers
+	is therefore read with the work of every thread in it. Counts are scaled
+	by enabled / running time when the PMU multiplexes.
+
+	Events the kernel refuses (perf_event_paranoid, containers, virtual
+	machines without a PMU) are left out; open() fails only when none is
+	available, and getError() says why. Elsewhere open() always fails.
+*/
+class PerfCounters
+{
+private:
+	int m_fds[PERF_EVENTS];
+	std::string m_error;
+
+public:
+	PerfCounters();
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	// Getters
+	bool isOpen() const;
+	bool hasEvent(PerfEvent event) const;
+	const std::string& getError() const;
+
+	// Starts counting for the calling thread and the threads it starts from now on
+	bool open();
+	void close();
+
+	PerfReading read() const;
+
+	// Adds the counts between `start` and `end` to `sample`
+	void accumulate(const PerfReading& start, const PerfReading& end, PerfSample& sample) const;
+
+	static const char* eventName(PerfEvent event);
+
+	// One row per phase plus the total: time, IPC and misses per interaction.
+	// Events that were not available are shown as "-".
+	void report(std::ostream& out, const char* const names[], const PerfSample samples[], std::size_t count) const;
+};
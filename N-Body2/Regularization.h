@@ -0,0 +1,124 @@
+#ifndef REGULARIZATION_H
+#define REGULARIZATION_H
+#pragma once
+#include <glm/glm.hpp>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "constants.h"
+#include "Node.h"
+
+/*
+	Close-encounter regularization (--regularize).
+
+	Bound pairs and small groups closer than the capture distance leave the
+	global integration: their members are replaced in the tree by one composite
+	body at their center of mass, carrying their total mass, which the rest of
+	the system attracts and integrates like any other body. The members move
+	relative to that center of mass under their mutual forces plus the tidal
+	field of everything else, frozen over each global step.
+
+	The internal motion uses algorithmic regularization: the logarithmic
+	Hamiltonian leapfrog of Mikkola & Tanikawa (1999), which steps in a
+	fictitious time s with dt = ds / (T + B) for the drifts and dt = ds / U for
+	the kicks (T kinetic energy, U = sum G m_i m_j / r_ij, B = -E). It follows a
+	Kepler orbit exactly up to a phase error, through any eccentricity and
+	pericenter, and works for any number of members. The last substep of a
+	global step is solved for so the subsystem lands on the global time.
+
+	A group dissolves back into single bodies when it becomes unbound or a
+	member gets further than twice the capture distance from the center of mass.
+*/
+template <typename VecType>
+class Regularization
+{
+public:
+	// One composite body: members relative to its center of mass
+	struct Subsystem {
+		std::vector<Node<VecType>> members;
+		double binding;		// B = -(T - U), updated by the tidal work
+		std::vector<VecType> tides;	// tidal accelerations of the last step
+	};
+
+private:
+	double m_captureDistance;	// 0 = off
+	std::size_t m_maxMembers;
+	int m_stepsPerOrbit;
+	static constexpr long long maxSubsteps = 1000000;	// per subsystem and global step
+
+	// Keyed by the id of the composite body, which is its heaviest member's
+	std::unordered_map<int, Subsystem> m_subsystems;
+
+	long long m_captures;
+	long long m_dissolutions;
+	long long m_substeps;
+	std::size_t m_largestGroup;
+
+public:
+	Regularization();
+
+	// Getters
+	bool isEnabled();
+	double getCaptureDistance();
+	std::size_t getMaxMembers();
+	std::unordered_map<int, Subsystem>& getSubsystems();
+
+	// Setters
+	void setCaptureDistance(double distance);
+	void setMaxMembers(std::size_t members);
+	void setStepsPerOrbit(int steps);
+
+	bool isComposite(int id) const;
+
+	// Whether `a` and `b` (bodies or composites) may be merged into one subsystem
+	bool shouldCapture(const Node<VecType>& a, const Node<VecType>& b) const;
+
+	// Merges `a` and `b` into a subsystem and returns its composite body. The
+	// subsystems of composites among them are taken over.
+	Node<VecType> capture(const Node<VecType>& a, const Node<VecType>& b);
+
+	// Whether the subsystem of `composite` has to be dissolved
+	bool shouldDissolve(const Node<VecType>& composite) const;
+
+	// Removes the subsystem of `composite` and appends its members, in absolute
+	// coordinates and with their current forces, to `bodies`
+	void dissolve(const Node<VecType>& composite, std::vector<Node<VecType>>& bodies);
+
+	// Absolute positions of the members of `composite`
+	void memberPositions(const Node<VecType>& composite, std::vector<VecType>& positions) const;
+
+	// Advances the internal motion of `composite`'s subsystem by dt. tides[i] is
+	// the external acceleration of member i minus that of the center of mass.
+	void advance(const Node<VecType>& composite, double dt, const std::vector<VecType>& tides);
+
+	// Adds the internal energy and angular momentum of every subsystem, which the
+	// composite point masses leave out (angular momentum only along z in 2D)
+	void addInternal(double& kinetic, double& potential, glm::dvec3& angularMomentum) const;
+
+	void report(std::ostream& out);
+
+	// Two-body energy of the relative motion of `a` and `b`
+	static double pairEnergy(const Node<VecType>& a, const Node<VecType>& b);
+
+private:
+	struct State {
+		std::vector<VecType> position;
+		std::vector<VecType> velocity;
+		double binding;
+		double time;
+	};
+
+	static double kinetic(const std::vector<Node<VecType>>& members, const std::vector<VecType>& velocity);
+	static double forceFunction(const std::vector<Node<VecType>>& members, const std::vector<VecType>& position);
+	static void accelerations(const std::vector<Node<VecType>>& members, const std::vector<VecType>& position, std::vector<VecType>& out);
+
+	// One drift(h / 2) kick(h) drift(h / 2) step of the logarithmic Hamiltonian leapfrog
+	static void leapfrog(const std::vector<Node<VecType>>& members, const std::vector<VecType>& tides, State& state, double h, std::vector<VecType>& scratch);
+
+	// Fictitious time step giving about m_stepsPerOrbit steps per orbit of the subsystem
+	double stepSize(const Subsystem& subsystem) const;
+};
+
+#include "Regularization.tpp"
+#endif
@@ -0,0 +1,398 @@
+#ifndef REGULARIZATION_TPP
+#define REGULARIZATION_TPP
+#include "Regularization.h"
+#include <cmath>
+
+template <typename VecType>
+Regularization<VecType>::Regularization() :
+	m_captureDistance(0.0),
+	m_maxMembers(4),
+	m_stepsPerOrbit(256),
+	m_subsystems(),
+	m_captures(0),
+	m_dissolutions(0),
+	m_substeps(0),
+	m_largestGroup(0)
+{}
+
+template <typename VecType>
+bool Regularization<VecType>::isEnabled() {
+	return m_captureDistance > 0.0;
+}
+
+template <typename VecType>
+double Regularization<VecType>::getCaptureDistance() {
+	return m_captureDistance;
+}
+
+template <typename VecType>
+std::size_t Regularization<VecType>::getMaxMembers() {
+	return m_maxMembers;
+}
+
+template <typename VecType>
+std::unordered_map<int, typename Regularization<VecType>::Subsystem>& Regularization<VecType>::getSubsystems() {
+	return m_subsystems;
+}
+
+template <typename VecType>
+void Regularization<VecType>::setCaptureDistance(double distance) {
+	m_captureDistance = distance > 0.0 ? distance : 0.0;
+}
+
+template <typename VecType>
+void Regularization<VecType>::setMaxMembers(std::size_t members) {
+	m_maxMembers = members > 2 ? members : 2;
+}
+
+template <typename VecType>
+void Regularization<VecType>::setStepsPerOrbit(int steps) {
+	m_stepsPerOrbit = steps > 8 ? steps : 8;
+}
+
+template <typename VecType>
+bool Regularization<VecType>::isComposite(int id) const
+{
+	return m_subsystems.count(id) > 0;
+}
+
+template <typename VecType>
+double Regularization<VecType>::pairEnergy(const Node<VecType>& a, const Node<VecType>& b)
+{
+	VecType velocity = a.velocity - b.velocity;
+	double reduced = a.mass * b.mass / (a.mass + b.mass);
+	return 0.5 * reduced * glm::dot(velocity, velocity) - G * a.mass * b.mass / glm::length(a.position - b.position);
+}
+
+template <typename VecType>
+bool Regularization<VecType>::shouldCapture(const Node<VecType>& a, const Node<VecType>& b) const
+{
+	if (m_captureDistance <= 0.0 || a.getId() == b.getId())
+		return false;
+
+	auto members = [this](const Node<VecType>& body) {
+		auto found = m_subsystems.find(body.getId());
+		return found == m_subsystems.end() ? std::size_t(1) : found->second.members.size();
+	};
+	if (members(a) + members(b) > m_maxMembers)
+		return false;
+
+	VecType separation = a.position - b.position;
+	return glm::dot(separation, separation) < m_captureDistance * m_captureDistance && pairEnergy(a, b) < 0.0;
+}
+
+template <typename VecType>
+Node<VecType> Regularization<VecType>::capture(const Node<VecType>& a, const Node<VecType>& b)
+{
+	// Every member in absolute coordinates; composites give up their subsystem
+	std::vector<Node<VecType>> members;
+	for (const Node<VecType>* body : { &a, &b }) {
+		auto found = m_subsystems.find(body->getId());
+		if (found == m_subsystems.end()) {
+			members.push_back(*body);
+			continue;
+		}
+
+		for (Node<VecType> member : found->second.members) {
+			member.position += body->position;
+			member.velocity += body->velocity;
+			members.push_back(member);
+		}
+		m_subsystems.erase(found);
+	}
+
+	double mass = 0.0;
+	VecType position(0), velocity(0);
+	std::size_t heaviest = 0;
+	std::string name;
+	double radius = 0.0;
+	for (std::size_t i = 0; i < members.size(); ++i) {
+		mass += members[i].mass;
+		position += members[i].mass * members[i].position;
+		velocity += members[i].mass * members[i].velocity;
+		if (members[i].mass > members[heaviest].mass)
+			heaviest = i;
+		name += (i ? "+" : "") + members[i].name;
+		radius = std::max(radius, members[i].radius);
+	}
+	position /= mass;
+	velocity /= mass;
+
+	Subsystem subsystem;
+	std::vector<VecType> relative_position, relative_velocity;
+	for (Node<VecType>& member : members) {
+		member.position -= position;
+		member.velocity -= velocity;
+		member.force = VecType(0);
+		relative_position.push_back(member.position);
+		relative_velocity.push_back(member.velocity);
+	}
+	subsystem.binding = forceFunction(members, relative_position) - kinetic(members, relative_velocity);
+	subsystem.tides.assign(members.size(), VecType(0));
+	subsystem.members = std::move(members);
+
+	Node<VecType> composite(subsystem.members[heaviest].getId(), name, position, velocity, mass, radius);
+	composite.force = a.force + b.force;
+
+	m_largestGroup = std::max(m_largestGroup, subsystem.members.size());
+	m_subsystems[composite.getId()] = std::move(subsystem);
+	++m_captures;
+	return composite;
+}
+
+template <typename VecType>
+bool Regularization<VecType>::shouldDissolve(const Node<VecType>& composite) const
+{
+	auto found = m_subsystems.find(composite.getId());
+	if (found == m_subsystems.end())
+		return false;
+
+	const std::vector<Node<VecType>>& members = found->second.members;
+	std::vector<VecType> position, velocity;
+	double limit = 4.0 * m_captureDistance * m_captureDistance;
+	bool escaped = false;
+	for (const Node<VecType>& member : members) {
+		position.push_back(member.position);
+		velocity.push_back(member.velocity);
+		escaped = escaped || glm::dot(member.position, member.position) > limit;
+	}
+
+	return escaped || kinetic(members, velocity) >= forceFunction(members, position);
+}
+
+template <typename VecType>
+void Regularization<VecType>::dissolve(const Node<VecType>& composite, std::vector<Node<VecType>>& bodies)
+{
+	auto found = m_subsystems.find(composite.getId());
+	if (found == m_subsystems.end())
+		return;
+
+	Subsystem& subsystem = found->second;
+	std::vector<VecType> position, internal;
+	for (const Node<VecType>& member : subsystem.members)
+		position.push_back(member.position);
+	accelerations(subsystem.members, position, internal);
+
+	// Forces as the next global step expects them: the external field plus each other
+	for (std::size_t i = 0; i < subsystem.members.size(); ++i) {
+		Node<VecType> body = subsystem.members[i];
+		body.position += composite.position;
+		body.velocity += composite.velocity;
+		body.force = body.mass * (composite.force / composite.mass + subsystem.tides[i] + internal[i]);
+		bodies.push_back(body);
+	}
+
+	m_subsystems.erase(found);
+	++m_dissolutions;
+}
+
+template <typename VecType>
+void Regularization<VecType>::memberPositions(const Node<VecType>& composite, std::vector<VecType>& positions) const
+{
+	positions.clear();
+	auto found = m_subsystems.find(composite.getId());
+	if (found == m_subsystems.end())
+		return;
+
+	for (const Node<VecType>& member : found->second.members)
+		positions.push_back(composite.position + member.position);
+}
+
+template <typename VecType>
+double Regularization<VecType>::kinetic(const std::vector<Node<VecType>>& members, const std::vector<VecType>& velocity)
+{
+	double energy = 0.0;
+	for (std::size_t i = 0; i < members.size(); ++i)
+		energy += 0.5 * members[i].mass * glm::dot(velocity[i], velocity[i]);
+	return energy;
+}
+
+template <typename VecType>
+double Regularization<VecType>::forceFunction(const std::vector<Node<VecType>>& members, const std::vector<VecType>& position)
+{
+	double u = 0.0;
+	for (std::size_t i = 0; i < members.size(); ++i) {
+		for (std::size_t j = i + 1; j < members.size(); ++j)
+			u += G * members[i].mass * members[j].mass / glm::length(position[i] - position[j]);
+	}
+	return u;
+}
+
+template <typename VecType>
+void Regularization<VecType>::accelerations(const std::vector<Node<VecType>>& members, const std::vector<VecType>& position, std::vector<VecType>& out)
+{
+	out.assign(members.size(), VecType(0));
+	for (std::size_t i = 0; i < members.size(); ++i) {
+		for (std::size_t j = i + 1; j < members.size(); ++j) {
+			VecType separation = position[i] - position[j];
+			double r2 = glm::dot(separation, separation);
+			VecType pull = G * separation / (r2 * std::sqrt(r2));
+			out[i] -= members[j].mass * pull;
+			out[j] += members[i].mass * pull;
+		}
+	}
+}
+
+template <typename VecType>
+void Regularization<VecType>::leapfrog(const std::vector<Node<VecType>>& members, const std::vector<VecType>& tides, State& state, double h, std::vector<VecType>& scratch)
+{
+	auto drift = [&](double ds) {
+		double dt = ds / (kinetic(members, state.velocity) + state.binding);
+		for (std::size_t i = 0; i < members.size(); ++i)
+			state.position[i] += dt * state.velocity[i];
+		state.time += dt;
+	};
+
+	drift(0.5 * h);
+
+	// The kick's time step only depends on the positions, so it is explicit
+	double dt = h / forceFunction(members, state.position);
+	accelerations(members, state.position, scratch);
+
+	double work = 0.0;
+	for (std::size_t i = 0; i < members.size(); ++i) {
+		VecType kicked = state.velocity[i] + dt * (scratch[i] + tides[i]);
+		work += members[i].mass * glm::dot(0.5 * (state.velocity[i] + kicked), tides[i]);
+		state.velocity[i] = kicked;
+	}
+	state.binding -= dt * work;
+
+	drift(0.5 * h);
+}
+
+template <typename VecType>
+double Regularization<VecType>::stepSize(const Subsystem& subsystem) const
+{
+	std::vector<VecType> position;
+	double total = 0.0, pairs = 0.0;
+	for (const Node<VecType>& member : subsystem.members) {
+		position.push_back(member.position);
+		total += member.mass;
+	}
+	for (std::size_t i = 0; i < subsystem.members.size(); ++i) {
+		for (std::size_t j = i + 1; j < subsystem.members.size(); ++j)
+			pairs += subsystem.members[i].mass * subsystem.members[j].mass;
+	}
+
+	// Over a Kepler orbit U averages to 2B, so ds = 2B dt. Unbound moments
+	// (tidal kicks) use the current U instead.
+	double scale = subsystem.binding > 0.0 ? 2.0 * subsystem.binding : forceFunction(subsystem.members, position);
+	double axis = G * pairs / scale;
+	double period = 2.0 * M_PI * std::sqrt(axis * axis * axis / (G * total));
+	return scale * period / m_stepsPerOrbit;
+}
+
+template <typename VecType>
+void Regularization<VecType>::advance(const Node<VecType>& composite, double dt, const std::vector<VecType>& tides)
+{
+	auto found = m_subsystems.find(composite.getId());
+	if (found == m_subsystems.end() || dt <= 0.0)
+		return;
+
+	Subsystem& subsystem = found->second;
+	const std::vector<Node<VecType>>& members = subsystem.members;
+	subsystem.tides = tides;
+	if (subsystem.tides.size() != members.size())
+		subsystem.tides.assign(members.size(), VecType(0));
+
+	State state;
+	for (const Node<VecType>& member : members) {
+		state.position.push_back(member.position);
+		state.velocity.push_back(member.velocity);
+	}
+	state.binding = subsystem.binding;
+	state.time = 0.0;
+
+	double h = stepSize(subsystem);
+	std::vector<VecType> scratch;
+	State trial;
+	long long substeps = 0;
+
+	while (state.time < dt && substeps < maxSubsteps) {
+		trial = state;
+		leapfrog(members, subsystem.tides, trial, h, scratch);
+		++substeps;
+
+		if (trial.time <= dt) {
+			state = trial;
+			continue;
+		}
+
+		// Overshot: the time reached grows monotonically with the step, so the
+		// last one is found by regula falsi (Illinois) between 0 and h
+		double low = 0.0, high = h;
+		double low_time = state.time - dt, high_time = trial.time - dt;
+		int side = 0;
+		for (int iteration = 0; iteration < 50; ++iteration) {
+			double guess = (low * high_time - high * low_time) / (high_time - low_time);
+			trial = state;
+			leapfrog(members, subsystem.tides, trial, guess, scratch);
+			++substeps;
+
+			double miss = trial.time - dt;
+			if (std::abs(miss) <= 1e-13 * dt)
+				break;
+
+			if (miss < 0.0) {
+				low = guess;
+				low_time = miss;
+				if (side == -1)
+					high_time *= 0.5;
+				side = -1;
+			}
+			else {
+				high = guess;
+				high_time = miss;
+				if (side == 1)
+					low_time *= 0.5;
+				side = 1;
+			}
+		}
+		state = trial;
+		break;
+	}
+
+	if (substeps >= maxSubsteps)
+		std::cerr << "WARNING: regularized subsystem " << composite.name << " did not reach the end of the step\n";
+
+	for (std::size_t i = 0; i < members.size(); ++i) {
+		subsystem.members[i].position = state.position[i];
+		subsystem.members[i].velocity = state.velocity[i];
+	}
+	subsystem.binding = state.binding;
+	m_substeps += substeps;
+}
+
+template <typename VecType>
+void Regularization<VecType>::addInternal(double& kinetic_energy, double& potential_energy, glm::dvec3& angularMomentum) const
+{
+	for (const auto& entry : m_subsystems) {
+		const std::vector<Node<VecType>>& members = entry.second.members;
+		std::vector<VecType> position, velocity;
+		for (const Node<VecType>& member : members) {
+			position.push_back(member.position);
+			velocity.push_back(member.velocity);
+
+			VecType momentum = member.mass * member.velocity;
+			if constexpr (VecDimensions<VecType>::value == 3)
+				angularMomentum += glm::cross(member.position, momentum);
+			else
+				angularMomentum.z += member.position.x * momentum.y - member.position.y * momentum.x;
+		}
+		kinetic_energy += kinetic(members, velocity);
+		potential_energy -= forceFunction(members, position);
+	}
+}
+
+template <typename VecType>
+void Regularization<VecType>::report(std::ostream& out)
+{
+	if (m_captureDistance <= 0.0)
+		return;
+
+	out << "Regularization -- capture distance " << m_captureDistance << " m, up to " << m_maxMembers << " members: "
+		<< m_captures << " captures, " << m_dissolutions << " dissolutions, " << m_subsystems.size() << " active, largest group "
+		<< m_largestGroup << ", " << m_substeps << " substeps" << std::endl;
+}
+
+#endif
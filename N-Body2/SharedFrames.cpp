@@ -0,0 +1,273 @@
+#include "SharedFrames.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <thread>
+
+#if defined(__linux__) || defined(__unix__)
+#define SHARED_FRAMES_POSIX
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	// POSIX shared memory names start with a single slash
+	std::string segmentName(const std::string& name) {
+		return name.empty() || name[0] != '/' ? "/" + name : name;
+	}
+}
+
+SharedFrames::SharedFrames() :
+	m_name(),
+	m_owner(false),
+	m_memory(nullptr),
+	m_bytes(0),
+	m_header(nullptr)
+{}
+
+SharedFrames::~SharedFrames() {
+	close();
+}
+
+bool SharedFrames::isOpen() {
+	return m_header != nullptr;
+}
+
+bool SharedFrames::isFinished() {
+	return m_header == nullptr || m_header->finished.load(std::memory_order_acquire) != 0;
+}
+
+int SharedFrames::getDimensions() {
+	return m_header ? static_cast<int>(m_header->dimensions) : 0;
+}
+
+std::size_t SharedFrames::getCapacity() {
+	return m_header ? static_cast<std::size_t>(m_header->capacity) : 0;
+}
+
+std::uint64_t SharedFrames::getPublished() {
+	return m_header ? m_header->published.load(std::memory_order_acquire) : 0;
+}
+
+bool SharedFrames::isProducerAlive() {
+	if (!m_header)
+		return false;
+#ifdef SHARED_FRAMES_POSIX
+	// Signal 0 only checks that the process exists; EPERM means it does, as another user
+	pid_t producer = static_cast<pid_t>(m_header->producer);
+	return producer > 0 && (kill(producer, 0) == 0 || errno == EPERM);
+#else
+	return false;
+#endif
+}
+
+bool SharedFrames::create(const std::string& name, int dimensions, std::size_t capacity, int slots) {
+	close();
+
+#ifdef SHARED_FRAMES_POSIX
+	m_name = segmentName(name);
+
+	// Slots stay 64-byte aligned so two of them never share a cache line
+	std::size_t values = capacity * (static_cast<std::size_t>(dimensions) + 1);
+	std::size_t slot_bytes = (sizeof(Slot) + values * sizeof(double) + 63) / 64 * 64;
+	std::size_t header_bytes = (sizeof(Header) + 63) / 64 * 64;
+	m_bytes = header_bytes + slot_bytes * slots;
+
+	int descriptor = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (descriptor < 0 && errno == EEXIST) {
+		// A producer that has just created the segment writes its magic last, so give it a moment
+		SharedFrames existing;
+		for (int attempt = 0; attempt < 50 && !existing.attach(name); ++attempt)
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+		if (!existing.isOpen()) {
+			std::cerr << "Error: shared memory " << m_name << " exists but is not a frame ring; remove it or pick another name" << std::endl;
+			return false;
+		}
+
+		// Only a ring whose producer is gone may be taken over
+		if (!existing.isFinished() && existing.isProducerAlive()) {
+			std::cerr << "Error: shared memory ring " << m_name << " is in use by process " << existing.m_header->producer << std::endl;
+			return false;
+		}
+		existing.close();
+
+		shm_unlink(m_name.c_str());
+		descriptor = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	}
+	if (descriptor < 0 || ftruncate(descriptor, static_cast<off_t>(m_bytes)) != 0) {
+		std::cerr << "Error: Could not create shared memory " << m_name << std::endl;
+		if (descriptor >= 0) {
+			::close(descriptor);
+			shm_unlink(m_name.c_str());
+		}
+		return false;
+	}
+
+	m_memory = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	::close(descriptor);
+	if (m_memory == MAP_FAILED) {
+		m_memory = nullptr;
+		shm_unlink(m_name.c_str());
+		std::cerr << "Error: Could not map shared memory " << m_name << std::endl;
+		return false;
+	}
+
+	// The segment is zero filled, so every sequence starts even
+	m_header = new (m_memory) Header();
+	m_header->dimensions = static_cast<std::uint32_t>(dimensions);
+	m_header->slots = static_cast<std::uint32_t>(slots);
+	m_header->capacity = capacity;
+	m_header->slotBytes = slot_bytes;
+	m_header->published.store(0, std::memory_order_relaxed);
+	m_header->finished.store(0, std::memory_order_relaxed);
+	m_header->producer = static_cast<std::int64_t>(getpid());
+	for (int s = 0; s < slots; ++s)
+		new (reinterpret_cast<char*>(m_memory) + header_bytes + s * slot_bytes) Slot();
+
+	m_header->version = version;
+	m_owner = true;
+
+	// Consumers check the magic last
+	std::atomic_thread_fence(std::memory_order_release);
+	m_header->magic = magic;
+	return true;
+#else
+	std::cerr << "Error: shared memory frames need a POSIX system" << std::endl;
+	return false;
+#endif
+}
+
+bool SharedFrames::attach(const std::string& name) {
+	close();
+
+#ifdef SHARED_FRAMES_POSIX
+	m_name = segmentName(name);
+
+	int descriptor = shm_open(m_name.c_str(), O_RDWR, 0);
+	if (descriptor < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(descriptor, &info) != 0 || static_cast<std::size_t>(info.st_size) < sizeof(Header)) {
+		::close(descriptor);
+		return false;
+	}
+
+	m_bytes = static_cast<std::size_t>(info.st_size);
+	m_memory = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	::close(descriptor);
+	if (m_memory == MAP_FAILED) {
+		m_memory = nullptr;
+		return false;
+	}
+
+	m_header = reinterpret_cast<Header*>(m_memory);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (m_header->magic != magic || m_header->version != version || !validLayout()) {
+		close();
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool SharedFrames::validLayout() {
+	// Checked against the mapping before slot() trusts any of it
+	const Header& header = *m_header;
+	if ((header.dimensions != 2 && header.dimensions != 3) || header.slots == 0)
+		return false;
+
+	std::size_t header_bytes = (sizeof(Header) + 63) / 64 * 64;
+	if (m_bytes < header_bytes || header.slotBytes < sizeof(Slot) || header.slotBytes > (m_bytes - header_bytes) / header.slots)
+		return false;
+
+	std::uint64_t values = (header.slotBytes - sizeof(Slot)) / sizeof(double);
+	return header.capacity <= values / (header.dimensions + 1);
+}
+
+void SharedFrames::close() {
+#ifdef SHARED_FRAMES_POSIX
+	if (m_memory) {
+		if (m_owner) {
+			m_header->finished.store(1, std::memory_order_release);
+			shm_unlink(m_name.c_str());
+		}
+		munmap(m_memory, m_bytes);
+	}
+#endif
+	m_memory = nullptr;
+	m_header = nullptr;
+	m_owner = false;
+	m_bytes = 0;
+}
+
+SharedFrames::Slot* SharedFrames::slot(std::uint64_t number) {
+	std::size_t header_bytes = (sizeof(Header) + 63) / 64 * 64;
+	char* base = reinterpret_cast<char*>(m_memory) + header_bytes;
+	return reinterpret_cast<Slot*>(base + (number % m_header->slots) * m_header->slotBytes);
+}
+
+double* SharedFrames::slotValues(Slot* slot) {
+	return reinterpret_cast<double*>(slot + 1);
+}
+
+double* SharedFrames::beginFrame(double time, std::size_t count) {
+	std::uint64_t number = m_header->published.load(std::memory_order_relaxed);
+	Slot* target = slot(number);
+
+	// Odd: readers of this slot retry until endFrame()
+	target->sequence.store(target->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	target->number = number;
+	target->time = time;
+	target->count = count;
+	return slotValues(target);
+}
+
+void SharedFrames::endFrame() {
+	std::uint64_t number = m_header->published.load(std::memory_order_relaxed);
+	Slot* target = slot(number);
+
+	target->sequence.store(target->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	m_header->published.store(number + 1, std::memory_order_release);
+}
+
+bool SharedFrames::readLatest(Frame& frame, std::uint64_t seen) {
+	if (!m_header)
+		return false;
+
+	for (int attempt = 0; attempt < 8; ++attempt) {
+		std::uint64_t published = m_header->published.load(std::memory_order_acquire);
+		if (published <= seen)
+			return false;
+
+		Slot* source = slot(published - 1);
+		std::uint64_t before = source->sequence.load(std::memory_order_acquire);
+		if (before & 1) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		frame.number = source->number;
+		frame.time = source->time;
+		frame.dimensions = static_cast<int>(m_header->dimensions);
+		frame.count = std::min<std::uint64_t>(source->count, m_header->capacity);
+		frame.values.resize(frame.count * frame.stride());
+		std::memcpy(frame.values.data(), slotValues(source), frame.values.size() * sizeof(double));
+
+		// The copy is only valid if the producer did not touch the slot meanwhile
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (source->sequence.load(std::memory_order_relaxed) == before && frame.number == published - 1)
+			return true;
+	}
+	return false;
+}
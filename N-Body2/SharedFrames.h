@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "Node.h"
+
+// One frame copied out of the ring: `stride` doubles per body, the position
+// followed by the mass
+struct Frame {
+	std::uint64_t number = 0;
+	double time = 0.0;
+	int dimensions = 0;
+	std::size_t count = 0;
+	std::vector<double> values;
+
+	std::size_t stride() const { return static_cast<std::size_t>(dimensions) + 1; }
+};
+
+/*
+	Ring of position frames in POSIX shared memory, so viewers and analysis
+	tools can attach to a running simulation.
+
+	The segment starts with a header holding the number of published frames,
+	followed by `slots` frame slots. Each slot is guarded by a seqlock: the
+	producer makes its sequence odd, writes the bodies straight from nodeList
+	and makes it even again. It never waits for readers; a reader copies a slot
+	and retries when the sequence was odd or changed under it.
+
+	Only available on Linux / POSIX systems; elsewhere create() and attach() fail.
+*/
+class SharedFrames
+{
+private:
+	static constexpr std::uint32_t magic = 0x4e424652;	// "NBFR"
+	static constexpr std::uint32_t version = 2;
+
+	struct Header {
+		std::uint32_t magic;
+		std::uint32_t version;
+		std::uint32_t dimensions;
+		std::uint32_t slots;
+		std::uint64_t capacity;					// bodies per slot
+		std::uint64_t slotBytes;
+		std::atomic<std::uint64_t> published;	// frames written so far
+		std::atomic<std::uint32_t> finished;	// set by the producer on close()
+		std::int64_t producer;					// process id of the producer
+	};
+
+	struct Slot {
+		std::atomic<std::uint64_t> sequence;	// odd while being written
+		std::uint64_t number;
+		double time;
+		std::uint64_t count;
+		// followed by capacity * (dimensions + 1) doubles
+	};
+
+	std::string m_name;
+	bool m_owner;
+	void* m_memory;
+	std::size_t m_bytes;
+	Header* m_header;
+
+public:
+	SharedFrames();
+	~SharedFrames();
+
+	SharedFrames(const SharedFrames&) = delete;
+	SharedFrames& operator=(const SharedFrames&) = delete;
+
+	// Getters
+	bool isOpen();
+	bool isFinished();
+	int getDimensions();
+	std::size_t getCapacity();
+	std::uint64_t getPublished();
+
+	// False once the producer's process is gone, also when it died without close()
+	bool isProducerAlive();
+
+	// Producer: creates the segment `name` for up to `capacity` bodies. Fails while
+	// another live producer uses the name; a ring left behind by one that died is replaced.
+	// A segment of that name that is not a ring is left alone and fails too.
+	bool create(const std::string& name, int dimensions, std::size_t capacity, int slots = 4);
+
+	// Consumer: maps the segment of a running producer. Fails unless the header is
+	// complete and its slots fit into the segment.
+	bool attach(const std::string& name);
+
+	// Unmaps; the producer also marks the ring finished and removes the name
+	void close();
+
+	// Writes `bodies` (a std::vector or a BodyFrame, at most getCapacity() of them) into the next slot
+	template <typename Bodies>
+	void publish(double time, const Bodies& bodies) {
+		using VecType = std::decay_t<decltype(bodies[0].position)>;
+		if (!m_owner || m_header->dimensions != static_cast<std::uint32_t>(VecType::length()))
+			return;
+
+		std::size_t count = std::min<std::size_t>(bodies.size(), m_header->capacity);
+		double* values = beginFrame(time, count);
+		const std::size_t stride = m_header->dimensions + 1;
+
+		for (std::size_t i = 0; i < count; ++i) {
+			for (int d = 0; d < VecType::length(); ++d)
+				values[i * stride + d] = bodies[i].position[d];
+			values[i * stride + VecType::length()] = bodies[i].mass;
+		}
+		endFrame();
+	}
+
+	// Copies the newest frame if more than `seen` frames have been published
+	// (pass the last frame's number + 1). Returns false when there is none, or
+	// when the producer kept overwriting it.
+	bool readLatest(Frame& frame, std::uint64_t seen = 0);
+
+private:
+	// Whether the header's slots fit into the mapping, for a segment made by someone else
+	bool validLayout();
+
+	Slot* slot(std::uint64_t number);
+	double* slotValues(Slot* slot);
+
+	// Opens the slot of the next frame for writing / publishes it
+	double* beginFrame(double time, std::size_t count);
+	void endFrame();
+};
@@ -0,0 +1,309 @@
+#include "Transport.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#if defined(__linux__) || defined(__unix__)
+#define TRANSPORT_POSIX
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+std::vector<int> Transport::s_children;
+
+MessageBuffer::MessageBuffer() :
+	data(),
+	m_cursor(0)
+{}
+
+MessageBuffer::MessageBuffer(std::vector<char> bytes) :
+	data(std::move(bytes)),
+	m_cursor(0)
+{}
+
+void MessageBuffer::writeString(const std::string& text) {
+	write<std::uint32_t>(static_cast<std::uint32_t>(text.size()));
+	data.insert(data.end(), text.begin(), text.end());
+}
+
+std::string MessageBuffer::readString() {
+	std::uint32_t length = read<std::uint32_t>();
+	std::string text(data.data() + m_cursor, length);
+	m_cursor += length;
+	return text;
+}
+
+bool MessageBuffer::finished() const {
+	return m_cursor >= data.size();
+}
+
+Transport::Transport() :
+	m_rank(0),
+	m_size(1),
+	m_sockets()
+{}
+
+Transport::~Transport() {
+	close();
+}
+
+int Transport::getRank() {
+	return m_rank;
+}
+
+int Transport::getSize() {
+	return m_size;
+}
+
+int Transport::spawn(int size) {
+#ifdef TRANSPORT_POSIX
+	for (int rank = 1; rank < size; ++rank) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			s_children.clear();
+			return rank;
+		}
+		if (pid < 0) {
+			std::cerr << "Error: could not start rank " << rank << std::endl;
+			break;
+		}
+		s_children.push_back(static_cast<int>(pid));
+	}
+#endif
+	return 0;
+}
+
+bool Transport::open(int rank, int size, int basePort) {
+	m_rank = rank;
+	m_size = size;
+	m_sockets.assign(size, -1);
+
+	if (size <= 1)
+		return true;
+
+#ifdef TRANSPORT_POSIX
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int enable = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(static_cast<uint16_t>(basePort + rank));
+
+	if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, size) != 0) {
+		std::cerr << "Error: rank " << rank << " could not listen on port " << basePort + rank << std::endl;
+		::close(listener);
+		return false;
+	}
+
+	// Connect to every lower rank, retrying while it starts up
+	for (int other = 0; other < rank; ++other) {
+		sockaddr_in target{};
+		target.sin_family = AF_INET;
+		target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		target.sin_port = htons(static_cast<uint16_t>(basePort + other));
+
+		int connection = -1;
+		for (int attempt = 0; attempt < 200 && connection < 0; ++attempt) {
+			connection = socket(AF_INET, SOCK_STREAM, 0);
+			if (connect(connection, reinterpret_cast<sockaddr*>(&target), sizeof(target)) != 0) {
+				::close(connection);
+				connection = -1;
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			}
+		}
+
+		if (connection < 0) {
+			std::cerr << "Error: rank " << rank << " could not reach rank " << other << std::endl;
+			::close(listener);
+			return false;
+		}
+
+		std::int32_t self = rank;
+		sendAll(connection, reinterpret_cast<const char*>(&self), sizeof(self));
+		m_sockets[other] = connection;
+	}
+
+	// Accept every higher rank; they identify themselves first
+	for (int accepted = rank + 1; accepted < size; ++accepted) {
+		int connection = accept(listener, nullptr, nullptr);
+		std::int32_t other = -1;
+
+		if (connection < 0 || !receiveAll(connection, reinterpret_cast<char*>(&other), sizeof(other)) || other <= rank || other >= size) {
+			std::cerr << "Error: rank " << rank << " received an invalid connection" << std::endl;
+			::close(listener);
+			return false;
+		}
+		m_sockets[other] = connection;
+	}
+	::close(listener);
+
+	for (int connection : m_sockets) {
+		if (connection >= 0)
+			setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	}
+	return true;
+#else
+	std::cerr << "Error: multiple ranks are only supported on Linux" << std::endl;
+	return false;
+#endif
+}
+
+void Transport::close() {
+#ifdef TRANSPORT_POSIX
+	for (int& connection : m_sockets) {
+		if (connection >= 0)
+			::close(connection);
+		connection = -1;
+	}
+
+	for (int child : s_children) {
+		waitpid(static_cast<pid_t>(child), nullptr, 0);
+	}
+	s_children.clear();
+#endif
+	m_sockets.clear();
+}
+
+std::vector<std::vector<char>> Transport::exchange(const std::vector<std::vector<char>>& outgoing) {
+	std::vector<std::vector<char>> incoming(m_size);
+	incoming[m_rank] = outgoing[m_rank];
+
+	if (m_size <= 1)
+		return incoming;
+
+	// Sends run on their own thread so two ranks sending large messages to each
+	// other cannot both block on full socket buffers
+	std::atomic<int> failed_send(-1);
+	int send_error = 0;	// errno is per thread, so both sides keep their own
+	std::thread sender([&]() {
+		for (int other = 0; other < m_size; ++other) {
+			if (other == m_rank)
+				continue;
+
+			std::uint64_t length = outgoing[other].size();
+			if (!sendAll(m_sockets[other], reinterpret_cast<const char*>(&length), sizeof(length))
+				|| !sendAll(m_sockets[other], outgoing[other].data(), outgoing[other].size())) {
+				send_error = errno;
+				failed_send = other;
+				return;
+			}
+		}
+	});
+
+	int failed_receive = -1;
+	int receive_error = 0;
+	for (int other = 0; other < m_size && failed_receive < 0 && failed_send < 0; ++other) {
+		if (other == m_rank)
+			continue;
+
+		std::uint64_t length = 0;
+		bool received = receiveAll(m_sockets[other], reinterpret_cast<char*>(&length), sizeof(length));
+		if (received) {
+			incoming[other].resize(length);
+			received = receiveAll(m_sockets[other], incoming[other].data(), length);
+		}
+		if (!received) {
+			receive_error = errno;
+			failed_receive = other;
+		}
+	}
+
+	// A sender blocked on a peer that stopped reading is woken by shutting the sockets down
+	if (failed_receive >= 0)
+		shutdownAll();
+	sender.join();
+
+	if (failed_receive >= 0)
+		fail("receive from", failed_receive, receive_error);
+	if (failed_send >= 0)
+		fail("send to", failed_send, send_error);
+	return incoming;
+}
+
+std::vector<double> Transport::allGather(double value) {
+	MessageBuffer message;
+	message.write(value);
+
+	std::vector<std::vector<char>> outgoing(m_size, message.data);
+	std::vector<std::vector<char>> incoming = exchange(outgoing);
+
+	std::vector<double> values(m_size);
+	for (int rank = 0; rank < m_size; ++rank) {
+		values[rank] = MessageBuffer(incoming[rank]).read<double>();
+	}
+	return values;
+}
+
+void Transport::barrier() {
+	exchange(std::vector<std::vector<char>>(m_size));
+}
+
+void Transport::shutdownAll() {
+#ifdef TRANSPORT_POSIX
+	for (int connection : m_sockets) {
+		if (connection >= 0)
+			shutdown(connection, SHUT_RDWR);
+	}
+#endif
+}
+
+// Partial ghosts or migrants would silently corrupt the step, so a rank that
+// loses a peer stops; closing its sockets makes the other ranks stop as well
+void Transport::fail(const char* what, int other, int error) {
+	std::cerr << "Error: rank " << m_rank << " could not " << what << " rank " << other;
+	if (error != 0)
+		std::cerr << " (" << std::strerror(error) << ")";
+	std::cerr << ", stopping the run" << std::endl;
+
+	shutdownAll();
+	std::exit(EXIT_FAILURE);
+}
+
+// Both loop until the whole buffer went through; false when the peer closed the
+// connection or the socket failed
+bool Transport::sendAll(int socket, const char* data, std::size_t size) {
+#ifdef TRANSPORT_POSIX
+	while (size > 0) {
+		ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		data += sent;
+		size -= static_cast<std::size_t>(sent);
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Transport::receiveAll(int socket, char* data, std::size_t size) {
+#ifdef TRANSPORT_POSIX
+	while (size > 0) {
+		ssize_t received = recv(socket, data, size, 0);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received == 0)
+			errno = ECONNRESET;
+		if (received <= 0)
+			return false;
+		data += received;
+		size -= static_cast<std::size_t>(received);
+	}
+	return true;
+#else
+	return false;
+#endif
+}
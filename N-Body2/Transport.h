@@ -0,0 +1,93 @@
+#pragma once
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Byte buffer used to pack messages exchanged between ranks
+class MessageBuffer
+{
+public:
+	std::vector<char> data;
+
+private:
+	std::size_t m_cursor;
+
+public:
+	MessageBuffer();
+	MessageBuffer(std::vector<char> bytes);
+
+	// Appends / reads a trivially copyable value
+	template <typename T>
+	void write(const T& value) {
+		static_assert(std::is_trivially_copyable<T>::value, "MessageBuffer can only write trivially copyable types");
+		const char* bytes = reinterpret_cast<const char*>(&value);
+		data.insert(data.end(), bytes, bytes + sizeof(T));
+	}
+
+	template <typename T>
+	T read() {
+		T value;
+		std::memcpy(&value, data.data() + m_cursor, sizeof(T));
+		m_cursor += sizeof(T);
+		return value;
+	}
+
+	void writeString(const std::string& text);
+	std::string readString();
+
+	// True once every written value has been read
+	bool finished() const;
+};
+
+/*
+	Message passing between the processes ("ranks") of one simulation on a single
+	machine. Every pair of ranks shares a localhost TCP connection; rank r listens
+	on basePort + r and connects to every lower rank.
+
+	Only available on Linux / POSIX systems; elsewhere open() fails and the
+	simulation stays in a single process.
+*/
+class Transport
+{
+private:
+	int m_rank;
+	int m_size;
+	std::vector<int> m_sockets;
+
+	// Worker processes started by spawn(), waited for in close()
+	static std::vector<int> s_children;
+
+public:
+	Transport();
+	~Transport();
+
+	// Getters
+	int getRank();
+	int getSize();
+
+	// Forks size - 1 copies of the calling process. Returns the rank of the
+	// caller: 0 in the original process, 1 .. size - 1 in the copies.
+	static int spawn(int size);
+
+	// Connects every rank to every other rank. Returns false on failure.
+	bool open(int rank, int size, int basePort);
+	void close();
+
+	// Sends outgoing[r] to every other rank r and returns what each rank sent
+	// to this one (the entry for this rank is outgoing[rank] itself). A failed or
+	// closed connection ends the process with an error message.
+	std::vector<std::vector<char>> exchange(const std::vector<std::vector<char>>& outgoing);
+
+	// Every rank's `value`, indexed by rank
+	std::vector<double> allGather(double value);
+
+	void barrier();
+
+private:
+	void shutdownAll();
+	[[noreturn]] void fail(const char* what, int other, int error);
+
+	static bool sendAll(int socket, const char* data, std::size_t size);
+	static bool receiveAll(int socket, char* data, std::size_t size);
+};
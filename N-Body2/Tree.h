@@ -10,6 +10,7 @@
 #include "constants.h"
 #include "BoxBase.h"
 #include "Node.h"
+#include "TreePolicy.h"
 #include "Utils.h"
 
 /*********************
@@ -55,23 +56,57 @@ methods:
 	     	+--------------+--------------+
 
 */
-// Primary template: Not defined to trigger a compile-time error for unsupported types
 template <typename VecType>
-struct TreePartitions;
+class TreeWrapper;
 
-// Specialization for glm::dvec2
-template <>
-struct TreePartitions<glm::dvec2> {
-	static constexpr size_t value = 4;
-};
+template <typename VecType>
+class Fmm;
+
+template <typename VecType>
+class Tree;
 
-// Specialization for glm::dvec3
-template <>
-struct TreePartitions<glm::dvec3> {
-	static constexpr size_t value = 8;
+// A cell left by Tree::partitionBodies for insertBody, with the bodies it receives
+template <typename VecType>
+struct PendingCell {
+	Tree<VecType>* cell;
+	std::vector<Node<VecType>*> bodies;
 };
+
+// Result of a nearest-neighbour query. `body` points at the copy stored in the
+// tree, so it is only valid until the tree is rebuilt.
 template <typename VecType>
-class TreeWrapper;
+struct Neighbour {
+	const Node<VecType>* body;
+	double distanceSquared;
+};
+
+// Shape of a tree, filled in by Tree::collectStatistics. Vectors are indexed by level (root = 0).
+struct TreeStatistics {
+	std::vector<std::size_t> cells;
+	std::vector<std::size_t> bodies;	// bodies in leaves at that level: the depth histogram
+	std::vector<std::size_t> empty;		// leaves without a body
+	std::size_t bytes = 0;				// cells, their allocations and the names they store
+
+	// Bodies insertBody dropped because they were outside the root (set by TreeWrapper)
+	std::size_t dropped = 0;			// by the last build
+	std::size_t totalDropped = 0;		// since the start of the run
+
+	int depth() const { return static_cast<int>(cells.size()) - 1; }
+
+	std::size_t totalCells() const {
+		std::size_t total = 0;
+		for (std::size_t count : cells)
+			total += count;
+		return total;
+	}
+
+	double emptyFraction() const {
+		std::size_t total = totalCells(), leaves = 0;
+		for (std::size_t count : empty)
+			leaves += count;
+		return total > 0 ? static_cast<double>(leaves) / total : 0.0;
+	}
+};
 
 template <typename VecType>
 class Tree
@@ -79,6 +114,9 @@ class Tree
 	template <typename VecType>
 	friend class TreeWrapper;
 
+	template <typename VecType>
+	friend class Fmm;
+
 private:
 
 	// Actual data
@@ -87,25 +125,30 @@ private:
 	// Region defining the Tree
 	Box<VecType> m_boundingBox;
 
+	// Geometry of the cells; the walk's kernels come from TreeWrapper::withPolicy
+	using Policy = TreePolicy<VecType>;
+
 	// Children: total number based on glm::dvec2 (4) or glm::dvec3 (8)
-	static constexpr size_t partitions = TreePartitions<VecType>::value;
+	static constexpr size_t partitions = Policy::partitions;
 	std::array<std::shared_ptr<Tree<VecType>>, partitions> m_children;
 
 	VecType m_centerOfMass;
 
-	// Array of unit directions to aid finding / creating regions
-	static const glm::dvec3 basis[8];
-
 	double m_totalMass;
 
-	// Barnes-Hut threshold
-	static double m_theta;
-
-	// Error threshold
- 	static double m_epsilon;
+	// Barnes-Hut threshold and error threshold of this tree. Every cell holds the
+	// values of its root, so a walk reads them from the cell it is at.
+	static constexpr double defaultTheta = 0.5;
+	static constexpr double defaultEpsilon = 1e-3;
+	double m_theta;
+	double m_epsilon;
 
 	// Total number of Nodes contained in all the leaves
 	int m_totalDescendants;
+
+	// Largest body radius contained in this region, used to inflate the
+	// bounds for overlap queries
+	double m_maxRadius;
 	
 public:
 	// Members
@@ -125,7 +168,7 @@ public:
 public:
 	Tree<VecType>(Box<VecType> boundingBox);
 	Tree<VecType>(Box<VecType> boundingBox, Node<VecType>& body);
-	Tree<VecType>(Box<VecType> boundingBox, double& theta, double& epsilon);
+	Tree<VecType>(Box<VecType> boundingBox, double theta, double epsilon);
 
 	// Returns QuadTree child at childIndex
 	std::shared_ptr<Tree<VecType>>& operator[](std::size_t childIndex);
@@ -133,16 +176,17 @@ public:
 	// Getters
 	double getLength();
 	double getMass();
-	double& getTheta();
-	double& getEpsilon();
+	double getMaxRadius();
+	double getTheta();
+	double getEpsilon();
 
 	int getTotalDescendants();
 
 	glm::dvec3 getBoundingBoxColor();
 
-	// Setters
-	void setTheta(double& newTheta);
-	void setEpsilon(double& newEpsilon);
+	// Setters; theta and epsilon apply to the whole subtree
+	void setTheta(double newTheta);
+	void setEpsilon(double newEpsilon);
 	void setBoundingBoxColor(const glm::dvec3& color);
 
 	// bool
@@ -154,6 +198,49 @@ public:
 	void insertBody(Node<VecType>& body);
 	void updateCenterOfMass(Node<VecType>& body);
 
+	// Split insertion, so the lower levels can be built by several threads.
+	// partitionBodies lays out the cells `depth` levels down exactly as
+	// inserting `bodies` one by one would, and returns in `pending` the cells
+	// still to be filled by calling insertBody with their bodies. Once every
+	// pending cell is filled, finishInsertion(depth) totals the levels above.
+	void partitionBodies(std::vector<Node<VecType>*>& bodies, int depth, std::vector<PendingCell<VecType>>& pending);
+	void finishInsertion(int depth);
+
+	// Collects the bodies whose radius overlaps `body`s radius. Cells are pruned
+	// when their bounds, inflated by body.radius + m_maxRadius, miss the body.
+	// Only bodies with a greater id are returned so each pair is reported once.
+	void queryOverlaps(const Node<VecType>& body, std::vector<const Node<VecType>*>& overlaps);
+
+	// Spatial queries. Results point at the bodies stored in the tree.
+
+	// Appends every body within `radius` of `point`
+	void queryRange(const VecType& point, double radius, std::vector<const Node<VecType>*>& results);
+
+	// Appends every body inside `region`
+	void queryBox(const Box<VecType>& region, std::vector<const Node<VecType>*>& results);
+
+	// Finds the k bodies nearest to `point`, sorted by distance. The body with
+	// id `excludeId` (usually the query body itself) is skipped.
+	void kNearest(const VecType& point, std::size_t k, std::vector<Neighbour<VecType>>& results, int excludeId = -1);
+
+	// Mass density estimated from the k nearest bodies: their mass over the
+	// volume (area in 2D) of the sphere reaching the k-th neighbour
+	double localDensity(const VecType& point, std::size_t k, int excludeId = -1);
+
+	// Batched versions over all `bodies`, each excluding itself. The tree is
+	// only read, so the queries are split across threads (0 = all cores).
+	void kNearestBatch(const std::vector<Node<VecType>>& bodies, std::size_t k, std::vector<std::vector<Neighbour<VecType>>>& results, unsigned int threads = 0);
+	void localDensityBatch(const std::vector<Node<VecType>>& bodies, std::size_t k, std::vector<double>& densities, unsigned int threads = 0);
+
+	// Locally essential part of the tree as seen from `region`: cells that pass
+	// the opening criterion for every point of `region` are appended as one
+	// pseudo-body at their center of mass, closer cells are opened down to the
+	// bodies. Only position and mass of the appended nodes are meaningful.
+	void collectEssential(const Box<VecType>& region, std::vector<Node<VecType>>& essential);
+
+	// Adds this cell and everything below it to `stats`, counting this cell at `level`
+	void collectStatistics(TreeStatistics& stats, int level = 0);
+
 
 	// returns the parent container for a point assuming an unbounded box
 	// if a Box has center point, < 1, 1 >, then point < 50, 50 > is considerd
@@ -162,9 +249,17 @@ public:
 	// Use: to find which portion of a smaller tree a point belongs to in order to 
 	// force the tree to grow to contain it.
 	Region findRegion(VecType& point);
+
+private:
+	// Recursive k-NN step. `heap` is a max-heap on distance holding at most k entries.
+	void collectNearest(const VecType& point, std::size_t k, int excludeId, std::vector<Neighbour<VecType>>& heap);
 };
 using Tree2D = Tree<glm::dvec2>;
 using Tree3D = Tree<glm::dvec3>;
 #include "Tree.tpp"
+
+// Instantiated once, in Instantiations.cpp
+extern template class Tree<glm::dvec2>;
+extern template class Tree<glm::dvec3>;
 #endif
 
@@ -2,49 +2,42 @@
 #define TREE_TPP
 #include "Tree.h"
 #include <iostream>
-
-template <typename VecType>
-const glm::dvec3 Tree<VecType>::basis[8] = {
-	glm::dvec3(-1, -1, -1), // Index 0: bSOUTHWEST
-	glm::dvec3(1, -1, -1),  // Index 1: bSOUTHEAST
-	glm::dvec3(-1, 1, -1),  // Index 2: bNORTHWEST
-	glm::dvec3(1, 1, -1),   // Index 3: bNORTHEAST
-	glm::dvec3(-1, -1, 1),  // Index 4: tSOUTHWEST
-	glm::dvec3(1, -1, 1),   // Index 5: tSOUTHEAST
-	glm::dvec3(-1, 1, 1),   // Index 6: tNORTHWEST
-	glm::dvec3(1, 1, 1)     // Index 7: tNORTHEAST
-};
-
-template <typename VecType>
-double Tree<VecType>::m_theta = 0.5;
-template <typename VecType>
-double Tree<VecType>::m_epsilon = 1e-3;
+#include <algorithm>
 
 template <typename VecType>
 Tree<VecType>::Tree(Box<VecType> boundingBox, Node<VecType>& body)://, std::weak_ptr<OctTree> parent) :
-	m_centerOfMass(VecType(0)),
-	m_boundingBox(boundingBox),
 	m_body(body),
+	m_boundingBox(boundingBox),
+	m_centerOfMass(VecType(0)),
+	m_totalMass(0),
+	m_theta(defaultTheta),
+	m_epsilon(defaultEpsilon),
 	m_totalDescendants(0),
-	m_totalMass(0)
+	m_maxRadius(0)
 {
 }
 
 template <typename VecType>
 Tree<VecType>::Tree(Box<VecType> boundingBox)://, std::weak_ptr<OctTree> parent) :
-	m_totalDescendants(0),
-	m_totalMass(0),
 	m_boundingBox(boundingBox),
-	m_centerOfMass(VecType(0))
+	m_centerOfMass(VecType(0)),
+	m_totalMass(0),
+	m_theta(defaultTheta),
+	m_epsilon(defaultEpsilon),
+	m_totalDescendants(0),
+	m_maxRadius(0)
 {
 }
 
 template <typename VecType>
-Tree<VecType>::Tree(Box<VecType> boundingBox, double& theta, double& epsilon) :
+Tree<VecType>::Tree(Box<VecType> boundingBox, double theta, double epsilon) :
 	m_boundingBox(boundingBox),
 	m_centerOfMass(VecType(0)),
 	m_totalMass(0),
-	m_totalDescendants(0)
+	m_theta(theta),
+	m_epsilon(epsilon),
+	m_totalDescendants(0),
+	m_maxRadius(0)
 {
 }
 
@@ -64,23 +57,36 @@ double Tree<VecType>::getMass() {
 }
 
 template <typename VecType>
-double& Tree<VecType>::getTheta() {
+double Tree<VecType>::getMaxRadius() {
+	return m_maxRadius;
+}
+
+template <typename VecType>
+double Tree<VecType>::getTheta() {
 	return m_theta;
 }
 
 template <typename VecType>
-void Tree<VecType>::setTheta(double& theta) {
+void Tree<VecType>::setTheta(double theta) {
 	m_theta = theta;
+	for (auto& child : m_children) {
+		if (child)
+			child->setTheta(theta);
+	}
 }
 
 template <typename VecType>
-double& Tree<VecType>::getEpsilon() {
+double Tree<VecType>::getEpsilon() {
 	return m_epsilon;
 }
 
 template <typename VecType>
-void Tree<VecType>::setEpsilon(double& epsilon) {
+void Tree<VecType>::setEpsilon(double epsilon) {
 	m_epsilon = epsilon;
+	for (auto& child : m_children) {
+		if (child)
+			child->setEpsilon(epsilon);
+	}
 }
 
 template <typename VecType>
@@ -117,16 +123,16 @@ void Tree<VecType>::subdivide()
 	// retrieve once and use in loop
 	VecType thisCenter = m_boundingBox.center;
 
-	int i = 0;
-	for (auto& child : m_children)
+	for (std::size_t i = 0; i < partitions; ++i)
 	{
-		child = std::make_shared<Tree<VecType>>(
+		m_children[i] = std::make_shared<Tree<VecType>>(
 			Box<VecType>(
-				thisCenter + halfLength * (VecType(basis[i])),
+				thisCenter + halfLength * Policy::childOffset(i),
 				halfLength,
 				halfLength,
-				halfLength));
-		++i;
+				halfLength),
+			m_theta,
+			m_epsilon);
 	}
 }
 
@@ -148,25 +154,13 @@ typename Tree<VecType>::Region Tree<VecType>::findRegion(VecType& point) {
 	VecType center = m_boundingBox.center;
 	int index = 0;
 
-	if (point.x > center.x) index |= 1;  // 1 if east, 0 if west
-	if (point.y > center.y) index |= 2;  // 1 if north, 0 if south
-
-	if constexpr (VecDimensions<VecType>::value == 3) {
-		if (point.z > center.z) index |= 4;  // 1 if top, 0 if bottom
+	// Bit d is set above the center along axis d: east, north, top. Region is numbered the same way.
+	for (int d = 0; d < Policy::dimensions; ++d) {
+		if (point[d] > center[d])
+			index |= 1 << d;
 	}
 
-	// Lookup table for quadrants
-	switch (index) {
-	case 0: return Tree::bSOUTHWEST;  // (west, south, bottom)
-	case 1: return Tree::bSOUTHEAST;  // (east, south, bottom)
-	case 2: return Tree::bNORTHWEST;  // (west, north, bottom)
-	case 3: return Tree::bNORTHEAST;  // (east, north, bottom)
-	case 4: return Tree::tSOUTHWEST;  // (west, south, top)
-	case 5: return Tree::tSOUTHEAST;  // (east, south, top)
-	case 6: return Tree::tNORTHWEST;  // (west, north, top)
-	case 7: return Tree::tNORTHEAST;  // (east, north, top)
-	default: return Tree::QVOID;  // Should never happen
-	}
+	return static_cast<Region>(index);
 }
 
 template <typename VecType>
@@ -181,6 +175,9 @@ void Tree<VecType>::insertBody(Node<VecType>& body)
 	++m_totalDescendants;
 	updateCenterOfMass(body);
 
+	if (body.radius > m_maxRadius)
+		m_maxRadius = body.radius;
+
 	octant = findRegion(body.position);
 
 	if (m_body.getId() == -1 && isLeaf()) {
@@ -221,4 +218,315 @@ void Tree<VecType>::insertBody(Node<VecType>& body)
 	return;
 }
 
+template <typename VecType>
+void Tree<VecType>::partitionBodies(std::vector<Node<VecType>*>& bodies, int depth, std::vector<PendingCell<VecType>>& pending)
+{
+	// insertBody drops bodies outside the tree
+	std::vector<Node<VecType>*> inside;
+	for (Node<VecType>* body : bodies)
+	{
+		if (inBounds(body->position))
+			inside.push_back(body);
+	}
+
+	if (inside.empty())
+		return;
+
+	// A single body becomes this leaf's body, as in insertBody
+	if (inside.size() == 1 || depth == 0)
+	{
+		pending.push_back(PendingCell<VecType>{ this, std::move(inside) });
+		return;
+	}
+
+	subdivide();
+
+	std::array<std::vector<Node<VecType>*>, partitions> regions;
+	for (Node<VecType>* body : inside)
+	{
+		regions[findRegion(body->position)].push_back(body);
+	}
+
+	for (std::size_t i = 0; i < partitions; ++i)
+	{
+		m_children[i]->partitionBodies(regions[i], depth - 1, pending);
+	}
+}
+
+template <typename VecType>
+void Tree<VecType>::finishInsertion(int depth)
+{
+	// Pending cells and leaves were filled by insertBody
+	if (depth == 0 || isLeaf())
+		return;
+
+	m_totalDescendants = 0;
+	m_totalMass = 0.0;
+	m_maxRadius = 0.0;
+	VecType weighted(0);
+
+	for (auto& child : m_children)
+	{
+		child->finishInsertion(depth - 1);
+
+		m_totalDescendants += child->m_totalDescendants;
+		m_totalMass += child->m_totalMass;
+		weighted += child->m_totalMass * child->m_centerOfMass;
+
+		if (child->m_maxRadius > m_maxRadius)
+			m_maxRadius = child->m_maxRadius;
+	}
+
+	m_centerOfMass = m_totalMass > 0.0 ? weighted / m_totalMass : VecType(0);
+}
+
+template <typename VecType>
+void Tree<VecType>::queryOverlaps(const Node<VecType>& body, std::vector<const Node<VecType>*>& overlaps)
+{
+	if (m_totalDescendants == 0 || !m_boundingBox.intersects(body.position, body.radius + m_maxRadius))
+		return;
+
+	if (isLeaf())
+	{
+		if (m_body.getId() > body.getId())
+		{
+			double reach = body.radius + m_body.radius;
+			VecType distance = m_body.position - body.position;
+
+			if (glm::dot(distance, distance) < reach * reach)
+				overlaps.push_back(&m_body);
+		}
+		return;
+	}
+
+	for (auto& child : m_children)
+	{
+		child->queryOverlaps(body, overlaps);
+	}
+}
+
+template <typename VecType>
+void Tree<VecType>::collectEssential(const Box<VecType>& region, std::vector<Node<VecType>>& essential)
+{
+	if (m_totalDescendants == 0)
+		return;
+
+	if (isLeaf())
+	{
+		essential.push_back(m_body);
+		return;
+	}
+
+	// The closest point of `region` sees the cell under the largest angle
+	double distanceSquared = region.distanceSquared(m_centerOfMass);
+	double length = getLength();
+
+	if (distanceSquared > 0.0 && length * length < m_theta * m_theta * distanceSquared)
+	{
+		essential.push_back(Node<VecType>(-1, "", m_centerOfMass, VecType(0), m_totalMass, 0.0));
+		return;
+	}
+
+	for (auto& child : m_children)
+	{
+		child->collectEssential(region, essential);
+	}
+}
+
+template <typename VecType>
+void Tree<VecType>::collectStatistics(TreeStatistics& stats, int level)
+{
+	if (stats.cells.size() <= static_cast<std::size_t>(level))
+	{
+		stats.cells.resize(level + 1, 0);
+		stats.bodies.resize(level + 1, 0);
+		stats.empty.resize(level + 1, 0);
+	}
+
+	++stats.cells[level];
+
+	// make_shared puts the control block (two counters) next to the cell
+	stats.bytes += sizeof(Tree<VecType>) + 2 * sizeof(long);
+
+	// Names too long for the small string buffer live on the heap
+	const char* name = m_body.name.data();
+	const char* inline_begin = reinterpret_cast<const char*>(&m_body.name);
+	if (name < inline_begin || name >= inline_begin + sizeof(std::string))
+		stats.bytes += m_body.name.capacity() + 1;
+
+	if (isLeaf())
+	{
+		if (m_body.getId() == -1)
+			++stats.empty[level];
+		else
+			++stats.bodies[level];
+		return;
+	}
+
+	for (auto& child : m_children)
+	{
+		child->collectStatistics(stats, level + 1);
+	}
+}
+
+template <typename VecType>
+void Tree<VecType>::queryRange(const VecType& point, double radius, std::vector<const Node<VecType>*>& results)
+{
+	if (m_totalDescendants == 0 || !m_boundingBox.intersects(point, radius))
+		return;
+
+	if (isLeaf())
+	{
+		VecType distance = m_body.position - point;
+		if (glm::dot(distance, distance) <= radius * radius)
+			results.push_back(&m_body);
+		return;
+	}
+
+	for (auto& child : m_children)
+	{
+		child->queryRange(point, radius, results);
+	}
+}
+
+template <typename VecType>
+void Tree<VecType>::queryBox(const Box<VecType>& region, std::vector<const Node<VecType>*>& results)
+{
+	if (m_totalDescendants == 0 || !m_boundingBox.intersects(region))
+		return;
+
+	if (isLeaf())
+	{
+		if (region.contains(m_body.position))
+			results.push_back(&m_body);
+		return;
+	}
+
+	for (auto& child : m_children)
+	{
+		child->queryBox(region, results);
+	}
+}
+
+template <typename VecType>
+void Tree<VecType>::kNearest(const VecType& point, std::size_t k, std::vector<Neighbour<VecType>>& results, int excludeId)
+{
+	results.clear();
+	if (k == 0)
+		return;
+
+	results.reserve(k);
+	collectNearest(point, k, excludeId, results);
+
+	// sort_heap leaves the max-heap in ascending distance order
+	std::sort_heap(results.begin(), results.end(), [](const Neighbour<VecType>& a, const Neighbour<VecType>& b) {
+		return a.distanceSquared < b.distanceSquared;
+	});
+}
+
+template <typename VecType>
+void Tree<VecType>::collectNearest(const VecType& point, std::size_t k, int excludeId, std::vector<Neighbour<VecType>>& heap)
+{
+	auto closer = [](const Neighbour<VecType>& a, const Neighbour<VecType>& b) {
+		return a.distanceSquared < b.distanceSquared;
+	};
+
+	if (m_totalDescendants == 0)
+		return;
+
+	// Nothing in this cell can beat the current k-th neighbour
+	if (heap.size() == k && m_boundingBox.distanceSquared(point) >= heap.front().distanceSquared)
+		return;
+
+	if (isLeaf())
+	{
+		if (m_body.getId() == excludeId)
+			return;
+
+		VecType distance = m_body.position - point;
+		Neighbour<VecType> candidate = { &m_body, glm::dot(distance, distance) };
+
+		if (heap.size() < k)
+		{
+			heap.push_back(candidate);
+			std::push_heap(heap.begin(), heap.end(), closer);
+		}
+		else if (candidate.distanceSquared < heap.front().distanceSquared)
+		{
+			std::pop_heap(heap.begin(), heap.end(), closer);
+			heap.back() = candidate;
+			std::push_heap(heap.begin(), heap.end(), closer);
+		}
+		return;
+	}
+
+	// Visit the nearest children first so the heap tightens quickly
+	std::array<std::pair<double, Tree<VecType>*>, partitions> order;
+	for (std::size_t i = 0; i < partitions; ++i)
+	{
+		order[i] = { m_children[i]->m_boundingBox.distanceSquared(point), m_children[i].get() };
+	}
+	std::sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	for (auto& child : order)
+	{
+		child.second->collectNearest(point, k, excludeId, heap);
+	}
+}
+
+template <typename VecType>
+double Tree<VecType>::localDensity(const VecType& point, std::size_t k, int excludeId)
+{
+	std::vector<Neighbour<VecType>> neighbours;
+	kNearest(point, k, neighbours, excludeId);
+
+	if (neighbours.empty())
+		return 0.0;
+
+	double mass = 0.0;
+	for (auto& neighbour : neighbours)
+	{
+		mass += neighbour.body->mass;
+	}
+
+	double radiusSquared = neighbours.back().distanceSquared;
+	double volume;
+	if constexpr (VecDimensions<VecType>::value == 3)
+	{
+		volume = 4.0 / 3.0 * M_PI * radiusSquared * std::sqrt(radiusSquared);
+	}
+	else
+	{
+		volume = M_PI * radiusSquared;
+	}
+
+	return volume > 0.0 ? mass / volume : 0.0;
+}
+
+template <typename VecType>
+void Tree<VecType>::kNearestBatch(const std::vector<Node<VecType>>& bodies, std::size_t k, std::vector<std::vector<Neighbour<VecType>>>& results, unsigned int threads)
+{
+	results.resize(bodies.size());
+
+	Utils::parallelFor(bodies.size(), threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i)
+		{
+			kNearest(bodies[i].position, k, results[i], bodies[i].getId());
+		}
+	});
+}
+
+template <typename VecType>
+void Tree<VecType>::localDensityBatch(const std::vector<Node<VecType>>& bodies, std::size_t k, std::vector<double>& densities, unsigned int threads)
+{
+	densities.resize(bodies.size());
+
+	Utils::parallelFor(bodies.size(), threads, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t i = begin; i < end; ++i)
+		{
+			densities[i] = localDensity(bodies[i].position, k, bodies[i].getId());
+		}
+	});
+}
+
 #endif
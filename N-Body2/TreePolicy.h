@@ -0,0 +1,74 @@
+#ifndef TREEPOLICY_H
+#define TREEPOLICY_H
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+#include "Node.h"
+
+// Pairwise force kernel of the tree walk and the direct sum
+enum Softening {
+	SOFTENING_NONE = 0,		// Newtonian; pairs closer than epsilon are skipped with a warning
+	SOFTENING_PLUMMER = 1	// 1 / (r^2 + epsilon^2), epsilon is the softening length
+};
+
+/*
+	Compile-time configuration of the tree, its walk and the force kernel.
+	Everything the inner loops branch on is a constant here, so the child loops
+	have a fixed trip count and unroll, and the kernel of the other softening
+	disappears from the walk. main() picks the dimension once, TreeWrapper picks
+	the kernel once per force pass (see TreeWrapper::withPolicy); every
+	combination is instantiated in Instantiations.cpp.
+
+	Leaves hold a single body and the FMM keeps its runtime --fmm-order, so
+	neither is a parameter.
+*/
+template <typename VecType, Softening Kernel = SOFTENING_NONE>
+struct TreePolicy {
+	using Vector = VecType;
+	using Scalar = typename VecType::value_type;
+
+	static constexpr int dimensions = static_cast<int>(VecDimensions<VecType>::value);
+	static constexpr std::size_t partitions = std::size_t(1) << dimensions;
+	static constexpr std::size_t leafCapacity = 1;
+	static constexpr Softening softening = Kernel;
+
+	// Direction of child `child` from its parent's center: bit d set = positive along axis d,
+	// the numbering of Tree::Region
+	static Vector childOffset(std::size_t child) {
+		Vector offset(0);
+		for (int d = 0; d < dimensions; ++d)
+			offset[d] = (child >> d) & 1 ? Scalar(1) : Scalar(-1);
+		return offset;
+	}
+
+	// Whether a pair at squared distance r2 interacts at all
+	static bool interacts(Scalar r2, Scalar epsilon2) {
+		if constexpr (Kernel == SOFTENING_PLUMMER)
+			return r2 > Scalar(0);
+		else
+			return r2 > epsilon2;
+	}
+
+	// |F| / (G m1 m2 r): the force is -G m1 m2 * inverseCube * separation
+	static Scalar inverseCube(Scalar r2, Scalar epsilon2) {
+		if constexpr (Kernel == SOFTENING_PLUMMER)
+			r2 += epsilon2;
+		return Scalar(1) / (r2 * std::sqrt(r2));
+	}
+
+	// Potential of a pair is -G m1 m2 * inverse
+	static Scalar inverse(Scalar r2, Scalar epsilon2) {
+		if constexpr (Kernel == SOFTENING_PLUMMER)
+			r2 += epsilon2;
+		return Scalar(1) / std::sqrt(r2);
+	}
+};
+
+template <Softening Kernel = SOFTENING_NONE>
+using TreePolicy2D = TreePolicy<glm::dvec2, Kernel>;
+template <Softening Kernel = SOFTENING_NONE>
+using TreePolicy3D = TreePolicy<glm::dvec3, Kernel>;
+
+#endif
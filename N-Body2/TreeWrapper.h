@@ -1,9 +1,75 @@
 #ifndef TREEWRAPPER_H
 #define TREEWRAPPER_H
 #pragma once
+#include <array>
+
 #include "Tree.h"
+#include "Ewald.h"
+#include "Fmm.h"
+#include "ParticleMesh.h"
+#include "Numa.h"
+#include "PerfCounters.h"
+#include "Regularization.h"
 #include "Utils.h"
 
+// How overlapping bodies (distance < sum of radii) are resolved after each update
+enum CollisionMode {
+	COLLISION_NONE = 0,
+	COLLISION_MERGE = 1,	// perfect merge, conserving mass and momentum
+	COLLISION_BOUNCE = 2	// elastic bounce along the line of centers
+};
+
+// Algorithm used to evaluate the forces in update()
+enum ForceEngine {
+	ENGINE_BARNES_HUT = 0,
+	ENGINE_FMM = 1,
+	ENGINE_TREEPM = 2,	// mesh for the long range, tree walk inside the cutoff
+	ENGINE_DIRECT = 3	// every pair, exact but O(N^2)
+};
+
+// Part of each pairwise force the tree walks in progress add up (multiple time stepping)
+enum ForceRange {
+	RANGE_ALL = 0,
+	RANGE_NEAR = 1,	// weighted by the near-field switch, cells beyond it are skipped
+	RANGE_FAR = 2	// the remainder, cached between far-field refreshes
+};
+
+// Phases of update() measured by the performance counters
+enum UpdatePhase {
+	PHASE_PREPARE = 0,		// back buffer
+	PHASE_FIELD = 1,		// FMM / mesh pass over every body
+	PHASE_FAR_FIELD = 2,	// far-field cache refresh
+	PHASE_WALK = 3,			// force walk and integration
+	PHASE_TREE = 4,			// tree rebuild
+	PHASE_COLLISIONS = 5,
+	UPDATE_PHASES = 6
+};
+
+// Conserved quantities of the bodies at the start of a measured update()
+template <typename VecType>
+struct Conservation {
+	double kinetic = 0.0;
+	double potential = 0.0;
+	VecType momentum = VecType(0);
+	glm::dvec3 angularMomentum = glm::dvec3(0);	// only z in 2D
+
+	double energy() const { return kinetic + potential; }
+};
+
+// Read-only view of the bodies as a completed update() left them. The next
+// update() writes the other buffer, so the view can be read on another thread
+// while that update() runs; it is overwritten by the update() after it.
+template <typename VecType>
+struct BodyFrame {
+	const Node<VecType>* bodies = nullptr;
+	std::size_t count = 0;
+
+	std::size_t size() const { return count; }
+	const Node<VecType>& operator[](std::size_t index) const { return bodies[index]; }
+	const Node<VecType>* begin() const { return bodies; }
+	const Node<VecType>* end() const { return bodies + count; }
+};
+
 template <typename VecType>
 class TreeWrapper
 {
@@ -14,33 +80,275 @@ private:
 	std::shared_ptr<Tree<VecType>> m_tree;
 	int m_totalBodies;
 
+	// Back buffer of nodeList: update() reads nodeList, writes the new state
+	// here and swaps the two, leaving the previous state untouched for readers
+	std::vector<Node<VecType>> m_backList;
+
+	CollisionMode m_collisionMode;
+	int m_totalCollisions;
+
+	ForceEngine m_engine;
+	Softening m_softening;	// kernel of the tree walk and the direct sum; the FMM stays Newtonian
+	Fmm<VecType> m_fmm;
+	ParticleMesh<VecType> m_mesh;
+
+	// Forces from engines that evaluate every body at once
+	std::vector<VecType> m_forces;
+
+	// Source-only bodies owned by other ranks, inserted into the tree until the next update
+	std::vector<Node<VecType>> m_ghosts;
+
+	// Threads of the Barnes-Hut walk in update() (0 = all cores)
+	unsigned int m_threads;
+
+	// NUMA mode: workers pinned to nodes, each building its share of the tree
+	// and owning a slice of nodeList placed on its node. With m_replicaLevels > 0
+	// the top levels of the tree are also copied onto every node.
+	bool m_numa;
+	int m_replicaLevels;
+	std::vector<std::shared_ptr<Tree<VecType>>> m_replicas;
+	const Node<VecType>* m_placedData;
+	const Node<VecType>* m_placedBack;
+	std::size_t m_placedCount;
+
+	// Multiple time stepping (r-RESPA) for Barnes-Hut: the far field is evaluated
+	// every m_farFieldInterval steps and reused in between, while the near field
+	// inside m_nearDistance is walked every step. The two are blended with a
+	// smooth switch so no interaction is counted twice or lost.
+	int m_farFieldInterval;
+	static constexpr double nearFieldBodies = 16.0;
+	double m_nearDistance;			// 0 = sized to hold about nearFieldBodies bodies
+	bool m_farFieldExtrapolation;	// add the far field's rate of change between refreshes
+	ForceRange m_walkRange;
+	double m_switchDistance;		// outer edge of the switch for the current cache
+	int m_farFieldAge;				// steps since the last refresh
+	int m_farFieldRefreshes;
+	std::vector<VecType> m_farForces;
+	std::vector<VecType> m_farForceRates;
+
+	// Conservation diagnostics: with plain Barnes-Hut the potential energy is
+	// accumulated by the force walk itself, other engines need a potential walk
+	bool m_measureConservation;
+	bool m_walkPotential;
+	Conservation<VecType> m_conservation;
+
+	// Periodic boundaries (Barnes-Hut only): bodies wrap around m_periodicBox, which
+	// is also the root of the tree. The walk uses nearest images and adds the
+	// tabulated Ewald correction for all the other images.
+	bool m_periodic;
+	Box<VecType> m_periodicBox;
+	Ewald<VecType> m_ewald;
+
+	// Bound close pairs and small groups, each a composite body in nodeList and the tree
+	Regularization<VecType> m_regularization;
+
+	// Deterministic mode: trajectories and diagnostics identical to the bit for any
+	// thread count and with or without NUMA. Every body's force is already summed
+	// in a fixed order by its own walk; on top of that the tree is always built
+	// from the same partition into about deterministicCells cells, the FMM cuts a
+	// fixed set of tasks and the conservation sums keep one share per body, added
+	// up in body order with compensation instead of per worker as they finish.
+	bool m_deterministic;
+	static constexpr std::size_t deterministicCells = 512;
+	std::vector<Conservation<VecType>> m_bodyConservation;
+
+	// Hardware counters around the phases of update(), while open
+	PerfCounters m_perf;
+	std::array<PerfSample, UPDATE_PHASES> m_phaseCounters;
+
+	// Pairwise force evaluations of the calling thread; passes reset it and sum it up per worker
+	static inline thread_local std::uint64_t m_threadInteractions = 0;
+	std::uint64_t m_forceInteractions;	// of the last computeForces()
+
+	// Bodies the tree dropped because they were outside its root
+	std::size_t m_droppedBodies;	// by the last rebuild
+	std::size_t m_totalDropped;
 
 public:
 	TreeWrapper(std::shared_ptr<Tree<VecType>> root);
 
 	// Getters
 	int getTotalBodies();
+	int getTotalCollisions();
+	CollisionMode getCollisionMode();
+	ForceEngine getEngine();
+	Softening getSoftening();
+	Fmm<VecType>& getFmm();
+	ParticleMesh<VecType>& getMesh();
+	unsigned int getThreads();
+	bool getNuma();
+	int getFarFieldInterval();
+	int getFarFieldRefreshes();
+	bool getPeriodic();
+	Ewald<VecType>& getEwald();
+	bool getDeterministic();
+	Regularization<VecType>& getRegularization();
+
+	// Interactions of the last computeForces(): body-body and body-cell evaluations
+	// of the walk, or the FMM's P2P body pairs and M2L cell pairs
+	std::uint64_t getForceInteractions();
+
+	// Result of the last update() after measureConservation()
+	Conservation<VecType>& getConservation();
 
 	Tree<VecType>& getTree();
 
+	// State after the last update(), readable while the next one runs
+	BodyFrame<VecType> getFront();
+
+	// The bodies with every composite replaced by its members, in id order so
+	// output columns stay put while subsystems form and dissolve
+	void expandBodies(std::vector<Node<VecType>>& bodies);
+
+	// Counts of every phase since setPerfCounters(true), indexed by UpdatePhase
+	std::array<PerfSample, UPDATE_PHASES>& getPhaseCounters();
+	PerfCounters& getPerfCounters();
+	static const char* phaseName(UpdatePhase phase);
+
+	// Walks the current tree; see TreeStatistics
+	TreeStatistics getTreeStatistics();
+
 	Node<VecType>& operator[](std::size_t index);
 
+	// Setters
+	void setCollisionMode(CollisionMode mode);
+	void setEngine(ForceEngine engine);
+	void setSoftening(Softening softening);
+	void setThreads(unsigned int threads);
+	void setNuma(bool enabled, int replicaLevels = 0);
+
+	// Re-evaluates the far field every `interval` steps (1 = every step). Beyond
+	// `nearDistance` (0 = automatic, about 16 bodies inside) interactions come from
+	// the cache; `extrapolate` adds a first-order Taylor term to the cached forces.
+	void setFarField(int interval, double nearDistance = 0.0, bool extrapolate = false);
+
+	// Makes the cube of side `period` around the origin periodic and tabulates its
+	// Ewald correction; 0 restores open boundaries. Call after loading the bodies.
+	// The potential of measureConservation() includes the other images.
+	void setPeriodic(double period);
+
+	// Regularizes bound pairs and groups of up to `maxMembers` bodies closer than
+	// `captureDistance` (0 = off) as composite bodies. Captures right away, so call
+	// after loading the bodies; update() captures and dissolves after every step.
+	void setRegularization(double captureDistance, std::size_t maxMembers = 4);
+
+	// Bit-reproducible updates across thread counts (see m_deterministic). The
+	// rank decomposition of a distributed run still changes the results.
+	void setDeterministic(bool deterministic);
+
+	// Reads the hardware counters around every phase of update() from now on.
+	// Returns false when none can be opened; getPerfCounters().getError() says why.
+	bool setPerfCounters(bool enabled);
+
+	// Makes the next update() measure energy, momentum and angular momentum
+	void measureConservation();
+
 	void insertBody(Node<VecType>& body);
 
+	// Rebuilds the tree from nodeList plus `ghosts`, growing it to fit both. Ghosts attract the bodies
+	// in nodeList during the next update() but are never integrated themselves;
+	// they need ids below -1 so they never match a real body. Cleared by update().
+	void setGhosts(std::vector<Node<VecType>> ghosts);
+
+	// Kernels and walk of one TreePolicy; update() and computeForces() use the policy of m_softening
+	template <typename Policy = TreePolicy<VecType>>
 	void calculateForce(Node<VecType>& body, const Node<VecType>& other);
-	void calculateForceBi(Node<VecType>& body, const Node<VecType>& other);
+	template <typename Policy = TreePolicy<VecType>>
 	void calculateForce(Node<VecType>& body, const VecType position, const double& mass);
 
-	void updateForce(Node<VecType>& body, std::shared_ptr<Tree<VecType>> tree);
+	// `corrected`: an ancestor of `tree` already added the periodic Ewald correction for all of it
+	template <typename Policy = TreePolicy<VecType>>
+	void updateForce(Node<VecType>& body, const std::shared_ptr<Tree<VecType>>& tree, bool corrected = false);
+
+	// Adds the force of every other body and ghost to body.force (ENGINE_DIRECT)
+	void directForce(Node<VecType>& body);
+
+	// Evaluates the force on every body at its current position with the
+	// selected engine, without moving anything. forces[i] belongs to nodeList[i].
+	void computeForces(std::vector<VecType>& forces);
 	void update(const double& dt);
 
+	// Uses the current tree as a broad phase to find overlapping bodies and
+	// resolves them according to m_collisionMode. Returns the number of collisions.
+	int resolveCollisions();
+
 	void loadBodies(const std::string& filePath);
+
+	// Takes over `bodies` as nodeList (e.g. from InitialConditions) and rebuilds the tree around them
+	void setBodies(std::vector<Node<VecType>> bodies);
 private:
+	// Replaces m_tree with a new tree of the given half length built from nodeList
+	void rebuildTree(double halfLength);
+
+	// Sizes m_backList to nodeList. The step writes every body's new state
+	// straight into it, nothing is copied up front.
+	void prepareBackBuffer();
+
+	// m_backList[i], first copied in full from nodeList[i] if loading, merging or
+	// migration put another body there; the caller overwrites its state
+	Node<VecType>& backBody(std::size_t i);
+
+	// position - other, or its nearest image with periodic boundaries
+	VecType separation(const VecType& position, const VecType& other) const;
+
+	// Adds the Ewald correction of `mass` at `position` to body.force, and to
+	// body.potential while the walk sums it
+	void ewaldCorrection(Node<VecType>& body, const VecType& position, double mass);
+
+	// Potential energy of the other images of `mass` at `position`
+	double ewaldPotential(const Node<VecType>& body, const VecType& position, double mass) const;
+
+	// Whether the correction is smooth enough over `cell` to take it at the center of mass
+	bool smoothCorrection(const Node<VecType>& body, const Box<VecType>& cell) const;
+
+	// Squared distance from `position` (or its nearest image) to `cell`
+	double cellDistanceSquared(const Box<VecType>& cell, const VecType& position) const;
+
+	// Near-field weight at distance r: 1 inside 0.7 * m_switchDistance, 0 beyond
+	// m_switchDistance and a smoothstep in between
+	double nearWeight(double r) const;
+
+	// Fraction of the Newtonian force at distance r the walk in progress adds up
+	double interactionFactor(double r) const;
+
+	// Advances every subsystem over the step update() just took, in the tidal field
+	// of the tree the walk used. Runs after the swap, while m_backList still
+	// holds the composites as the walk saw them.
+	void advanceSubsystems(const double& dt);
+
+	// Dissolves subsystems that came apart and captures new pairs among the nearest
+	// neighbours in the current tree; rebuilds the tree if nodeList changed
+	void updateSubsystems();
+
+	// Walks the far field of every body into m_farForces. Returns the pairwise interactions.
+	std::uint64_t refreshFarField(const double& dt);
+
+	// Barnes-Hut potential energy of `body`, for engines whose forces come without it
+	template <typename Policy>
+	double potentialWalk(const Node<VecType>& body, const std::shared_ptr<Tree<VecType>>& tree);
+
+	template <typename Policy>
+	void directSum(Node<VecType>& body);
+
+	// Calls func(policy) with the TreePolicy of m_softening. Passes dispatch once
+	// through here, so everything below them is compiled for a single kernel.
+	template <typename Func>
+	void withPolicy(Func&& func);
+
+	// Moves every worker's slice of both body buffers to the worker's node
+	void placeBodies();
+
+	// Copy of the top `levels` levels of `tree`, sharing everything below
+	static std::shared_ptr<Tree<VecType>> replicateTop(const std::shared_ptr<Tree<VecType>>& tree, int levels);
 };
 
 using TreeWrapper3D = TreeWrapper<glm::dvec3>;
 using TreeWrapper2D = TreeWrapper<glm::dvec2>;
 
 #include "TreeWrapper.tpp"
+
+// Instantiated once, in Instantiations.cpp
+extern template class TreeWrapper<glm::dvec2>;
+extern template class TreeWrapper<glm::dvec3>;
 #endif
 
@@ -1,13 +1,50 @@
 #ifndef TREEWRAPPER_TPP
 #define TREEWRAPPER_TPP
 #include "TreeWrapper.h"
-#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 
 template <typename VecType>
 TreeWrapper<VecType>::TreeWrapper(std::shared_ptr<Tree<VecType>> root) :
 	nodeList(),
 	m_totalBodies(0),
-	m_tree(root)
+	m_tree(root),
+	m_backList(),
+	m_collisionMode(COLLISION_NONE),
+	m_totalCollisions(0),
+	m_engine(ENGINE_BARNES_HUT),
+	m_softening(SOFTENING_NONE),
+	m_fmm(),
+	m_mesh(),
+	m_threads(0),
+	m_numa(false),
+	m_replicaLevels(0),
+	m_placedData(nullptr),
+	m_placedBack(nullptr),
+	m_placedCount(0),
+	m_farFieldInterval(1),
+	m_nearDistance(0.0),
+	m_farFieldExtrapolation(false),
+	m_walkRange(RANGE_ALL),
+	m_switchDistance(0.0),
+	m_farFieldAge(0),
+	m_farFieldRefreshes(0),
+	m_measureConservation(false),
+	m_walkPotential(false),
+	m_conservation(),
+	m_periodic(false),
+	m_periodicBox(),
+	m_ewald(),
+	m_regularization(),
+	m_deterministic(false),
+	m_bodyConservation(),
+	m_perf(),
+	m_phaseCounters(),
+	m_forceInteractions(0),
+	m_droppedBodies(0),
+	m_totalDropped(0)
 {
 }
 
@@ -23,18 +60,330 @@ int TreeWrapper<VecType>::getTotalBodies()
 	return m_totalBodies;
 }
 
+template <typename VecType>
+int TreeWrapper<VecType>::getTotalCollisions()
+{
+	return m_totalCollisions;
+}
+
+template <typename VecType>
+CollisionMode TreeWrapper<VecType>::getCollisionMode()
+{
+	return m_collisionMode;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setCollisionMode(CollisionMode mode)
+{
+	m_collisionMode = mode;
+}
+
+template <typename VecType>
+ForceEngine TreeWrapper<VecType>::getEngine()
+{
+	return m_engine;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setEngine(ForceEngine engine)
+{
+	m_engine = engine;
+
+	// The far-field cache is only kept up to date by Barnes-Hut steps
+	m_farForces.clear();
+}
+
+template <typename VecType>
+Softening TreeWrapper<VecType>::getSoftening()
+{
+	return m_softening;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setSoftening(Softening softening)
+{
+	m_softening = softening;
+	m_fmm.setSoftening(softening);
+}
+
+template <typename VecType>
+std::array<PerfSample, UPDATE_PHASES>& TreeWrapper<VecType>::getPhaseCounters()
+{
+	return m_phaseCounters;
+}
+
+template <typename VecType>
+PerfCounters& TreeWrapper<VecType>::getPerfCounters()
+{
+	return m_perf;
+}
+
+template <typename VecType>
+const char* TreeWrapper<VecType>::phaseName(UpdatePhase phase)
+{
+	const char* names[UPDATE_PHASES] = { "prepare", "field", "far field", "walk", "tree", "collisions" };
+	return phase >= 0 && phase < UPDATE_PHASES ? names[phase] : "?";
+}
+
+template <typename VecType>
+bool TreeWrapper<VecType>::setPerfCounters(bool enabled)
+{
+	m_phaseCounters = {};
+	if (!enabled) {
+		m_perf.close();
+		return true;
+	}
+	return m_perf.open();
+}
+
+template <typename VecType>
+Fmm<VecType>& TreeWrapper<VecType>::getFmm()
+{
+	return m_fmm;
+}
+
+template <typename VecType>
+ParticleMesh<VecType>& TreeWrapper<VecType>::getMesh()
+{
+	return m_mesh;
+}
+
+template <typename VecType>
+unsigned int TreeWrapper<VecType>::getThreads()
+{
+	return m_threads;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setThreads(unsigned int threads)
+{
+	m_threads = threads;
+}
+
+template <typename VecType>
+bool TreeWrapper<VecType>::getNuma()
+{
+	return m_numa;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setNuma(bool enabled, int replicaLevels)
+{
+	m_numa = enabled;
+	m_replicaLevels = enabled ? replicaLevels : 0;
+	m_replicas.clear();
+	m_placedData = nullptr;
+	m_placedBack = nullptr;
+
+	// Lay the current tree out for the new mode
+	rebuildTree(m_tree->m_boundingBox.getHalfLength());
+}
+
+template <typename VecType>
+int TreeWrapper<VecType>::getFarFieldInterval()
+{
+	return m_farFieldInterval;
+}
+
+template <typename VecType>
+int TreeWrapper<VecType>::getFarFieldRefreshes()
+{
+	return m_farFieldRefreshes;
+}
+
+template <typename VecType>
+Conservation<VecType>& TreeWrapper<VecType>::getConservation()
+{
+	return m_conservation;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::measureConservation()
+{
+	m_measureConservation = true;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setFarField(int interval, double nearDistance, bool extrapolate)
+{
+	m_farFieldInterval = interval > 1 ? interval : 1;
+	m_nearDistance = nearDistance;
+	m_farFieldExtrapolation = extrapolate;
+
+	// Forces the next update() to refresh
+	m_farForces.clear();
+	m_farFieldAge = 0;
+}
+
 template <typename VecType>
 Tree<VecType>& TreeWrapper<VecType>::getTree()
 {
 	return *m_tree;
 }
 
+template <typename VecType>
+bool TreeWrapper<VecType>::getPeriodic()
+{
+	return m_periodic;
+}
+
+template <typename VecType>
+Ewald<VecType>& TreeWrapper<VecType>::getEwald()
+{
+	return m_ewald;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setPeriodic(double period)
+{
+	m_periodic = period > 0.0;
+	m_farForces.clear();
+
+	if (!m_periodic) {
+		setGhosts({});
+		return;
+	}
+
+	double half = period / 2;
+	m_periodicBox = Box<VecType>(VecType(0.0), half, half, half);
+	if (m_ewald.getPeriod() != period)
+		m_ewald.build(period, m_threads);
+
+	for (Node<VecType>& body : nodeList)
+		body.position = m_periodicBox.wrap(body.position);
+
+	m_tree = std::make_shared<Tree<VecType>>(m_periodicBox, m_tree->m_theta, m_tree->m_epsilon);
+	rebuildTree(half);
+}
+
+template <typename VecType>
+bool TreeWrapper<VecType>::getDeterministic()
+{
+	return m_deterministic;
+}
+
+template <typename VecType>
+Regularization<VecType>& TreeWrapper<VecType>::getRegularization()
+{
+	return m_regularization;
+}
+
+template <typename VecType>
+std::uint64_t TreeWrapper<VecType>::getForceInteractions()
+{
+	return m_forceInteractions;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setRegularization(double captureDistance, std::size_t maxMembers)
+{
+	m_regularization.setCaptureDistance(captureDistance);
+	m_regularization.setMaxMembers(maxMembers);
+	if (m_regularization.isEnabled())
+		updateSubsystems();
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setDeterministic(bool deterministic)
+{
+	m_deterministic = deterministic;
+	m_fmm.setDeterministic(deterministic);
+
+	// The current tree may come from the thread-dependent build
+	rebuildTree(m_tree->m_boundingBox.getHalfLength());
+}
+
+template <typename VecType>
+VecType TreeWrapper<VecType>::separation(const VecType& position, const VecType& other) const
+{
+	return m_periodic ? m_periodicBox.nearestImage(position - other) : position - other;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::ewaldCorrection(Node<VecType>& body, const VecType& position, double mass)
+{
+	body.force += G * body.mass * mass * m_ewald.correction(separation(body.position, position));
+
+	if (m_walkPotential)
+		body.potential += ewaldPotential(body, position, mass);
+}
+
+template <typename VecType>
+double TreeWrapper<VecType>::ewaldPotential(const Node<VecType>& body, const VecType& position, double mass) const
+{
+	return -G * body.mass * mass * m_ewald.potential(separation(body.position, position));
+}
+
+template <typename VecType>
+bool TreeWrapper<VecType>::smoothCorrection(const Node<VecType>& body, const Box<VecType>& cell) const
+{
+	// Cells up to an eighth of the period, without the body itself
+	if (cell.getLength() > 0.125 * m_periodicBox.getLength() || cell.contains(body.position))
+		return false;
+
+	VecType image = separation(body.position, cell.center);
+	double reach = m_periodicBox.getHalfLength() - cell.getHalfLength();
+	for (int d = 0; d < VecType::length(); ++d) {
+		if (std::abs(image[d]) > reach)
+			return false;
+	}
+	return true;
+}
+
+template <typename VecType>
+double TreeWrapper<VecType>::cellDistanceSquared(const Box<VecType>& cell, const VecType& position) const
+{
+	if (!m_periodic)
+		return cell.distanceSquared(position);
+	return cell.distanceSquared(cell.center + separation(position, cell.center));
+}
+
+template <typename VecType>
+BodyFrame<VecType> TreeWrapper<VecType>::getFront()
+{
+	return BodyFrame<VecType>{ nodeList.data(), nodeList.size() };
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::expandBodies(std::vector<Node<VecType>>& bodies)
+{
+	bodies.clear();
+	for (const Node<VecType>& body : nodeList) {
+		auto found = m_regularization.getSubsystems().find(body.getId());
+		if (found == m_regularization.getSubsystems().end()) {
+			bodies.push_back(body);
+			continue;
+		}
+
+		for (Node<VecType> member : found->second.members) {
+			member.position += body.position;
+			member.velocity += body.velocity;
+			bodies.push_back(member);
+		}
+	}
+
+	std::sort(bodies.begin(), bodies.end(), [](const Node<VecType>& a, const Node<VecType>& b) { return a.getId() < b.getId(); });
+}
+
+template <typename VecType>
+TreeStatistics TreeWrapper<VecType>::getTreeStatistics()
+{
+	TreeStatistics stats;
+	m_tree->collectStatistics(stats);
+	stats.dropped = m_droppedBodies;
+	stats.totalDropped = m_totalDropped;
+	return stats;
+}
+
 template <typename VecType>
 void TreeWrapper<VecType>::insertBody(Node<VecType>& body)
 {
 	// TODO: grow to adapt to new nodes
 	// Use the Tree insertion function
+	int descendants = m_tree->getTotalDescendants();
 	m_tree->insertBody(body);
+	if (m_tree->getTotalDescendants() == descendants)
+		++m_totalDropped;
 
 
 	// Create a copy
@@ -47,35 +396,22 @@ void TreeWrapper<VecType>::insertBody(Node<VecType>& body)
 
 // Calculates the forces between to Nodes, body and other, and updates `body`s force
 template <typename VecType>
+template <typename Policy>
 void TreeWrapper<VecType>::calculateForce(Node<VecType>& body, const Node<VecType>& other)
 {
-	VecType distance = body.position - other.position;
-	double norm = glm::length(distance);
+	VecType distance = separation(body.position, other.position);
+	double norm_squared = glm::dot(distance, distance);
+	double epsilon_squared = m_tree->m_epsilon * m_tree->m_epsilon;
 
-	if (norm > m_tree->m_epsilon)
+	if (Policy::interacts(norm_squared, epsilon_squared))
 	{
-		body.force += -G * body.mass * other.mass * distance / (norm * norm * norm);
-	}
-	else
-	{
-		// to prevent this
-		std::cerr << "WARNING: Distance between bodies is too small\n" << "------ " << body.name << std::endl;
-	}
-}
+		// TreePM / far-field cache: only part of the force comes from this walk
+		double split = interactionFactor(std::sqrt(norm_squared));
+		body.force += -G * split * body.mass * other.mass * Policy::inverseCube(norm_squared, epsilon_squared) * distance;
+		++m_threadInteractions;
 
-template<typename VecType>
-void TreeWrapper<VecType>::calculateForceBi(Node<VecType>& body, const Node<VecType>& other)
-{
-	VecType distance = body.position - other.position;
-	double norm = glm::length(distance);
-	double massLookup;
-	int index = body.getId() * m_totalBodies + other.getId();
-
-	if (norm > m_tree->m_epsilon)
-	{
-		// Create a lookup table to reduce multiplications
-		body.force += -G*body.mass*other.mass * distance / (norm * norm * norm);
-		other.force += -body.force;
+		if (m_walkPotential)
+			body.potential += -G * body.mass * other.mass * Policy::inverse(norm_squared, epsilon_squared);
 	}
 	else
 	{
@@ -87,14 +423,21 @@ void TreeWrapper<VecType>::calculateForceBi(Node<VecType>& body, const Node<VecT
 // Calculates the forces between a body and a point mass, and updates `body`s force
 // Used in case we are calculating the force between a Node and a center of mass
 template <typename VecType>
+template <typename Policy>
 void TreeWrapper<VecType>::calculateForce(Node<VecType>& body, const VecType position, const double& mass)
 {
-	VecType distance = body.position - position;
-	double norm = glm::length(distance);
+	VecType distance = separation(body.position, position);
+	double norm_squared = glm::dot(distance, distance);
+	double epsilon_squared = m_tree->m_epsilon * m_tree->m_epsilon;
 
-	if (norm > m_tree->m_epsilon)
+	if (Policy::interacts(norm_squared, epsilon_squared))
 	{
-		body.force += -G * body.mass * mass * distance / (norm * norm * norm);
+		double split = interactionFactor(std::sqrt(norm_squared));
+		body.force += -G * split * body.mass * mass * Policy::inverseCube(norm_squared, epsilon_squared) * distance;
+		++m_threadInteractions;
+
+		if (m_walkPotential)
+			body.potential += -G * body.mass * mass * Policy::inverse(norm_squared, epsilon_squared);
 	}
 	else
 	{
@@ -103,10 +446,27 @@ void TreeWrapper<VecType>::calculateForce(Node<VecType>& body, const VecType pos
 }
 
 template <typename VecType>
-void TreeWrapper<VecType>::updateForce(Node<VecType>& body, std::shared_ptr<Tree<VecType>> tree)
+template <typename Policy>
+void TreeWrapper<VecType>::updateForce(Node<VecType>& body, const std::shared_ptr<Tree<VecType>>& tree, bool corrected)
 {
+	// TreePM: cells entirely outside the cutoff are left to the mesh
+	if (m_engine == ENGINE_TREEPM)
+	{
+		double cutoff = m_mesh.getCutoff();
+		if (cellDistanceSquared(tree->m_boundingBox, body.position) > cutoff * cutoff)
+			return;
+	}
+
+	// Near-field walks: cells entirely outside the switch are in the far-field cache
+	if (m_walkRange == RANGE_NEAR && cellDistanceSquared(tree->m_boundingBox, body.position) > m_switchDistance * m_switchDistance)
+		return;
+
 	bool leaf = tree->isLeaf();
-	bool threshold = (tree->getLength() / glm::length(body.position - tree->m_centerOfMass)) < tree->m_theta;
+	bool threshold = (tree->getLength() / glm::length(separation(body.position, tree->m_centerOfMass))) < tree->m_theta;
+
+	// Periodic: Ewald correction for the other images, unless an ancestor already
+	// took it for the whole cell. Near-field walks leave it to the far field.
+	bool correct = m_periodic && !corrected && m_walkRange != RANGE_NEAR;
 
 	// Debug: Print out the key variables to check their values
 	DEBUG_LOG("---- %s ----\n", body.name.c_str());
@@ -133,14 +493,22 @@ void TreeWrapper<VecType>::updateForce(Node<VecType>& body, std::shared_ptr<Tree
 		if (threshold && tree->m_totalDescendants) {
 
 			DEBUG_LOG("*********************************************************************************\n");
-			calculateForce(body, tree->m_centerOfMass, tree->m_totalMass);
+			calculateForce<Policy>(body, tree->m_centerOfMass, tree->m_totalMass);
+			if (correct)
+				ewaldCorrection(body, tree->m_centerOfMass, tree->m_totalMass);
 		}
 		else {
+			// The correction only jumps where the nearest image does, so a cell well
+			// inside the nearest-image cube takes it whole, however it is opened
+			if (correct && smoothCorrection(body, tree->m_boundingBox)) {
+				ewaldCorrection(body, tree->m_centerOfMass, tree->m_totalMass);
+				corrected = true;
+			}
 
 			int i = 0;
 			for (auto& childTree : tree->m_children) {
 				if (childTree->m_totalDescendants > 0)
-					updateForce(body, childTree);
+					updateForce<Policy>(body, childTree, corrected);
 				++i;
 			}
 		}
@@ -150,80 +518,789 @@ void TreeWrapper<VecType>::updateForce(Node<VecType>& body, std::shared_ptr<Tree
 	else {
 		DEBUG_LOG("%s: Leaf or invalid node, calculating force directly.\n", __func__);
 
-		calculateForce(body, tree->m_body);
+		calculateForce<Policy>(body, tree->m_body);
+		if (correct)
+			ewaldCorrection(body, tree->m_body.position, tree->m_body.mass);
 	}
 
 	return;
 
 }
 
+template <typename VecType>
+template <typename Policy>
+double TreeWrapper<VecType>::potentialWalk(const Node<VecType>& body, const std::shared_ptr<Tree<VecType>>& tree)
+{
+	double epsilon_squared = m_tree->m_epsilon * m_tree->m_epsilon;
+
+	if (tree->isLeaf()) {
+		if (tree->m_body.getId() == -1 || tree->m_body.getId() == body.getId())
+			return 0.0;
+
+		VecType distance = separation(body.position, tree->m_body.position);
+		double norm_squared = glm::dot(distance, distance);
+		double potential = Policy::interacts(norm_squared, epsilon_squared) ? -G * body.mass * tree->m_body.mass * Policy::inverse(norm_squared, epsilon_squared) : 0.0;
+		return m_periodic ? potential + ewaldPotential(body, tree->m_body.position, tree->m_body.mass) : potential;
+	}
+
+	VecType distance = separation(body.position, tree->m_centerOfMass);
+	double norm_squared = glm::dot(distance, distance);
+	if (tree->getLength() / std::sqrt(norm_squared) < tree->m_theta && tree->m_totalDescendants) {
+		double potential = Policy::interacts(norm_squared, epsilon_squared) ? -G * body.mass * tree->m_totalMass * Policy::inverse(norm_squared, epsilon_squared) : 0.0;
+		return m_periodic ? potential + ewaldPotential(body, tree->m_centerOfMass, tree->m_totalMass) : potential;
+	}
+
+	double potential = 0.0;
+	for (auto& childTree : tree->m_children) {
+		if (childTree->m_totalDescendants > 0)
+			potential += potentialWalk<Policy>(body, childTree);
+	}
+	return potential;
+}
+
+template <typename VecType>
+double TreeWrapper<VecType>::nearWeight(double r) const
+{
+	double inner = 0.7 * m_switchDistance;
+	if (r <= inner)
+		return 1.0;
+	if (r >= m_switchDistance)
+		return 0.0;
+
+	double x = (r - inner) / (m_switchDistance - inner);
+	return 1.0 - x * x * (3.0 - 2.0 * x);
+}
+
+template <typename VecType>
+double TreeWrapper<VecType>::interactionFactor(double r) const
+{
+	// TreePM: the mesh already provides the long-range part
+	double factor = (m_engine == ENGINE_TREEPM) ? m_mesh.shortRangeFactor(r) : 1.0;
+
+	if (m_walkRange == RANGE_NEAR)
+		factor *= nearWeight(r);
+	else if (m_walkRange == RANGE_FAR)
+		factor *= 1.0 - nearWeight(r);
+
+	return factor;
+}
+
+template <typename VecType>
+std::uint64_t TreeWrapper<VecType>::refreshFarField(const double& dt)
+{
+	// The rate of change needs the previous cache of the same bodies
+	bool rates = m_farFieldExtrapolation && m_farForces.size() == nodeList.size() && m_farFieldAge > 0;
+	std::vector<VecType> previous;
+	if (rates)
+		previous.swap(m_farForces);
+
+	m_switchDistance = m_nearDistance;
+	if (m_switchDistance <= 0.0) {
+		// Default: a sphere (circle) holding about nearFieldBodies bodies at the mean
+		// density of the bodies' extent (the root cell can be far larger after it grows)
+		const int dimensions = VecType::length();
+		double extent = 0.0;
+		for (const Node<VecType>& body : nodeList) {
+			for (int d = 0; d < dimensions; ++d)
+				extent = std::max(extent, std::abs(body.position[d]));
+		}
+
+		double volume = std::pow(2.0 * extent, dimensions);
+		double unit_ball = dimensions == 3 ? 4.0 / 3.0 * M_PI : M_PI;
+		double bodies = std::max<double>(1.0, static_cast<double>(nodeList.size()));
+		m_switchDistance = std::pow(nearFieldBodies * volume / (unit_ball * bodies), 1.0 / dimensions);
+	}
+	m_farForces.assign(nodeList.size(), VecType(0));
+
+	m_walkRange = RANGE_FAR;
+	std::atomic<std::uint64_t> interactions(0);
+	withPolicy([&](auto policy) {
+		Utils::parallelFor(nodeList.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+			m_threadInteractions = 0;
+			for (std::size_t i = begin; i < end; ++i) {
+				// The walk runs on the back buffer, which the step overwrites anyway,
+				// so nodeList and the force the integrator still needs stay untouched
+				Node<VecType>& body = backBody(i);
+				body.position = nodeList[i].position;
+				body.force = VecType(0);
+
+				updateForce<decltype(policy)>(body, m_tree);
+				m_farForces[i] = body.force;
+			}
+			interactions += m_threadInteractions;
+		});
+	});
+	m_walkRange = RANGE_ALL;
+
+	m_farForceRates.assign(nodeList.size(), VecType(0));
+	if (rates) {
+		for (std::size_t i = 0; i < nodeList.size(); ++i)
+			m_farForceRates[i] = (m_farForces[i] - previous[i]) / (m_farFieldAge * dt);
+	}
+
+	m_farFieldAge = 0;
+	++m_farFieldRefreshes;
+	return interactions;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::computeForces(std::vector<VecType>& forces)
+{
+	if (m_engine == ENGINE_FMM) {
+		m_fmm.computeForces(*m_tree, nodeList, forces);
+		m_forceInteractions = m_fmm.getP2PCount() + m_fmm.getM2LCount();
+		return;
+	}
+
+	if (m_engine == ENGINE_TREEPM)
+		m_mesh.computeForces(m_tree->m_boundingBox, nodeList, forces);
+	else
+		forces.assign(nodeList.size(), VecType(0));
+
+	// Split across threads as in update(), so the timings of the engines compare
+	std::atomic<std::uint64_t> interactions(0);
+	withPolicy([&](auto policy) {
+		using Policy = decltype(policy);
+		Utils::parallelFor(nodeList.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+			m_threadInteractions = 0;
+			for (std::size_t i = begin; i < end; ++i) {
+				Node<VecType> probe = nodeList[i];
+				probe.force = VecType(0);
+				if (m_engine == ENGINE_DIRECT)
+					directSum<Policy>(probe);
+				else
+					updateForce<Policy>(probe, m_tree);
+				forces[i] += probe.force;
+			}
+			interactions += m_threadInteractions;
+		});
+	});
+	m_forceInteractions = interactions;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::directForce(Node<VecType>& body)
+{
+	withPolicy([&](auto policy) {
+		directSum<decltype(policy)>(body);
+	});
+}
+
+template <typename VecType>
+template <typename Policy>
+void TreeWrapper<VecType>::directSum(Node<VecType>& body)
+{
+	for (const Node<VecType>& other : nodeList) {
+		if (other.getId() != body.getId())
+			calculateForce<Policy>(body, other);
+	}
+	for (const Node<VecType>& ghost : m_ghosts)
+		calculateForce<Policy>(body, ghost);
+}
+
+template <typename VecType>
+template <typename Func>
+void TreeWrapper<VecType>::withPolicy(Func&& func)
+{
+	if (m_softening == SOFTENING_PLUMMER)
+		func(TreePolicy<VecType, SOFTENING_PLUMMER>());
+	else
+		func(TreePolicy<VecType, SOFTENING_NONE>());
+}
+
 template <typename VecType>
 void TreeWrapper<VecType>::update(const double& dt)
 {
 	auto total_time = std::chrono::duration<double>::zero();
 	double max = m_tree->m_boundingBox.getHalfLength();
-	double max_test;
 
 	bool expand = false;
 
-	for (Node<VecType>& body : nodeList) {
-		// This should never happen, but hey.
-		if (body.getId() == -1) {
-			std::cout << "found null body in update loop\n";
-		}
+	// Performance counters: every phase adds the counts since the end of the previous one
+	bool profile = m_perf.isOpen();
+	PerfReading mark = profile ? m_perf.read() : PerfReading();
+	auto phase_done = [&](UpdatePhase phase, std::uint64_t interactions) {
+		if (!profile)
+			return;
+		PerfReading now = m_perf.read();
+		m_perf.accumulate(mark, now, m_phaseCounters[phase]);
+		m_phaseCounters[phase].interactions += interactions;
+		mark = now;
+	};
 
-		/** Velocity verlet integration **/
+	// Double buffering: nodeList is only read from here on, the step is written into m_backList
+	// body by body by the integrator
+	prepareBackBuffer();
+	phase_done(PHASE_PREPARE, 0);
 
-		// Calculate acceleration from force and get the new position
-		VecType acc = body.force / body.mass;
-		VecType new_pos = body.position + body.velocity * dt + acc * (dt * dt * 0.5);
+	// The FMM and the mesh evaluate every force in one pass, before any body moves
+	if (m_engine == ENGINE_FMM) {
+		m_fmm.computeForces(*m_tree, nodeList, m_forces);
+		phase_done(PHASE_FIELD, m_fmm.getP2PCount() + m_fmm.getM2LCount());
+	}
+	else if (m_engine == ENGINE_TREEPM) {
+		m_mesh.computeForces(m_tree->m_boundingBox, nodeList, m_forces);
+		phase_done(PHASE_FIELD, 0);
+	}
+
+	// Multiple time stepping: refresh the cached far field when it is due or stale
+	bool far_field = m_farFieldInterval > 1 && m_engine == ENGINE_BARNES_HUT;
+	if (far_field) {
+		if (m_farFieldAge >= m_farFieldInterval || m_farForces.size() != nodeList.size())
+			phase_done(PHASE_FAR_FIELD, refreshFarField(dt));
+		m_walkRange = RANGE_NEAR;
+	}
+
+	// Conservation diagnostics of the state before this step. Only a complete
+	// Barnes-Hut walk or direct sum adds up the whole potential on its own.
+	bool measure = m_measureConservation;
+	m_measureConservation = false;
+	m_walkPotential = measure && (m_engine == ENGINE_BARNES_HUT || m_engine == ENGINE_DIRECT) && !far_field;
+	Conservation<VecType> conservation;
+
+	// Deterministic: the workers' partial sums depend on the split, so each body keeps its share
+	bool body_shares = measure && m_deterministic;
+	if (body_shares)
+		m_bodyConservation.assign(nodeList.size(), Conservation<VecType>());
+
+	std::mutex max_mutex;
+	std::uint64_t interactions = 0;
 
-		// Reset the force
-		body.force = VecType(0);
+	// The walk is compiled for the policy `withPolicy` passes in
+	auto integrate = [&](std::size_t begin, std::size_t end, const std::shared_ptr<Tree<VecType>>& root, auto policy) {
+		using Policy = decltype(policy);
+		double local_max = 0.0;
+		Conservation<VecType> local;
+		m_threadInteractions = 0;
 
-		updateForce(body, m_tree);
+		for (std::size_t i = begin; i < end; ++i) {
+			// The old state is read from nodeList, the new one written into the back buffer
+			const Node<VecType>& source = nodeList[i];
+			Node<VecType>& body = backBody(i);
+			Conservation<VecType>& share = body_shares ? m_bodyConservation[i] : local;
+
+			// This should never happen, but hey.
+			if (source.getId() == -1) {
+				std::cout << "found null body in update loop\n";
+			}
+
+			/** Velocity verlet integration **/
+
+			// Calculate acceleration from force and get the new position
+			VecType acc = source.force / source.mass;
+			VecType new_pos = source.position + source.velocity * dt + acc * (dt * dt * 0.5);
+			if (m_periodic)
+				new_pos = m_periodicBox.wrap(new_pos);
+
+			if (measure) {
+				VecType momentum = source.mass * source.velocity;
+				share.kinetic += 0.5 * glm::dot(source.velocity, momentum);
+				share.momentum += momentum;
+				if constexpr (std::is_same_v<VecType, glm::dvec3>)
+					share.angularMomentum += glm::cross(source.position, momentum);
+				else
+					share.angularMomentum.z += source.position.x * momentum.y - source.position.y * momentum.x;
+			}
 
-		// Getting ready to create a new body to insert into newTree
-		VecType new_force = body.force;
-		VecType new_accel = new_force / body.mass;
-		VecType new_vel = body.velocity + (acc + new_accel) * (dt * 0.5);
+			// The force is taken where the body is now
+			body.position = source.position;
+			body.force = VecType(0);
+			body.potential = 0.0;
 
-		body.position = new_pos;
-		body.velocity = new_vel;
+			if (m_engine == ENGINE_FMM)
+				body.force = m_forces[i];
+			else if (m_engine == ENGINE_DIRECT)
+				directSum<Policy>(body);
+			else
+				updateForce<Policy>(body, root);
 
-		// Keep track of the furthest body from the center of the tree to determine if it needs to grow
-		// There may be a better, less expensive way of doing this, but hopefully iterating through nodelist again
+			// Long-range mesh force on top of the short-range walk
+			if (m_engine == ENGINE_TREEPM)
+				body.force += m_forces[i];
 
-		// and rebuilding at most once per update outweighs potentially rebuilding multiple times per update and not
-		// iterating through the list a second time
-		max_test = glm::length(new_pos);
-		if (max_test > max) {
-			//std::cout << "max_test: " << max_test << std::endl;
-			max = max_test;
+			// Cached far field on top of the near-field walk
+			if (far_field) {
+				body.force += m_farForces[i];
+				if (m_farFieldExtrapolation)
+					body.force += m_farForceRates[i] * (m_farFieldAge * dt);
+			}
+
+			// Every pair is seen from both ends
+			if (m_walkPotential)
+				share.potential += 0.5 * body.potential;
+			else if (measure)
+				share.potential += 0.5 * potentialWalk<Policy>(body, root);
+
+			// Getting ready to create a new body to insert into newTree
+			VecType new_force = body.force;
+			VecType new_accel = new_force / body.mass;
+			VecType new_vel = source.velocity + (acc + new_accel) * (dt * 0.5);
+
+			body.position = new_pos;
+			body.velocity = new_vel;
+
+			// Keep track of the furthest body from the center of the tree to determine if it needs to grow
+			// Each worker tracks its own furthest body and merges it once at the end of its range
+			double max_test = glm::length(new_pos);
+			if (max_test > local_max)
+				local_max = max_test;
+		}
+
+		std::lock_guard<std::mutex> lock(max_mutex);
+		interactions += m_threadInteractions;
+		if (measure) {
+			conservation.kinetic += local.kinetic;
+			conservation.potential += local.potential;
+			conservation.momentum += local.momentum;
+			conservation.angularMomentum += local.angularMomentum;
+		}
+		if (local_max > max) {
+			max = local_max;
 			expand = true;
 		}
+	};
+
+	// Bodies only read the old tree and write themselves, so the walk splits across threads
+	if (m_numa) {
+		// The buffers swap every step, so either may be the front one
+		bool placed = nodeList.size() == m_placedCount
+			&& ((nodeList.data() == m_placedData && m_backList.data() == m_placedBack)
+				|| (nodeList.data() == m_placedBack && m_backList.data() == m_placedData));
+		if (!placed)
+			placeBodies();
 	}
 
-	if (expand)
+	withPolicy([&](auto policy) {
+		if (m_numa) {
+			Numa::parallelFor(nodeList.size(), m_threads, [&](std::size_t begin, std::size_t end, int node) {
+				integrate(begin, end, m_replicas.empty() ? m_tree : m_replicas[node], policy);
+			});
+		}
+		else {
+			Utils::parallelFor(nodeList.size(), m_threads, [&](std::size_t begin, std::size_t end) {
+				integrate(begin, end, m_tree, policy);
+			});
+		}
+	});
+
+	// The new state becomes the front; the old one stays intact until the next update()
+	nodeList.swap(m_backList);
+	phase_done(PHASE_WALK, interactions);
+
+	if (far_field) {
+		m_walkRange = RANGE_ALL;
+		++m_farFieldAge;
+	}
+
+	if (body_shares) {
+		Utils::CompensatedSum<double> kinetic, potential;
+		Utils::CompensatedSum<VecType> momentum;
+		Utils::CompensatedSum<glm::dvec3> angular_momentum;
+		for (const Conservation<VecType>& share : m_bodyConservation) {
+			kinetic.add(share.kinetic);
+			potential.add(share.potential);
+			momentum.add(share.momentum);
+			angular_momentum.add(share.angularMomentum);
+		}
+
+		conservation.kinetic = kinetic.sum;
+		conservation.potential = potential.sum;
+		conservation.momentum = momentum.sum;
+		conservation.angularMomentum = angular_momentum.sum;
+	}
+
+	if (measure) {
+		// Composites only count as point masses
+		m_regularization.addInternal(conservation.kinetic, conservation.potential, conservation.angularMomentum);
+		m_conservation = conservation;
+		m_walkPotential = false;
+	}
+
+	if (m_regularization.isEnabled())
+		advanceSubsystems(dt);
+
+	// A periodic root never grows, the bodies wrap around it instead
+	if (m_periodic)
+	{
+		max = m_periodicBox.getHalfLength();
+	}
+	else if (expand)
 	{
 		max *= 2;
 	}
 
 	// Create new tree so we dont move bodies before all forces are calcualted
-	Box<VecType> newBoundingBox = Box<VecType>(m_tree->m_boundingBox.center, max, max, max);
-	std::shared_ptr<Tree<VecType>> newTree = std::make_shared<Tree<VecType>>(newBoundingBox);
+	m_ghosts.clear();
+	rebuildTree(max);
+	if (m_regularization.isEnabled())
+		updateSubsystems();
+	phase_done(PHASE_TREE, 0);
 
-	// Create new wrapper to utilize its insertion that will expand the member tree if needed
+	// The fresh tree doubles as the broad phase for collisions
+	m_totalCollisions += resolveCollisions();
+	phase_done(PHASE_COLLISIONS, 0);
+	return;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::advanceSubsystems(const double& dt)
+{
+	std::vector<VecType> positions, tides;
+
+	withPolicy([&](auto policy) {
+		using Policy = decltype(policy);
+
+		// External acceleration at `position`; the composite's own leaf is skipped by its id
+		auto field = [&](const Node<VecType>& composite, const VecType& position) {
+			Node<VecType> probe(composite.getId(), composite.name, position, VecType(0), 1.0, 0.0);
+			if (m_engine == ENGINE_DIRECT)
+				directSum<Policy>(probe);
+			else
+				updateForce<Policy>(probe, m_tree);
+			return probe.force;
+		};
+
+		for (std::size_t i = 0; i < nodeList.size(); ++i) {
+			const Node<VecType>& before = m_backList[i];
+			if (!m_regularization.isComposite(before.getId()))
+				continue;
+
+			m_regularization.memberPositions(before, positions);
+			VecType center = field(before, before.position);
+
+			tides.clear();
+			for (const VecType& position : positions)
+				tides.push_back(field(before, position) - center);
+
+			m_regularization.advance(before, dt, tides);
+		}
+	});
+}
 
-	for (Node<VecType>& body : nodeList) {
-		Node<VecType> bodyCopy = body;
-		newTree->insertBody(bodyCopy);
+template <typename VecType>
+void TreeWrapper<VecType>::updateSubsystems()
+{
+	std::vector<Node<VecType>> bodies;
+	bodies.reserve(nodeList.size());
+	bool dissolved = false;
+
+	for (const Node<VecType>& body : nodeList) {
+		if (m_regularization.shouldDissolve(body)) {
+			m_regularization.dissolve(body, bodies);
+			dissolved = true;
+		}
+		else {
+			bodies.push_back(body);
+		}
 	}
 
+	// Released members are found again by the capture search below
+	if (dissolved) {
+		nodeList = std::move(bodies);
+		setGhosts({});
+	}
+
+	std::vector<std::vector<Neighbour<VecType>>> nearest;
+	m_tree->kNearestBatch(nodeList, 1, nearest, m_threads);
+
+	std::unordered_map<int, std::size_t> index_of;
+	index_of.reserve(nodeList.size());
+	for (std::size_t i = 0; i < nodeList.size(); ++i)
+		index_of[nodeList[i].getId()] = i;
+
+	// Each body joins at most one new subsystem per step, so groups grow a member at a time
+	std::vector<bool> taken(nodeList.size(), false);
+	std::vector<Node<VecType>> composites;
+	for (std::size_t i = 0; i < nodeList.size(); ++i) {
+		if (taken[i] || nearest[i].empty())
+			continue;
+
+		auto found = index_of.find(nearest[i].front().body->getId());
+		if (found == index_of.end() || taken[found->second])
+			continue;
+
+		if (!m_regularization.shouldCapture(nodeList[i], nodeList[found->second]))
+			continue;
+
+		composites.push_back(m_regularization.capture(nodeList[i], nodeList[found->second]));
+		taken[i] = true;
+		taken[found->second] = true;
+	}
+
+	if (composites.empty())
+		return;
+
+	std::size_t kept = 0;
+	for (std::size_t i = 0; i < nodeList.size(); ++i) {
+		if (!taken[i])
+			nodeList[kept++] = nodeList[i];
+	}
+	nodeList.resize(kept);
+	nodeList.insert(nodeList.end(), composites.begin(), composites.end());
+	setGhosts({});
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setGhosts(std::vector<Node<VecType>> ghosts)
+{
+	m_ghosts = std::move(ghosts);
+	m_totalBodies = static_cast<int>(nodeList.size());
+
+	// nodeList may have been replaced, so cached far fields no longer line up
+	m_farForces.clear();
+
+	// Bodies added directly are wrapped into the periodic root
+	if (m_periodic) {
+		for (Node<VecType>& body : nodeList)
+			body.position = m_periodicBox.wrap(body.position);
+
+		rebuildTree(m_periodicBox.getHalfLength());
+		return;
+	}
+
+	// Grow the tree until it holds the ghosts and any bodies added to nodeList directly
+	double max = m_tree->m_boundingBox.getHalfLength();
+	bool expand = false;
+
+	for (const std::vector<Node<VecType>>* bodies : { &nodeList, &m_ghosts }) {
+		for (const Node<VecType>& body : *bodies) {
+			double max_test = glm::length(body.position - m_tree->m_boundingBox.center);
+			if (max_test > max) {
+				max = max_test;
+				expand = true;
+			}
+		}
+	}
+
+	if (expand)
+		max *= 2;
+
+	rebuildTree(max);
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::setBodies(std::vector<Node<VecType>> bodies)
+{
+	nodeList = std::move(bodies);
+	setGhosts({});
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::rebuildTree(double halfLength)
+{
+	Box<VecType> newBoundingBox = Box<VecType>(m_tree->m_boundingBox.center, halfLength, halfLength, halfLength);
+	std::shared_ptr<Tree<VecType>> newTree = std::make_shared<Tree<VecType>>(newBoundingBox, m_tree->m_theta, m_tree->m_epsilon);
+
+	if (m_numa || m_deterministic) {
+		// Pinned workers build the subtrees below the top levels, so each part of
+		// the tree is first touched (allocated) on the node of its worker.
+		// Deterministic: the cut below the top levels fixes where the centers of
+		// mass are summed up, so it does not follow the thread count.
+		std::vector<Node<VecType>*> bodies;
+		for (Node<VecType>& body : nodeList)
+			bodies.push_back(&body);
+		for (Node<VecType>& ghost : m_ghosts)
+			bodies.push_back(&ghost);
+
+		unsigned int threads = m_threads ? m_threads : std::thread::hardware_concurrency();
+		std::size_t wanted = m_deterministic ? deterministicCells : 8 * static_cast<std::size_t>(threads);
+		int depth = 0;
+		for (std::size_t cells = 1; cells < wanted; cells *= TreePolicy<VecType>::partitions)
+			++depth;
+
+		std::vector<PendingCell<VecType>> pending;
+		newTree->partitionBodies(bodies, depth, pending);
+
+		auto fill = [&](std::size_t begin, std::size_t end) {
+			for (std::size_t p = begin; p < end; ++p) {
+				for (Node<VecType>* body : pending[p].bodies) {
+					Node<VecType> bodyCopy = *body;
+					pending[p].cell->insertBody(bodyCopy);
+				}
+			}
+		};
+
+		if (m_numa)
+			Numa::parallelFor(pending.size(), m_threads, [&](std::size_t begin, std::size_t end, int) { fill(begin, end); });
+		else
+			Utils::parallelFor(pending.size(), m_threads, fill);
+
+		newTree->finishInsertion(depth);
+	}
+	else {
+		for (Node<VecType>& body : nodeList) {
+			Node<VecType> bodyCopy = body;
+			newTree->insertBody(bodyCopy);
+		}
+
+		for (Node<VecType>& ghost : m_ghosts) {
+			Node<VecType> ghostCopy = ghost;
+			newTree->insertBody(ghostCopy);
+		}
+	}
+
+	// Every body the root accepted is counted by it, the rest were dropped
+	m_droppedBodies = nodeList.size() + m_ghosts.size() - newTree->getTotalDescendants();
+	m_totalDropped += m_droppedBodies;
+
 	// Replace the old tree with the new tree
-	//m_tree = std::move(newTree);
 	m_tree = newTree;
-	return;
+
+	// Every node gets its own copy of the levels all walks pass through
+	m_replicas.clear();
+	if (m_numa && m_replicaLevels > 0 && Numa::nodeCount() > 1) {
+		m_replicas.resize(Numa::nodeCount());
+		std::vector<std::thread> copiers;
+
+		for (int node = 0; node < Numa::nodeCount(); ++node) {
+			copiers.emplace_back([this, node]() {
+				Numa::pinThreadToNode(node);
+				m_replicas[node] = replicateTop(m_tree, m_replicaLevels);
+			});
+		}
+
+		for (auto& copier : copiers) {
+			copier.join();
+		}
+	}
+}
+
+template <typename VecType>
+std::shared_ptr<Tree<VecType>> TreeWrapper<VecType>::replicateTop(const std::shared_ptr<Tree<VecType>>& tree, int levels)
+{
+	std::shared_ptr<Tree<VecType>> copy = std::make_shared<Tree<VecType>>(*tree);
+
+	if (levels > 1 && !tree->isLeaf()) {
+		for (std::size_t i = 0; i < copy->m_children.size(); ++i)
+			copy->m_children[i] = replicateTop(tree->m_children[i], levels - 1);
+	}
+	return copy;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::prepareBackBuffer()
+{
+	m_backList.resize(nodeList.size());
+}
+
+template <typename VecType>
+Node<VecType>& TreeWrapper<VecType>::backBody(std::size_t i)
+{
+	const Node<VecType>& source = nodeList[i];
+	Node<VecType>& body = m_backList[i];
+
+	// Loading, merging and migration rearrange nodeList; only then is the whole body copied
+	if (body.getId() != source.getId() || body.mass != source.mass || body.radius != source.radius)
+		body = source;
+	return body;
+}
+
+template <typename VecType>
+void TreeWrapper<VecType>::placeBodies()
+{
+	// Same split as the walk in update(), so each worker's bodies live on its node
+	Numa::parallelFor(nodeList.size(), m_threads, [&](std::size_t begin, std::size_t end, int node) {
+		Numa::placeMemory(nodeList.data() + begin, (end - begin) * sizeof(Node<VecType>), node);
+		Numa::placeMemory(m_backList.data() + begin, (end - begin) * sizeof(Node<VecType>), node);
+	});
+
+	m_placedData = nodeList.data();
+	m_placedBack = m_backList.data();
+	m_placedCount = nodeList.size();
+}
+
+template <typename VecType>
+int TreeWrapper<VecType>::resolveCollisions()
+{
+	if (m_collisionMode == COLLISION_NONE || nodeList.size() < 2)
+		return 0;
+
+	// The tree holds copies of the bodies, so map their ids back to nodeList
+	std::unordered_map<int, std::size_t> index_of;
+	index_of.reserve(nodeList.size());
+	for (std::size_t i = 0; i < nodeList.size(); ++i) {
+		index_of[nodeList[i].getId()] = i;
+	}
+
+	// Merged bodies are only flagged here; nodeList is compacted once every
+	// query against the tree has finished
+	std::vector<bool> absorbed(nodeList.size(), false);
+	std::vector<const Node<VecType>*> overlaps;
+	int collisions = 0;
+
+	for (std::size_t i = 0; i < nodeList.size(); ++i) {
+		if (absorbed[i])
+			continue;
+
+		overlaps.clear();
+		m_tree->queryOverlaps(nodeList[i], overlaps);
+
+		for (const Node<VecType>* overlap : overlaps) {
+			auto found = index_of.find(overlap->getId());
+			if (found == index_of.end() || absorbed[found->second])
+				continue;
+
+			Node<VecType>& body = nodeList[i];
+			Node<VecType>& other = nodeList[found->second];
+
+			if (m_collisionMode == COLLISION_MERGE) {
+				double mass = body.mass + other.mass;
+				VecType position = (body.position * body.mass + other.position * other.mass) / mass;
+				VecType velocity = (body.velocity * body.mass + other.velocity * other.mass) / mass;
+				VecType force = body.force + other.force;
+
+				// Conserve volume
+				double radius = std::cbrt(body.radius * body.radius * body.radius + other.radius * other.radius * other.radius);
+
+				// The heavier body survives and keeps its id and name
+				bool keep_body = body.mass >= other.mass;
+				Node<VecType>& survivor = keep_body ? body : other;
+
+				survivor.position = position;
+				survivor.velocity = velocity;
+				survivor.force = force;
+				survivor.radius = radius;
+				survivor.mass = mass;
+
+				absorbed[keep_body ? found->second : i] = true;
+				++collisions;
+
+				if (!keep_body)
+					break;
+			}
+			else {
+				VecType normal = other.position - body.position;
+				double norm = glm::length(normal);
+				if (norm <= 0.0)
+					continue;
+				normal /= norm;
+
+				// Only bounce bodies that are still approaching each other
+				double approach = glm::dot(body.velocity - other.velocity, normal);
+				if (approach <= 0.0)
+					continue;
+
+				double impulse = 2.0 * approach / (1.0 / body.mass + 1.0 / other.mass);
+				body.velocity -= (impulse / body.mass) * normal;
+				other.velocity += (impulse / other.mass) * normal;
+				++collisions;
+			}
+		}
+	}
+
+	if (m_collisionMode == COLLISION_MERGE && collisions > 0) {
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < nodeList.size(); ++i) {
+			if (!absorbed[i])
+				nodeList[kept++] = nodeList[i];
+		}
+		nodeList.resize(kept);
+		m_totalBodies = static_cast<int>(kept);
+
+		rebuildTree(m_tree->m_boundingBox.getHalfLength());
+	}
+
+	return collisions;
 }
 
 #include <nlohmann/json.hpp>
@@ -260,7 +1337,7 @@ void TreeWrapper<VecType>::loadBodies(const std::string& file_path) {
 
 	Box<VecType> new_bounding_box(m_tree->m_boundingBox.center, 2 * max, 2 * max, 2 * max);
 
-	std::shared_ptr<Tree<VecType>> new_tree = std::make_shared<Tree<VecType>>(new_bounding_box);
+	std::shared_ptr<Tree<VecType>> new_tree = std::make_shared<Tree<VecType>>(new_bounding_box, m_tree->m_theta, m_tree->m_epsilon);
 	m_tree = new_tree;
 
 	// Loop through each body in the JSON data
@@ -1,8 +1,16 @@
 #include "Utils.h"
+#include <algorithm>
 #include <filesystem>
 
+#ifndef _WIN32
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
 void Utils::signalHandler(int signum) {
+#ifdef _WIN32
 	system("cls");
+#endif
 
 	exit(signum);
 }
@@ -15,6 +23,10 @@ void Utils::signalHandler(int signum) {
 //}
 
 void Utils::setClipboardText(const std::string& text) {
+#ifndef _WIN32
+	(void)text;
+	std::cerr << "Clipboard is only available on Windows" << std::endl;
+#else
 	// Open the clipboard
 	if (!OpenClipboard(nullptr)) {
 		std::cerr << "Failed to open clipboard" << std::endl;
@@ -44,6 +56,7 @@ void Utils::setClipboardText(const std::string& text) {
 
 	// Free the global memory (not needed anymore since it's now managed by the clipboard)
 	GlobalFree(hGlobal);
+#endif
 }
 
 void Utils::printProgressBar(int i, int limit, int barWidth, const std::string& process) {
@@ -55,6 +68,13 @@ void Utils::printProgressBar(int i, int limit, int barWidth, const std::string&
 	//COORD cursorPosition;
 	//COORD currentPosition;
 	
+#ifndef _WIN32
+	// No console API: redraw the bar in place on one line
+	(void)width;
+	(void)height;
+	std::cout << "\r[" << std::string(std::min(pos, barWidth), '|') << std::string(barWidth - std::min(pos, barWidth), ' ')
+		<< "] " << std::fixed << std::setprecision(2) << progress * 100.0 << " % " << process << std::flush;
+#else
 	// Get the console handle
 	HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
 	CONSOLE_SCREEN_BUFFER_INFO csbi;
@@ -100,10 +120,15 @@ void Utils::printProgressBar(int i, int limit, int barWidth, const std::string&
 	if(pos == 100) cursorInfo.bVisible = TRUE;
 	SetConsoleCursorInfo(hConsole, &cursorInfo);
 	setCursorPosition(0, 1);
+#endif
 }
 
 // Function to set the cursor position
 void Utils::setCursorPosition(int x, int y) {
+#ifndef _WIN32
+	// ANSI terminals count from 1
+	std::cout << "\x1b[" << y + 1 << ";" << x + 1 << "H";
+#else
 	// Get the console handle
 	HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
 
@@ -114,9 +139,21 @@ void Utils::setCursorPosition(int x, int y) {
 
 	// Use SetConsoleCursorPosition to move the cursor
 	SetConsoleCursorPosition(hConsole, cursorPosition);
+#endif
 }
 
 void Utils::getConsoleSize(int& width, int& height) {
+#ifndef _WIN32
+	winsize size;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) {
+		width = size.ws_col;
+		height = size.ws_row;
+	}
+	else {
+		width = 0;
+		height = 0;
+	}
+#else
 	// Get the console handle
 	HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
 
@@ -136,6 +173,7 @@ void Utils::getConsoleSize(int& width, int& height) {
 		width = 0;
 		height = 0;
 	}
+#endif
 }
 
 // expects a csv with data formatted as:
@@ -1,6 +1,7 @@
 #pragma once
-#include "Tree.h"
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 #include <iostream>
 #include <fstream>
 #include <iomanip>
@@ -10,6 +11,8 @@
 #include <list>
 #include <chrono>
 #include <functional>
+#include <memory>
+#include <thread>
 #include <cmath>
 #include <stdint.h>
 //#define _DEBUG
@@ -26,10 +29,11 @@ class Utils
 public:
 	static void setClipboardText(const std::string& text);
 
-	template <typename NodeType>
-	static void outputPositions(std::vector<NodeType> bodies, double time, std::ofstream& file) {
+	// `bodies` is a std::vector or a BodyFrame of nodes
+	template <typename Bodies>
+	static void outputPositions(const Bodies& bodies, double time, std::ofstream& file) {
 		file << time;
-		for (auto& node : bodies) {
+		for (const auto& node : bodies) {
 			//file << "," << node.position.x << "," << node.position.y << "," << node.position.z;
 			node.OutputPositionToStream(file);
 		}
@@ -50,6 +54,50 @@ public:
 		return elapsed;
 	}
 
+	// Splits [0, count) into contiguous chunks and runs func(begin, end) for each
+	// chunk on its own thread. A thread count of 0 uses every hardware thread.
+	template <typename Func>
+	static void parallelFor(std::size_t count, unsigned int threads, Func&& func) {
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads > count)
+			threads = static_cast<unsigned int>(count);
+
+		if (threads <= 1) {
+			func(std::size_t(0), count);
+			return;
+		}
+
+		std::size_t chunk = (count + threads - 1) / threads;
+		std::vector<std::thread> workers;
+		workers.reserve(threads);
+
+		for (std::size_t begin = 0; begin < count; begin += chunk) {
+			std::size_t end = begin + chunk < count ? begin + chunk : count;
+			workers.emplace_back([&func, begin, end]() { func(begin, end); });
+		}
+
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	// Kahan-compensated sum of doubles or glm vectors (per component). Fed in a
+	// fixed order it is reproducible to the bit and nearly independent of that
+	// order. Needs strict floating point: /fp:fast or -ffast-math drop the compensation.
+	template <typename T>
+	struct CompensatedSum {
+		T sum = T(0);
+		T compensation = T(0);
+
+		void add(const T& value) {
+			T corrected = value - compensation;
+			T next = sum + corrected;
+			compensation = (next - sum) - corrected;
+			sum = next;
+		}
+	};
+
 	static void printProgressBar(int i, int limit, int barWidth = 100, const std::string& process = "");
 	static void setCursorPosition(int x, int y);
 	static void getConsoleSize(int& width, int& height);
@@ -64,7 +112,11 @@ public:
 #ifdef _DEBUG  // Only compile this block in debug mode
 		std::ostringstream ss;
 		ss << FormatString(format, args...) << "\n";  // Format the message
+#ifdef _WIN32
 		OutputDebugStringA(ss.str().c_str());  // Output to Visual Studio's debug output
+#else
+		std::cerr << ss.str();
+#endif
 #endif
 	}
 
@@ -2,11 +2,23 @@
 
 #include <cxxopts.hpp>
 #include <filesystem>
+#include <future>
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 #include <iostream>
 #include <csignal>
 
 #include "TreeWrapper.h"
+#include "Benchmark.h"
+#include "Domain.h"
+#include "Ensemble.h"
+#include "EngineSelector.h"
+#include "FrameViewer.h"
+#include "InitialConditions.h"
+#include "Monitor.h"
+#include "OutOfCore.h"
+#include "SharedFrames.h"
 #include "Utils.h"
 
 // TODO:
@@ -44,10 +56,60 @@ int main(int argc, char** argv)
 		("p,plot", "Enable gnuplot plotting", cxxopts::value<bool>()->default_value("false"))
 		("s,script", "Gnuplot script file", cxxopts::value<std::string>()->default_value("plot.gp"))
 		("g,gif", "GIF output filename", cxxopts::value<std::string>()->default_value("orbits"))
-		("theta", "Theta threshold", cxxopts::value<double>()->default_value("0.5"))
-		("f,file", "Input point data file (JSON)", cxxopts::value<std::string>()->default_value("../Data/test_bodies-1.json"))
-		("b,brute-force", "N-body simulation algorithm", cxxopts::value<bool>()->default_value("false"))
+		("theta", "Opening angle of the Barnes-Hut walk and the FMM (capped at 0.95 for the FMM)", cxxopts::value<double>()->default_value("0.5"))
+		("softening", "Force kernel of the tree walk and direct sum: none or plummer", cxxopts::value<std::string>()->default_value("none"))
+		("epsilon", "Closest distance bodies interact at, or the Plummer softening length with --softening plummer [m]", cxxopts::value<double>()->default_value("1e-3"))
+		("f,file", "Input point data file (JSON, or a .nbs snapshot)", cxxopts::value<std::string>()->default_value("../Data/test_bodies-1.json"))
+		("b,brute-force", "Direct summation, same as --engine direct", cxxopts::value<bool>()->default_value("false"))
 		("twoD", "Choice of 2 or 3", cxxopts::value<bool>()->default_value("false"))
+		("c,collisions", "Collision handling: none, merge or bounce", cxxopts::value<std::string>()->default_value("none"))
+		("engine", "Force engine: bh (Barnes-Hut), fmm, treepm, direct or auto (calibrated on the bodies)", cxxopts::value<std::string>()->default_value("bh"))
+		("auto-tolerance", "Relative force error an engine may have to be chosen by --engine auto", cxxopts::value<double>()->default_value("1e-2"))
+		("auto-interval", "Steps between --engine auto calibrations (0 = only when the body count changes)", cxxopts::value<int>()->default_value("100"))
+		("fmm-order", "FMM expansion order", cxxopts::value<int>()->default_value("4"))
+		("fmm-traversal", "FMM cell pairs: mutual (each pair once, both ways) or one-sided", cxxopts::value<std::string>()->default_value("mutual"))
+		("pm-grid", "TreePM mesh cells per axis (power of two)", cxxopts::value<int>()->default_value("64"))
+		("pm-assign", "TreePM mass assignment: cic or tsc", cxxopts::value<std::string>()->default_value("cic"))
+		("threads", "Worker threads, 0 = all cores", cxxopts::value<int>()->default_value("0"))
+		("numa", "Pin workers and place bodies and tree on their NUMA nodes", cxxopts::value<bool>()->default_value("false"))
+		("numa-replicate", "Tree levels copied onto every NUMA node with --numa", cxxopts::value<int>()->default_value("0"))
+		("regularize", "Integrate bound pairs and small groups closer than this as regularized composite bodies (0 = off) [m]", cxxopts::value<double>()->default_value("0"))
+		("regularize-members", "Largest group --regularize merges into one composite", cxxopts::value<int>()->default_value("4"))
+		("out-of-core", "Keep the bodies in this memory-mapped file and step them in spatially sorted chunks, for more bodies than fit in memory (Barnes-Hut); the file is scratch space and removed at the end", cxxopts::value<std::string>())
+		("out-of-core-out", "Snapshot (.nbs) of the bodies after the last --out-of-core step", cxxopts::value<std::string>()->default_value("outofcore.nbs"))
+		("out-of-core-chunk", "Bodies stepped together by --out-of-core", cxxopts::value<int>()->default_value("65536"))
+		("deterministic", "Results identical to the bit for any --threads and with or without --numa, at some cost in speed", cxxopts::value<bool>()->default_value("false"))
+		("ensemble", "Comma separated bodies files stepped as an ensemble of independent systems", cxxopts::value<std::string>())
+		("ensemble-copies", "Perturbed variants added per ensemble system", cxxopts::value<int>()->default_value("0"))
+		("ensemble-spread", "Relative mass / velocity perturbation of the variants", cxxopts::value<double>()->default_value("0.01"))
+		("ensemble-out", "Ensemble results file (CSV)", cxxopts::value<std::string>()->default_value("ensemble.csv"))
+		("respa", "Steps between far-field evaluations with Barnes-Hut (1 = every step)", cxxopts::value<int>()->default_value("1"))
+		("respa-distance", "Near-field distance walked every step with --respa (0 = automatic)", cxxopts::value<double>()->default_value("0"))
+		("respa-extrapolate", "Extrapolate the cached far field linearly between evaluations", cxxopts::value<bool>()->default_value("false"))
+		("monitor", "Steps between energy / momentum measurements (0 = off)", cxxopts::value<int>()->default_value("0"))
+		("monitor-out", "Conservation log written with --monitor (CSV)", cxxopts::value<std::string>()->default_value("conservation.csv"))
+		("energy-tolerance", "Relative energy error that triggers a warning with --monitor (0 = never)", cxxopts::value<double>()->default_value("1e-3"))
+		("energy-abort", "Stop the run instead of warning when --energy-tolerance is exceeded", cxxopts::value<bool>()->default_value("false"))
+		("periodic", "Side of a periodic cube around the origin, Barnes-Hut only (0 = open boundaries) [m]", cxxopts::value<double>()->default_value("0"))
+		("perf-counters", "Read hardware counters around every phase of the update and add them to the run report (Linux)", cxxopts::value<bool>()->default_value("false"))
+		("tree-stats", "Steps between tree depth / occupancy / memory samples in the run report (0 = off)", cxxopts::value<int>()->default_value("0"))
+		("publish", "Publish every frame to this POSIX shared memory ring (e.g. /nbody)", cxxopts::value<std::string>())
+		("publish-slots", "Frames kept in the --publish ring", cxxopts::value<int>()->default_value("4"))
+		("watch", "Follow a simulation publishing to this shared memory ring and exit", cxxopts::value<std::string>())
+		("watch-mode", "How --watch shows frames: stats, ascii or ppm", cxxopts::value<std::string>()->default_value("stats"))
+		("watch-out", "File prefix of the --watch-mode ppm images", cxxopts::value<std::string>()->default_value("frame"))
+		("generate", "Generate the bodies instead of reading --file: uniform, plummer, hernquist or disk", cxxopts::value<std::string>())
+		("gen-bodies", "Bodies created by --generate", cxxopts::value<int>()->default_value("100000"))
+		("gen-scale", "Cube half length, scale radius or disk radius of --generate [m]", cxxopts::value<double>()->default_value("1e9"))
+		("gen-mass", "Total mass of the generated bodies [kg]", cxxopts::value<double>()->default_value("1e30"))
+		("gen-central-mass", "Central body of the generated disk [kg]", cxxopts::value<double>()->default_value("2e30"))
+		("gen-seed", "Seed of --generate", cxxopts::value<int>()->default_value("1"))
+		("gen-out", "Write the generated bodies to this snapshot (.nbs) and exit", cxxopts::value<std::string>())
+		("benchmark", "Run a benchmark and exit: engines, numa, respa, periodic, deterministic, out-of-core, dual-tree", cxxopts::value<std::string>())
+		("bench-bodies", "Largest number of bodies used by --benchmark", cxxopts::value<int>()->default_value("64000"))
+		("ranks", "Number of processes sharing the simulation (Linux only)", cxxopts::value<int>()->default_value("1"))
+		("port", "First localhost port used between ranks", cxxopts::value<int>()->default_value("47100"))
+		("rebalance", "Steps between domain rebalances (0 = never)", cxxopts::value<int>()->default_value("10"))
 		;
 
 	system("CLS");
@@ -85,18 +147,367 @@ int main(int argc, char** argv)
 	double dt = result["delta"].as<double>();
 	double theta = result["theta"].as<double>();
 
+	std::string collisions = result["collisions"].as<std::string>();
+	CollisionMode collision_mode = COLLISION_NONE;
+	if (collisions == "merge")
+		collision_mode = COLLISION_MERGE;
+	else if (collisions == "bounce")
+		collision_mode = COLLISION_BOUNCE;
+	else if (collisions != "none")
+		std::cout << "WARNING: unknown --collisions mode '" << collisions << "', collisions disabled.\n";
+
+	std::string engine = result["engine"].as<std::string>();
+	ForceEngine force_engine = ENGINE_BARNES_HUT;
+	if (engine == "direct" || brute_force)
+		force_engine = ENGINE_DIRECT;
+	else if (engine == "fmm")
+		force_engine = ENGINE_FMM;
+	else if (engine == "treepm")
+		force_engine = ENGINE_TREEPM;
+	else if (engine != "bh" && engine != "auto")
+		std::cout << "WARNING: unknown --engine '" << engine << "', using Barnes-Hut.\n";
+
+	// Barnes-Hut until the first calibration
+	bool auto_engine = engine == "auto" && !brute_force;
+	double auto_tolerance = result["auto-tolerance"].as<double>();
+	int auto_interval = result["auto-interval"].as<int>();
+
+	std::string softening = result["softening"].as<std::string>();
+	Softening softening_kernel = SOFTENING_NONE;
+	if (softening == "plummer")
+		softening_kernel = SOFTENING_PLUMMER;
+	else if (softening != "none")
+		std::cout << "WARNING: unknown --softening '" << softening << "', using none.\n";
+
+	int fmm_order = result["fmm-order"].as<int>();
+	std::string fmm_traversal = result["fmm-traversal"].as<std::string>();
+	bool fmm_mutual = fmm_traversal != "one-sided";
+	if (fmm_mutual && fmm_traversal != "mutual")
+		std::cout << "WARNING: unknown --fmm-traversal '" << fmm_traversal << "', using mutual.\n";
+	int pm_grid = result["pm-grid"].as<int>();
+	std::string pm_scheme = result["pm-assign"].as<std::string>();
+	AssignmentScheme pm_assign = pm_scheme == "tsc" ? ASSIGN_TSC : ASSIGN_CIC;
+	if (pm_scheme != "tsc" && pm_scheme != "cic")
+		std::cout << "WARNING: unknown --pm-assign '" << pm_scheme << "', using cic.\n";
+
+	unsigned int threads = result["threads"].as<int>();
+	bool numa = result["numa"].as<bool>();
+	int numa_replicate = result["numa-replicate"].as<int>();
+	bool deterministic = result["deterministic"].as<bool>();
+	double regularize = result["regularize"].as<double>();
+	int regularize_members = result["regularize-members"].as<int>();
+
+	int respa = result["respa"].as<int>();
+	double respa_distance = result["respa-distance"].as<double>();
+	bool respa_extrapolate = result["respa-extrapolate"].as<bool>();
+
+	int monitor_interval = result["monitor"].as<int>();
+	std::string monitor_path = result["monitor-out"].as<std::string>();
+	double energy_tolerance = result["energy-tolerance"].as<double>();
+	bool energy_abort = result["energy-abort"].as<bool>();
+
+	int tree_stats = result["tree-stats"].as<int>();
+	bool perf_counters = result["perf-counters"].as<bool>();
+
+	double periodic = result["periodic"].as<double>();
+
+	bool publish = result.count("publish") > 0;
+
+	bool generate = result.count("generate") > 0;
+	GeneratorSettings generator;
+	if (generate) {
+		std::string distribution = result["generate"].as<std::string>();
+		if (!InitialConditions3D::parseDistribution(distribution, generator.distribution)) {
+			std::cout << "Unknown --generate distribution '" << distribution << "'\n";
+			return EXIT_FAILURE;
+		}
+		int gen_bodies = result["gen-bodies"].as<int>();
+		if (gen_bodies < 1) {
+			std::cout << "--gen-bodies must be at least 1\n";
+			return EXIT_FAILURE;
+		}
+		generator.count = gen_bodies;
+		generator.scale = result["gen-scale"].as<double>();
+		generator.mass = result["gen-mass"].as<double>();
+		generator.centralMass = result["gen-central-mass"].as<double>();
+		generator.seed = result["gen-seed"].as<int>();
+		generator.threads = threads;
+	}
+
+	if (result.count("benchmark")) {
+		std::string benchmark = result["benchmark"].as<std::string>();
+		std::size_t bench_bodies = result["bench-bodies"].as<int>();
+
+		if (benchmark == "engines") {
+			if (twoD)
+				Benchmark::engineScaling<glm::dvec2>(bench_bodies, theta, fmm_order, std::cout);
+			else
+				Benchmark::engineScaling<glm::dvec3>(bench_bodies, theta, fmm_order, std::cout);
+		}
+		else if (benchmark == "numa") {
+			Benchmark::numaAccess(256, std::cout);
+			std::cout << std::endl;
+			if (twoD)
+				Benchmark::numaScaling<glm::dvec2>(bench_bodies, theta, 5, std::cout);
+			else
+				Benchmark::numaScaling<glm::dvec3>(bench_bodies, theta, 5, std::cout);
+		}
+		else if (benchmark == "respa") {
+			if (twoD)
+				Benchmark::farFieldDrift<glm::dvec2>(bench_bodies, theta, 40, std::cout);
+			else
+				Benchmark::farFieldDrift<glm::dvec3>(bench_bodies, theta, 40, std::cout);
+		}
+		else if (benchmark == "periodic") {
+			if (twoD)
+				Benchmark::periodicCost<glm::dvec2>(bench_bodies, theta, std::cout);
+			else
+				Benchmark::periodicCost<glm::dvec3>(bench_bodies, theta, std::cout);
+		}
+		else if (benchmark == "deterministic") {
+			if (twoD)
+				Benchmark::deterministicCost<glm::dvec2>(bench_bodies, theta, fmm_order, 5, std::cout);
+			else
+				Benchmark::deterministicCost<glm::dvec3>(bench_bodies, theta, fmm_order, 5, std::cout);
+		}
+		else if (benchmark == "out-of-core") {
+			std::string path = result.count("out-of-core") ? result["out-of-core"].as<std::string>() : "outofcore.bin";
+			if (twoD)
+				Benchmark::outOfCore<glm::dvec2>(bench_bodies, theta, 5, path, std::cout);
+			else
+				Benchmark::outOfCore<glm::dvec3>(bench_bodies, theta, 5, path, std::cout);
+		}
+		else if (benchmark == "dual-tree") {
+			if (twoD)
+				Benchmark::dualTree<glm::dvec2>(bench_bodies, theta, fmm_order, std::cout);
+			else
+				Benchmark::dualTree<glm::dvec3>(bench_bodies, theta, fmm_order, std::cout);
+		}
+		else {
+			std::cout << "Unknown benchmark '" << benchmark << "'\n";
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (result.count("watch"))
+		return FrameViewer::watch(result["watch"].as<std::string>(), result["watch-mode"].as<std::string>(), result["watch-out"].as<std::string>());
+
+	if (generate && result.count("gen-out")) {
+		std::string snapshot = result["gen-out"].as<std::string>();
+
+		// Same steps for 2D and 3D snapshots
+		auto write_snapshot = [&](auto origin) {
+			using Generator = InitialConditions<decltype(origin)>;
+			std::vector<Node<decltype(origin)>> bodies;
+
+			auto time = Utils::measureInvokeCall(&Generator::generate, generator, bodies);
+			std::cout << "Generate -- " << bodies.size() << " bodies in " << time.count() << " s" << std::endl;
+			return Generator::writeSnapshot(snapshot, bodies) ? EXIT_SUCCESS : EXIT_FAILURE;
+		};
+
+		if (twoD)
+			return write_snapshot(glm::dvec2(0.0));
+		return write_snapshot(glm::dvec3(0.0));
+	}
+
+	if (result.count("ensemble")) {
+		std::stringstream files(result["ensemble"].as<std::string>());
+		std::string ensemble_out = result["ensemble-out"].as<std::string>();
+
+		// Same steps for 2D and 3D ensembles
+		auto run_ensemble = [&](auto& ensemble) {
+			std::string file;
+			while (std::getline(files, file, ',')) {
+				if (!ensemble.loadSystem(file))
+					return EXIT_FAILURE;
+			}
+
+			ensemble.addVariants(result["ensemble-copies"].as<int>(), result["ensemble-spread"].as<double>(), 1);
+			ensemble.setThreads(threads);
+			ensemble.pack();
+
+			auto time = std::chrono::duration<double>::zero();
+			int divFactor = (int)log2(num) + 1;
+			for (int i = 0; i < num; i += divFactor) {
+				time += Utils::measureInvokeCall(&std::remove_reference_t<decltype(ensemble)>::step, ensemble, dt, std::min(divFactor, num - i));
+				Utils::printProgressBar(i, num, 80, "time - " + std::to_string(time.count()));
+			}
+
+			ensemble.collect();
+			ensemble.writeResults(ensemble_out);
+
+			// Systems starting at zero energy have no relative error, their drift is reported in J
+			double worst_error = 0.0, worst_drift = 0.0;
+			bool zero_energy = false;
+			for (auto& system : ensemble.getSystems()) {
+				if (system.initialEnergy != 0.0) {
+					worst_error = std::max(worst_error, std::abs((system.energy - system.initialEnergy) / system.initialEnergy));
+				}
+				else {
+					worst_drift = std::max(worst_drift, std::abs(system.energy));
+					zero_energy = true;
+				}
+			}
+
+			std::cout << std::endl;
+			std::cout << "Ensemble -- " << ensemble.getSystemCount() << " systems, " << num << " steps in " << time.count() << " s: "
+				<< ensemble.getSystemCount() * num / time.count() << " system-steps / s" << std::endl;
+			std::cout << "Ensemble -- worst relative energy error " << worst_error;
+			if (zero_energy)
+				std::cout << ", worst absolute energy drift of zero-energy systems " << worst_drift << " J";
+			std::cout << ", results in " << ensemble_out << std::endl;
+			return EXIT_SUCCESS;
+		};
+
+		if (twoD) {
+			Ensemble2D ensemble;
+			return run_ensemble(ensemble);
+		}
+		Ensemble3D ensemble;
+		return run_ensemble(ensemble);
+	}
+
+	if (result.count("out-of-core")) {
+		std::string store_path = result["out-of-core"].as<std::string>();
+		std::string input_path = result["file"].as<std::string>();
+		std::string snapshot_path = result["out-of-core-out"].as<std::string>();
+
+		// Only the Barnes-Hut walk runs on a chunk and its surroundings
+		if (force_engine != ENGINE_BARNES_HUT || auto_engine || collision_mode != COLLISION_NONE || periodic > 0.0
+			|| regularize > 0.0 || respa > 1 || result["ranks"].as<int>() > 1 || publish || plot) {
+			std::cout << "--out-of-core needs --engine bh, no collisions, open boundaries, a single rank and no --respa, --regularize, --publish or --plot\n";
+			return EXIT_FAILURE;
+		}
+
+		// Same steps for 2D and 3D runs
+		auto run_out_of_core = [&](auto origin) {
+			using Vector = decltype(origin);
+			OutOfCore<Vector> store(store_path, result["out-of-core-chunk"].as<int>());
+			store.setThreads(threads);
+			store.getWrapper().setSoftening(softening_kernel);
+			store.getWrapper().getTree().setTheta(theta);
+			store.getWrapper().getTree().setEpsilon(result["epsilon"].as<double>());
+
+			// Generated bodies go straight to the file, others pass through memory once
+			bool snapshot = input_path.size() > 4 && input_path.compare(input_path.size() - 4, 4, ".nbs") == 0;
+			bool loaded = false;
+			if (generate) {
+				loaded = store.generate(generator);
+			}
+			else if (snapshot) {
+				std::vector<Node<Vector>> bodies;
+				loaded = InitialConditions<Vector>::readSnapshot(input_path, bodies) && store.import(bodies);
+			}
+			else {
+				TreeWrapper<Vector> wrapper(std::make_shared<Tree<Vector>>(Box<Vector>(origin, 1.0, 1.0, 1.0)));
+				wrapper.loadBodies(input_path);
+				loaded = store.import(wrapper.nodeList);
+			}
+			if (!loaded)
+				return EXIT_FAILURE;
+
+			auto time = std::chrono::duration<double>::zero();
+			for (int i = 0; i < num; ++i) {
+				time += Utils::measureInvokeCall(&OutOfCore<Vector>::step, store, dt);
+				Utils::printProgressBar(i, num, 80, "time - " + std::to_string(time.count()));
+			}
+
+			std::cout << std::endl;
+			std::cout << "Out of core -- " << num << " steps in " << time.count() << " s" << std::endl;
+			store.report(std::cout);
+
+			// The mapped files go with the store; the snapshot is the run's output
+			if (!store.writeSnapshot(snapshot_path))
+				return EXIT_FAILURE;
+			std::cout << "Wrote " << store.getCount() << " bodies to " << snapshot_path << std::endl;
+			return EXIT_SUCCESS;
+		};
+
+		if (twoD)
+			return run_out_of_core(glm::dvec2(0.0));
+		return run_out_of_core(glm::dvec3(0.0));
+	}
+
 	std::string input_path = result["file"].as<std::string>();
 	std::string data_name = result["out"].as<std::string>() + ".csv";
 	std::string gif_path = result["gif"].as<std::string>();
 	std::string gifCommand = "powershell.exe Start-Process '" + gif_path + ".gif'";
 	std::string script_path = result["script"].as<std::string>();
 	std::string gnuCommand = "wsl gnuplot " + script_path;
+
+	int ranks = result["ranks"].as<int>();
+	int port = result["port"].as<int>();
+	int rebalance = result["rebalance"].as<int>();
+
+	// Ghost exchange and the mesh engines do not know about periodic images
+	if (periodic > 0.0 && (force_engine != ENGINE_BARNES_HUT || auto_engine || ranks > 1)) {
+		std::cout << "--periodic needs --engine bh and a single rank\n";
+		return EXIT_FAILURE;
+	}
+
+	// Ranks calibrating on their own share could pick different engines
+	if (auto_engine && ranks > 1) {
+		std::cout << "--engine auto needs a single rank\n";
+		return EXIT_FAILURE;
+	}
+
+	// Composites are neither merged, wrapped nor migrated as a group
+	if (regularize > 0.0 && (collision_mode != COLLISION_NONE || periodic > 0.0 || ranks > 1)) {
+		std::cout << "--regularize needs --collisions none, open boundaries and a single rank\n";
+		return EXIT_FAILURE;
+	}
+
+	// A composite holds at least a pair
+	if (regularize_members < 2) {
+		std::cout << "--regularize-members must be at least 2\n";
+		return EXIT_FAILURE;
+	}
+
+	// The calibration picks the engine by timing, which no rerun repeats
+	if (auto_engine && deterministic) {
+		std::cout << "--deterministic needs a fixed --engine\n";
+		return EXIT_FAILURE;
+	}
 #endif
 
-	std::ofstream orbitFile(data_name, std::ios::out | std::ios::trunc);
-	orbitFile.close();
+	// Bodies come from --generate, a binary snapshot or a JSON file
+	auto load_bodies = [&](auto& wrapper) {
+		using Vector = std::decay_t<decltype(wrapper.nodeList[0].position)>;
+		bool snapshot = input_path.size() > 4 && input_path.compare(input_path.size() - 4, 4, ".nbs") == 0;
 
-	orbitFile.open(data_name, std::ios::app);
+		if (generate) {
+			std::vector<Node<Vector>> bodies;
+			InitialConditions<Vector>::generate(generator, bodies);
+			wrapper.setBodies(std::move(bodies));
+		}
+		else if (snapshot) {
+			std::vector<Node<Vector>> bodies;
+			if (InitialConditions<Vector>::readSnapshot(input_path, bodies))
+				wrapper.setBodies(std::move(bodies));
+		}
+		else {
+			wrapper.loadBodies(input_path);
+		}
+	};
+
+	// Every rank runs the rest of main on its own share of the bodies
+	int rank = 0;
+	if (ranks > 1) {
+		rank = Transport::spawn(ranks);
+
+		// Ranks share the cores instead of each using all of them
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency() / ranks);
+	}
+
+	std::ofstream orbitFile;
+	if (rank == 0) {
+		orbitFile.open(data_name, std::ios::out | std::ios::trunc);
+		orbitFile.close();
+
+		orbitFile.open(data_name, std::ios::app);
+	}
 
 	auto total_time = std::chrono::duration<double>::zero();
 	std::chrono::duration<double> previous_time;
@@ -114,17 +525,60 @@ int main(int argc, char** argv)
 	/************************** SETUP ****************************/
 	/*************************************************************/
 
-	double epsilon = 1e-3;
+	double epsilon = result["epsilon"].as<double>();
 	double rootLength = 1e5;
 
-	if (!twoD) {
-		Box3D bb(glm::dvec3(0.0), rootLength / 2, rootLength / 2, rootLength / 2);
-		std::shared_ptr<Tree3D> root = std::make_shared<Tree3D>(bb, theta, epsilon);
-		root->setTheta(theta);
-		TreeWrapper3D TestTree(root);
+	// Same steps for 2D and 3D simulations
+	auto run_simulation = [&](auto origin) {
+		using Vector = decltype(origin);
 
-		TestTree.loadBodies(input_path);
+		Box<Vector> bb(origin, rootLength / 2, rootLength / 2, rootLength / 2);
+		std::shared_ptr<Tree<Vector>> root = std::make_shared<Tree<Vector>>(bb, theta, epsilon);
+		root->setTheta(theta);
+		TreeWrapper<Vector> TestTree(root);
+		TestTree.setCollisionMode(collision_mode);
+		TestTree.setEngine(force_engine);
+		TestTree.setSoftening(softening_kernel);
+		TestTree.getFmm().setOrder(fmm_order);
+		TestTree.getFmm().setMutual(fmm_mutual);
+		TestTree.getMesh().setGridSize(pm_grid);
+		TestTree.getMesh().setScheme(pm_assign);
+		TestTree.setThreads(threads);
+		TestTree.getFmm().setThreads(threads);
+		TestTree.getMesh().setThreads(threads);
+		TestTree.setFarField(respa, respa_distance, respa_extrapolate);
+
+		load_bodies(TestTree);
+		if (periodic > 0.0)
+			TestTree.setPeriodic(periodic);
 		rootLength = TestTree.getTree().getLength();
+		if (numa)
+			TestTree.setNuma(true, numa_replicate);
+		if (deterministic)
+			TestTree.setDeterministic(true);
+		if (regularize > 0.0)
+			TestTree.setRegularization(regularize, regularize_members);
+		if (perf_counters && !TestTree.setPerfCounters(true))
+			std::cout << "WARNING: --perf-counters unavailable, " << TestTree.getPerfCounters().getError() << ".\n";
+
+		DomainDecomposition<Vector> domain(TestTree, rebalance);
+		if (!domain.start(rank, ranks, port))
+			return EXIT_FAILURE;
+		std::vector<Node<Vector>> all_bodies;
+
+		ConservationMonitor<Vector> monitor(monitor_interval, energy_tolerance, energy_abort);
+		if (rank == 0 && monitor.getInterval() > 0)
+			monitor.open(monitor_path);
+		TreeMonitor<Vector> tree_monitor(tree_stats);
+		EngineSelector<Vector> selector(auto_tolerance, auto_interval);
+
+		// Collective: every rank learns the body count, rank 0 owns the ring
+		SharedFrames frames;
+		if (publish) {
+			std::size_t capacity = domain.getTotalBodies();
+			if (rank == 0)
+				frames.create(result["publish"].as<std::string>(), Vector::length(), capacity, result["publish-slots"].as<int>());
+		}
 
 
 
@@ -134,77 +588,109 @@ int main(int argc, char** argv)
 		signal(SIGINT, Utils::signalHandler);
 
 		int divFactor = (int)log2(num) + 1;
+		int steps = num;
+		std::future<void> output;
 		for (int i = 0; i < num; ++i) {
+			// Calibration only evaluates forces, the output still reading the front buffer is safe
+			if (auto_engine && selector.due(i, TestTree))
+				selector.calibrate(i, TestTree);
+
+			if (monitor.due(i))
+				TestTree.measureConservation();
+
+			// The output thread would count towards whichever phase it exits in
+			if (TestTree.getPerfCounters().isOpen() && output.valid())
+				output.wait();
 
 			previous_time = total_time;
-			total_time += Utils::measureInvokeCall(&TreeWrapper3D::update, TestTree, dt);
-			if (plot)
-				Utils::outputPositions(TestTree.nodeList, i * dt, orbitFile);
+			total_time += Utils::measureInvokeCall(&DomainDecomposition<Vector>::step, domain, dt);
+			if (rank == 0 && tree_monitor.due(i))
+				tree_monitor.record(i, TestTree);
+
+			// The gathered copy is reused, so the previous output has to finish first
+			if (output.valid())
+				output.wait();
+			if (ranks > 1 && (plot || publish))
+				domain.gatherBodies(all_bodies);
+			else if (regularize > 0.0 && (plot || publish))
+				TestTree.expandBodies(all_bodies);
+
+			// Output of this step overlaps with the next one: it only reads the front
+			// buffer (or the gathered / expanded copy), which the next update() leaves alone
+			if (rank == 0 && (plot || frames.isOpen())) {
+				BodyFrame<Vector> front = ranks > 1 || regularize > 0.0 ? BodyFrame<Vector>{ all_bodies.data(), all_bodies.size() } : TestTree.getFront();
+				output = std::async(std::launch::async, [&, front, i]() {
+					if (plot)
+						Utils::outputPositions(front, i * dt, orbitFile);
+					if (frames.isOpen())
+						frames.publish((i + 1) * dt, front);
+				});
+			}
 
-			if (i % divFactor == 0 || i == num)
+			if (rank == 0 && (i % divFactor == 0 || i == num))
 				Utils::printProgressBar(i, num, 80, "time - " + std::to_string((total_time - previous_time).count()));
-		}
-		std::cout << std::endl;
-		std::cout << "Update -- Average update time for - " << TestTree.getTotalBodies() << " - bodies: " << std::setprecision(15) << total_time.count() / num << std::endl;
-		orbitFile.close();
 
-		if (result.count("plot")) {
-			std::vector<std::string> node_names;
-			for (auto& body : TestTree.nodeList) {
-				node_names.push_back(body.name);
+			// Collective: the sum is the same on every rank, so they all stop together
+			if (monitor.due(i) && !monitor.record(i, i * dt, domain.getConservation())) {
+				steps = i + 1;
+				break;
 			}
-
-			std::cout << script_path << " written\n";
-			Utils::gpScript3d(script_path, gif_path, data_name, TestTree.getTree().getLength() / 3, node_names);
-			std::cout << "Calling " << script_path << "\n";
-			system(gnuCommand.c_str());
-			std::cout << "opening " << gif_path << "\n";
-			system(gifCommand.c_str());
 		}
-	}
-	else {
-		Box2D bb(glm::dvec2(0.0), rootLength / 2, rootLength / 2, rootLength / 2);
-		std::shared_ptr<Tree2D> root2d = std::make_shared<Tree2D>(bb, theta, epsilon);
-		root2d->setTheta(theta);
-		TreeWrapper2D TestTree2d(root2d);
-
-		TestTree2d.loadBodies(input_path);
-		rootLength = TestTree2d.getTree().getLength();
-
-
+		if (output.valid())
+			output.wait();
+		frames.close();
 
-		/*************************************************************/
-		/************************ END SETUP **************************/
-		/*************************************************************/
-		signal(SIGINT, Utils::signalHandler);
+		// Collective: every rank takes part before the others return
+		int total_bodies = domain.getTotalBodies();
+		double imbalance = domain.getImbalance();
+		if (result.count("plot"))
+			domain.gatherBodies(all_bodies);
+		if (result.count("plot") && regularize > 0.0)
+			TestTree.expandBodies(all_bodies);
 
-		int divFactor = (int)log2(num) + 1;
-		for (int i = 0; i < num; ++i) {
+		if (rank != 0)
+			return EXIT_SUCCESS;
 
-			previous_time = total_time;
-			total_time += Utils::measureInvokeCall(&TreeWrapper2D::update, TestTree2d, dt);
-			if (plot)
-				Utils::outputPositions(TestTree2d.nodeList, i * dt, orbitFile);
-
-			if (i % divFactor == 0 || i == num)
-				Utils::printProgressBar(i, num, 80, "time - " + std::to_string((total_time - previous_time).count()));
-		}
 		std::cout << std::endl;
-		std::cout << "Update -- Average update time for - " << TestTree2d.getTotalBodies() << " - bodies: " << std::setprecision(15) << total_time.count() / num << std::endl;
+		std::cout << "Update -- Average update time for - " << total_bodies << " - bodies: " << std::setprecision(15) << total_time.count() / steps << std::endl;
+		if (collision_mode != COLLISION_NONE)
+			std::cout << "Collisions -- " << TestTree.getTotalCollisions() << " resolved" << std::endl;
+		if (ranks > 1)
+			std::cout << "Domains -- " << ranks << " ranks, load imbalance (max / mean step time): " << imbalance
+				<< ", communication: " << domain.getCommunicationTime() << " s, ghosts: " << domain.getGhosts()
+				<< ", migrated: " << domain.getMigrated() << std::endl;
+		selector.report(std::cout);
+		TestTree.getRegularization().report(std::cout);
+		monitor.report(std::cout);
+		tree_monitor.report(std::cout);
+		if (TestTree.getPerfCounters().isOpen()) {
+			const char* phases[UPDATE_PHASES];
+			for (int phase = 0; phase < UPDATE_PHASES; ++phase)
+				phases[phase] = TreeWrapper<Vector>::phaseName(static_cast<UpdatePhase>(phase));
+			TestTree.getPerfCounters().report(std::cout, phases, TestTree.getPhaseCounters().data(), UPDATE_PHASES);
+		}
 		orbitFile.close();
 
 		if (result.count("plot")) {
 			std::vector<std::string> node_names;
-			for (auto& body : TestTree2d.nodeList) {
+			for (auto& body : all_bodies) {
 				node_names.push_back(body.name);
 			}
 
 			std::cout << script_path << " written\n";
-			Utils::gpScript(script_path, gif_path, data_name, TestTree2d.getTree().getLength() / 3, node_names);
+			if constexpr (std::is_same_v<Vector, glm::dvec3>)
+				Utils::gpScript3d(script_path, gif_path, data_name, TestTree.getTree().getLength() / 3, node_names);
+			else
+				Utils::gpScript(script_path, gif_path, data_name, TestTree.getTree().getLength() / 3, node_names);
 			std::cout << "Calling " << script_path << "\n";
 			system(gnuCommand.c_str());
 			std::cout << "opening " << gif_path << "\n";
 			system(gifCommand.c_str());
 		}
-	}
+		return EXIT_SUCCESS;
+	};
+
+	if (twoD)
+		return run_simulation(glm::dvec2(0.0));
+	return run_simulation(glm::dvec3(0.0));
 }